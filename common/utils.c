@@ -461,6 +461,7 @@ rl_msg_free(struct rl_msg_layout *numtables, size_t num_entries,
             struct rl_msg_base *msg)
 {
     unsigned int copylen = numtables[msg->hdr.msg_type].copylen;
+    struct rl_msg_array_field *af;
     struct rina_name *name;
     string_t *str;
     int i;
@@ -484,6 +485,17 @@ rl_msg_free(struct rl_msg_layout *numtables, size_t num_entries,
             COMMON_FREE(*str);
         }
     }
+
+    /* Skip the buffers, which are owned by the caller, and release the
+     * arrays. */
+    af = (struct rl_msg_array_field *)(((struct rl_msg_buf_field *)str) +
+                                       numtables[msg->hdr.msg_type].buffers);
+    for (i = 0; i < numtables[msg->hdr.msg_type].arrays; i++, af++) {
+        if (af->slots.raw) {
+            COMMON_FREE(af->slots.raw);
+            af->slots.raw = NULL;
+        }
+    }
 }
 COMMON_EXPORT(rl_msg_free);
 
@@ -793,18 +805,23 @@ flow_config_dump(const struct rl_flow_config *c)
                  "   dtcp.initial_a=%u\n"
                  "   dtcp.bandwidth=%u\n"
                  "   dtcp.flow_control=%x\n"
-                 "   dtcp.rtx_control=%x\n",
+                 "   dtcp.rtx_control=%x\n"
+                 "   dtcp.sack=%x\n",
                  c->msg_boundaries, c->in_order_delivery,
                  (long long unsigned)c->max_sdu_gap, c->dtcp.flags,
                  c->dtcp.initial_a, c->dtcp.bandwidth,
                  !!(c->dtcp.flags & DTCP_CFG_FLOW_CTRL),
-                 !!(c->dtcp.flags & DTCP_CFG_RTX_CTRL));
+                 !!(c->dtcp.flags & DTCP_CFG_RTX_CTRL),
+                 !!(c->dtcp.flags & DTCP_CFG_SACK));
 
     if (c->dtcp.fc.fc_type == RLITE_FC_T_WIN) {
         COMMON_PRINT("   dtcp.fc.max_cwq_len=%lu\n"
-                     "   dtcp.fc.initial_credit=%lu\n",
+                     "   dtcp.fc.initial_credit=%lu\n"
+                     "   dtcp.cc=%.*s\n",
                      (long unsigned)c->dtcp.fc.cfg.w.max_cwq_len,
-                     (long unsigned)c->dtcp.fc.cfg.w.initial_credit);
+                     (long unsigned)c->dtcp.fc.cfg.w.initial_credit,
+                     RL_CC_NAME_MAX,
+                     c->dtcp.cc_name[0] ? c->dtcp.cc_name : "default");
     } else if (c->dtcp.fc.fc_type == RLITE_FC_T_RATE) {
         COMMON_PRINT("   dtcp.fc.sender_rate=%lu\n"
                      "   dtcp.fc.time_period=%lu\n",
@@ -221,6 +221,182 @@ void rina_flow_spec_unreliable(struct rina_flow_spec *spec);
  */
 unsigned int rina_flow_mss_get(int fd);
 
+/*
+ * Set the busy-poll budget for the flow @fd, in microseconds. When the
+ * budget is not zero, blocking reads and poll() spin for up to @usecs
+ * waiting for an SDU before putting the caller to sleep, trading CPU
+ * time for lower wakeup latency. Zero disables busy-polling (default).
+ * Returns 0 on success, -1 on error with errno set properly.
+ */
+#define RINA_FLOW_BUSY_POLL_MAX 10000 /* microseconds */
+int rina_flow_busy_poll_set(int fd, unsigned int usecs);
+
+/*
+ * Descriptor of an SDU for rina_flow_read_batch() and
+ * rina_flow_write_batch(). The @len field contains the size of the
+ * buffer (read) or the length of the SDU (write). On return, @status
+ * contains the number of bytes transferred, or a negative errno code.
+ */
+struct rina_sdu {
+    void *buf;
+    size_t len;
+    int status;
+};
+
+/*
+ * Read up to @num SDUs from the flow @fd with a single system call,
+ * similarly to recvmmsg(). If @fd is blocking, the call only blocks
+ * waiting for the first SDU. At most 64 SDUs are transferred per call.
+ *
+ * On success, it returns the number of SDUs read, with the status of each
+ * one stored in the corresponding descriptor; 0 is returned if the flow
+ * has been deallocated by the remote peer. On error -1 is returned, with
+ * the errno code properly set.
+ */
+int rina_flow_read_batch(int fd, struct rina_sdu *sdus, unsigned int num);
+
+/*
+ * Write up to @num SDUs to the flow @fd with a single system call,
+ * similarly to sendmmsg(). At most 64 SDUs are transferred per call.
+ *
+ * On success, it returns the number of SDUs written, with the status of
+ * each one stored in the corresponding descriptor. On error -1 is
+ * returned, with the errno code properly set.
+ */
+int rina_flow_write_batch(int fd, struct rina_sdu *sdus, unsigned int num);
+
+/*
+ * Set the size limit of the receive queue of the flow @fd, in bytes.
+ * When the queue is full, incoming SDUs are dropped, unless the flow uses
+ * flow control. Zero restores the default limit, which is derived from
+ * the average bandwidth in the flow spec. Returns 0 on success, -1 on
+ * error with errno set properly.
+ */
+int rina_flow_rxq_limit_set(int fd, unsigned int bytes);
+
+/*
+ * Set the receive low watermark of the flow @fd, in SDUs, similarly to
+ * SO_RCVLOWAT. Readers sleeping on the flow (blocking read(), poll() and
+ * flow groups) are woken up only when at least @sdus SDUs are queued,
+ * or when the flow is deallocated; poll() reports the flow readable under
+ * the same condition. A read() that finds SDUs already queued still
+ * returns immediately. Values of 0 and 1 restore the default behaviour.
+ * Returns 0 on success, -1 on error with errno set properly.
+ */
+#define RINA_FLOW_RX_LOWAT_MAX 4096 /* SDUs */
+int rina_flow_rx_lowat_set(int fd, unsigned int sdus);
+
+/*
+ * Flow groups: a single file descriptor multiplexing many flows, similarly
+ * to a UDP socket serving many peers. Each read() on a group returns a
+ * struct rina_flow_group_hdr followed by an SDU received on one of the
+ * member flows, and each write() must start with a struct
+ * rina_flow_group_hdr selecting the member flow where the SDU is sent.
+ * The end of a member flow is reported by a record with the
+ * RINA_FLOW_GROUP_F_EOF flag set and no SDU. SDUs that do not fit the
+ * read() buffer are truncated and flagged with RINA_FLOW_GROUP_F_TRUNC.
+ * The group file descriptor is always writable for poll().
+ */
+struct rina_flow_group_hdr {
+    uint16_t port_id;
+    uint16_t flags;
+    uint32_t pad;
+};
+
+#define RINA_FLOW_GROUP_F_EOF (1 << 0)
+#define RINA_FLOW_GROUP_F_TRUNC (1 << 1)
+
+/*
+ * Create an empty flow group. Returns a file descriptor for the group,
+ * or -1 on error with errno set properly.
+ */
+int rina_flow_group_create(void);
+
+/*
+ * Add the flow @fd to the group @gfd. The group keeps the flow alive,
+ * so @fd can be closed after this call. Returns the port-id identifying
+ * the flow in the group records, or -1 on error with errno set properly.
+ */
+int rina_flow_group_add(int gfd, int fd);
+
+/*
+ * Remove the flow identified by @port_id from the group @gfd, releasing
+ * the flow if there is no other reference to it. Returns 0 on success,
+ * or -1 on error with errno set properly.
+ */
+int rina_flow_group_del(int gfd, unsigned int port_id);
+
+/*
+ * Shared memory rings for flow I/O, as an alternative to read() and
+ * write(). Each ring has @num_slots slots (a power of two), and each
+ * slot can hold an SDU of at most @slot_size bytes.
+ */
+struct rina_flow_rings;
+
+/*
+ * Set up and map the rings for the flow @fd. On success, it returns a
+ * rings handle. On error NULL is returned, with the errno code properly
+ * set. After this call, incoming SDUs are delivered to the RX ring, and
+ * must not be read with read().
+ */
+struct rina_flow_rings *rina_flow_rings_open(int fd, unsigned int num_slots,
+                                             unsigned int slot_size);
+
+/*
+ * Unmap the rings. The rings are released when @fd is closed.
+ */
+void rina_flow_rings_close(struct rina_flow_rings *rings);
+
+/*
+ * Return the buffer of the next free TX slot, storing its size in
+ * @size, or NULL if the TX ring is full. The SDU is not transmitted
+ * until rina_flow_rings_tx_put() is called.
+ */
+void *rina_flow_rings_tx_get(struct rina_flow_rings *rings, unsigned int *size);
+
+/*
+ * Publish the SDU of @len bytes stored in the buffer returned by the
+ * last call to rina_flow_rings_tx_get().
+ */
+void rina_flow_rings_tx_put(struct rina_flow_rings *rings, unsigned int len);
+
+/*
+ * Return the next SDU in the RX ring, storing its length in @len, or NULL
+ * if the RX ring is empty. The SDU stays valid until
+ * rina_flow_rings_rx_put() is called.
+ */
+void *rina_flow_rings_rx_get(struct rina_flow_rings *rings, unsigned int *len);
+
+/*
+ * Release the SDU returned by the last call to rina_flow_rings_rx_get().
+ */
+void rina_flow_rings_rx_put(struct rina_flow_rings *rings);
+
+/* Flags of an SDU in the rings. */
+#define RINA_RING_F_TRUNC (1 << 0) /* RX SDU truncated to the slot size */
+#define RINA_RING_F_ERR (1 << 1)   /* TX SDU dropped by the kernel */
+
+/*
+ * Return the RINA_RING_F_* flags of the SDU returned by the last call to
+ * rina_flow_rings_rx_get().
+ */
+unsigned int rina_flow_rings_rx_flags(struct rina_flow_rings *rings);
+
+/*
+ * Return the number of published TX SDUs that the kernel dropped with
+ * RINA_RING_F_ERR (too long, or rejected by the flow) since the last call.
+ */
+unsigned int rina_flow_rings_tx_errors(struct rina_flow_rings *rings);
+
+/*
+ * Ring the doorbell, asking the kernel to transmit the published TX
+ * SDUs and to move the pending incoming SDUs into the RX ring. Calling
+ * poll() on the flow file descriptor has the same effect; POLLIN and
+ * POLLOUT report a non-empty RX ring and a non-full TX ring, respectively.
+ * Returns 0 on success, or -1 on error with the errno code properly set.
+ */
+int rina_flow_rings_sync(struct rina_flow_rings *rings);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,7 +43,7 @@ extern "C" {
 #endif
 
 /* Expected control API version. */
-#define RL_API_VERSION 8
+#define RL_API_VERSION 16
 
 #define RLITE_CTRLDEV_NAME "/dev/rlite"
 #define RLITE_IODEV_NAME "/dev/rlite-io"
@@ -159,6 +159,9 @@ struct rl_msg_ipcp {
 /* Use this device to write/read management
  * PDUs for the IPCP specified by ipcp_id. */
 #define RLITE_IO_MODE_IPCP_MGMT 88
+/* Use this device to read/write SDUs for a group of
+ * flows, added with RLITE_IOCTL_GROUP_ADD. */
+#define RLITE_IO_MODE_FLOW_GROUP 89
 
 struct rl_ioctl_info {
     uint8_t mode;
@@ -171,6 +174,108 @@ struct rl_ioctl_info {
 #define RLITE_IOCTL_CHFLAGS _IOW(0xAF, 0x01, uint64_t)
 #define RLITE_IOCTL_MSS_GET _IOW(0xAF, 0x02, uint32_t *)
 
+/* Descriptor of a single SDU for the batched read/write ioctls. On input,
+ * 'len' is the size of the buffer (read) or the length of the SDU (write).
+ * On output, 'status' contains the number of bytes transferred or a
+ * negative error code. */
+struct rl_ioctl_sdu {
+    uint64_t buf; /* userspace pointer */
+    uint32_t len;
+    int32_t status;
+};
+
+/* Argument of the batched ioctls: an array of 'num' SDU descriptors. */
+struct rl_ioctl_batch {
+    uint64_t sdus; /* userspace pointer to struct rl_ioctl_sdu[num] */
+    uint32_t num;
+    uint32_t flags; /* unused */
+};
+
+#define RLITE_IO_BATCH_MAX 64
+
+/* Read/write up to RLITE_IO_BATCH_MAX SDUs with a single system call.
+ * They return the number of SDUs transferred. */
+#define RLITE_IOCTL_READ_BATCH _IOWR(0xAF, 0x03, struct rl_ioctl_batch)
+#define RLITE_IOCTL_WRITE_BATCH _IOWR(0xAF, 0x04, struct rl_ioctl_batch)
+
+/*
+ * Shared memory rings for flow I/O. A flow bound to an rlite-io device
+ * can be given an RX ring and a TX ring, allocated by the kernel with
+ * RLITE_IOCTL_RINGS_SETUP and mapped in the application address space
+ * with mmap(). The RX ring starts at offset 0, while the TX ring starts
+ * at offset 'ring_size'. Each ring is a single-producer single-consumer
+ * queue of SDU slots, with free running producer and consumer indices.
+ * The kernel is the producer of the RX ring and the consumer of the TX
+ * ring. Userspace asks the kernel to consume the TX ring and to refill
+ * the RX ring with RLITE_IOCTL_RINGS_SYNC or with poll().
+ */
+struct rl_ring_slot {
+    uint32_t len;
+    uint32_t flags;
+#define RL_RING_SLOT_F_TRUNC (1 << 0) /* RX SDU truncated to slot_size */
+#define RL_RING_SLOT_F_ERR (1 << 1)   /* TX SDU dropped */
+};
+
+struct rl_ring {
+    uint32_t num_slots; /* a power of two */
+    uint32_t slot_size; /* size of each slot buffer */
+    uint32_t buf_ofs;   /* offset of the slot buffers from the ring */
+    uint32_t pad0[13];
+    uint32_t prod; /* written by the producer only */
+    uint32_t pad1[15];
+    uint32_t cons; /* written by the consumer only */
+    uint32_t pad2[15];
+    struct rl_ring_slot slots[0];
+};
+
+#define RL_RING_BUF(_ring, _idx)                                               \
+    (((uint8_t *)(_ring)) + (_ring)->buf_ofs +                                 \
+     ((_idx) & ((_ring)->num_slots - 1)) * (_ring)->slot_size)
+
+struct rl_rings_req {
+    uint32_t num_slots; /* in */
+    uint32_t slot_size; /* in/out (rounded up) */
+    uint32_t ring_size; /* out */
+    uint32_t pad;
+};
+
+#define RL_RINGS_SLOTS_MAX 4096
+#define RL_RINGS_SLOT_SIZE_MAX (1 << 16)
+
+#define RLITE_IOCTL_RINGS_SETUP _IOWR(0xAF, 0x05, struct rl_rings_req)
+#define RLITE_IOCTL_RINGS_SYNC _IOW(0xAF, 0x06, uint32_t)
+#define RL_RINGS_SYNC_TX (1 << 0)
+#define RL_RINGS_SYNC_RX (1 << 1)
+
+/* Set the busy-poll budget (in microseconds) of a flow. When the budget
+ * is not zero, blocking reads and poll() spin on the flow receive queue
+ * for up to the budget before going to sleep. Zero disables busy-polling.
+ * The budget cannot exceed RINA_FLOW_BUSY_POLL_MAX. */
+#define RLITE_IOCTL_BUSY_POLL _IOW(0xAF, 0x07, uint32_t)
+
+/* Set the size limit (in bytes) of the receive queue of a flow, beyond
+ * which incoming SDUs are dropped if the flow has no flow control. Zero
+ * restores the default limit, derived from the flow spec. */
+#define RLITE_IOCTL_RXQ_LIMIT _IOW(0xAF, 0x0A, uint32_t)
+
+/* Set the receive low watermark of a flow, in SDUs: readers are woken up
+ * (and poll() reports POLLIN) only when at least that many SDUs are
+ * queued, or on EOF. Zero restores the default. */
+#define RLITE_IOCTL_RX_LOWAT _IOW(0xAF, 0x0B, uint32_t)
+
+/* Add to (or remove from) a RLITE_IO_MODE_FLOW_GROUP device the flow bound
+ * to the rlite-io file descriptor 'fd' (or identified by 'port_id'). On
+ * success, RLITE_IOCTL_GROUP_ADD returns the port-id of the flow, which
+ * identifies it in the struct rina_flow_group_hdr records. */
+struct rl_ioctl_group {
+    int32_t fd;
+    rl_port_t port_id;
+    uint16_t pad;
+};
+
+#define RLITE_IOCTL_GROUP_ADD _IOWR(0xAF, 0x08, struct rl_ioctl_group)
+#define RLITE_IOCTL_GROUP_DEL _IOW(0xAF, 0x09, struct rl_ioctl_group)
+
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT 1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR 2
 #define RLITE_MGMT_HDR_T_IN 3
@@ -201,7 +306,11 @@ struct rl_pci_match {
     rlm_cepid_t dst_cepid;
     rlm_cepid_t src_cepid;
     rlm_qosid_t qos_id;
-    rlm_qosid_t pad2;
+    /* Prefix length for 'dst_addr', in bits. Zero (or the address
+     * size) means an exact match. Only valid for destination-only
+     * matches. */
+    uint8_t dst_plen;
+    uint8_t pad2[3];
 };
 
 #define DTCP_PRESENT(_dc) ((_dc).flags != 0)
@@ -211,6 +320,7 @@ struct dtcp_config {
 #define DTCP_CFG_FLOW_CTRL (1 << 0)
 #define DTCP_CFG_RTX_CTRL (1 << 1)
 #define DTCP_CFG_SHAPER (1 << 2)
+#define DTCP_CFG_SACK (1 << 3) /* selective ACKs, with DTCP_CFG_RTX_CTRL */
 
     /* Flow control. */
     struct {
@@ -242,6 +352,11 @@ struct dtcp_config {
 
     uint32_t initial_a; /* A */
     uint32_t bandwidth; /* in bps */
+
+    /* Congestion control algorithm, used with flow control windows
+     * (an empty string selects the default one). */
+#define RL_CC_NAME_MAX 16
+    char cc_name[RL_CC_NAME_MAX];
 };
 
 struct rl_flow_config {
@@ -280,6 +395,8 @@ struct rl_flow_stats {
     uint64_t rx_byte;
     uint64_t rx_overrun_pkt;
     uint64_t rx_overrun_byte;
+    uint64_t busy_poll_hit;
+    uint64_t busy_poll_miss;
 };
 
 /* RMT statistics. All counters must be 64 bits wide. */
@@ -307,10 +424,34 @@ struct rl_ipcp_stats {
 
     uint64_t rtx_pkt;
     uint64_t rtx_byte;
+    /* Retransmissions of the holes reported by selective ACKs. */
+    uint64_t rtx_sack_pkt;
+    /* Timer retransmissions skipped, since the PDU was selectively
+     * acknowledged by the receiver. */
+    uint64_t rtx_avoided;
+    /* Retransmissions triggered by duplicate ACKs or time-based loss
+     * detection (RACK). */
+    uint64_t rtx_fast_pkt;
+    /* Tail loss probes. */
+    uint64_t rtx_tlp_pkt;
 
     struct rl_rmt_stats rmt;
 } __attribute__((aligned(64)));
 
+/* PDU forwarding table occupancy. */
+struct rl_pduft_stats {
+#define RL_PDUFT_T_HASH 0  /* hash table, resized with the entries */
+#define RL_PDUFT_T_ARRAY 1 /* array indexed by destination address */
+    uint32_t type;
+    uint32_t size;          /* number of buckets or slots */
+    uint32_t count;         /* destination-based entries */
+    uint32_t used;          /* non-empty buckets or slots */
+    uint32_t max_chain;     /* length of the longest bucket chain */
+    uint32_t perflow_count; /* per-flow entries */
+    uint32_t dflt;          /* is there a default entry? */
+    uint32_t prefix_count;  /* prefix entries */
+};
+
 /* DTP state exported to userspace. */
 struct rl_flow_dtp {
     /* Sender state. */
@@ -326,7 +467,7 @@ struct rl_flow_dtp {
     uint32_t rtt;        /* estimated round trip time, in usecs. */
     uint32_t rtt_stddev; /* stddev in usecs */
     uint32_t cgwin;      /* congestion window size, in PDUs */
-    uint32_t pad1;
+    uint32_t rto;        /* retransmission timeout, in usecs */
 
     /* Receiver state. */
     rlm_seq_t rcv_lwe;
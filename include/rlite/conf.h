@@ -81,7 +81,10 @@ int rl_conf_flow_get_dtp(rl_port_t port_id, struct rl_flow_dtp *dtp);
 
 int rl_conf_flow_get_stats(rl_port_t port_id, struct rl_flow_stats *stats);
 
-int rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats);
+/* The 'pduft' argument is optional (it may be NULL). Its content is
+ * zeroed for IPCPs that do not have a PDU forwarding table. */
+int rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats,
+                           struct rl_pduft_stats *pduft);
 
 #ifdef RL_MEMTRACK
 int rl_conf_memtrack_dump(void);
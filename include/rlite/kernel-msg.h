@@ -67,6 +67,10 @@ enum {
     RLITE_KER_IPCP_CONFIG_GET_RESP,  /* 35 */
     RLITE_KER_IPCP_SCHED_WRR,        /* 36 */
     RLITE_KER_IPCP_SCHED_PFIFO,      /* 37 */
+    RLITE_KER_IPCP_PDUFT_BATCH,      /* 38 */
+    RLITE_KER_IPCP_SCHED_DRR,        /* 39 */
+    RLITE_KER_IPCP_SCHED_FQ_CODEL,   /* 40 */
+    RLITE_KER_IPCP_SCHED_HTB,        /* 41 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -311,12 +315,56 @@ struct rl_kmsg_ipcp_pduft_mod {
     rl_ipcp_id_t ipcp_id;
     /* The local port where matching packets must be forwarded. */
     rl_port_t local_port;
-    uint32_t pad1;
+    /* RL_PDUFT_F_* flags, for RLITE_KER_IPCP_PDUFT_SET. */
+    uint16_t flags;
+    uint16_t pad1;
     /* Values of PCI fields that must match in order for this
-     * entry to be selected. */
+     * entry to be selected. With a match.dst_plen shorter than the
+     * address size, the entry is for a whole block of destinations,
+     * and it is selected by longest prefix match when no entry exists
+     * for the exact destination. */
     struct rl_pci_match match;
 };
 
+/* Add 'local_port' to the set of equal-cost lower flows of the entry
+ * (up to 8), instead of replacing the existing ones. A lower flow is
+ * selected for each PDU by hashing the fields that identify its EFCP
+ * connection. */
+#define RL_PDUFT_F_ADD (1 << 0)
+/* Set 'local_port' as the backup lower flow of the existing entry, to be
+ * used when the selected lower flow is deallocated or its link goes
+ * down, until the entry is updated. */
+#define RL_PDUFT_F_BACKUP (1 << 1)
+
+/* A single modification in a RLITE_KER_IPCP_PDUFT_BATCH message. */
+struct rl_pduft_mod {
+    /* RLITE_KER_IPCP_PDUFT_SET or RLITE_KER_IPCP_PDUFT_DEL. */
+    rl_msg_t op;
+    /* RL_PDUFT_F_* flags, for RLITE_KER_IPCP_PDUFT_SET. */
+    uint16_t flags;
+    /* The local port where matching packets must be forwarded. */
+    rl_port_t local_port;
+    uint16_t pad1;
+    struct rl_pci_match match;
+};
+
+/* Maximum number of modifications in a RLITE_KER_IPCP_PDUFT_BATCH
+ * message. */
+#define RL_PDUFT_BATCH_MAX 1024
+
+/* application --> kernel to apply a batch of PDUFT modifications, in
+ * order. The batch is atomic: if any modification fails nothing is
+ * changed, and the datapath sees either none or all of them. */
+struct rl_kmsg_ipcp_pduft_batch {
+    struct rl_msg_hdr hdr;
+
+    rl_ipcp_id_t ipcp_id;
+    uint16_t pad1[3];
+
+    /* Array of struct rl_pduft_mod. */
+    struct rl_msg_array_field mods;
+};
+
 /* application --> kernel message to flush the PDUFT of an IPC Process. */
 #define rl_kmsg_ipcp_pduft_flush rl_kmsg_ipcp_create_resp
 
@@ -444,6 +492,8 @@ struct rl_kmsg_ipcp_stats_resp {
     struct rl_msg_hdr hdr;
 
     struct rl_ipcp_stats stats;
+    /* Only valid for IPCPs that have a PDUFT. */
+    struct rl_pduft_stats pduft;
 };
 
 /* application --> kernel message to configure a WRR PDU scheduler. */
@@ -471,4 +521,75 @@ struct rl_kmsg_ipcp_sched_pfifo {
     rlm_qosid_t prio_levels;
 };
 
+/* application --> kernel message to configure a DRR PDU scheduler. */
+struct rl_kmsg_ipcp_sched_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* DRR quanta (in bytes) are dwords, one for each queue. */
+    struct rl_msg_array_field quanta;
+};
+
+/* application --> kernel message to configure a FQ-CoDel PDU scheduler. */
+struct rl_kmsg_ipcp_sched_fq_codel {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max size of all the sub-queues together, in bytes. */
+    uint32_t max_queue_size;
+
+    /* Number of per-destination sub-queues, at most 1024. With a single
+     * sub-queue the scheduler behaves as plain CoDel. */
+    uint32_t flows;
+
+    /* Acceptable minimum sojourn time, in microseconds. */
+    uint32_t target_us;
+
+    /* Sliding window where the minimum sojourn time is measured,
+     * in microseconds. */
+    uint32_t interval_us;
+
+    /* DRR quantum across the sub-queues, in bytes. */
+    uint32_t quantum;
+};
+
+/* Maximum number of classes in a RLITE_KER_IPCP_SCHED_HTB message. */
+#define RL_HTB_CLASSES_MAX 64
+
+/* A class in the hierarchy of a RLITE_KER_IPCP_SCHED_HTB message. */
+struct rl_htb_class {
+    /* Identifier of the class, nonzero and unique. */
+    uint16_t id;
+    /* Identifier of the parent class, or 0 for a root class. */
+    uint16_t parent;
+    /* For leaf classes, the QoS id of the PDUs queued in the class. */
+    rlm_qosid_t qos_id;
+    /* Rate guaranteed to the class, in bytes per second. */
+    uint32_t rate;
+    /* Maximum rate that the class can reach by borrowing from its
+     * ancestors, in bytes per second. If 0 it is the same as 'rate'. */
+    uint32_t ceil;
+    /* Bytes that the class can send back-to-back after being idle.
+     * If 0 a default is used. */
+    uint32_t burst;
+};
+
+/* application --> kernel message to configure a HTB PDU scheduler. */
+struct rl_kmsg_ipcp_sched_htb {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size of each leaf class, in bytes. */
+    uint32_t max_queue_size;
+
+    /* Leaf class for the PDUs whose QoS id does not match any leaf
+     * class. If 0, the first leaf class is used. */
+    uint16_t default_class;
+    uint16_t pad1;
+
+    /* Array of struct rl_htb_class, where parents come before their
+     * children. */
+    struct rl_msg_array_field classes;
+};
+
 #endif /* __RLITE_KER_H__ */
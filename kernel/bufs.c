@@ -24,8 +24,570 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/skbuff.h>
 #include "rlite-kernel.h"
 
+#ifndef RL_SKB
+/*
+ * Per-CPU cache of buffer headers and buffer blocks.
+ *
+ * A buffer returned by rl_buf_alloc() is a single block, where the
+ * struct rl_buf is followed by the struct rl_rawbuf (reference counter
+ * and packet data). Only clones need a separate struct rl_buf. To avoid
+ * a trip to the slab allocator for each PDU at each layer of the stack,
+ * freed blocks and headers are parked in a small per-CPU stack, and
+ * reused by the next allocation on the same CPU. Blocks are grouped in
+ * size classes, and allocations are rounded up to the size of their
+ * class. The small class can host a control PDU (or any other small PDU)
+ * together with its header in a few cache lines. The size of the large
+ * class follows the biggest buffer that an IPCP can ask for (hdroom + MSS
+ * + tailroom), as reported by rl_buf_cache_hint(). Blocks larger than
+ * RL_BUFCACHE_SIZE_MAX are never cached.
+ *
+ * The cache is accessed with local interrupts disabled, so that the same
+ * per-CPU stack can be used from process context, softirq and timers.
+ */
+
+#define RL_BUFCACHE_SIZE_MAX ((1 << 16) + 1024)
+
+/* Maximum number of cached objects per CPU. */
+#define RL_BUFCACHE_HDRS_DEPTH 128
+static const unsigned int rl_bufcache_depth[RL_BUFCACHE_NCLASSES] = {
+    [RL_BUFCACHE_SMALL]  = 128,
+    [RL_BUFCACHE_MEDIUM] = 64,
+    [RL_BUFCACHE_LARGE]  = 8,
+};
+
+/* Block size of each class. These are powers of two, so that the slab
+ * allocator returns cache-aligned blocks. The size of the large class
+ * can grow at run-time (see rl_buf_cache_hint()). */
+static size_t rl_bufcache_size[RL_BUFCACHE_NCLASSES] = {
+    [RL_BUFCACHE_SMALL]  = 256,
+    [RL_BUFCACHE_MEDIUM] = 2048,
+    [RL_BUFCACHE_LARGE]  = 2048,
+};
+
+struct rl_buf_cache {
+    unsigned int num_hdrs;
+    struct rl_buf *hdrs[RL_BUFCACHE_HDRS_DEPTH];
+    struct rl_buf_cache_stats stats;
+
+    struct rl_buf_cache_class {
+        unsigned int num_blocks;
+        struct rl_buf **blocks;
+    } classes[RL_BUFCACHE_NCLASSES];
+};
+
+static struct rl_buf_cache __percpu *rl_buf_cache;
+
+static inline size_t
+rl_buf_block_size(size_t real_size)
+{
+    return L1_CACHE_ALIGN(RL_BUF_BLOCK_OVERHEAD + real_size);
+}
+
+static inline int
+rl_bufcache_class(size_t block_size)
+{
+    int i;
+
+    for (i = 0; i < RL_BUFCACHE_NCLASSES; i++) {
+        if (block_size <= READ_ONCE(rl_bufcache_size[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static struct rl_buf *
+rl_bufcache_hdr_get(gfp_t gfp)
+{
+    struct rl_buf *rb = NULL;
+
+    if (likely(rl_buf_cache)) {
+        struct rl_buf_cache *c;
+        unsigned long flags;
+
+        local_irq_save(flags);
+        c = this_cpu_ptr(rl_buf_cache);
+        if (c->num_hdrs) {
+            rb = c->hdrs[--c->num_hdrs];
+            c->stats.hdr_hit++;
+        } else {
+            c->stats.hdr_miss++;
+        }
+        local_irq_restore(flags);
+    }
+
+    if (!rb) {
+        rb = rl_alloc(sizeof(*rb), gfp, RL_MT_BUFHDR);
+    }
+
+    return rb;
+}
+
+static void
+rl_bufcache_hdr_put(struct rl_buf *rb)
+{
+    if (likely(rl_buf_cache)) {
+        struct rl_buf_cache *c;
+        unsigned long flags;
+
+        local_irq_save(flags);
+        c = this_cpu_ptr(rl_buf_cache);
+        if (c->num_hdrs < RL_BUFCACHE_HDRS_DEPTH) {
+            c->hdrs[c->num_hdrs++] = rb;
+            rb                     = NULL;
+        }
+        local_irq_restore(flags);
+    }
+
+    if (rb) {
+        rl_free(rb, RL_MT_BUFHDR);
+    }
+}
+
+/* Get a block that can hold at least 'real_size' bytes of packet data.
+ * The returned struct rl_buf is the owner of the block. */
+static struct rl_buf *
+rl_bufcache_block_get(size_t real_size, gfp_t gfp)
+{
+    size_t block_size    = rl_buf_block_size(real_size);
+    int cls              = rl_bufcache_class(block_size);
+    struct rl_buf *rb    = NULL;
+    struct rl_buf *stale = NULL;
+
+    if (likely(rl_buf_cache && cls >= 0)) {
+        struct rl_buf_cache_class *cc;
+        struct rl_buf_cache *c;
+        unsigned long flags;
+
+        local_irq_save(flags);
+        c  = this_cpu_ptr(rl_buf_cache);
+        cc = c->classes + cls;
+        if (cc->num_blocks) {
+            rb = cc->blocks[--cc->num_blocks];
+            if (unlikely(RL_BUF_INLINE_RAW(rb)->size < real_size)) {
+                /* Cached before the large class was resized. */
+                stale = rb;
+                rb    = NULL;
+            }
+        }
+        if (rb) {
+            c->stats.block_hit[cls]++;
+        } else {
+            c->stats.block_miss[cls]++;
+        }
+        local_irq_restore(flags);
+
+        if (stale) {
+            rl_free(stale, RL_MT_BUFDATA);
+        }
+
+        /* Round up to the class size, so that the block can be
+         * reused by any allocation that falls in the same class. */
+        block_size = READ_ONCE(rl_bufcache_size[cls]);
+    }
+
+    if (!rb) {
+        rb = rl_alloc(block_size, gfp, RL_MT_BUFDATA);
+        if (unlikely(!rb)) {
+            return NULL;
+        }
+        RL_BUF_INLINE_RAW(rb)->size = block_size - RL_BUF_BLOCK_OVERHEAD;
+    }
+
+    rb->raw        = RL_BUF_INLINE_RAW(rb);
+    rb->raw->frags = NULL;
+
+    return rb;
+}
+
+/* Release a block, whose raw buffer is not referenced anymore. */
+static void
+rl_bufcache_block_put(struct rl_buf *rb)
+{
+    size_t block_size = RL_BUF_BLOCK_OVERHEAD + RL_BUF_INLINE_RAW(rb)->size;
+    int cls           = rl_bufcache_class(block_size);
+
+    if (likely(rl_buf_cache && cls >= 0 &&
+               block_size == READ_ONCE(rl_bufcache_size[cls]))) {
+        struct rl_buf_cache_class *cc;
+        unsigned long flags;
+
+        local_irq_save(flags);
+        cc = this_cpu_ptr(rl_buf_cache)->classes + cls;
+        if (cc->num_blocks < rl_bufcache_depth[cls]) {
+            cc->blocks[cc->num_blocks++] = rb;
+            rb                           = NULL;
+        }
+        local_irq_restore(flags);
+    }
+
+    if (rb) {
+        rl_free(rb, RL_MT_BUFDATA);
+    }
+}
+
+int
+rl_buf_cache_init(void)
+{
+    int cpu;
+
+    rl_buf_cache = alloc_percpu(struct rl_buf_cache);
+    if (!rl_buf_cache) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_buf_cache *c = per_cpu_ptr(rl_buf_cache, cpu);
+        int i;
+
+        for (i = 0; i < RL_BUFCACHE_NCLASSES; i++) {
+            c->classes[i].blocks = rl_alloc(
+                rl_bufcache_depth[i] * sizeof(c->classes[i].blocks[0]),
+                GFP_KERNEL | __GFP_ZERO, RL_MT_MISC);
+            if (!c->classes[i].blocks) {
+                rl_buf_cache_fini();
+                return -ENOMEM;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void
+rl_buf_cache_fini(void)
+{
+    struct rl_buf_cache __percpu *cache = rl_buf_cache;
+    int cpu;
+
+    if (!cache) {
+        return;
+    }
+
+    /* Stop using the cache, and drain it. Nobody can allocate buffers
+     * at this point, since all the users of this module are gone. */
+    rl_buf_cache = NULL;
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_buf_cache *c = per_cpu_ptr(cache, cpu);
+        int i;
+
+        while (c->num_hdrs) {
+            rl_free(c->hdrs[--c->num_hdrs], RL_MT_BUFHDR);
+        }
+
+        for (i = 0; i < RL_BUFCACHE_NCLASSES; i++) {
+            struct rl_buf_cache_class *cc = c->classes + i;
+
+            if (!cc->blocks) {
+                continue;
+            }
+            while (cc->num_blocks) {
+                rl_free(cc->blocks[--cc->num_blocks], RL_MT_BUFDATA);
+            }
+            rl_free(cc->blocks, RL_MT_MISC);
+        }
+    }
+
+    free_percpu(cache);
+}
+
+/* Tell the cache about the largest buffer (hdroom + MSS + tailroom) that
+ * an IPCP is going to allocate, so that the large class can be sized
+ * accordingly. The large class never shrinks. */
+void
+rl_buf_cache_hint(size_t real_size)
+{
+    size_t block_size = rl_buf_block_size(real_size);
+
+    if (block_size > RL_BUFCACHE_SIZE_MAX) {
+        block_size = RL_BUFCACHE_SIZE_MAX;
+    }
+    if (block_size > READ_ONCE(rl_bufcache_size[RL_BUFCACHE_LARGE])) {
+        WRITE_ONCE(rl_bufcache_size[RL_BUFCACHE_LARGE], block_size);
+    }
+}
+EXPORT_SYMBOL(rl_buf_cache_hint);
+
+/* Collect the per-CPU hit/miss counters. */
+void
+rl_buf_cache_stats_get(struct rl_buf_cache_stats *stats)
+{
+    int cpu;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!rl_buf_cache) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_buf_cache_stats *cs =
+            &per_cpu_ptr(rl_buf_cache, cpu)->stats;
+        int i;
+
+        stats->hdr_hit += cs->hdr_hit;
+        stats->hdr_miss += cs->hdr_miss;
+        for (i = 0; i < RL_BUFCACHE_NCLASSES; i++) {
+            stats->block_hit[i] += cs->block_hit[i];
+            stats->block_miss[i] += cs->block_miss[i];
+        }
+    }
+}
+
+static void
+rl_buf_frags_free(struct rl_rawbuf *raw)
+{
+    struct rl_buf_frags *frags = raw->frags;
+    unsigned int i;
+
+    for (i = 0; i < frags->nr; i++) {
+        put_page(frags->f[i].page);
+    }
+    rl_free(frags, RL_MT_BUFDATA);
+    raw->frags = NULL;
+}
+
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+/* Fill an empty buffer with 'len' bytes copied from userspace, using
+ * page fragments rather than the linear part. The caller is expected to
+ * free the buffer on failure. */
+int
+rl_buf_frags_from_user(struct rl_buf *rb, struct iov_iter *from, size_t len)
+{
+    unsigned int nr = DIV_ROUND_UP(len, PAGE_SIZE);
+    struct rl_buf_frags *frags;
+
+    BUG_ON(rb->len || rb->raw->frags || nr > RL_BUF_FRAGS_MAX);
+
+    frags = rl_alloc(sizeof(*frags) + nr * sizeof(frags->f[0]),
+                     GFP_KERNEL | __GFP_ZERO, RL_MT_BUFDATA);
+    if (unlikely(!frags)) {
+        return -ENOMEM;
+    }
+    rb->raw->frags = frags;
+
+    while (frags->nr < nr) {
+        struct rl_buf_frag *frag = frags->f + frags->nr;
+        size_t fraglen           = min_t(size_t, len - frags->len, PAGE_SIZE);
+        void *va                 = netdev_alloc_frag(fraglen);
+
+        if (unlikely(!va)) {
+            return -ENOMEM;
+        }
+        frag->page = virt_to_head_page(va);
+        frag->off  = va - page_address(frag->page);
+        frag->len  = fraglen;
+        frags->nr++;
+        frags->len += fraglen;
+
+        if (unlikely(copy_from_iter(va, fraglen, from) != fraglen)) {
+            return -EFAULT;
+        }
+    }
+
+    rb->len      = len;
+    rb->data_len = len;
+
+    return 0;
+}
+
+int
+rl_buf_frags_copy_to_user(struct rl_buf *rb, struct iov_iter *to,
+                          size_t bytes)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    size_t headlen             = min(bytes, rl_buf_headlen(rb));
+    size_t copied;
+    unsigned int off, len;
+    unsigned int i;
+
+    copied = copy_to_iter(RL_BUF_DATA(rb), headlen, to);
+    if (unlikely(copied != headlen)) {
+        return copied;
+    }
+
+    for (i = rl_buf_frag_first(rb, &off, &len); copied < bytes;) {
+        size_t chunk = min(bytes - copied, (size_t)len);
+        size_t ret;
+
+        ret = copy_to_iter(rl_buf_frag_address(frags->f + i, off), chunk, to);
+        copied += ret;
+        if (unlikely(ret != chunk) || ++i >= frags->nr) {
+            break;
+        }
+        off = frags->f[i].off;
+        len = frags->f[i].len;
+    }
+
+    return copied;
+}
+#else  /* AIO_RW */
+int
+rl_buf_frags_copy_to_user(struct rl_buf *rb, const struct iovec *to,
+                          size_t bytes)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    size_t copied              = min(bytes, rl_buf_headlen(rb));
+    unsigned int off, len;
+    unsigned int i;
+    int ret;
+
+    ret = memcpy_toiovecend(to, RL_BUF_DATA(rb), 0, copied);
+    if (ret) {
+        return ret;
+    }
+
+    for (i = rl_buf_frag_first(rb, &off, &len); copied < bytes;) {
+        size_t chunk = min(bytes - copied, (size_t)len);
+
+        ret = memcpy_toiovecend(to, rl_buf_frag_address(frags->f + i, off),
+                                copied, chunk);
+        if (ret) {
+            return ret;
+        }
+        copied += chunk;
+        if (++i >= frags->nr) {
+            break;
+        }
+        off = frags->f[i].off;
+        len = frags->f[i].len;
+    }
+
+    return copied;
+}
+#endif /* AIO_RW */
+
+/* Fill in a kvec array (with at least RL_BUF_KVEC_MAX entries) with the
+ * linear part and the fragments, to be passed to kernel_sendmsg().
+ * Returns the number of entries used. */
+int
+rl_buf_kvec(struct rl_buf *rb, struct kvec *vec)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    unsigned int off, len;
+    unsigned int i;
+    int n = 0;
+
+    vec[n].iov_base = RL_BUF_DATA(rb);
+    vec[n].iov_len  = rl_buf_headlen(rb);
+    n++;
+
+    if (likely(!rb->data_len)) {
+        return n;
+    }
+
+    for (i = rl_buf_frag_first(rb, &off, &len); i < frags->nr; i++, n++) {
+        vec[n].iov_base = rl_buf_frag_address(frags->f + i, off);
+        vec[n].iov_len  = len;
+        if (i + 1 < frags->nr) {
+            off = frags->f[i + 1].off;
+            len = frags->f[i + 1].len;
+        }
+    }
+
+    return n;
+}
+EXPORT_SYMBOL(rl_buf_kvec);
+
+/* Copy the linear part at the tail of 'skb', and attach the fragments
+ * (if any) to 'skb' without copying them. */
+void
+rl_buf_copy_to_skb(struct rl_buf *rb, struct sk_buff *skb)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    size_t headlen             = rl_buf_headlen(rb);
+    unsigned int off, len;
+    unsigned int i;
+    int j = 0;
+
+    memcpy(skb_put(skb, headlen), RL_BUF_DATA(rb), headlen);
+
+    if (likely(!rb->data_len)) {
+        return;
+    }
+
+    for (i = rl_buf_frag_first(rb, &off, &len); i < frags->nr; i++, j++) {
+        get_page(frags->f[i].page);
+        skb_fill_page_desc(skb, j, frags->f[i].page, off, len);
+        if (i + 1 < frags->nr) {
+            off = frags->f[i + 1].off;
+            len = frags->f[i + 1].len;
+        }
+    }
+    skb->len += rb->data_len;
+    skb->data_len += rb->data_len;
+    skb->truesize += rb->data_len;
+}
+EXPORT_SYMBOL(rl_buf_copy_to_skb);
+
+/* Copy the first 'len' bytes of the PDU (linear part and fragments)
+ * into a contiguous kernel buffer. */
+void
+rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t len)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    size_t headlen             = min(len, rl_buf_headlen(rb));
+    uint8_t *p                 = dst;
+    unsigned int off, flen;
+    unsigned int i;
+
+    memcpy(p, RL_BUF_DATA(rb), headlen);
+    if (likely(headlen == len)) {
+        return;
+    }
+    p += headlen;
+    len -= headlen;
+
+    for (i = rl_buf_frag_first(rb, &off, &flen); len && i < frags->nr;) {
+        size_t chunk = min(len, (size_t)flen);
+
+        memcpy(p, rl_buf_frag_address(frags->f + i, off), chunk);
+        p += chunk;
+        len -= chunk;
+        if (++i < frags->nr) {
+            off  = frags->f[i].off;
+            flen = frags->f[i].len;
+        }
+    }
+}
+
+/* Return a linear copy of 'rb', for the users that need to access the
+ * whole PDU (e.g. to compute a checksum). The original buffer is
+ * consumed. Returns 'rb' itself if it is already linear. */
+struct rl_buf *
+rl_buf_linearize(struct rl_buf *rb, gfp_t gfp)
+{
+    size_t hdroom = (uint8_t *)RL_BUF_DATA(rb) - rb->raw->buf;
+    struct rl_buf *nrb;
+
+    if (likely(!rb->data_len)) {
+        return rb;
+    }
+
+    nrb = rl_buf_alloc(rb->len, hdroom, 0, gfp);
+    if (unlikely(!nrb)) {
+        rl_buf_free(rb);
+        return NULL;
+    }
+
+    rl_buf_copy_bits(rb, RL_BUF_DATA(nrb), rb->len);
+    rl_buf_append(nrb, rb->len);
+    nrb->u = rb->u;
+    rl_buf_free(rb);
+
+    return nrb;
+}
+EXPORT_SYMBOL(rl_buf_linearize);
+#endif /* !RL_SKB */
+
 /*
  * Allocate a buffer to hold PDU header and data.
  * The returned buffer has zero length (i.e. it's empty).
@@ -35,27 +597,16 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
 {
     struct rl_buf *rb;
 #ifndef RL_SKB
-    size_t real_size = hdroom + size + tailroom;
-    uint8_t *kbuf;
-
-    rb = rl_alloc(sizeof(*rb), gfp, RL_MT_BUFHDR);
+    rb = rl_bufcache_block_get(hdroom + size + tailroom, gfp);
     if (unlikely(!rb)) {
         RPV(1, "Out of memory\n");
         return NULL;
     }
 
-    kbuf = rl_alloc(sizeof(*rb->raw) + real_size, gfp, RL_MT_BUFDATA);
-    if (unlikely(!kbuf)) {
-        rl_free(rb, RL_MT_BUFHDR);
-        RPV(1, "Out of memory\n");
-        return NULL;
-    }
-
-    rb->raw       = (struct rl_rawbuf *)kbuf;
-    rb->raw->size = real_size;
     atomic_set(&rb->raw->refcnt, 1);
-    rb->pci = (struct rina_pci *)(rb->raw->buf + hdroom);
-    rb->len = 0;
+    rb->pci      = (struct rina_pci *)(rb->raw->buf + hdroom);
+    rb->len      = 0;
+    rb->data_len = 0;
     rb_list_init(&rb->node);
 
 #else  /* RL_SKB */
@@ -81,13 +632,14 @@ rl_buf_clone(struct rl_buf *rb, gfp_t gfp)
     struct rl_buf *crb;
 
 #ifndef RL_SKB
-    crb = rl_alloc(sizeof(*crb), gfp, RL_MT_BUFHDR);
+    crb = rl_bufcache_hdr_get(gfp);
     if (unlikely(!crb)) {
         return NULL;
     }
 
     BUG_ON(rb == NULL);
-    /* Increment the raw buffer reference counter. */
+    /* Increment the raw buffer reference counter. This also keeps
+     * alive the block containing the raw buffer. */
     atomic_inc(&rb->raw->refcnt);
 
     /* Normal copy - includes pointer copy. */
@@ -114,11 +666,22 @@ void
 __rl_buf_free(struct rl_buf *rb)
 {
 #ifndef RL_SKB
-    if (atomic_dec_and_test(&rb->raw->refcnt)) {
-        rl_free(rb->raw, RL_MT_BUFDATA);
+    struct rl_rawbuf *raw = rb->raw;
+    bool clone            = (raw != RL_BUF_INLINE_RAW(rb));
+
+    /* The header of the block owner is not released here, since
+     * it lives in the same block as the raw buffer, which may still be
+     * referenced by some clones. */
+    if (atomic_dec_and_test(&raw->refcnt)) {
+        if (raw->frags) {
+            rl_buf_frags_free(raw);
+        }
+        rl_bufcache_block_put(RL_RAWBUF_OWNER(raw));
     }
 
-    rl_free(rb, RL_MT_BUFHDR);
+    if (clone) {
+        rl_bufcache_hdr_put(rb);
+    }
 #else  /* RL_SKB */
     kfree_skb(rb);
 #endif /* RL_SKB */
@@ -602,6 +602,9 @@ ipcp_add_entry(struct rl_dm *dm, struct rl_kmsg_ipcp_create *req,
         entry->rxhdroom         = 0;
         entry->tailroom         = 0;
         entry->max_sdu_size     = (1 << 16) - 1;
+        entry->rxq_budget       = RL_RXQ_BUDGET_DFLT;
+        atomic_set(&entry->rxq_mem, 0);
+        atomic_set(&entry->rxq_active, 0);
         INIT_LIST_HEAD(&entry->registered_appls);
         spin_lock_init(&entry->regapp_lock);
         init_waitqueue_head(&entry->uipcp_wqh);
@@ -622,6 +625,15 @@ ipcp_add_entry(struct rl_dm *dm, struct rl_kmsg_ipcp_create *req,
     return ret;
 }
 
+/* Let the buffer cache know about the largest buffers this IPCP
+ * is going to allocate. */
+static void
+ipcp_buf_cache_hint(struct ipcp_entry *ipcp)
+{
+    rl_buf_cache_hint(max(ipcp->txhdroom, ipcp->rxhdroom) +
+                      ipcp->max_sdu_size + ipcp->tailroom);
+}
+
 static int
 ipcp_add(struct rl_dm *dm, struct rl_kmsg_ipcp_create *req,
          rl_ipcp_id_t *ipcp_id)
@@ -668,6 +680,7 @@ ipcp_add(struct rl_dm *dm, struct rl_kmsg_ipcp_create *req,
     entry->ops = factory->ops;
     entry->flags |= factory->use_cep_ids ? RL_K_IPCP_USE_CEP_IDS : 0;
     *ipcp_id = entry->id;
+    ipcp_buf_cache_hint(entry);
 
 out:
     mutex_unlock(&rl_global.lock);
@@ -1201,8 +1214,6 @@ flow_del(struct flow_entry *entry)
     struct rl_kmsg_flow_deallocated ntfy;
     struct ipcp_entry *upper_ipcp;
     struct ipcp_entry *ipcp;
-    struct rl_buf *tmp;
-    struct rl_buf *rb;
     struct dtp *dtp;
 
 #if 0
@@ -1224,11 +1235,7 @@ flow_del(struct flow_entry *entry)
 
     /* dtp_fini() may print txrx.rx_qsize, so we purge the queue after
      * calling that function. */
-    rb_list_foreach_safe (rb, tmp, &entry->txrx.rx_q) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-    }
-    entry->txrx.rx_qsize = 0;
+    txrx_rxq_purge(&entry->txrx);
 
     if (upper_ipcp) {
         upper_ipcp->ops.pduft_flush_by_flow(upper_ipcp, entry);
@@ -2108,6 +2115,8 @@ rl_ipcp_config(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
         } else if (strcmp(req->name, "flow-del-wait-ms") == 0) {
             ret =
                 rl_configstr_to_u32(req->value, &entry->flow_del_wait_ms, NULL);
+        } else if (strcmp(req->name, "rxq-budget") == 0) {
+            ret = rl_configstr_to_u32(req->value, &entry->rxq_budget, NULL);
         } else {
             ret = -EINVAL; /* unknown request */
         }
@@ -2116,6 +2125,7 @@ rl_ipcp_config(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     if (ret == 0) {
         PD("Configured IPC process %s: %s <= %s\n", entry->name, req->name,
            req->value);
+        ipcp_buf_cache_hint(entry);
 
         if (notify) {
             /* Upqueue an RLITE_KER_IPCP_UPDATE message to each
@@ -2170,6 +2180,8 @@ rl_ipcp_config_get(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
             snprintf(valbuf, sizeof(valbuf), "%u", entry->max_sdu_size);
         } else if (strcmp(req->param_name, "flow-del-wait-ms") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->flow_del_wait_ms);
+        } else if (strcmp(req->param_name, "rxq-budget") == 0) {
+            snprintf(valbuf, sizeof(valbuf), "%u", entry->rxq_budget);
         } else {
             ret = -EINVAL; /* unknown request */
         }
@@ -2241,7 +2253,7 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
          * anymore (so references to flows in the pduft will stay there forever,
          * and so the IPCPs bound to them). */
         if (req->hdr.msg_type == RLITE_KER_IPCP_PDUFT_SET) {
-            ret = ipcp->ops.pduft_set(ipcp, &req->match, flow);
+            ret = ipcp->ops.pduft_set(ipcp, &req->match, flow, req->flags);
         } else { /* RLITE_KER_IPCP_PDUFT_DEL */
             ret = ipcp->ops.pduft_del_addr(ipcp, &req->match);
         }
@@ -2259,6 +2271,64 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+static int
+rl_ipcp_pduft_batch(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_pduft_batch *req =
+        (struct rl_kmsg_ipcp_pduft_batch *)bmsg;
+    const struct rl_pduft_mod *mods = req->mods.slots.raw;
+    unsigned int n                  = req->mods.num_elements;
+    struct flow_entry **flows       = NULL;
+    struct ipcp_entry *ipcp;
+    unsigned int i;
+    int ret = -EINVAL; /* Report failure by default. */
+
+    ipcp = ipcp_get(rc->dm, req->ipcp_id);
+
+    if (!ipcp || !ipcp->ops.pduft_batch || (ipcp->flags & RL_K_IPCP_ZOMBIE) ||
+        (n && req->mods.elem_size != sizeof(*mods)) ||
+        n > RL_PDUFT_BATCH_MAX) {
+        goto out;
+    }
+
+    flows = rl_alloc(max(n, 1U) * sizeof(*flows), GFP_KERNEL | __GFP_ZERO,
+                     RL_MT_MISC);
+    if (!flows) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Same check as rl_ipcp_pduft_mod(), for each lower flow. */
+    for (i = 0; i < n; i++) {
+        if (mods[i].op != RLITE_KER_IPCP_PDUFT_SET) {
+            continue;
+        }
+        flows[i] = flow_get(rc->dm, mods[i].local_port);
+        if (!flows[i] || flows[i]->upper.ipcp != ipcp) {
+            goto out;
+        }
+    }
+
+    mutex_lock(&ipcp->lock);
+    ret = ipcp->ops.pduft_batch(ipcp, mods, flows, n);
+    mutex_unlock(&ipcp->lock);
+
+    if (ret == 0) {
+        PV("Applied %u PDUFT modifications to IPC process %s\n", n,
+           ipcp->name);
+    }
+out:
+    if (flows) {
+        for (i = 0; i < n; i++) {
+            flow_put(flows[i]);
+        }
+        rl_free(flows, RL_MT_MISC);
+    }
+    ipcp_put(ipcp);
+
+    return ret;
+}
+
 static int
 rl_ipcp_pduft_flush(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2405,6 +2475,9 @@ rl_ipcp_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
                 *sdst += *ssrc;
             }
         }
+        if (ipcp->ops.pduft_stats) {
+            ipcp->ops.pduft_stats(ipcp, &resp.pduft);
+        }
         ret = rl_upqueue_append(rc, (const struct rl_msg_base *)&resp, false);
         rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&resp));
     }
@@ -2476,6 +2549,22 @@ rl_flow_shutdown(struct flow_entry *flow)
 }
 EXPORT_SYMBOL(rl_flow_shutdown);
 
+/* Mark a flow as (not) able to carry traffic because of the state of
+ * the underlying link, so that the PDUFT of the upper IPCP can switch
+ * to backup flows right away. */
+void
+rl_flow_set_down(struct flow_entry *flow, bool down)
+{
+    spin_lock_bh(&flow->txrx.rx_lock);
+    if (down) {
+        flow->flags |= RL_FLOW_DOWN;
+    } else {
+        flow->flags &= ~RL_FLOW_DOWN;
+    }
+    spin_unlock_bh(&flow->txrx.rx_lock);
+}
+EXPORT_SYMBOL(rl_flow_set_down);
+
 static int
 rl_flow_dealloc(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2538,8 +2627,9 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.dtp.max_cwq_len            = dtp->max_cwq_len;
     resp.dtp.rtxq_len               = dtp->rtxq_len;
     resp.dtp.max_rtxq_len           = dtp->max_rtxq_len;
-    resp.dtp.rtt                    = jiffies_to_msecs(dtp->rtt) * 1000;
-    resp.dtp.rtt_stddev             = jiffies_to_msecs(dtp->rtt_stddev) * 1000;
+    resp.dtp.rtt                    = dtp->rtt_us;
+    resp.dtp.rtt_stddev             = dtp->rtt_stddev_us;
+    resp.dtp.rto                    = dtp->rto_us;
     resp.dtp.cgwin                  = dtp->cgwin;
     resp.dtp.rcv_lwe                = dtp->rcv_lwe;
     resp.dtp.rcv_next_seq_num       = dtp->rcv_next_seq_num;
@@ -3181,6 +3271,10 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_CONFIG_GET_REQ]   = rl_ipcp_config_get,
     [RLITE_KER_IPCP_SCHED_WRR]        = rl_ipcp_sched_config,
     [RLITE_KER_IPCP_SCHED_PFIFO]      = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_PDUFT_BATCH]      = rl_ipcp_pduft_batch,
+    [RLITE_KER_IPCP_SCHED_DRR]        = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_FQ_CODEL]   = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_HTB]        = rl_ipcp_sched_config,
 #ifdef RL_MEMTRACK
     [RLITE_KER_MEMTRACK_DUMP] = rl_memtrack_dump,
 #endif /* RL_MEMTRACK */
@@ -3235,6 +3329,7 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
     case RLITE_KER_IPCP_CONFIG:
     case RLITE_KER_IPCP_PDUFT_SET:
     case RLITE_KER_IPCP_PDUFT_FLUSH:
+    case RLITE_KER_IPCP_PDUFT_BATCH:
     case RLITE_KER_APPL_REGISTER_RESP:
     case RLITE_KER_IPCP_UIPCP_SET:
     case RLITE_KER_UIPCP_FA_REQ_ARRIVED:
@@ -3669,8 +3764,15 @@ rlite_init(void)
     INIT_LIST_HEAD(&rl_global.ipcp_factories);
     hash_init(rl_global.netns_table);
 
+    ret = rl_buf_cache_init();
+    if (ret) {
+        PE("Failed to initialize buffer cache\n");
+        return ret;
+    }
+
     ret = misc_register(&rl_ctrl_misc);
     if (ret) {
+        rl_buf_cache_fini();
         PE("Failed to register rlite misc device\n");
         return ret;
     }
@@ -3678,6 +3780,7 @@ rlite_init(void)
     ret = misc_register(&rl_io_misc);
     if (ret) {
         misc_deregister(&rl_ctrl_misc);
+        rl_buf_cache_fini();
         PE("Failed to register rlite-io misc device\n");
         return ret;
     }
@@ -3700,6 +3803,9 @@ rlite_fini(void)
 {
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
+    /* Wait for pending RCU callbacks (e.g. PDUFT entries). */
+    rcu_barrier();
+    rl_buf_cache_fini();
 }
 
 module_init(rlite_init);
@@ -37,6 +37,13 @@
 #include <linux/hashtable.h>
 #include <linux/spinlock.h>
 #include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/splice.h>
+#include <asm/div64.h>
+#include <linux/pipe_fs_i.h>
 #include <asm/compat.h>
 
 static LIST_HEAD(rl_iodevs);
@@ -62,15 +69,121 @@ hms_time(void)
 }
 #endif
 
-/* Userspace queue threshold in bytes. */
-#define RL_RXQ_SIZE_MAX (1 << 20)
+/* Maximum amount of memory for the shared memory rings of a flow. */
+#define RL_RINGS_MEM_MAX (64 << 20)
+
+/* Kernel-side state of the shared memory rings. The kernel keeps its own
+ * copy of the ring parameters and of the indices it owns, since
+ * userspace can write to the shared memory at any time. The rings are
+ * referenced by the rl_io they are set up for and by each mapping. */
+struct rl_io_rings {
+    atomic_t refcnt;
+    void *mem; /* vmalloc_user() area containing both rings */
+    size_t ring_size;
+    struct rl_ring *rx;
+    struct rl_ring *tx;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t buf_ofs;
+
+    /* RX ring producer index, and last consumer index seen by the
+     * kernel, protected by txrx->rx_lock. */
+    uint32_t rx_prod;
+    uint32_t rx_cons;
+
+    /* TX ring consumer index, protected by tx_lock. */
+    struct mutex tx_lock;
+    uint32_t tx_cons;
+
+    /* Sequence number to be reported to flow->sdu_rx_consumed() when
+     * userspace releases each RX slot. */
+    rlm_seq_t rx_seqnums[0];
+};
 
-int
-rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
-               struct rl_buf *rb, bool qlimit)
+static void
+rl_io_rings_put(struct rl_io_rings *rings)
+{
+    if (atomic_dec_and_test(&rings->refcnt)) {
+        vfree(rings->mem);
+        rl_free(rings, RL_MT_IODEV);
+    }
+}
+
+/* Use the kernel copy of the ring parameters to locate a slot buffer. */
+static inline uint8_t *
+rl_io_ring_buf(struct rl_io_rings *rings, struct rl_ring *ring, uint32_t idx)
+{
+    return (uint8_t *)ring + rings->buf_ofs + idx * rings->slot_size;
+}
+
+static int rl_io_rings_rx(struct rl_io_rings *rings, struct rl_buf *rb);
+
+/* Size limit for the userspace receive queue of 'txrx', which belongs
+ * to 'flow' (NULL for management queues). Unless set explicitly, the
+ * limit is sized to hold 100 ms worth of the average bandwidth in the
+ * flow spec. */
+static inline unsigned int
+rl_rxq_limit(struct txrx *txrx, struct flow_entry *flow)
+{
+    uint64_t limit;
+
+    if (txrx->rx_qlimit) {
+        return txrx->rx_qlimit;
+    }
+
+    if (!flow || !flow->spec.avg_bandwidth) {
+        return RL_RXQ_SIZE_DFLT;
+    }
+
+    limit = flow->spec.avg_bandwidth;
+    do_div(limit, 8 * 10);
+
+    return clamp_t(uint64_t, limit, RL_RXQ_SIZE_MIN, RL_RXQ_SIZE_MAX);
+}
+
+/* Should a new packet be dropped to avoid userspace receive queue overrun?
+ * Beyond the per-flow limit, when the per-IPCP budget is exhausted each
+ * active flow can only use its fair share of the budget. */
+static inline bool
+rl_rxq_overrun(struct txrx *txrx, struct flow_entry *flow)
+{
+    struct ipcp_entry *ipcp = txrx->ipcp;
+    unsigned int budget     = ipcp->rxq_budget;
+    unsigned int share;
+
+    if (txrx->rx_qsize > rl_rxq_limit(txrx, flow)) {
+        return true;
+    }
+
+    if (!budget || atomic_read(&ipcp->rxq_mem) <= budget) {
+        return false;
+    }
+
+    share = budget / max(atomic_read(&ipcp->rxq_active), 1);
+
+    return txrx->rx_qsize > max_t(unsigned int, share, RL_RXQ_SIZE_MIN);
+}
+
+static inline void
+rl_rx_wake(struct txrx *txrx)
+{
+    /* Skip the wait queue lock if nobody is waiting. */
+    if (wq_has_sleeper(&txrx->rx_wqh)) {
+        wake_up_interruptible_poll(&txrx->rx_wqh,
+                                   POLLIN | POLLRDNORM | POLLRDBAND);
+    }
+}
+
+/* Deliver 'rb' to the reader of 'flow'. If 'batch' is set the reader is
+ * not woken up here, but only marked for the rl_sdu_rx_flush() that
+ * the caller will issue at the end of its drain loop. */
+static int
+rl_sdu_rx_flow_common(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                      struct rl_buf *rb, bool qlimit, bool batch)
 {
     struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
     struct txrx *txrx;
+    bool wake = true;
 
     if (upper_ipcp) {
         /* The flow is used by an upper IPCP. */
@@ -89,7 +202,7 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     spin_lock_bh(&txrx->rx_lock);
-    if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
+    if (unlikely(qlimit && rl_rxq_overrun(txrx, upper_ipcp ? NULL : flow))) {
         /* This is useful when flow control is not used on a flow. */
         RPD(1,
             "dropping PDU [length %lu] to avoid userspace rx queue "
@@ -98,19 +211,71 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
         flow->stats.rx_overrun_pkt++;
         flow->stats.rx_overrun_byte += rb->len;
         rl_buf_free(rb);
+    } else if (txrx->rings && rb_list_empty(&txrx->rx_q) &&
+               rl_io_rings_rx(txrx->rings, rb) == 0) {
+        /* Delivered straight into the RX ring. */
+        flow->stats.rx_pkt++;
+        flow->stats.rx_byte += rb->len;
+        rl_buf_free(rb);
     } else {
-        rb_list_enq(rb, &txrx->rx_q);
-        txrx->rx_qsize += rl_buf_truesize(rb);
+        txrx_rxq_enq(txrx, rb);
         flow->stats.rx_pkt++;
         flow->stats.rx_byte += rb->len;
+        /* Honour the low watermark, if any. */
+        wake = txrx_rx_readable(txrx);
+    }
+    if (wake && batch) {
+        txrx->flags |= RL_TXRX_WAKE_PENDING;
+        wake = false;
     }
     spin_unlock_bh(&txrx->rx_lock);
-    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+    if (wake) {
+        rl_rx_wake(txrx);
+    }
 
     return 0;
 }
+
+int
+rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
+               struct rl_buf *rb, bool qlimit)
+{
+    return rl_sdu_rx_flow_common(ipcp, flow, rb, qlimit, /*batch=*/false);
+}
 EXPORT_SYMBOL(rl_sdu_rx_flow);
 
+/* Same as rl_sdu_rx_flow(), for drain loops that deliver many SDUs in
+ * a row: the caller must call rl_sdu_rx_flush() when done with 'flow',
+ * so that the reader is woken up once per burst. */
+int
+rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rl_buf *rb, bool qlimit)
+{
+    return rl_sdu_rx_flow_common(ipcp, flow, rb, qlimit, /*batch=*/true);
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow_batch);
+
+void
+rl_sdu_rx_flush(struct flow_entry *flow)
+{
+    struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
+    struct txrx *txrx = upper_ipcp ? upper_ipcp->mgmt_txrx : &flow->txrx;
+    bool wake;
+
+    if (unlikely(!txrx)) {
+        return;
+    }
+
+    spin_lock_bh(&txrx->rx_lock);
+    wake = txrx->flags & RL_TXRX_WAKE_PENDING;
+    txrx->flags &= ~RL_TXRX_WAKE_PENDING;
+    spin_unlock_bh(&txrx->rx_lock);
+    if (wake) {
+        rl_rx_wake(txrx);
+    }
+}
+EXPORT_SYMBOL(rl_sdu_rx_flush);
+
 int
 rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port)
 {
@@ -168,10 +333,38 @@ rl_write_restart_flows(struct ipcp_entry *ipcp)
 }
 EXPORT_SYMBOL(rl_write_restart_flows);
 
+/* A flow bound to a flow group. The group is woken up through a custom
+ * entry in the receive wait queue of the flow, so that the datapath does
+ * not need to know about groups. */
+struct rl_flow_group_member {
+    struct flow_entry *flow; /* holds a reference */
+    struct rl_flow_group *grp;
+    wait_queue_entry_t wait;
+    struct hlist_node node; /* in grp->members */
+    struct list_head ready; /* in grp->ready, if the flow is readable */
+};
+
+/* A set of flows bound to a single rlite-io device. */
+struct rl_flow_group {
+    /* Protects 'members' and 'ready'. Membership changes are also
+     * serialized by IODEVS_LOCK(). */
+    spinlock_t lock;
+    DECLARE_HASHTABLE(members, 10);
+    unsigned int num_members;
+    /* Members with pending SDUs (or EOF), served in round-robin order. */
+    struct list_head ready;
+    wait_queue_head_t wqh;
+};
+
+#define RL_FLOW_GROUP_MEMBERS_MAX 65536
+
 struct rl_io {
     uint8_t mode;
     struct flow_entry *flow;
     struct txrx *txrx;
+    struct rl_flow_group *group; /* only in RLITE_IO_MODE_FLOW_GROUP */
+    struct rl_io_rings *rings;   /* freed on close, as it may be mmapped */
+    uint32_t busy_poll_us;       /* busy-poll budget, 0 if disabled */
 
     struct list_head node;
 };
@@ -195,60 +388,29 @@ rl_io_open(struct inode *inode, struct file *f)
     return 0;
 }
 
-static ssize_t
-rl_io_write_iter(struct kiocb *iocb,
+/* Userspace buffers, as passed to the read/write file operations. */
 #ifdef RL_HAVE_CHRDEV_RW_ITER
-                 struct iov_iter *from
+typedef struct iov_iter *rl_io_iter_t;
 #else  /* AIO_RW */
-                 const struct iovec *from, unsigned long iov_cnt, loff_t pos
+typedef const struct iovec *rl_io_iter_t;
 #endif /* AIO_RW */
-)
+
+/* Write 'left' bytes of userspace data from 'from' to 'flow', which belongs
+ * to 'ipcp'. If 'mhdr' is not NULL, this is a management SDU write and
+ * 'flow' is ignored. The first 'tot' bytes of 'from' (headers) have already
+ * been consumed by the caller. */
+static ssize_t
+rl_io_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                struct rl_mgmt_hdr *mhdr, rl_io_iter_t from, size_t tot,
+                size_t left, bool blocking)
 {
-    struct file *f    = iocb->ki_filp;
-    struct rl_io *rio = (struct rl_io *)f->private_data;
-    struct flow_entry *flow;
-    struct ipcp_entry *ipcp;
     struct rl_buf *rb;
-    struct rl_mgmt_hdr mhdr;
-#ifdef RL_HAVE_CHRDEV_RW_ITER
-    size_t left = iov_iter_count(from);
-#else  /* AIO_RW */
-    size_t left = iov_length(from, iov_cnt);
-#endif /* AIO_RW */
-    size_t tot     = 0;
-    unsigned flags = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
-    bool mgmt_sdu;
+    unsigned flags      = blocking ? RL_RMT_F_MAYSLEEP : 0;
+    bool mgmt_sdu       = (mhdr != NULL);
     bool something_sent = false;
     DECLARE_WAITQUEUE(wait, current);
     ssize_t ret = 0;
 
-    if (unlikely(!rio->txrx)) {
-        PE("Error: Not bound to a flow nor IPCP\n");
-        return -ENXIO;
-    }
-
-    /* If this is a management SDU write, rio->flow is NULL. */
-    ipcp     = rio->txrx->ipcp;
-    flow     = rio->flow;
-    mgmt_sdu = (rio->mode == RLITE_IO_MODE_IPCP_MGMT);
-
-    if (unlikely(mgmt_sdu)) {
-        /* Copy in the management header. */
-#ifdef RL_HAVE_CHRDEV_RW_ITER
-        if (copy_from_iter(&mhdr, sizeof(mhdr), from) != sizeof(mhdr)) {
-            PE("copy_from_iter(mgmthdr)\n");
-            return -EINVAL;
-        }
-#else
-        if (memcpy_fromiovecend((void *)&mhdr, from, 0, sizeof(mhdr))) {
-            PE("memcpy_fromiovecend(mgmthdr)\n");
-            return -EFAULT;
-        }
-#endif
-        left -= sizeof(mhdr);
-        tot += sizeof(mhdr);
-    }
-
     if (unlikely((mgmt_sdu || flow->cfg.msg_boundaries) &&
                  left > ipcp->max_sdu_size)) {
         /* We cannot split the write(): message boundaries need to be handled
@@ -259,6 +421,28 @@ rl_io_write_iter(struct kiocb *iocb,
     while (left) {
         size_t copylen = min(left, (size_t)ipcp->max_sdu_size);
 
+#if defined(RL_HAVE_CHRDEV_RW_ITER) && !defined(RL_SKB)
+        if (!mgmt_sdu && copylen >= RL_BUF_FRAGS_THRESH &&
+            DIV_ROUND_UP(copylen, PAGE_SIZE) <= RL_BUF_FRAGS_MAX) {
+            /* Large SDU: copy it into page fragments, so that the shims
+             * can transmit it without copying it again. The linear part
+             * only needs to host the headers. */
+            rb = rl_buf_alloc(0, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+            if (unlikely(!rb)) {
+                ret = -ENOMEM;
+                break;
+            }
+
+            ret = rl_buf_frags_from_user(rb, from, copylen);
+            if (unlikely(ret)) {
+                PE("rl_buf_frags_from_user(data) failed [%d]\n", (int)ret);
+                rl_buf_free(rb);
+                break;
+            }
+            goto copied;
+        }
+#endif /* RL_HAVE_CHRDEV_RW_ITER && !RL_SKB */
+
         rb = rl_buf_alloc(copylen, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
         if (unlikely(!rb)) {
             ret = -ENOMEM;
@@ -284,6 +468,9 @@ rl_io_write_iter(struct kiocb *iocb,
         }
 #endif /* AIO_RW */
         rl_buf_append(rb, copylen);
+#if defined(RL_HAVE_CHRDEV_RW_ITER) && !defined(RL_SKB)
+copied:
+#endif /* RL_HAVE_CHRDEV_RW_ITER && !RL_SKB */
 
         if (unlikely(mgmt_sdu)) {
             struct ipcp_entry *lower_ipcp;
@@ -298,7 +485,7 @@ rl_io_write_iter(struct kiocb *iocb,
 
             /* Management write. Prepare the buffer and get the lower
              * flow and lower IPCP. */
-            ret = ipcp->ops.mgmt_sdu_build(ipcp, &mhdr, rb, &lower_ipcp,
+            ret = ipcp->ops.mgmt_sdu_build(ipcp, mhdr, rb, &lower_ipcp,
                                            &lower_flow);
             if (ret) {
                 rl_buf_free(rb);
@@ -365,28 +552,139 @@ rl_io_write_iter(struct kiocb *iocb,
     return something_sent ? tot : ret;
 }
 
+/* Copy in a 'len' bytes header that precedes the SDU in 'from'. */
+static int
+rl_io_hdr_copy_in(void *hdr, size_t len, rl_io_iter_t from, size_t left)
+{
+    if (unlikely(left < len)) {
+        return -EINVAL;
+    }
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    if (copy_from_iter(hdr, len, from) != len) {
+        PE("copy_from_iter(hdr)\n");
+        return -EINVAL;
+    }
+#else
+    if (memcpy_fromiovecend(hdr, from, 0, len)) {
+        PE("memcpy_fromiovecend(hdr)\n");
+        return -EFAULT;
+    }
+#endif
+    return 0;
+}
+
+static ssize_t rl_io_group_write(struct rl_flow_group *grp, rl_io_iter_t from,
+                                 size_t left, bool blocking);
+
+/* Write 'left' bytes of userspace data from 'from' to the flow (or IPCP,
+ * or flow group) bound to 'rio'. */
 static ssize_t
-rl_io_read_iter(struct kiocb *iocb,
+rl_io_write_internal(struct rl_io *rio, rl_io_iter_t from, size_t left,
+                     bool blocking)
+{
+    struct rl_mgmt_hdr mhdr;
+    int ret;
+
+    if (rio->mode == RLITE_IO_MODE_FLOW_GROUP) {
+        return rl_io_group_write(rio->group, from, left, blocking);
+    }
+
+    if (unlikely(!rio->txrx)) {
+        PE("Error: Not bound to a flow nor IPCP\n");
+        return -ENXIO;
+    }
+
+    if (likely(rio->mode != RLITE_IO_MODE_IPCP_MGMT)) {
+        return rl_io_sdu_write(rio->txrx->ipcp, rio->flow, NULL, from, 0, left,
+                               blocking);
+    }
+
+    /* Copy in the management header. If this is a management SDU write,
+     * rio->flow is NULL. */
+    ret = rl_io_hdr_copy_in(&mhdr, sizeof(mhdr), from, left);
+    if (ret) {
+        return ret;
+    }
+
+    return rl_io_sdu_write(rio->txrx->ipcp, NULL, &mhdr, from, sizeof(mhdr),
+                           left - sizeof(mhdr), blocking);
+}
+
+static ssize_t
+rl_io_write_iter(struct kiocb *iocb,
 #ifdef RL_HAVE_CHRDEV_RW_ITER
-                struct iov_iter *to
+                 struct iov_iter *from
 #else  /* AIO_RW */
-                const struct iovec *to, unsigned long iov_cnt, loff_t pos
+                 const struct iovec *from, unsigned long iov_cnt, loff_t pos
 #endif /* AIO_RW */
 )
 {
-    struct file *f          = iocb->ki_filp;
-    struct rl_io *rio       = (struct rl_io *)f->private_data;
-    struct flow_entry *flow = rio->flow; /* NULL if mgmt */
-    bool blocking           = !(f->f_flags & O_NONBLOCK);
-    struct txrx *txrx       = rio->txrx;
-    DECLARE_WAITQUEUE(wait, current);
+    struct file *f    = iocb->ki_filp;
+    struct rl_io *rio = (struct rl_io *)f->private_data;
 #ifdef RL_HAVE_CHRDEV_RW_ITER
-    size_t ulen = iov_iter_count(to);
+    size_t left = iov_iter_count(from);
 #else  /* AIO_RW */
-    size_t ulen = iov_length(to, iov_cnt);
+    size_t left = iov_length(from, iov_cnt);
 #endif /* AIO_RW */
+
+    return rl_io_write_internal(rio, from, left, !(f->f_flags & O_NONBLOCK));
+}
+
+static ssize_t rl_io_group_read(struct rl_flow_group *grp, rl_io_iter_t to,
+                                size_t ulen, bool blocking);
+
+/* Spin on the receive queue of 'txrx' for at most 'rio->busy_poll_us'
+ * microseconds, waiting for an SDU (or EOF) to show up. Returns true if
+ * the receive queue became readable before the budget expired. */
+static bool
+rl_io_busy_poll(struct rl_io *rio, struct txrx *txrx)
+{
+    struct flow_entry *flow = rio->flow;
+    ktime_t start           = ktime_get();
+    bool hit                = false;
+
+    for (;;) {
+        if (READ_ONCE(txrx->rx_qlen) >= max(READ_ONCE(txrx->rx_lowat), 1U) ||
+            (READ_ONCE(txrx->flags) & RL_TXRX_EOF)) {
+            hit = true;
+            break;
+        }
+        if (need_resched() || signal_pending(current) ||
+            ktime_us_delta(ktime_get(), start) >= rio->busy_poll_us) {
+            break;
+        }
+        cpu_relax();
+    }
+
+    if (flow) {
+        spin_lock_bh(&txrx->rx_lock);
+        if (hit) {
+            flow->stats.busy_poll_hit++;
+        } else {
+            flow->stats.busy_poll_miss++;
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+    }
+
+    return hit;
+}
+
+/* Read (up to) an SDU from the flow (or IPCP) bound to 'rio', storing
+ * at most 'ulen' bytes in 'to'. */
+static ssize_t
+rl_io_read_internal(struct rl_io *rio, rl_io_iter_t to, size_t ulen,
+                    bool blocking)
+{
+    struct flow_entry *flow = rio->flow; /* NULL if mgmt */
+    struct txrx *txrx       = rio->txrx;
+    bool busy_poll          = blocking && rio->busy_poll_us;
+    DECLARE_WAITQUEUE(wait, current);
     ssize_t ret = 0;
 
+    if (rio->mode == RLITE_IO_MODE_FLOW_GROUP) {
+        return rl_io_group_read(rio->group, to, ulen, blocking);
+    }
+
     if (unlikely(!txrx)) {
         return -ENXIO;
     }
@@ -420,6 +718,15 @@ rl_io_read_iter(struct kiocb *iocb,
                 break;
             }
 
+            if (busy_poll) {
+                /* Spin for a while before giving up the CPU, but
+                 * only once per read. */
+                busy_poll = false;
+                __set_current_state(TASK_RUNNING);
+                rl_io_busy_poll(rio, txrx);
+                continue;
+            }
+
             /* Nothing to read, let's sleep. */
             schedule();
             continue;
@@ -437,8 +744,7 @@ rl_io_read_iter(struct kiocb *iocb,
 
         } else {
             /* Complete SDU read, consume the rb. */
-            rb_list_del(rb);
-            txrx->rx_qsize -= rl_buf_truesize(rb);
+            txrx_rxq_del(txrx, rb);
             spin_unlock_bh(&txrx->rx_lock);
 
             ret = rl_buf_copy_to_user(rb, to, rb->len);
@@ -462,75 +768,995 @@ rl_io_read_iter(struct kiocb *iocb,
     return ret;
 }
 
-static unsigned int
-rl_io_poll(struct file *f, poll_table *wait)
+static ssize_t
+rl_io_read_iter(struct kiocb *iocb,
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+                struct iov_iter *to
+#else  /* AIO_RW */
+                const struct iovec *to, unsigned long iov_cnt, loff_t pos
+#endif /* AIO_RW */
+)
 {
-    struct rl_io *rio       = (struct rl_io *)f->private_data;
-    struct txrx *txrx       = rio->txrx;
-    struct ipcp_entry *ipcp = txrx->ipcp;
-    unsigned int mask       = 0;
+    struct file *f    = iocb->ki_filp;
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    size_t ulen = iov_iter_count(to);
+#else  /* AIO_RW */
+    size_t ulen = iov_length(to, iov_cnt);
+#endif /* AIO_RW */
 
-    if (unlikely(!txrx)) {
-        return POLLERR;
+    return rl_io_read_internal(rio, to, ulen, !(f->f_flags & O_NONBLOCK));
+}
+
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+/* Called with the flow rx wait queue lock held, whenever the flow receive
+ * queue becomes non-empty or the flow is shut down. */
+static int
+rl_io_group_wake(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
+{
+    struct rl_flow_group_member *m =
+        container_of(wait, struct rl_flow_group_member, wait);
+    struct rl_flow_group *grp = m->grp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&grp->lock, flags);
+    if (list_empty(&m->ready)) {
+        list_add_tail(&m->ready, &grp->ready);
     }
+    spin_unlock_irqrestore(&grp->lock, flags);
+    wake_up_interruptible_poll(&grp->wqh, POLLIN | POLLRDNORM | POLLRDBAND);
 
-    poll_wait(f, &txrx->rx_wqh, wait);
-    poll_wait(f, txrx->tx_wqh, wait);
+    return 0;
+}
 
-    spin_lock_bh(&txrx->rx_lock);
-    if (!rb_list_empty(&txrx->rx_q) || (txrx->flags & RL_TXRX_EOF)) {
-        /* Userspace can read when the flow rxq is not empty
-         * or when the flow has been deallocated, so that
-         * we can report EOF. */
-        mask |= POLLIN | POLLRDNORM;
-    }
-    spin_unlock_bh(&txrx->rx_lock);
+/* To be called under grp->lock. */
+static struct rl_flow_group_member *
+rl_io_group_lookup(struct rl_flow_group *grp, rl_port_t port_id)
+{
+    struct rl_flow_group_member *m;
 
-    if (!rio->flow || !ipcp->ops.flow_writeable ||
-        ipcp->ops.flow_writeable(rio->flow)) {
-        mask |= POLLOUT | POLLWRNORM;
+    hash_for_each_possible (grp->members, m, node, port_id) {
+        if (m->flow->local_port == port_id) {
+            return m;
+        }
     }
 
-    return mask;
+    return NULL;
 }
 
-void
-rl_iodevs_shutdown_by_ipcp(struct ipcp_entry *ipcp)
+/* Mark the member bound to 'port_id' (if still there) as readable. */
+static void
+rl_io_group_requeue(struct rl_flow_group *grp, rl_port_t port_id)
 {
-    struct rl_io *rio;
+    struct rl_flow_group_member *m;
+    unsigned long flags;
 
-    IODEVS_LOCK();
-    list_for_each_entry (rio, &rl_iodevs, node) {
-        if (rio->mode == RLITE_IO_MODE_APPL_BIND && rio->flow &&
-            rio->flow->txrx.ipcp == ipcp) {
-            PD("Shutting down flow %u\n", rio->flow->local_port);
-            rl_flow_shutdown(rio->flow);
-        }
+    spin_lock_irqsave(&grp->lock, flags);
+    m = rl_io_group_lookup(grp, port_id);
+    if (m && list_empty(&m->ready)) {
+        list_add_tail(&m->ready, &grp->ready);
     }
-    IODEVS_UNLOCK();
+    spin_unlock_irqrestore(&grp->lock, flags);
 }
 
-void
-rl_iodevs_probe_ipcp_references(struct ipcp_entry *ipcp)
+/* Pop the next readable member, returning a reference to its flow. */
+static struct flow_entry *
+rl_io_group_next(struct rl_flow_group *grp)
 {
-    struct rl_io *rio;
-
-    IODEVS_LOCK();
-    list_for_each_entry (rio, &rl_iodevs, node) {
-        if (rio->flow && rio->flow->txrx.ipcp == ipcp) {
-            PE("iodev bound to flow %u has dangling reference to ipcp %u\n",
-               rio->flow->local_port, ipcp->id);
-        }
+    struct rl_flow_group_member *m;
+    struct flow_entry *flow = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&grp->lock, flags);
+    if (!list_empty(&grp->ready)) {
+        m = list_first_entry(&grp->ready, struct rl_flow_group_member, ready);
+        list_del_init(&m->ready);
+        flow = m->flow;
+        flow_get_ref(flow);
     }
-    IODEVS_UNLOCK();
+    spin_unlock_irqrestore(&grp->lock, flags);
+
+    return flow;
 }
 
-void
-rl_iodevs_probe_flow_references(struct flow_entry *flow)
+/* Read a (struct rina_flow_group_hdr, SDU) record from the first readable
+ * member of the group. SDUs that do not fit 'ulen' are truncated, and the
+ * end of a flow is reported with a record carrying no SDU. */
+static ssize_t
+rl_io_group_read(struct rl_flow_group *grp, rl_io_iter_t to, size_t ulen,
+                 bool blocking)
 {
-    struct rl_io *rio;
+    struct rina_flow_group_hdr hdr;
+    DECLARE_WAITQUEUE(wait, current);
+    struct flow_entry *flow;
+    struct rl_buf *rb = NULL;
+    ssize_t ret       = 0;
+    bool more;
+    bool eof;
 
-    IODEVS_LOCK();
+    if (ulen < sizeof(hdr)) {
+        return -EINVAL;
+    }
+
+    if (blocking) {
+        add_wait_queue(&grp->wqh, &wait);
+    }
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        flow = rl_io_group_next(grp);
+        if (!flow) {
+            if (signal_pending(current)) {
+                ret = -EINTR; /* -ERESTARTSYS */
+                break;
+            }
+
+            if (!blocking) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            /* Nothing to read, let's sleep. */
+            schedule();
+            continue;
+        }
+
+        spin_lock_bh(&flow->txrx.rx_lock);
+        eof = flow->txrx.flags & RL_TXRX_EOF;
+        if (!rb_list_empty(&flow->txrx.rx_q)) {
+            rb = rb_list_front(&flow->txrx.rx_q);
+            txrx_rxq_del(&flow->txrx, rb);
+        }
+        /* Still readable if there are more SDUs or if the EOF has not
+         * been reported yet. */
+        more = !rb_list_empty(&flow->txrx.rx_q) || (rb && eof);
+        spin_unlock_bh(&flow->txrx.rx_lock);
+
+        if (more) {
+            rl_io_group_requeue(grp, flow->local_port);
+        }
+
+        if (rb || eof) {
+            break;
+        }
+
+        /* Spurious wake up, try the next member. */
+        flow_put(flow);
+    }
+
+    __set_current_state(TASK_RUNNING);
+
+    if (blocking) {
+        remove_wait_queue(&grp->wqh, &wait);
+    }
+
+    if (!flow) {
+        return ret;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.port_id = flow->local_port;
+
+    if (!rb) {
+        hdr.flags = RINA_FLOW_GROUP_F_EOF;
+        ret       = sizeof(hdr);
+        if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr)) {
+            ret = -EFAULT;
+        }
+        flow_put(flow);
+        return ret;
+    }
+
+    ulen -= sizeof(hdr);
+    if (ulen < rb->len) {
+        hdr.flags = RINA_FLOW_GROUP_F_TRUNC;
+    } else {
+        ulen = rb->len;
+    }
+
+    if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr)) {
+        ret = -EFAULT;
+    } else {
+        ret = rl_buf_copy_to_user(rb, to, ulen);
+        if (ret >= 0) {
+            ret += sizeof(hdr);
+        }
+    }
+
+    if (flow->sdu_rx_consumed && ret >= 0) {
+        flow->sdu_rx_consumed(flow, RL_BUF_RX(rb).cons_seqnum, blocking);
+    }
+    rl_buf_free(rb);
+    flow_put(flow);
+
+    return ret;
+}
+
+/* Write an SDU to the member flow selected by the struct
+ * rina_flow_group_hdr that precedes it. */
+static ssize_t
+rl_io_group_write(struct rl_flow_group *grp, rl_io_iter_t from, size_t left,
+                  bool blocking)
+{
+    struct rina_flow_group_hdr hdr;
+    struct rl_flow_group_member *m;
+    struct flow_entry *flow = NULL;
+    unsigned long flags;
+    ssize_t ret;
+
+    ret = rl_io_hdr_copy_in(&hdr, sizeof(hdr), from, left);
+    if (ret) {
+        return ret;
+    }
+
+    spin_lock_irqsave(&grp->lock, flags);
+    m = rl_io_group_lookup(grp, hdr.port_id);
+    if (m) {
+        flow = m->flow;
+        flow_get_ref(flow);
+    }
+    spin_unlock_irqrestore(&grp->lock, flags);
+
+    if (!flow) {
+        return -ENXIO;
+    }
+
+    ret = rl_io_sdu_write(flow->txrx.ipcp, flow, NULL, from, sizeof(hdr),
+                          left - sizeof(hdr), blocking);
+    flow_put(flow);
+
+    return ret;
+}
+
+static unsigned int
+rl_io_group_poll(struct file *f, struct rl_flow_group *grp, poll_table *wait)
+{
+    unsigned int mask = POLLOUT | POLLWRNORM;
+    unsigned long flags;
+
+    poll_wait(f, &grp->wqh, wait);
+
+    spin_lock_irqsave(&grp->lock, flags);
+    if (!list_empty(&grp->ready)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    spin_unlock_irqrestore(&grp->lock, flags);
+
+    return mask;
+}
+
+static const struct file_operations rl_io_fops;
+
+/* Add the flow bound to the rlite-io file descriptor 'fd' to the group. The
+ * group takes its own reference to the flow, so that 'fd' can be closed. */
+static long
+rl_io_ioctl_group_add(struct rl_io *rio, struct rl_ioctl_group __user *ureq)
+{
+    struct rl_flow_group *grp = rio->group;
+    struct rl_flow_group_member *m;
+    struct rl_ioctl_group req;
+    struct flow_entry *flow;
+    struct rl_io *frio;
+    unsigned long flags;
+    struct file *f;
+    long ret = 0;
+
+    if (rio->mode != RLITE_IO_MODE_FLOW_GROUP) {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(&req, ureq, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    f = fget(req.fd);
+    if (!f) {
+        return -EBADF;
+    }
+
+    m = rl_alloc(sizeof(*m), GFP_KERNEL | __GFP_ZERO, RL_MT_IODEV);
+    if (!m) {
+        fput(f);
+        return -ENOMEM;
+    }
+
+    IODEVS_LOCK();
+    frio = (struct rl_io *)f->private_data;
+    if (f->f_op != &rl_io_fops || frio->mode != RLITE_IO_MODE_APPL_BIND) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (frio->rings) {
+        /* Incoming SDUs may be delivered to the RX ring. */
+        ret = -EBUSY;
+        goto out;
+    }
+    flow = frio->flow;
+    if (grp->num_members >= RL_FLOW_GROUP_MEMBERS_MAX) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    spin_lock_irqsave(&grp->lock, flags);
+    if (rl_io_group_lookup(grp, flow->local_port)) {
+        spin_unlock_irqrestore(&grp->lock, flags);
+        ret = -EBUSY;
+        goto out;
+    }
+    flow_get_ref(flow);
+    m->flow = flow;
+    m->grp  = grp;
+    INIT_LIST_HEAD(&m->ready);
+    init_waitqueue_func_entry(&m->wait, rl_io_group_wake);
+    hash_add(grp->members, &m->node, flow->local_port);
+    grp->num_members++;
+    spin_unlock_irqrestore(&grp->lock, flags);
+
+    add_wait_queue(&flow->txrx.rx_wqh, &m->wait);
+
+    /* SDUs (or EOF) may already be pending. */
+    spin_lock_bh(&flow->txrx.rx_lock);
+    if (txrx_rx_readable(&flow->txrx)) {
+        rl_io_group_requeue(grp, flow->local_port);
+    }
+    spin_unlock_bh(&flow->txrx.rx_lock);
+
+    req.port_id = flow->local_port;
+    m           = NULL;
+out:
+    IODEVS_UNLOCK();
+    fput(f);
+    if (m) {
+        rl_free(m, RL_MT_IODEV);
+    }
+    if (ret == 0 && copy_to_user(ureq, &req, sizeof(req))) {
+        ret = -EFAULT;
+    }
+
+    return ret;
+}
+
+/* Unlink a member from its group. To be called under IODEVS_LOCK(). The
+ * caller is responsible for dropping the flow reference and freeing 'm'. */
+static void
+rl_io_group_member_unlink(struct rl_flow_group *grp,
+                          struct rl_flow_group_member *m)
+{
+    unsigned long flags;
+
+    /* After this, rl_io_group_wake() cannot run anymore for 'm'. */
+    remove_wait_queue(&m->flow->txrx.rx_wqh, &m->wait);
+    spin_lock_irqsave(&grp->lock, flags);
+    hash_del(&m->node);
+    list_del_init(&m->ready);
+    grp->num_members--;
+    spin_unlock_irqrestore(&grp->lock, flags);
+}
+
+static long
+rl_io_ioctl_group_del(struct rl_io *rio, struct rl_ioctl_group __user *ureq)
+{
+    struct rl_flow_group_member *m;
+    struct rl_ioctl_group req;
+    unsigned long flags;
+
+    if (rio->mode != RLITE_IO_MODE_FLOW_GROUP) {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(&req, ureq, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    IODEVS_LOCK();
+    spin_lock_irqsave(&rio->group->lock, flags);
+    m = rl_io_group_lookup(rio->group, req.port_id);
+    spin_unlock_irqrestore(&rio->group->lock, flags);
+    if (m) {
+        rl_io_group_member_unlink(rio->group, m);
+    }
+    IODEVS_UNLOCK();
+
+    if (!m) {
+        return -ENXIO;
+    }
+    flow_put(m->flow);
+    rl_free(m, RL_MT_IODEV);
+
+    return 0;
+}
+
+static long
+rl_io_ioctl_group(struct rl_io *rio)
+{
+    struct rl_flow_group *grp;
+
+    grp = rl_alloc(sizeof(*grp), GFP_KERNEL | __GFP_ZERO, RL_MT_IODEV);
+    if (!grp) {
+        RPV(1, "Out of memory\n");
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&grp->lock);
+    hash_init(grp->members);
+    INIT_LIST_HEAD(&grp->ready);
+    init_waitqueue_head(&grp->wqh);
+
+    IODEVS_LOCK();
+    rio->group = grp;
+    IODEVS_UNLOCK();
+
+    return 0;
+}
+
+static void
+rl_io_group_destroy(struct rl_io *rio)
+{
+    struct rl_flow_group *grp = rio->group;
+    struct rl_flow_group_member *m, *mtmp;
+    struct hlist_node *tmp;
+    LIST_HEAD(unlinked);
+    int bkt;
+
+    IODEVS_LOCK();
+    hash_for_each_safe (grp->members, bkt, tmp, m, node) {
+        rl_io_group_member_unlink(grp, m);
+        list_add_tail(&m->ready, &unlinked);
+    }
+    rio->group = NULL;
+    IODEVS_UNLOCK();
+
+    list_for_each_entry_safe (m, mtmp, &unlinked, ready) {
+        flow_put(m->flow);
+        rl_free(m, RL_MT_IODEV);
+    }
+    rl_free(grp, RL_MT_IODEV);
+}
+#else  /* AIO_RW */
+static ssize_t
+rl_io_group_read(struct rl_flow_group *grp, rl_io_iter_t to, size_t ulen,
+                 bool blocking)
+{
+    return -EOPNOTSUPP;
+}
+
+static ssize_t
+rl_io_group_write(struct rl_flow_group *grp, rl_io_iter_t from, size_t left,
+                  bool blocking)
+{
+    return -EOPNOTSUPP;
+}
+#endif /* AIO_RW */
+
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+/* Move data from a pipe to the flow. The pipe content is turned into
+ * SDUs by rl_io_write_iter(), which already splits writes larger than
+ * the MSS. When the flow preserves message boundaries a single write
+ * cannot be split, so we move at most an MSS worth of data per call. */
+static ssize_t
+rl_io_splice_write(struct pipe_inode_info *pipe, struct file *out,
+                   loff_t *ppos, size_t len, unsigned int flags)
+{
+    struct rl_io *rio = (struct rl_io *)out->private_data;
+
+    if (unlikely(!rio->txrx || rio->mode != RLITE_IO_MODE_APPL_BIND)) {
+        return -EINVAL;
+    }
+
+    if (rio->flow->cfg.msg_boundaries) {
+        len = min(len, (size_t)rio->txrx->ipcp->max_sdu_size);
+    }
+
+    return iter_file_splice_write(pipe, out, ppos, len, flags);
+}
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+
+#if defined(RL_HAVE_COPY_SPLICE_READ) || defined(RL_HAVE_ITER_PIPE)
+/* Move (up to) an SDU from the flow to a pipe. The generic helpers call
+ * rl_io_read_iter() once, so that each splice() call consumes at most
+ * one SDU, possibly spread over multiple pipe buffers. */
+static ssize_t
+rl_io_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                  size_t len, unsigned int flags)
+{
+    struct rl_io *rio = (struct rl_io *)in->private_data;
+
+    if (unlikely(!rio->txrx || rio->mode != RLITE_IO_MODE_APPL_BIND)) {
+        return -EINVAL;
+    }
+
+#ifdef RL_HAVE_COPY_SPLICE_READ
+    return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+}
+#endif /* RL_HAVE_COPY_SPLICE_READ || RL_HAVE_ITER_PIPE */
+
+/* Read or write a vector of SDUs with a single system call, similarly
+ * to recvmmsg() and sendmmsg(). Reads only block (if 'blocking') for
+ * the first SDU, while writes may block for each SDU. The status of each
+ * SDU (bytes transferred or negative error) is reported in the user
+ * descriptor. Returns the number of SDUs transferred, or an error if the
+ * first one could not be transferred. */
+static long
+rl_io_ioctl_batch(struct rl_io *rio, struct rl_ioctl_batch __user *ubatch,
+                  bool write, bool blocking)
+{
+    struct rl_ioctl_sdu __user *usdus;
+    struct rl_ioctl_batch batch;
+    unsigned int i;
+    ssize_t ret = 0;
+
+    if (unlikely(!rio->txrx)) {
+        return -ENXIO;
+    }
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch))) {
+        return -EFAULT;
+    }
+
+    if (batch.num == 0 || batch.num > RLITE_IO_BATCH_MAX) {
+        return -EINVAL;
+    }
+    usdus = (struct rl_ioctl_sdu __user *)(uintptr_t)batch.sdus;
+
+    for (i = 0; i < batch.num; i++) {
+        struct rl_ioctl_sdu sdu;
+        struct iovec iov;
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+        struct iov_iter iter;
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+
+        if (copy_from_user(&sdu, usdus + i, sizeof(sdu))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        iov.iov_base = (void __user *)(uintptr_t)sdu.buf;
+        iov.iov_len  = sdu.len;
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+        iov_iter_init(&iter, write ? WRITE : READ, &iov, 1, sdu.len);
+        ret = write ? rl_io_write_internal(rio, &iter, sdu.len, blocking)
+                    : rl_io_read_internal(rio, &iter, sdu.len,
+                                          blocking && i == 0);
+#else  /* AIO_RW */
+        ret = write ? rl_io_write_internal(rio, &iov, sdu.len, blocking)
+                    : rl_io_read_internal(rio, &iov, sdu.len,
+                                          blocking && i == 0);
+#endif /* AIO_RW */
+
+        if (put_user((int32_t)ret, &usdus[i].status)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (ret < 0 || (!write && ret == 0)) {
+            /* Error, no more SDUs to read or EOF. */
+            break;
+        }
+    }
+
+    if (i == 0 && ret < 0) {
+        return ret;
+    }
+
+    return i;
+}
+
+/* Rings are only usable while the flow they were created for is
+ * still bound. */
+static inline bool
+rl_io_rings_active(struct rl_io *rio)
+{
+    return rio->rings && rio->txrx && rio->txrx->rings == rio->rings;
+}
+
+/* Copy an SDU into the next RX slot, if any. Called under rx_lock, the
+ * caller still owns 'rb'. */
+static int
+rl_io_rings_rx(struct rl_io_rings *rings, struct rl_buf *rb)
+{
+    struct rl_ring *ring = rings->rx;
+    uint32_t cons        = smp_load_acquire(&ring->cons);
+    uint32_t idx         = rings->rx_prod & (rings->num_slots - 1);
+    struct rl_ring_slot *slot;
+    size_t len;
+
+    if (rings->rx_prod - cons >= rings->num_slots) {
+        return -ENOSPC; /* RX ring is full */
+    }
+
+    slot = ring->slots + idx;
+    len  = min(rb->len, (size_t)rings->slot_size);
+    rl_buf_copy_bits(rb, rl_io_ring_buf(rings, ring, idx), len);
+    slot->len   = len;
+    slot->flags = (len < rb->len) ? RL_RING_SLOT_F_TRUNC : 0;
+
+    rings->rx_seqnums[idx] = RL_BUF_RX(rb).cons_seqnum;
+    smp_store_release(&ring->prod, ++rings->rx_prod);
+
+    return 0;
+}
+
+/* Report the RX slots released by userspace to the flow, so that the
+ * sender window only opens as the application drains the ring, and move
+ * the SDUs queued in the rx queue into the RX ring. */
+static void
+rl_io_rings_rxsync(struct rl_io *rio)
+{
+    struct rl_io_rings *rings = rio->rings;
+    struct txrx *txrx         = rio->txrx;
+    struct flow_entry *flow   = rio->flow;
+    rlm_seq_t cons_seqnum     = 0;
+    bool consumed             = false;
+    uint32_t cons;
+
+    spin_lock_bh(&txrx->rx_lock);
+    cons = smp_load_acquire(&rings->rx->cons);
+    if (unlikely(cons - rings->rx_cons > rings->rx_prod - rings->rx_cons)) {
+        RPD(1, "Invalid RX ring consumer index %u (prod %u)\n", cons,
+            rings->rx_prod);
+    } else if (cons != rings->rx_cons) {
+        consumed    = true;
+        cons_seqnum = rings->rx_seqnums[(cons - 1) & (rings->num_slots - 1)];
+        rings->rx_cons = cons;
+    }
+    while (!rb_list_empty(&txrx->rx_q)) {
+        struct rl_buf *rb = rb_list_front(&txrx->rx_q);
+
+        if (rl_io_rings_rx(rings, rb)) {
+            break;
+        }
+        txrx_rxq_del(txrx, rb);
+        rl_buf_free(rb);
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+
+    if (consumed && flow->sdu_rx_consumed) {
+        flow->sdu_rx_consumed(flow, cons_seqnum, true);
+    }
+}
+
+/* Transmit the SDUs that userspace published in the TX ring, until the
+ * ring is empty or the flow cannot accept more SDUs. */
+static int
+rl_io_rings_txsync(struct rl_io *rio)
+{
+    struct rl_io_rings *rings = rio->rings;
+    struct rl_ring *ring      = rings->tx;
+    struct flow_entry *flow   = rio->flow;
+    struct ipcp_entry *ipcp   = flow->txrx.ipcp;
+    uint32_t mask             = rings->num_slots - 1;
+    uint32_t prod;
+    int ret = 0;
+
+    mutex_lock(&rings->tx_lock);
+    prod = smp_load_acquire(&ring->prod);
+    if (unlikely(prod - rings->tx_cons > rings->num_slots)) {
+        RPD(1, "Invalid TX ring producer index %u (cons %u)\n", prod,
+            rings->tx_cons);
+        mutex_unlock(&rings->tx_lock);
+        return -EINVAL;
+    }
+
+    for (; rings->tx_cons != prod; rings->tx_cons++) {
+        uint32_t idx              = rings->tx_cons & mask;
+        struct rl_ring_slot *slot = ring->slots + idx;
+        uint32_t len              = READ_ONCE(slot->len);
+        struct rl_buf *rb;
+
+        if (unlikely(len > rings->slot_size || len > ipcp->max_sdu_size)) {
+            slot->flags = RL_RING_SLOT_F_ERR;
+            continue;
+        }
+
+        rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+        if (unlikely(!rb)) {
+            ret = -ENOMEM;
+            break;
+        }
+        memcpy(RL_BUF_DATA(rb), rl_io_ring_buf(rings, ring, idx), len);
+        rl_buf_append(rb, len);
+
+        ret = ipcp->ops.sdu_write(ipcp, flow, rb, 0);
+        if (ret == -EAGAIN) {
+            /* Backpressure, try again on the next sync. */
+            rl_buf_free(rb);
+            ret = 0;
+            break;
+        }
+
+        if (unlikely(ret < 0)) {
+            slot->flags = RL_RING_SLOT_F_ERR;
+            continue;
+        }
+        slot->flags = 0;
+        flow->stats.tx_pkt++;
+        flow->stats.tx_byte += len;
+    }
+    smp_store_release(&ring->cons, rings->tx_cons);
+    mutex_unlock(&rings->tx_lock);
+
+    return ret;
+}
+
+static unsigned int
+rl_io_rings_poll(struct rl_io *rio)
+{
+    struct rl_io_rings *rings = rio->rings;
+    struct txrx *txrx         = rio->txrx;
+    unsigned int mask         = 0;
+
+    rl_io_rings_txsync(rio);
+    rl_io_rings_rxsync(rio);
+
+    spin_lock_bh(&txrx->rx_lock);
+    if (rings->rx_prod != smp_load_acquire(&rings->rx->cons) ||
+        (txrx->flags & RL_TXRX_EOF)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+
+    mutex_lock(&rings->tx_lock);
+    if (smp_load_acquire(&rings->tx->prod) - rings->tx_cons <
+        rings->num_slots) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    mutex_unlock(&rings->tx_lock);
+
+    return mask;
+}
+
+static void
+rl_io_ring_init(struct rl_io_rings *rings, struct rl_ring *ring)
+{
+    ring->num_slots = rings->num_slots;
+    ring->slot_size = rings->slot_size;
+    ring->buf_ofs   = rings->buf_ofs;
+}
+
+static long
+rl_io_ioctl_rings_setup(struct rl_io *rio, struct rl_rings_req __user *ureq)
+{
+    struct rl_io_rings *rings;
+    struct rl_rings_req req;
+    uint32_t buf_ofs;
+
+    if (rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->flow) {
+        return -ENXIO;
+    }
+
+    if (rio->rings) {
+        return -EBUSY;
+    }
+
+    if (copy_from_user(&req, ureq, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    if (!is_power_of_2(req.num_slots) || req.num_slots > RL_RINGS_SLOTS_MAX ||
+        req.slot_size == 0 || req.slot_size > RL_RINGS_SLOT_SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    req.slot_size = L1_CACHE_ALIGN(req.slot_size);
+    buf_ofs       = PAGE_ALIGN(sizeof(struct rl_ring) +
+                         req.num_slots * sizeof(struct rl_ring_slot));
+    if (2 * PAGE_ALIGN(buf_ofs + req.num_slots * req.slot_size) >
+        RL_RINGS_MEM_MAX) {
+        return -EINVAL;
+    }
+
+    rings = rl_alloc(sizeof(*rings) + req.num_slots * sizeof(rlm_seq_t),
+                     GFP_KERNEL | __GFP_ZERO, RL_MT_IODEV);
+    if (!rings) {
+        return -ENOMEM;
+    }
+
+    atomic_set(&rings->refcnt, 1);
+    rings->num_slots = req.num_slots;
+    rings->slot_size = req.slot_size;
+    rings->buf_ofs   = buf_ofs;
+    rings->ring_size = PAGE_ALIGN(buf_ofs + req.num_slots * req.slot_size);
+    rings->mem       = vmalloc_user(2 * rings->ring_size);
+    if (!rings->mem) {
+        rl_free(rings, RL_MT_IODEV);
+        return -ENOMEM;
+    }
+    rings->rx = (struct rl_ring *)rings->mem;
+    rings->tx = (struct rl_ring *)((uint8_t *)rings->mem + rings->ring_size);
+    rl_io_ring_init(rings, rings->rx);
+    rl_io_ring_init(rings, rings->tx);
+    mutex_init(&rings->tx_lock);
+
+    req.ring_size = rings->ring_size;
+    if (copy_to_user(ureq, &req, sizeof(req))) {
+        vfree(rings->mem);
+        rl_free(rings, RL_MT_IODEV);
+        return -EFAULT;
+    }
+
+    /* From now on rl_sdu_rx_flow() can fill the RX ring. */
+    spin_lock_bh(&rio->txrx->rx_lock);
+    rio->rings       = rings;
+    rio->txrx->rings = rings;
+    spin_unlock_bh(&rio->txrx->rx_lock);
+
+    return 0;
+}
+
+static long
+rl_io_ioctl_rings_sync(struct rl_io *rio, uint32_t flags)
+{
+    int ret = 0;
+
+    if (!rl_io_rings_active(rio)) {
+        return -ENXIO;
+    }
+
+    if (flags & RL_RINGS_SYNC_TX) {
+        ret = rl_io_rings_txsync(rio);
+    }
+
+    if (flags & RL_RINGS_SYNC_RX) {
+        rl_io_rings_rxsync(rio);
+    }
+
+    return ret;
+}
+
+/* Each mapping holds a reference to the rings, so that the memory
+ * outlives the binding. */
+static void
+rl_io_vma_open(struct vm_area_struct *vma)
+{
+    struct rl_io_rings *rings = vma->vm_private_data;
+
+    atomic_inc(&rings->refcnt);
+}
+
+static void
+rl_io_vma_close(struct vm_area_struct *vma)
+{
+    rl_io_rings_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct rl_io_vm_ops = {
+    .open  = rl_io_vma_open,
+    .close = rl_io_vma_close,
+};
+
+static int
+rl_io_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+    struct rl_io_rings *rings;
+    int ret;
+
+    IODEVS_LOCK();
+    rings = rio->rings;
+    if (!rings) {
+        ret = -ENXIO;
+    } else if (vma->vm_pgoff ||
+               vma->vm_end - vma->vm_start > 2 * rings->ring_size) {
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, rings->mem, 0);
+    }
+    if (ret == 0) {
+        vma->vm_private_data = rings;
+        vma->vm_ops          = &rl_io_vm_ops;
+        rl_io_vma_open(vma);
+    }
+    IODEVS_UNLOCK();
+
+    return ret;
+}
+
+static unsigned int
+rl_io_poll(struct file *f, poll_table *wait)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+    struct txrx *txrx = rio->txrx;
+    struct ipcp_entry *ipcp;
+    unsigned int mask = 0;
+
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    if (rio->mode == RLITE_IO_MODE_FLOW_GROUP) {
+        return rl_io_group_poll(f, rio->group, wait);
+    }
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+
+    if (unlikely(!txrx)) {
+        return POLLERR;
+    }
+    ipcp = txrx->ipcp;
+
+    poll_wait(f, &txrx->rx_wqh, wait);
+    poll_wait(f, txrx->tx_wqh, wait);
+
+    if (rl_io_rings_active(rio)) {
+        return rl_io_rings_poll(rio);
+    }
+
+    if (rio->busy_poll_us && !poll_does_not_wait(wait) &&
+        rb_list_empty(&txrx->rx_q)) {
+        /* First pass of poll()/select(): spin on the receive queue
+         * before letting the caller go to sleep. */
+        rl_io_busy_poll(rio, txrx);
+    }
+
+    spin_lock_bh(&txrx->rx_lock);
+    if (txrx_rx_readable(txrx)) {
+        /* Userspace can read when the flow rxq holds at least rx_lowat
+         * SDUs or when the flow has been deallocated, so that
+         * we can report EOF. */
+        mask |= POLLIN | POLLRDNORM;
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+
+    if (!rio->flow || !ipcp->ops.flow_writeable ||
+        ipcp->ops.flow_writeable(rio->flow)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+
+    return mask;
+}
+
+void
+rl_iodevs_shutdown_by_ipcp(struct ipcp_entry *ipcp)
+{
+    struct rl_io *rio;
+
+    IODEVS_LOCK();
+    list_for_each_entry (rio, &rl_iodevs, node) {
+        if (rio->mode == RLITE_IO_MODE_APPL_BIND && rio->flow &&
+            rio->flow->txrx.ipcp == ipcp) {
+            PD("Shutting down flow %u\n", rio->flow->local_port);
+            rl_flow_shutdown(rio->flow);
+        }
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+        if (rio->mode == RLITE_IO_MODE_FLOW_GROUP) {
+            struct rl_flow_group_member *m;
+            int bkt;
+
+            /* Membership cannot change, since we hold IODEVS_LOCK(). */
+            hash_for_each (rio->group->members, bkt, m, node) {
+                if (m->flow->txrx.ipcp == ipcp) {
+                    PD("Shutting down grouped flow %u\n",
+                       m->flow->local_port);
+                    rl_flow_shutdown(m->flow);
+                }
+            }
+        }
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+    }
+    IODEVS_UNLOCK();
+}
+
+void
+rl_iodevs_probe_ipcp_references(struct ipcp_entry *ipcp)
+{
+    struct rl_io *rio;
+
+    IODEVS_LOCK();
+    list_for_each_entry (rio, &rl_iodevs, node) {
+        if (rio->flow && rio->flow->txrx.ipcp == ipcp) {
+            PE("iodev bound to flow %u has dangling reference to ipcp %u\n",
+               rio->flow->local_port, ipcp->id);
+        }
+    }
+    IODEVS_UNLOCK();
+}
+
+void
+rl_iodevs_probe_flow_references(struct flow_entry *flow)
+{
+    struct rl_io *rio;
+
+    IODEVS_LOCK();
     list_for_each_entry (rio, &rl_iodevs, node) {
         if (rio->flow == flow) {
             PE("iodev bound has dangling reference to flow %u\n",
@@ -611,14 +1837,26 @@ rl_io_release_internal(struct rl_io *rio)
     BUG_ON(!rio);
 
     if (rio->txrx) {
+        if (rio->rings) {
+            struct rl_io_rings *rings = rio->rings;
+
+            /* Stop filling the RX ring and tear the rings down, so
+             * that new ones can be set up after a rebind. The memory
+             * is released once it is not mapped anymore. */
+            spin_lock_bh(&rio->txrx->rx_lock);
+            rio->txrx->rings = NULL;
+            spin_unlock_bh(&rio->txrx->rx_lock);
+            IODEVS_LOCK();
+            rio->rings = NULL;
+            IODEVS_UNLOCK();
+            rl_io_rings_put(rings);
+        }
+
         /* Drain rx queue. */
-        struct rl_buf *rb, *tmp;
 
-        rb_list_foreach_safe (rb, tmp, &rio->txrx->rx_q) {
-            rb_list_del(rb);
-            rl_buf_free(rb);
-        }
-        rio->txrx->rx_qsize = 0;
+        spin_lock_bh(&rio->txrx->rx_lock);
+        txrx_rxq_purge(rio->txrx);
+        spin_unlock_bh(&rio->txrx->rx_lock);
     }
 
     switch (rio->mode) {
@@ -636,6 +1874,13 @@ rl_io_release_internal(struct rl_io *rio)
         flow_put(flow);
     } break;
 
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    case RLITE_IO_MODE_FLOW_GROUP:
+        BUG_ON(!rio->group);
+        rl_io_group_destroy(rio);
+        break;
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+
     case RLITE_IO_MODE_IPCP_MGMT:
         BUG_ON(!rio->txrx);
         BUG_ON(!rio->txrx->ipcp);
@@ -683,6 +1928,14 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         case RLITE_IO_MODE_IPCP_MGMT:
             ret = rl_io_ioctl_mgmt(rio, &info);
             break;
+
+        case RLITE_IO_MODE_FLOW_GROUP:
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+            ret = rl_io_ioctl_group(rio);
+#else
+            ret = -EOPNOTSUPP;
+#endif
+            break;
         }
 
         if (ret == 0) {
@@ -698,7 +1951,10 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
     case RLITE_IOCTL_MSS_GET: {
         uint32_t __user *mss = (uint32_t __user *)argp;
 
-        BUG_ON(!rio->txrx);
+        if (!rio->txrx) {
+            /* Not bound, or bound to a group of flows. */
+            return -ENXIO;
+        }
         BUG_ON(!rio->txrx->ipcp);
         if (put_user(rio->txrx->ipcp->max_sdu_size, mss)) {
             return -EFAULT;
@@ -706,6 +1962,93 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         break;
     }
 
+    case RLITE_IOCTL_READ_BATCH:
+    case RLITE_IOCTL_WRITE_BATCH:
+        ret = rl_io_ioctl_batch(rio, (struct rl_ioctl_batch __user *)argp,
+                                cmd == RLITE_IOCTL_WRITE_BATCH,
+                                !(f->f_flags & O_NONBLOCK));
+        break;
+
+    case RLITE_IOCTL_RINGS_SETUP:
+        ret = rl_io_ioctl_rings_setup(rio, (struct rl_rings_req __user *)argp);
+        break;
+
+    case RLITE_IOCTL_RINGS_SYNC: {
+        uint32_t flags;
+
+        if (get_user(flags, (uint32_t __user *)argp)) {
+            return -EFAULT;
+        }
+        ret = rl_io_ioctl_rings_sync(rio, flags);
+        break;
+    }
+
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    case RLITE_IOCTL_GROUP_ADD:
+        ret = rl_io_ioctl_group_add(rio, (struct rl_ioctl_group __user *)argp);
+        break;
+
+    case RLITE_IOCTL_GROUP_DEL:
+        ret = rl_io_ioctl_group_del(rio, (struct rl_ioctl_group __user *)argp);
+        break;
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
+
+    case RLITE_IOCTL_RXQ_LIMIT: {
+        uint32_t limit;
+
+        if (get_user(limit, (uint32_t __user *)argp)) {
+            return -EFAULT;
+        }
+        if (!rio->txrx) {
+            return -ENXIO;
+        }
+        if (limit && (limit < RL_RXQ_SIZE_MIN || limit > RL_RXQ_SIZE_MAX)) {
+            return -EINVAL;
+        }
+        spin_lock_bh(&rio->txrx->rx_lock);
+        rio->txrx->rx_qlimit = limit;
+        spin_unlock_bh(&rio->txrx->rx_lock);
+        break;
+    }
+
+    case RLITE_IOCTL_RX_LOWAT: {
+        struct txrx *txrx = rio->txrx;
+        uint32_t lowat;
+        bool wake;
+
+        if (get_user(lowat, (uint32_t __user *)argp)) {
+            return -EFAULT;
+        }
+        if (!txrx) {
+            return -ENXIO;
+        }
+        if (lowat > RINA_FLOW_RX_LOWAT_MAX) {
+            return -EINVAL;
+        }
+        spin_lock_bh(&txrx->rx_lock);
+        txrx->rx_lowat = lowat;
+        wake           = txrx_rx_readable(txrx);
+        spin_unlock_bh(&txrx->rx_lock);
+        if (wake) {
+            /* Lowering the watermark may unblock waiting readers. */
+            rl_rx_wake(txrx);
+        }
+        break;
+    }
+
+    case RLITE_IOCTL_BUSY_POLL: {
+        uint32_t usecs;
+
+        if (get_user(usecs, (uint32_t __user *)argp)) {
+            return -EFAULT;
+        }
+        if (usecs > RINA_FLOW_BUSY_POLL_MAX) {
+            return -EINVAL;
+        }
+        rio->busy_poll_us = usecs;
+        break;
+    }
+
     default:
         ret = -EINVAL;
         break;
@@ -747,7 +2090,14 @@ static const struct file_operations rl_io_fops = {
     .aio_write = rl_io_write_iter,
     .aio_read  = rl_io_read_iter,
 #endif /* AIO_RW */
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    .splice_write = rl_io_splice_write,
+#endif
+#if defined(RL_HAVE_COPY_SPLICE_READ) || defined(RL_HAVE_ITER_PIPE)
+    .splice_read = rl_io_splice_read,
+#endif
     .poll           = rl_io_poll,
+    .mmap           = rl_io_mmap,
     .unlocked_ioctl = rl_io_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = rl_io_compat_ioctl,
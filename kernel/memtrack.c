@@ -83,10 +83,31 @@ rl_memtrack_dump_stats(void)
 {
     int i;
 
+#ifndef RL_SKB
+    struct rl_buf_cache_stats cs;
+    static const char *cls_names[RL_BUFCACHE_NCLASSES] = {
+        [RL_BUFCACHE_SMALL]  = "SMALL",
+        [RL_BUFCACHE_MEDIUM] = "MEDIUM",
+        [RL_BUFCACHE_LARGE]  = "LARGE",
+    };
+#endif /* !RL_SKB */
+
     PI("Memtrack stats:\n");
     for (i = 0; i < RL_MT_MAX; i++) {
         PI("    %-8s:%8d\n", mt_names[i], atomic_read(mt_count + i));
     }
+
+#ifndef RL_SKB
+    rl_buf_cache_stats_get(&cs);
+    PI("Buffer cache stats (hit/miss):\n");
+    PI("    %-8s:%12llu/%llu\n", "BUFHDR", (long long unsigned)cs.hdr_hit,
+       (long long unsigned)cs.hdr_miss);
+    for (i = 0; i < RL_BUFCACHE_NCLASSES; i++) {
+        PI("    %-8s:%12llu/%llu\n", cls_names[i],
+           (long long unsigned)cs.block_hit[i],
+           (long long unsigned)cs.block_miss[i]);
+    }
+#endif /* !RL_SKB */
 }
 
 #endif /* RL_MEMTRACK */
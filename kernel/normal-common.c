@@ -25,9 +25,81 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
+#ifdef RL_HAVE_HRTIMER_SOFT
+static enum hrtimer_restart
+rl_hrtimer_fire(struct hrtimer *tmr)
+{
+    struct rl_hrtimer *t = container_of(tmr, struct rl_hrtimer, tmr);
+
+    t->func(t);
+
+    return HRTIMER_NORESTART;
+}
+#else  /* !RL_HAVE_HRTIMER_SOFT */
+static void
+rl_hrtimer_tasklet(unsigned long arg)
+{
+    struct rl_hrtimer *t = (struct rl_hrtimer *)arg;
+
+    t->func(t);
+}
+
+/* Runs in hard interrupt context: defer the function to a tasklet. */
+static enum hrtimer_restart
+rl_hrtimer_fire(struct hrtimer *tmr)
+{
+    struct rl_hrtimer *t = container_of(tmr, struct rl_hrtimer, tmr);
+
+    tasklet_schedule(&t->tasklet);
+
+    return HRTIMER_NORESTART;
+}
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+
+void
+rl_hrtimer_init(struct rl_hrtimer *t, void (*func)(struct rl_hrtimer *))
+{
+    t->func = func;
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&t->tmr, rl_hrtimer_fire, CLOCK_MONOTONIC,
+                  RL_HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&t->tmr, CLOCK_MONOTONIC, RL_HRTIMER_MODE_ABS);
+    t->tmr.function = rl_hrtimer_fire;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+#ifndef RL_HAVE_HRTIMER_SOFT
+    tasklet_init(&t->tasklet, rl_hrtimer_tasklet, (unsigned long)t);
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+}
+EXPORT_SYMBOL(rl_hrtimer_init);
+
+/* Stop the timer and wait for the function to complete, like
+ * del_timer_sync(). */
+void
+rl_hrtimer_cancel_sync(struct rl_hrtimer *t)
+{
+#ifdef RL_HAVE_HRTIMER_SOFT
+    hrtimer_cancel(&t->tmr);
+#else  /* !RL_HAVE_HRTIMER_SOFT */
+    /* A tasklet that is still running may re-arm the hrtimer after we
+     * cancelled it, so go on until neither of them is pending. */
+    do {
+        hrtimer_cancel(&t->tmr);
+        tasklet_kill(&t->tasklet);
+    } while (hrtimer_active(&t->tmr));
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+}
+EXPORT_SYMBOL(rl_hrtimer_cancel_sync);
+
 void
 dtp_init(struct dtp *dtp)
 {
@@ -39,6 +111,7 @@ dtp_init(struct dtp *dtp)
     rb_list_init(&dtp->seqq);
     dtp->seqq_len = 0;
     rb_list_init(&dtp->rtxq);
+    INIT_LIST_HEAD(&dtp->rtxq_exp);
     dtp->rtxq_len = dtp->max_rtxq_len = 0;
     dtp->flags                        = 0;
 }
@@ -56,8 +129,9 @@ dtp_fini(struct dtp *dtp)
     if (dtp->flags & DTP_F_TIMERS_INITIALIZED) {
         del_timer_sync(&dtp->snd_inact_tmr);
         del_timer_sync(&dtp->rcv_inact_tmr);
-        del_timer_sync(&dtp->rtx_tmr);
-        del_timer_sync(&dtp->a_tmr);
+        rl_hrtimer_cancel_sync(&dtp->rtx_tmr);
+        rl_hrtimer_cancel_sync(&dtp->a_tmr);
+        rl_hrtimer_cancel_sync(&dtp->tlp_tmr);
     }
 
     spin_lock_bh(&dtp->lock);
@@ -83,6 +157,7 @@ dtp_fini(struct dtp *dtp)
         rb_list_del(rb);
         rl_buf_free(rb);
     }
+    INIT_LIST_HEAD(&dtp->rtxq_exp);
     dtp->rtxq_len = 0;
 
     spin_unlock_bh(&dtp->lock);
@@ -105,8 +180,9 @@ dtp_dump(struct dtp *dtp)
            "    max_cwq_len=%lu\n"
            "    rtxq_len=%lu\n"
            "    max_rtxq_len=%lu\n"
-           "    rtt=%lu\n"
-           "    rtt_stddev=%lu\n"
+           "    rtt_us=%lu\n"
+           "    rtt_stddev_us=%lu\n"
+           "    rto_us=%lu\n"
            "    cgwin=%lu\n"
            "    rcv_lwe=%lu\n"
            "    rcv_next_seq_num=%lu\n"
@@ -123,7 +199,8 @@ dtp_dump(struct dtp *dtp)
            (long unsigned)dtp->last_ctrl_seq_num_rcvd,
            (long unsigned)dtp->cwq_len, (long unsigned)dtp->max_cwq_len,
            (long unsigned)dtp->rtxq_len, (long unsigned)dtp->max_rtxq_len,
-           (long unsigned)dtp->rtt, (long unsigned)dtp->rtt_stddev,
+           (long unsigned)dtp->rtt_us, (long unsigned)dtp->rtt_stddev_us,
+           (long unsigned)dtp->rto_us,
            (long unsigned)dtp->cgwin, (long unsigned)dtp->rcv_lwe,
            (long unsigned)dtp->rcv_next_seq_num, (long unsigned)dtp->rcv_rwe,
            (long unsigned)dtp->max_seq_num_rcvd,
@@ -135,6 +212,689 @@ EXPORT_SYMBOL(dtp_dump);
 
 #define PDUFT_PERFLOW_KEY(daddr, dcep) ((daddr) | (dcep) << 16)
 
+/* The PDUFT is protected by RCU: lookups run lock-free, while updates
+ * are serialized by priv->pduft_lock, and run in process context.
+ * Entries are never modified once published: an update replaces the
+ * whole entry, and the old one is freed (dropping its flow references)
+ * after a grace period. An entry may hold up to RL_PDUFT_ECMP_MAX
+ * equal-cost lower flows, which are selected by hashing the PCI fields
+ * that identify an EFCP connection, so that each connection is kept in
+ * order, and a backup lower flow (e.g. a loop-free alternate), which is
+ * used as soon as the selected flow goes down.
+ *
+ * Destination-based entries live in a pduft_table. If the DIF addresses
+ * are narrow enough the table is a direct-indexed array, which starts
+ * small and grows to cover the highest address in use, otherwise it is
+ * a hash table that is resized (by copying it and swapping the copy in)
+ * as the number of entries changes. */
+
+#define PDUFT_ARRAY_BITS_MIN 8
+#define PDUFT_ARRAY_BITS_MAX 16
+#define PDUFT_HASH_BITS_MIN 3
+#define PDUFT_HASH_BITS_MAX 20
+
+#define pduft_deref(_priv, _p)                                                 \
+    rcu_dereference_check(_p, lockdep_is_held(&(_priv)->pduft_lock))
+
+static void
+pduft_entry_free(struct pduft_entry *entry)
+{
+    unsigned int i;
+
+    for (i = 0; i < entry->num_flows; i++) {
+        flow_put(entry->flows[i]);
+    }
+    if (entry->backup) {
+        flow_put(entry->backup);
+    }
+    rl_free(entry, RL_MT_PDUFT);
+}
+
+static void
+pduft_entry_free_rcu(struct rcu_head *head)
+{
+    pduft_entry_free(container_of(head, struct pduft_entry, rcu));
+}
+
+/* Allocate an entry for 'match' with the lower flows of 'base' (if not
+ * NULL) except 'skip' (if not NULL), plus 'flow' (if not NULL). The
+ * backup flow of 'base' is kept, and it is promoted if no other flow
+ * is left. The caller makes sure that the result has between one and
+ * RL_PDUFT_ECMP_MAX flows. */
+static struct pduft_entry *
+pduft_entry_alloc(const struct rl_pci_match *match,
+                  const struct pduft_entry *base, struct flow_entry *flow,
+                  const struct flow_entry *skip)
+{
+    struct pduft_entry *entry;
+    unsigned int i;
+
+    entry = rl_alloc(sizeof(*entry), GFP_KERNEL | __GFP_ZERO, RL_MT_PDUFT);
+    if (!entry) {
+        return NULL;
+    }
+    entry->match = *match;
+    for (i = 0; base && i < base->num_flows; i++) {
+        if (base->flows[i] != skip) {
+            entry->flows[entry->num_flows++] = base->flows[i];
+        }
+    }
+    if (flow) {
+        entry->flows[entry->num_flows++] = flow;
+    }
+    if (base && base->backup && base->backup != skip) {
+        if (entry->num_flows) {
+            entry->backup = base->backup;
+        } else {
+            entry->flows[entry->num_flows++] = base->backup;
+        }
+    }
+    for (i = 0; i < entry->num_flows; i++) {
+        flow_get_ref(entry->flows[i]);
+    }
+    if (entry->backup) {
+        flow_get_ref(entry->backup);
+    }
+
+    return entry;
+}
+
+static bool
+pduft_entry_uses(const struct pduft_entry *entry, const struct flow_entry *flow)
+{
+    unsigned int i;
+
+    if (!flow || entry->backup == flow) {
+        return true;
+    }
+    for (i = 0; i < entry->num_flows; i++) {
+        if (entry->flows[i] == flow) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Fall back on the other equal-cost lower flows, and then on the
+ * backup one, when 'flow' cannot carry traffic. */
+static noinline struct flow_entry *
+pduft_entry_reroute(const struct pduft_entry *entry, struct flow_entry *flow)
+{
+    unsigned int i;
+
+    for (i = 0; i < entry->num_flows; i++) {
+        if (!rl_flow_unusable(entry->flows[i])) {
+            return entry->flows[i];
+        }
+    }
+    if (entry->backup && !rl_flow_unusable(entry->backup)) {
+        return entry->backup;
+    }
+
+    return flow;
+}
+
+/* Select one of the equal-cost lower flows of 'entry'. */
+static inline struct flow_entry *
+pduft_entry_select(const struct pduft_entry *entry,
+                   const struct rl_pci_match *pci)
+{
+    struct flow_entry *flow;
+    uint32_t words[4];
+    uint32_t hash;
+
+    if (likely(entry->num_flows == 1)) {
+        flow = entry->flows[0];
+    } else {
+        words[0] = (uint32_t)pci->src_addr ^ (uint32_t)(pci->src_addr >> 32);
+        words[1] = (uint32_t)pci->dst_addr ^ (uint32_t)(pci->dst_addr >> 32);
+        words[2] = ((uint32_t)pci->src_cepid << 16) ^ (uint32_t)pci->dst_cepid;
+        words[3] = (uint32_t)pci->qos_id;
+        hash     = jhash2(words, ARRAY_SIZE(words), 0);
+        flow     = entry->flows[((uint64_t)hash * entry->num_flows) >> 32];
+    }
+
+    if (unlikely(rl_flow_unusable(flow))) {
+        flow = pduft_entry_reroute(entry, flow);
+    }
+
+    return flow;
+}
+
+static struct pduft_table *
+pduft_table_alloc(uint8_t type, unsigned int bits)
+{
+    struct pduft_table *tbl;
+    size_t size = sizeof(*tbl);
+
+    if (type == RL_PDUFT_T_ARRAY) {
+        size += sizeof(tbl->slots[0]) << bits;
+    } else {
+        size += sizeof(tbl->buckets[0]) << bits;
+    }
+
+    tbl = size <= PAGE_SIZE ? kzalloc(size, GFP_KERNEL) : vzalloc(size);
+    if (!tbl) {
+        return NULL;
+    }
+    tbl->type = type;
+    tbl->bits = bits;
+    /* Zeroed memory is a valid (empty) array of slots or hlist heads. */
+
+    return tbl;
+}
+
+/* Free a table which is not visible to readers anymore, together
+ * with all its entries. */
+static void
+pduft_table_destroy(struct pduft_table *tbl)
+{
+    unsigned int i;
+
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        struct pduft_entry *entry;
+        struct hlist_node *tmp;
+
+        if (tbl->type == RL_PDUFT_T_ARRAY) {
+            entry = rcu_dereference_protected(tbl->slots[i], 1);
+            if (entry) {
+                pduft_entry_free(entry);
+            }
+            continue;
+        }
+        hlist_for_each_entry_safe (entry, tmp, &tbl->buckets[i], node) {
+            pduft_entry_free(entry);
+        }
+    }
+    kvfree(tbl);
+}
+
+static void
+pduft_table_free_rcu(struct rcu_head *head)
+{
+    pduft_table_destroy(container_of(head, struct pduft_table, rcu));
+}
+
+/* To be called under rcu_read_lock() or with priv->pduft_lock held. */
+static struct pduft_entry *
+pduft_table_lookup(struct rl_normal *priv, struct pduft_table *tbl,
+                   rlm_addr_t dst_addr)
+{
+    struct pduft_entry *entry;
+    struct hlist_head *head;
+
+    if (tbl->type == RL_PDUFT_T_ARRAY) {
+        if (unlikely(dst_addr >> tbl->bits)) {
+            return NULL;
+        }
+        return pduft_deref(priv, tbl->slots[dst_addr]);
+    }
+
+    head = &tbl->buckets[hash_min(dst_addr, tbl->bits)];
+    hlist_for_each_entry_rcu (entry, head, node) {
+        if (entry->match.dst_addr == dst_addr) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Return a private copy of 'tbl' (with 'bits' size, for hash tables),
+ * or NULL on allocation failures. To be called with priv->pduft_lock
+ * held. */
+static struct pduft_table *
+pduft_table_clone(struct rl_normal *priv, struct pduft_table *tbl,
+                  unsigned int bits)
+{
+    struct pduft_table *ntbl;
+    struct pduft_entry *entry, *copy;
+    unsigned int i;
+
+    if (tbl->type == RL_PDUFT_T_ARRAY) {
+        bits = tbl->bits;
+    }
+
+    ntbl = pduft_table_alloc(tbl->type, bits);
+    if (!ntbl) {
+        return NULL;
+    }
+
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        if (tbl->type == RL_PDUFT_T_ARRAY) {
+            entry = pduft_deref(priv, tbl->slots[i]);
+            if (!entry) {
+                continue;
+            }
+            copy = pduft_entry_alloc(&entry->match, entry, NULL, NULL);
+            if (!copy) {
+                pduft_table_destroy(ntbl);
+                return NULL;
+            }
+            RCU_INIT_POINTER(ntbl->slots[i], copy);
+            ntbl->count++;
+            continue;
+        }
+
+        hlist_for_each_entry (entry, &tbl->buckets[i], node) {
+            copy = pduft_entry_alloc(&entry->match, entry, NULL, NULL);
+            if (!copy) {
+                pduft_table_destroy(ntbl);
+                return NULL;
+            }
+            hlist_add_head(&copy->node,
+                           &ntbl->buckets[hash_min(copy->match.dst_addr,
+                                                   ntbl->bits)]);
+            ntbl->count++;
+        }
+    }
+
+    return ntbl;
+}
+
+/* Replace the table with a copy of 'bits' size. This is best effort:
+ * on allocation failures the current table is kept. To be called with
+ * priv->pduft_lock held. */
+static void
+pduft_table_resize(struct rl_normal *priv, struct pduft_table *tbl,
+                   unsigned int bits)
+{
+    struct pduft_table *ntbl = pduft_table_clone(priv, tbl, bits);
+
+    if (!ntbl) {
+        return;
+    }
+
+    rcu_assign_pointer(priv->pduft, ntbl);
+    call_rcu(&tbl->rcu, pduft_table_free_rcu);
+}
+
+static void
+pduft_table_shell_free_rcu(struct rcu_head *head)
+{
+    kvfree(container_of(head, struct pduft_table, rcu));
+}
+
+/* Make room for 'addr' in an array table, replacing it with a larger
+ * one if needed. Array slots only hold pointers, so the entries are
+ * moved to the new array rather than copied. Returns the current table,
+ * or NULL on allocation failures. To be called with priv->pduft_lock
+ * held. */
+static struct pduft_table *
+pduft_table_fit(struct rl_normal *priv, struct pduft_table *tbl,
+                rlm_addr_t addr)
+{
+    struct pduft_table *ntbl;
+    unsigned int i;
+
+    if (tbl->type != RL_PDUFT_T_ARRAY || !(addr >> tbl->bits) ||
+        (addr >> priv->addr_bits)) {
+        /* Addresses out of the address space are rejected later. */
+        return tbl;
+    }
+
+    ntbl = pduft_table_alloc(RL_PDUFT_T_ARRAY, fls64(addr));
+    if (!ntbl) {
+        return NULL;
+    }
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        RCU_INIT_POINTER(ntbl->slots[i], pduft_deref(priv, tbl->slots[i]));
+    }
+    ntbl->count = tbl->count;
+
+    rcu_assign_pointer(priv->pduft, ntbl);
+    call_rcu(&tbl->rcu, pduft_table_shell_free_rcu);
+
+    return ntbl;
+}
+
+/* Keep the load factor of hash tables between 1/8 and 2. */
+static void
+pduft_table_maybe_resize(struct rl_normal *priv, struct pduft_table *tbl)
+{
+    unsigned int buckets = 1U << tbl->bits;
+
+    if (tbl->type != RL_PDUFT_T_HASH) {
+        return;
+    }
+
+    if (tbl->count > 2 * buckets && tbl->bits < PDUFT_HASH_BITS_MAX) {
+        pduft_table_resize(priv, tbl, tbl->bits + 1);
+    } else if (tbl->count < buckets / 8 && tbl->bits > PDUFT_HASH_BITS_MIN) {
+        pduft_table_resize(priv, tbl, tbl->bits - 1);
+    }
+}
+
+/* To be called with priv->pduft_lock held. The entry is freed after
+ * a grace period. */
+static void
+pduft_table_unlink(struct pduft_table *tbl, struct pduft_entry *entry)
+{
+    if (tbl->type == RL_PDUFT_T_ARRAY) {
+        RCU_INIT_POINTER(tbl->slots[entry->match.dst_addr], NULL);
+    } else {
+        hlist_del_rcu(&entry->node);
+    }
+    tbl->count--;
+    call_rcu(&entry->rcu, pduft_entry_free_rcu);
+}
+
+/* Replace 'entry' with 'copy', which has the same match. */
+static void
+pduft_table_replace(struct pduft_table *tbl, struct pduft_entry *entry,
+                    struct pduft_entry *copy)
+{
+    if (tbl->type == RL_PDUFT_T_ARRAY) {
+        rcu_assign_pointer(tbl->slots[entry->match.dst_addr], copy);
+    } else {
+        hlist_replace_rcu(&entry->node, &copy->node);
+    }
+    call_rcu(&entry->rcu, pduft_entry_free_rcu);
+}
+
+/* Return a copy of 'entry' without 'flow', to replace 'entry' when
+ * 'flow' goes away, or NULL if the whole entry must be removed. A
+ * failed allocation removes the whole entry, as it was the case
+ * before multipath entries. */
+static struct pduft_entry *
+pduft_entry_drop(const struct pduft_entry *entry, const struct flow_entry *flow)
+{
+    unsigned int left = entry->num_flows + (entry->backup ? 1 : 0);
+
+    if (!flow || left <= 1) {
+        return NULL;
+    }
+
+    return pduft_entry_alloc(&entry->match, entry, NULL, flow);
+}
+
+int
+rl_pduft_init(struct rl_normal *priv, unsigned int addr_size)
+{
+    struct pduft_table *tbl;
+
+    hash_init(priv->pdu_ft_perflow);
+    priv->perflow_present = false;
+    RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+    RCU_INIT_POINTER(priv->pduft_trie, NULL);
+    priv->trie_count = 0;
+    priv->addr_bits  = addr_size * 8;
+    mutex_init(&priv->pduft_lock);
+    seqcount_init(&priv->pduft_seq);
+
+    /* Addresses of at most PDUFT_ARRAY_BITS_MAX bits can be used to
+     * directly index an array, which is grown as routes are added. */
+    if (addr_size * 8 <= PDUFT_ARRAY_BITS_MAX) {
+        tbl = pduft_table_alloc(RL_PDUFT_T_ARRAY,
+                                min_t(unsigned int, addr_size * 8,
+                                      PDUFT_ARRAY_BITS_MIN));
+    } else {
+        tbl = pduft_table_alloc(RL_PDUFT_T_HASH, PDUFT_HASH_BITS_MIN);
+    }
+    if (!tbl) {
+        return -ENOMEM;
+    }
+    RCU_INIT_POINTER(priv->pduft, tbl);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_pduft_init);
+
+/* To be called after the last rl_pduft_flush(). */
+void
+rl_pduft_fini(struct rl_normal *priv)
+{
+    struct pduft_table *tbl = rcu_dereference_protected(priv->pduft, 1);
+
+    RCU_INIT_POINTER(priv->pduft, NULL);
+    if (tbl) {
+        call_rcu(&tbl->rcu, pduft_table_free_rcu);
+    }
+}
+EXPORT_SYMBOL(rl_pduft_fini);
+
+/* Prefix entries. Addresses are priv->addr_bits wide, and a prefix of
+ * length 'plen' is made of their 'plen' most significant bits. */
+
+static inline rlm_addr_t
+pduft_mask(const struct rl_normal *priv, rlm_addr_t addr, unsigned int plen)
+{
+    if (plen == 0) {
+        return 0;
+    }
+
+    return addr & ~((((rlm_addr_t)1) << (priv->addr_bits - plen)) - 1);
+}
+
+/* Value of the bit following a prefix of length 'plen'. */
+static inline unsigned int
+pduft_bit(const struct rl_normal *priv, rlm_addr_t addr, unsigned int plen)
+{
+    return (addr >> (priv->addr_bits - 1 - plen)) & 1;
+}
+
+/* Length of the common prefix of 'a' and 'b', up to 'maxlen'. */
+static inline unsigned int
+pduft_common_plen(const struct rl_normal *priv, rlm_addr_t a, rlm_addr_t b,
+                  unsigned int maxlen)
+{
+    rlm_addr_t diff = a ^ b;
+    unsigned int len;
+
+    len = diff ? priv->addr_bits - fls64(diff) : priv->addr_bits;
+
+    return min(len, maxlen);
+}
+
+static bool
+rl_pduft_match_is_prefix(const struct rl_normal *priv,
+                         const struct rl_pci_match *match)
+{
+    return match->dst_plen && match->dst_plen < priv->addr_bits;
+}
+
+static void
+pduft_trie_node_free_rcu(struct rcu_head *head)
+{
+    rl_free(container_of(head, struct pduft_trie_node, rcu), RL_MT_PDUFT);
+}
+
+static struct pduft_trie_node *
+pduft_trie_node_alloc(rlm_addr_t prefix, unsigned int plen,
+                      struct pduft_entry *entry)
+{
+    struct pduft_trie_node *n;
+
+    n = rl_alloc(sizeof(*n), GFP_KERNEL | __GFP_ZERO, RL_MT_PDUFT);
+    if (!n) {
+        return NULL;
+    }
+    n->prefix = prefix;
+    n->plen   = plen;
+    RCU_INIT_POINTER(n->entry, entry);
+
+    return n;
+}
+
+/* Longest prefix match. To be called under rcu_read_lock(). */
+static struct pduft_entry *
+pduft_trie_lookup(struct rl_normal *priv, rlm_addr_t addr)
+{
+    struct pduft_trie_node *n = rcu_dereference(priv->pduft_trie);
+    struct pduft_entry *best  = NULL;
+
+    while (n && pduft_mask(priv, addr, n->plen) == n->prefix) {
+        struct pduft_entry *entry = rcu_dereference(n->entry);
+
+        if (entry) {
+            best = entry;
+        }
+        n = rcu_dereference(n->child[pduft_bit(priv, addr, n->plen)]);
+    }
+
+    return best;
+}
+
+/* Initialize one of the two 'spare' nodes preallocated by the caller,
+ * taking it from the array. */
+static struct pduft_trie_node *
+pduft_trie_node_take(struct pduft_trie_node **spare, rlm_addr_t prefix,
+                     unsigned int plen, struct pduft_entry *entry)
+{
+    struct pduft_trie_node *n;
+
+    if (spare[0]) {
+        n        = spare[0];
+        spare[0] = NULL;
+    } else {
+        n        = spare[1];
+        spare[1] = NULL;
+    }
+    BUG_ON(!n);
+    n->prefix = prefix;
+    n->plen   = plen;
+    RCU_INIT_POINTER(n->entry, entry);
+
+    return n;
+}
+
+/* Insert 'entry' (whose prefix is already masked), returning in 'old'
+ * the entry it replaces, if any. An insertion needs at most two new
+ * nodes, which are taken from 'spare', so that it cannot fail. Each
+ * step publishes a consistent trie, so that concurrent lookups are
+ * safe. To be called with priv->pduft_lock held. */
+static void
+pduft_trie_insert(struct rl_normal *priv, struct pduft_entry *entry,
+                  struct pduft_entry **old, struct pduft_trie_node **spare)
+{
+    struct pduft_trie_node __rcu **slot = &priv->pduft_trie;
+    rlm_addr_t prefix                   = entry->match.dst_addr;
+    unsigned int plen                   = entry->match.dst_plen;
+    struct pduft_trie_node *n, *m, *leaf;
+    unsigned int common;
+
+    *old = NULL;
+
+    for (;;) {
+        n = pduft_deref(priv, *slot);
+        if (!n) {
+            /* Empty slot, append a new leaf. */
+            leaf = pduft_trie_node_take(spare, prefix, plen, entry);
+            rcu_assign_pointer(*slot, leaf);
+            break;
+        }
+
+        common = pduft_common_plen(priv, prefix, n->prefix,
+                                   min_t(unsigned int, plen, n->plen));
+        if (common == n->plen && common == plen) {
+            /* Same prefix, replace the entry. */
+            *old = pduft_deref(priv, n->entry);
+            rcu_assign_pointer(n->entry, entry);
+            break;
+        }
+
+        if (common == n->plen) {
+            /* The node prefix covers ours, go down. */
+            slot = &n->child[pduft_bit(priv, prefix, n->plen)];
+            continue;
+        }
+
+        if (common == plen) {
+            /* Our prefix covers the node one, insert above it. */
+            m = pduft_trie_node_take(spare, prefix, plen, entry);
+            RCU_INIT_POINTER(m->child[pduft_bit(priv, n->prefix, plen)], n);
+            rcu_assign_pointer(*slot, m);
+            break;
+        }
+
+        /* The prefixes diverge: insert a branching node with the node
+         * and a new leaf as children. */
+        leaf = pduft_trie_node_take(spare, prefix, plen, entry);
+        m    = pduft_trie_node_take(spare, pduft_mask(priv, prefix, common),
+                                    common, NULL);
+        RCU_INIT_POINTER(m->child[pduft_bit(priv, prefix, common)], leaf);
+        RCU_INIT_POINTER(m->child[pduft_bit(priv, n->prefix, common)], n);
+        rcu_assign_pointer(*slot, m);
+        break;
+    }
+
+    if (!*old) {
+        priv->trie_count++;
+    }
+}
+
+/* Remove from the subtrie rooted at 'slot' the entries for the prefix
+ * in 'match' (if not NULL) that use 'flow' (if not NULL), compacting
+ * the nodes left without entry and with less than two children.
+ * Returns the number of entries removed. To be called with
+ * priv->pduft_lock held. */
+static unsigned int
+pduft_trie_prune(struct rl_normal *priv, struct pduft_trie_node __rcu **slot,
+                 const struct rl_pci_match *match,
+                 const struct flow_entry *flow)
+{
+    struct pduft_trie_node *n = pduft_deref(priv, *slot);
+    struct pduft_trie_node *c0, *c1;
+    struct pduft_entry *entry;
+    unsigned int removed = 0;
+
+    if (!n || (match && (n->plen > match->dst_plen ||
+                         pduft_mask(priv, match->dst_addr, n->plen) !=
+                             n->prefix))) {
+        return 0;
+    }
+
+    removed += pduft_trie_prune(priv, &n->child[0], match, flow);
+    removed += pduft_trie_prune(priv, &n->child[1], match, flow);
+
+    entry = pduft_deref(priv, n->entry);
+    if (entry && (!match || n->plen == match->dst_plen) &&
+        pduft_entry_uses(entry, flow)) {
+        struct pduft_entry *copy = pduft_entry_drop(entry, flow);
+
+        rcu_assign_pointer(n->entry, copy);
+        call_rcu(&entry->rcu, pduft_entry_free_rcu);
+        entry = copy;
+        if (!copy) {
+            priv->trie_count--;
+            removed++;
+        }
+    }
+
+    if (!entry) {
+        c0 = pduft_deref(priv, n->child[0]);
+        c1 = pduft_deref(priv, n->child[1]);
+        if (!c0 || !c1) {
+            /* This node is not needed anymore. */
+            rcu_assign_pointer(*slot, c0 ? c0 : c1);
+            call_rcu(&n->rcu, pduft_trie_node_free_rcu);
+        }
+    }
+
+    return removed;
+}
+
+/* Exact match for the prefix in 'match'. To be called with
+ * priv->pduft_lock held. */
+static struct pduft_entry *
+pduft_trie_find(struct rl_normal *priv, const struct rl_pci_match *match)
+{
+    struct pduft_trie_node *n = pduft_deref(priv, priv->pduft_trie);
+
+    while (n && n->plen <= match->dst_plen &&
+           pduft_mask(priv, match->dst_addr, n->plen) == n->prefix) {
+        if (n->plen == match->dst_plen) {
+            return pduft_deref(priv, n->entry);
+        }
+        n = pduft_deref(
+            priv, n->child[pduft_bit(priv, match->dst_addr, n->plen)]);
+    }
+
+    return NULL;
+}
+
+/* To be called under rcu_read_lock() or with priv->pduft_lock held. */
 static struct pduft_entry *
 pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
 {
@@ -142,11 +902,11 @@ pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
     struct hlist_head *head;
 
     /* If the per-flow table is not empty, lookup there first. */
-    if (priv->perflow_present) {
+    if (READ_ONCE(priv->perflow_present)) {
         head = &priv->pdu_ft_perflow[hash_min(
             PDUFT_PERFLOW_KEY(pci->dst_addr, pci->dst_cepid),
             HASH_BITS(priv->pdu_ft_perflow))];
-        hlist_for_each_entry (entry, head, node) {
+        hlist_for_each_entry_rcu (entry, head, node) {
             if (entry->match.dst_addr == pci->dst_addr &&
                 entry->match.src_addr == pci->src_addr &&
                 entry->match.dst_cepid == pci->dst_cepid &&
@@ -158,26 +918,38 @@ pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
     }
 
     /* Lookup the regular (destination-based) table. */
-    head = &priv->pdu_ft[hash_min(pci->dst_addr, HASH_BITS(priv->pdu_ft))];
-    hlist_for_each_entry (entry, head, node) {
-        if (entry->match.dst_addr == pci->dst_addr) {
-            return entry;
-        }
-    }
-
-    return NULL;
+    return pduft_table_lookup(priv, pduft_deref(priv, priv->pduft),
+                              pci->dst_addr);
 }
 
+/* As it has always been, the returned flow is not referenced: lower
+ * flows used by the PDUFT are flushed from it with
+ * rl_pduft_flush_by_flow() before going away, and their removal is
+ * postponed anyway. */
 struct flow_entry *
 rl_pduft_lookup(struct rl_normal *priv, const struct rl_pci_match *pci)
 {
     struct pduft_entry *entry;
-    struct flow_entry *flow;
+    struct flow_entry *flow = NULL;
+
+    unsigned int seq;
 
-    read_lock_bh(&priv->pduft_lock);
-    entry = pduft_lookup_internal(priv, pci);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
-    read_unlock_bh(&priv->pduft_lock);
+    rcu_read_lock();
+    do {
+        /* Retry if a batch of modifications was being installed. */
+        seq   = read_seqcount_begin(&priv->pduft_seq);
+        entry = pduft_lookup_internal(priv, pci);
+        if (!entry && rcu_access_pointer(priv->pduft_trie)) {
+            entry = pduft_trie_lookup(priv, pci->dst_addr);
+        }
+        if (!entry) {
+            entry = rcu_dereference(priv->pduft_dflt);
+        }
+    } while (read_seqcount_retry(&priv->pduft_seq, seq));
+    if (entry) {
+        flow = pduft_entry_select(entry, pci);
+    }
+    rcu_read_unlock();
 
     return flow;
 }
@@ -197,93 +969,369 @@ rl_pduft_match_is_perflow(const struct rl_pci_match *match)
            match->dst_cepid != 0 && match->src_cepid != 0;
 }
 
-int
-rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
-             struct flow_entry *flow)
+/* Exact lookup of the entry for a valid 'match', with 'tbl' as the
+ * destination table. To be called with priv->pduft_lock held. */
+static struct pduft_entry *
+pduft_find(struct rl_normal *priv, struct pduft_table *tbl,
+           const struct rl_pci_match *match)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct pduft_entry *entry;
 
+    if (rl_pduft_match_is_prefix(priv, match)) {
+        return pduft_trie_find(priv, match);
+    }
+    if (match->dst_addr == RL_ADDR_NULL) {
+        return pduft_deref(priv, priv->pduft_dflt);
+    }
+    if (!rl_pduft_match_is_dstonly(match)) {
+        entry = pduft_lookup_internal(priv, match);
+        return (entry && entry->match.src_addr != RL_ADDR_NULL) ? entry : NULL;
+    }
+
+    return pduft_table_lookup(priv, tbl, match->dst_addr);
+}
+
+/* Validate 'match', storing into 'm' its normalized version. */
+static int
+pduft_match_normalize(struct rl_normal *priv, const struct rl_pci_match *match,
+                      struct rl_pci_match *m)
+{
     if (!rl_pduft_match_is_dstonly(match) &&
         !rl_pduft_match_is_perflow(match)) {
         PE("Invalid route: neither dst-only nor per-flow\n");
         return -EINVAL;
     }
 
-    write_lock_bh(&priv->pduft_lock);
+    if (match->dst_plen > priv->addr_bits ||
+        (rl_pduft_match_is_prefix(priv, match) &&
+         !rl_pduft_match_is_dstonly(match))) {
+        PE("Invalid route: bad prefix length %u\n", match->dst_plen);
+        return -EINVAL;
+    }
+
+    *m = *match;
+    if (rl_pduft_match_is_prefix(priv, m)) {
+        m->dst_addr = pduft_mask(priv, m->dst_addr, m->dst_plen);
+    }
 
-    if (match->dst_addr == RL_ADDR_NULL) {
-        /* Default entry. */
-        priv->pduft_dflt = flow;
+    return 0;
+}
+
+/* Is a normalized 'match' for an entry of the destination table? */
+static bool
+pduft_match_is_exact(struct rl_normal *priv, const struct rl_pci_match *match)
+{
+    return match->dst_addr != RL_ADDR_NULL &&
+           rl_pduft_match_is_dstonly(match) &&
+           !rl_pduft_match_is_prefix(priv, match);
+}
+
+/* To be called with priv->pduft_lock held. The entry is freed after
+ * a grace period. */
+static void
+pduft_perflow_unlink(struct rl_normal *priv, struct pduft_entry *entry)
+{
+    hash_del_rcu(&entry->node);
+    if (hash_empty(priv->pdu_ft_perflow)) {
+        WRITE_ONCE(priv->perflow_present, false);
+    }
+    call_rcu(&entry->rcu, pduft_entry_free_rcu);
+}
+
+/* A PDUFT modification ready to be installed. Allocations and the
+ * checks that can fail are done in advance, so that installing it
+ * cannot fail. */
+struct pduft_stage {
+    struct rl_pci_match match;        /* normalized */
+    struct pduft_entry *entry;        /* new entry, NULL to delete */
+    struct pduft_trie_node *spare[2]; /* for prefix insertions */
+    bool noop;                        /* nothing to change */
+};
+
+/* Do two normalized matches select the same entry? */
+static bool
+pduft_match_same(struct rl_normal *priv, const struct rl_pci_match *a,
+                 const struct rl_pci_match *b)
+{
+    bool prefix = rl_pduft_match_is_prefix(priv, a);
+
+    return prefix == rl_pduft_match_is_prefix(priv, b) &&
+           (!prefix || a->dst_plen == b->dst_plen) &&
+           a->dst_addr == b->dst_addr && a->src_addr == b->src_addr &&
+           a->dst_cepid == b->dst_cepid && a->src_cepid == b->src_cepid &&
+           (!rl_pduft_match_is_perflow(a) || a->qos_id == b->qos_id);
+}
+
+/* Prepare 'st' to set the entry for st->match to use 'flow' (with the
+ * rl_pduft_set() flags), or to delete it if 'flow' is NULL. 'base' is
+ * the entry being modified, if any. On failure the caller releases the
+ * stage. To be called with priv->pduft_lock held. */
+static int
+pduft_stage_prepare(struct rl_normal *priv, struct pduft_table *tbl,
+                    struct pduft_stage *st, const struct pduft_entry *base,
+                    struct flow_entry *flow, unsigned int flags)
+{
+    const struct rl_pci_match *match = &st->match;
+    struct pduft_entry *entry;
+
+    if (!flow) {
+        /* Deletions of missing entries are ignored. */
+        st->noop = !base;
+        return 0;
+    }
+
+    if (tbl->type == RL_PDUFT_T_ARRAY && pduft_match_is_exact(priv, match) &&
+        (match->dst_addr >> tbl->bits)) {
+        PE("Address %llu does not fit the PDUFT\n",
+           (long long unsigned)match->dst_addr);
+        return -EINVAL;
+    }
+
+    if (flags & RL_PDUFT_F_BACKUP) {
+        if (!base) {
+            return -ENOENT;
+        }
+        if (pduft_entry_uses(base, flow)) {
+            st->noop = true;
+            return 0;
+        }
+        entry = pduft_entry_alloc(match, base, NULL, base->backup);
+        if (entry) {
+            entry->backup = flow;
+            flow_get_ref(flow);
+        }
+    } else if (flags & RL_PDUFT_F_ADD) {
+        if (base && pduft_entry_uses(base, flow)) {
+            st->noop = true;
+            return 0;
+        }
+        if (base && base->num_flows >= RL_PDUFT_ECMP_MAX) {
+            PE("Too many equal-cost lower flows\n");
+            return -ENOSPC;
+        }
+        entry = pduft_entry_alloc(match, base, flow, NULL);
     } else {
-        entry = pduft_lookup_internal(priv, match);
+        entry = pduft_entry_alloc(match, NULL, flow, NULL);
+    }
 
-        if (!entry) {
-            entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
-            if (!entry) {
-                write_unlock_bh(&priv->pduft_lock);
-                return -ENOMEM;
-            }
+    if (!entry) {
+        return -ENOMEM;
+    }
+    st->entry = entry;
 
-            if (rl_pduft_match_is_dstonly(match)) {
-                hash_add(priv->pdu_ft, &entry->node, match->dst_addr);
-            } else {
-                BUG_ON(!rl_pduft_match_is_perflow(match));
-                hash_add(priv->pdu_ft_perflow, &entry->node,
+    if (rl_pduft_match_is_prefix(priv, match)) {
+        st->spare[0] = pduft_trie_node_alloc(0, 0, NULL);
+        st->spare[1] = pduft_trie_node_alloc(0, 0, NULL);
+        if (!st->spare[0] || !st->spare[1]) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+/* Install a prepared stage, with 'tbl' as the destination table. Hash
+ * tables are not resized here. To be called with priv->pduft_lock
+ * held. */
+static void
+pduft_stage_install(struct rl_normal *priv, struct pduft_table *tbl,
+                    struct pduft_stage *st)
+{
+    const struct rl_pci_match *match = &st->match;
+    struct pduft_entry *entry        = st->entry;
+    struct pduft_entry *old          = NULL;
+
+    if (st->noop) {
+        return;
+    }
+    st->entry = NULL; /* now owned by the PDUFT */
+
+    if (rl_pduft_match_is_prefix(priv, match)) {
+        /* Prefix entry. */
+        if (entry) {
+            pduft_trie_insert(priv, entry, &old, st->spare);
+        } else {
+            pduft_trie_prune(priv, &priv->pduft_trie, match, NULL);
+        }
+    } else if (match->dst_addr == RL_ADDR_NULL) {
+        /* Default entry. */
+        old = pduft_deref(priv, priv->pduft_dflt);
+        rcu_assign_pointer(priv->pduft_dflt, entry);
+    } else if (!rl_pduft_match_is_dstonly(match)) {
+        /* Per-flow entry. */
+        old = pduft_lookup_internal(priv, match);
+        if (old && old->match.src_addr == RL_ADDR_NULL) {
+            old = NULL;
+        }
+        if (old && entry) {
+            hlist_replace_rcu(&old->node, &entry->node);
+        } else if (old) {
+            pduft_perflow_unlink(priv, old);
+            old = NULL;
+        } else if (entry) {
+            hash_add_rcu(priv->pdu_ft_perflow, &entry->node,
                          PDUFT_PERFLOW_KEY(match->dst_addr, match->dst_cepid));
-                priv->perflow_present = true;
+            WRITE_ONCE(priv->perflow_present, true);
+        }
+    } else {
+        old = pduft_table_lookup(priv, tbl, match->dst_addr);
+        if (!entry) {
+            if (old) {
+                pduft_table_unlink(tbl, old);
+                old = NULL;
+            }
+        } else if (tbl->type == RL_PDUFT_T_ARRAY) {
+            rcu_assign_pointer(tbl->slots[match->dst_addr], entry);
+            if (!old) {
+                tbl->count++;
             }
+        } else if (old) {
+            hlist_replace_rcu(&old->node, &entry->node);
         } else {
-            flow_put(entry->flow);
+            hlist_add_head_rcu(
+                &entry->node,
+                &tbl->buckets[hash_min(match->dst_addr, tbl->bits)]);
+            tbl->count++;
         }
+    }
 
-        entry->flow  = flow;
-        entry->match = *match;
+    if (old) {
+        call_rcu(&old->rcu, pduft_entry_free_rcu);
     }
-    write_unlock_bh(&priv->pduft_lock);
+}
 
-    flow_get_ref(flow);
+/* Free what a stage still owns. */
+static void
+pduft_stage_release(struct pduft_stage *st)
+{
+    unsigned int i;
 
-    return 0;
+    if (st->entry) {
+        pduft_entry_free(st->entry);
+    }
+    for (i = 0; i < 2; i++) {
+        if (st->spare[i]) {
+            rl_free(st->spare[i], RL_MT_PDUFT);
+        }
+    }
+}
+
+/* Set the entry for 'match' to use 'flow'. With RL_PDUFT_F_ADD, 'flow'
+ * is added to the equal-cost lower flows of the existing entry (if any),
+ * rather than replacing them. With RL_PDUFT_F_BACKUP, 'flow' becomes
+ * the backup flow of the existing entry. */
+int
+rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
+             struct flow_entry *flow, unsigned int flags)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_stage st;
+    struct pduft_table *tbl;
+    int ret;
+
+    memset(&st, 0, sizeof(st));
+    ret = pduft_match_normalize(priv, match, &st.match);
+    if (ret) {
+        return ret;
+    }
+
+    mutex_lock(&priv->pduft_lock);
+    tbl = pduft_deref(priv, priv->pduft);
+    if (pduft_match_is_exact(priv, &st.match)) {
+        tbl = pduft_table_fit(priv, tbl, st.match.dst_addr);
+        if (!tbl) {
+            mutex_unlock(&priv->pduft_lock);
+            return -ENOMEM;
+        }
+    }
+    ret = pduft_stage_prepare(priv, tbl, &st, pduft_find(priv, tbl, &st.match),
+                              flow, flags);
+    if (!ret) {
+        pduft_stage_install(priv, tbl, &st);
+        pduft_table_maybe_resize(priv, tbl);
+    }
+    mutex_unlock(&priv->pduft_lock);
+    pduft_stage_release(&st);
+
+    return ret;
 }
 EXPORT_SYMBOL(rl_pduft_set);
 
+/* To be called with priv->pduft_lock held. */
 static void
-pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
+pduft_dflt_unlink(struct rl_normal *priv)
 {
-    hash_del(&entry->node);
-    if (hash_empty(priv->pdu_ft_perflow)) {
-        priv->perflow_present = false;
+    struct pduft_entry *entry = pduft_deref(priv, priv->pduft_dflt);
+
+    if (entry) {
+        RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+        call_rcu(&entry->rcu, pduft_entry_free_rcu);
     }
-    flow_put(entry->flow);
 }
 
-int
-rl_pduft_flush(struct ipcp_entry *ipcp)
+/* Remove 'flow' from all the entries using it, unlinking the entries
+ * that are left without lower flows, or unlink all the entries if
+ * 'flow' is NULL. To be called with priv->pduft_lock held. */
+static void
+pduft_unlink_by_flow(struct rl_normal *priv, const struct flow_entry *flow)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
+    struct pduft_table *tbl = pduft_deref(priv, priv->pduft);
+    struct pduft_entry *entry, *copy;
     struct hlist_node *tmp;
+    unsigned int i;
     int bucket;
 
-    write_lock_bh(&priv->pduft_lock);
-
-    if (priv->pduft_dflt) {
-        flow_put(priv->pduft_dflt);
-        priv->pduft_dflt = NULL;
-    }
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        if (tbl->type == RL_PDUFT_T_ARRAY) {
+            entry = pduft_deref(priv, tbl->slots[i]);
+            if (entry && pduft_entry_uses(entry, flow)) {
+                copy = pduft_entry_drop(entry, flow);
+                if (copy) {
+                    pduft_table_replace(tbl, entry, copy);
+                } else {
+                    pduft_table_unlink(tbl, entry);
+                }
+            }
+            continue;
+        }
+        hlist_for_each_entry_safe (entry, tmp, &tbl->buckets[i], node) {
+            if (pduft_entry_uses(entry, flow)) {
+                copy = pduft_entry_drop(entry, flow);
+                if (copy) {
+                    pduft_table_replace(tbl, entry, copy);
+                } else {
+                    pduft_table_unlink(tbl, entry);
+                }
+            }
+        }
     }
+    pduft_table_maybe_resize(priv, tbl);
+
+    pduft_trie_prune(priv, &priv->pduft_trie, NULL, flow);
+
     hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
     {
-        pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
+        if (pduft_entry_uses(entry, flow)) {
+            copy = pduft_entry_drop(entry, flow);
+            if (copy) {
+                hlist_replace_rcu(&entry->node, &copy->node);
+                call_rcu(&entry->rcu, pduft_entry_free_rcu);
+            } else {
+                pduft_perflow_unlink(priv, entry);
+            }
+        }
     }
+}
+
+int
+rl_pduft_flush(struct ipcp_entry *ipcp)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    write_unlock_bh(&priv->pduft_lock);
+    mutex_lock(&priv->pduft_lock);
+    pduft_dflt_unlink(priv);
+    pduft_unlink_by_flow(priv, NULL);
+    mutex_unlock(&priv->pduft_lock);
 
     return 0;
 }
@@ -293,77 +1341,219 @@ int
 rl_pduft_flush_by_flow(struct ipcp_entry *ipcp, const struct flow_entry *flow)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+
+    mutex_lock(&priv->pduft_lock);
+    pduft_unlink_by_flow(priv, flow);
+    mutex_unlock(&priv->pduft_lock);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_pduft_flush_by_flow);
+
+/* Body of rl_pduft_del_addr(), with 'tbl' as the destination table.
+ * Hash tables are not resized here. To be called with priv->pduft_lock
+ * held. */
+static int
+pduft_del_locked(struct rl_normal *priv, struct pduft_table *tbl,
+                 const struct rl_pci_match *match)
+{
     struct pduft_entry *entry;
-    struct hlist_node *tmp;
-    int bucket;
+    int ret = -1;
 
-    write_lock_bh(&priv->pduft_lock);
+    if (rl_pduft_match_is_prefix(priv, match)) {
+        struct rl_pci_match m = *match;
 
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        if (entry->flow == flow) {
-            pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
+        m.dst_addr = pduft_mask(priv, m.dst_addr, m.dst_plen);
+        if (pduft_trie_prune(priv, &priv->pduft_trie, &m, NULL)) {
+            ret = 0;
+        }
+    } else if (match->dst_addr == RL_ADDR_NULL) {
+        /* Default entry. */
+        if (rcu_access_pointer(priv->pduft_dflt)) {
+            pduft_dflt_unlink(priv);
+            ret = 0;
+        }
+    } else {
+        entry = pduft_lookup_internal(priv, match);
+        if (entry && entry->match.src_addr != RL_ADDR_NULL) {
+            pduft_perflow_unlink(priv, entry);
+            ret = 0;
+        } else {
+            entry = pduft_table_lookup(priv, tbl, match->dst_addr);
+            if (entry) {
+                pduft_table_unlink(tbl, entry);
+                ret = 0;
+            }
         }
     }
 
-    hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
-    {
-        if (entry->flow == flow) {
-            pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
+    return ret;
+}
+
+int
+rl_pduft_del_addr(struct ipcp_entry *ipcp, const struct rl_pci_match *match)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_table *tbl;
+    int ret;
+
+    mutex_lock(&priv->pduft_lock);
+    tbl = pduft_deref(priv, priv->pduft);
+    ret = pduft_del_locked(priv, tbl, match);
+    pduft_table_maybe_resize(priv, tbl);
+    mutex_unlock(&priv->pduft_lock);
+
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_del_addr);
+
+/* The entry modified by stages[i], taking into account the previous
+ * modifications in the batch. To be called with priv->pduft_lock
+ * held. */
+static const struct pduft_entry *
+pduft_stage_base(struct rl_normal *priv, struct pduft_table *tbl,
+                 const struct pduft_stage *stages, unsigned int i)
+{
+    unsigned int j;
+
+    for (j = i; j-- > 0;) {
+        if (!stages[j].noop &&
+            pduft_match_same(priv, &stages[j].match, &stages[i].match)) {
+            return stages[j].entry;
         }
     }
 
-    write_unlock_bh(&priv->pduft_lock);
-
-    return 0;
+    return pduft_find(priv, tbl, &stages[i].match);
 }
-EXPORT_SYMBOL(rl_pduft_flush_by_flow);
 
+/* Apply a batch of modifications as described for struct
+ * rl_kmsg_ipcp_pduft_batch. flows[i] is the lower flow for mods[i], and
+ * it may be NULL for deletions, which are ignored if the entry does not
+ * exist. All the modifications are prepared first, so that nothing is
+ * changed if any of them fails. They are then installed within a
+ * seqcount write section, so that rl_pduft_lookup() sees either none
+ * or all of them. */
 int
-rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
+rl_pduft_batch(struct ipcp_entry *ipcp, const struct rl_pduft_mod *mods,
+               struct flow_entry **flows, unsigned int n)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    size_t size            = n * sizeof(struct pduft_stage);
+    struct pduft_stage *stages;
+    struct pduft_table *tbl;
+    unsigned int i;
+    int ret = 0;
 
-    write_lock_bh(&priv->pduft_lock);
-    pduft_entry_unlink(priv, entry);
-    write_unlock_bh(&priv->pduft_lock);
+    stages = size <= PAGE_SIZE ? kzalloc(size, GFP_KERNEL) : vzalloc(size);
+    if (!stages) {
+        return -ENOMEM;
+    }
 
-    rl_free(entry, RL_MT_PDUFT);
+    /* Validate the whole batch first. */
+    for (i = 0; i < n; i++) {
+        ret = pduft_match_normalize(priv, &mods[i].match, &stages[i].match);
+        if (ret) {
+            goto free;
+        }
+        if ((mods[i].op != RLITE_KER_IPCP_PDUFT_SET &&
+             mods[i].op != RLITE_KER_IPCP_PDUFT_DEL) ||
+            (mods[i].op == RLITE_KER_IPCP_PDUFT_SET && !flows[i])) {
+            ret = -EINVAL;
+            goto free;
+        }
+    }
 
-    return 0;
+    mutex_lock(&priv->pduft_lock);
+    tbl = pduft_deref(priv, priv->pduft);
+
+    /* Prepare the modifications. Growing an array table does not
+     * change its content. */
+    for (i = 0; i < n; i++) {
+        bool set = mods[i].op == RLITE_KER_IPCP_PDUFT_SET;
+
+        if (set && pduft_match_is_exact(priv, &stages[i].match)) {
+            tbl = pduft_table_fit(priv, tbl, stages[i].match.dst_addr);
+            if (!tbl) {
+                ret = -ENOMEM;
+                goto unlock;
+            }
+        }
+        ret = pduft_stage_prepare(priv, tbl, stages + i,
+                                  pduft_stage_base(priv, tbl, stages, i),
+                                  set ? flows[i] : NULL, mods[i].flags);
+        if (ret) {
+            goto unlock;
+        }
+    }
+
+    /* Install them. The datapath runs in softirq context, and it would
+     * spin forever on the seqcount if it interrupted the writer. */
+    local_bh_disable();
+    write_seqcount_begin(&priv->pduft_seq);
+    for (i = 0; i < n; i++) {
+        pduft_stage_install(priv, tbl, stages + i);
+    }
+    write_seqcount_end(&priv->pduft_seq);
+    local_bh_enable();
+    pduft_table_maybe_resize(priv, tbl);
+unlock:
+    mutex_unlock(&priv->pduft_lock);
+free:
+    for (i = 0; i < n; i++) {
+        pduft_stage_release(stages + i);
+    }
+    kvfree(stages);
+
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_batch);
+
+int
+rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
+{
+    return rl_pduft_del_addr(ipcp, &entry->match);
 }
 EXPORT_SYMBOL(rl_pduft_del);
 
 int
-rl_pduft_del_addr(struct ipcp_entry *ipcp, const struct rl_pci_match *match)
+rl_pduft_stats(struct ipcp_entry *ipcp, struct rl_pduft_stats *stats)
 {
-    struct rl_normal *priv    = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry = NULL;
-    int ret                   = -1;
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_table *tbl;
+    struct pduft_entry *entry;
+    unsigned int i;
+    int bucket;
 
-    write_lock_bh(&priv->pduft_lock);
-    if (match->dst_addr == RL_ADDR_NULL) {
-        /* Default entry. */
-        if (priv->pduft_dflt) {
-            flow_put(priv->pduft_dflt);
-            priv->pduft_dflt = NULL;
-            ret              = 0;
+    memset(stats, 0, sizeof(*stats));
+
+    mutex_lock(&priv->pduft_lock);
+    tbl                 = pduft_deref(priv, priv->pduft);
+    stats->type         = tbl->type;
+    stats->size         = 1U << tbl->bits;
+    stats->count        = tbl->count;
+    stats->dflt         = rcu_access_pointer(priv->pduft_dflt) != NULL;
+    stats->prefix_count = priv->trie_count;
+    for (i = 0; i < stats->size; i++) {
+        uint32_t len = 0;
+
+        if (tbl->type == RL_PDUFT_T_ARRAY) {
+            len = rcu_access_pointer(tbl->slots[i]) != NULL;
+        } else {
+            hlist_for_each_entry (entry, &tbl->buckets[i], node) {
+                len++;
+            }
         }
-    } else {
-        entry = pduft_lookup_internal(priv, match);
-        if (entry) {
-            pduft_entry_unlink(priv, entry);
-            ret = 0;
+        if (len) {
+            stats->used++;
         }
+        stats->max_chain = max(stats->max_chain, len);
     }
-    write_unlock_bh(&priv->pduft_lock);
-
-    if (entry) {
-        rl_free(entry, RL_MT_PDUFT);
+    hash_for_each(priv->pdu_ft_perflow, bucket, entry, node)
+    {
+        stats->perflow_count++;
     }
+    mutex_unlock(&priv->pduft_lock);
 
-    return ret;
+    return 0;
 }
-EXPORT_SYMBOL(rl_pduft_del_addr);
+EXPORT_SYMBOL(rl_pduft_stats);
@@ -37,11 +37,13 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/jhash.h>
 #include <asm/div64.h>
 
 #define RMTQ_MAX_SIZE (1 << 17)
 
 static LIST_HEAD(rl_pdu_schedulers);
+static LIST_HEAD(rl_cc_algorithms);
 
 /* PCI header to be used for transfer PDUs.
  * The order of the fields is extremely important, because we only
@@ -73,10 +75,28 @@ struct rina_pci_ctrl {
     rl_seq_t my_rwe; /* sent but unused */
 } __attribute__((__packed__));
 
+/* Range [start, end) of sequence numbers received beyond a gap. SACK
+ * control PDUs carry an array of blocks after the control PCI. */
+struct rina_sack_block {
+    rl_seq_t start;
+    rl_seq_t end;
+} __attribute__((__packed__));
+
+/* Maximum number of blocks in a SACK control PDU. */
+#define RL_SACK_BLOCKS_MAX 8
+
+/* A PDU reported missing by a SACK is considered lost, and retransmitted
+ * right away, when the receiver holds at least these many later PDUs. */
+#define RL_SACK_REORDER 3
+
+/* Number of duplicate ACKs that trigger the fast retransmission of the
+ * first unacknowledged PDU. */
+#define RL_DUPACK_THRESH 3
+
 static inline void
 rl_buf_pci_pop(struct rl_buf *rb)
 {
-    BUG_ON(rb->len < sizeof(struct rina_pci));
+    BUG_ON(rl_buf_headlen(rb) < sizeof(struct rina_pci));
 #ifndef RL_SKB
     rb->pci++;
     rb->len -= sizeof(struct rina_pci);
@@ -140,7 +160,7 @@ struct rl_sched_pfifo {
 
 static int
 sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
-                      rl_qosid_t num_queues)
+                      rl_qosid_t num_queues, gfp_t gfp)
 {
     struct rl_sched_pfifo *sched_priv = RL_SCHED_PRIV(sched);
     int i;
@@ -157,7 +177,7 @@ sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
     sched_priv->max_queue_size = max_queue_size;
     sched_priv->num_queues     = num_queues;
     sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
-                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+                                  gfp | __GFP_ZERO, RL_MT_SHIM);
     if (!sched_priv->queues) {
         return -ENOMEM;
     }
@@ -178,14 +198,23 @@ sched_pfifo_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
     struct rl_kmsg_ipcp_sched_pfifo *req =
         (struct rl_kmsg_ipcp_sched_pfifo *)bmsg;
 
-    return sched_pfifo_do_config(sched, req->max_queue_size, req->prio_levels);
+    return sched_pfifo_do_config(sched, req->max_queue_size, req->prio_levels,
+                                 GFP_KERNEL);
 }
 
 static int
-sched_pfifo_init(struct rl_sched *sched)
+sched_pfifo_init(struct rl_sched *sched, const struct rl_sched *tmpl,
+                 gfp_t gfp)
 {
+    if (tmpl) {
+        struct rl_sched_pfifo *tmpl_priv = RL_SCHED_PRIV(tmpl);
+
+        return sched_pfifo_do_config(sched, tmpl_priv->max_queue_size,
+                                     tmpl_priv->num_queues, gfp);
+    }
+
     return sched_pfifo_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
-                                 /*num_queues=*/1);
+                                 /*num_queues=*/1, gfp);
 }
 
 static void
@@ -287,13 +316,48 @@ struct rl_sched_wrr {
     unsigned int cur_class;
 };
 
+/* Replace the queues with 'num_queues' empty ones. Weights are left
+ * to the caller. */
+static int
+sched_wrr_build(struct rl_sched *sched, unsigned int max_queue_size,
+                unsigned int quantum, rl_qosid_t num_queues, gfp_t gfp)
+{
+    struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_queues     = num_queues;
+    sched_priv->quantum        = quantum;
+    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+                                  gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->queues) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        struct rl_sched_wrr_queue *wrrq = sched_priv->queues + i;
+
+        rb_list_init(&wrrq->q);
+        wrrq->qlen = 0;
+    }
+
+    sched_priv->cur_class = 0;
+
+    return 0;
+}
+
 static int
 sched_wrr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
                     unsigned int quantum, rl_qosid_t num_queues,
-                    unsigned int weights[])
+                    unsigned int weights[], gfp_t gfp)
 {
     struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
     unsigned int min_weight         = -1;
+    int ret;
     int i;
 
     if (quantum == 0 || num_queues == 0 || max_queue_size == 0) {
@@ -309,17 +373,9 @@ sched_wrr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
         return -1;
     }
 
-    /* Clean up the old queues (if any). */
-    sched->ops.fini(sched);
-
-    /* Build the new queues. */
-    sched_priv->max_queue_size = max_queue_size;
-    sched_priv->num_queues     = num_queues;
-    sched_priv->quantum        = quantum;
-    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
-                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
-    if (!sched_priv->queues) {
-        return -ENOMEM;
+    ret = sched_wrr_build(sched, max_queue_size, quantum, num_queues, gfp);
+    if (ret) {
+        return ret;
     }
 
     for (i = 0; i < num_queues; i++) {
@@ -332,12 +388,8 @@ sched_wrr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
         norm_weight *= quantum;
         norm_weight >>= 20;
         wrrq->weight = wrrq->credit = norm_weight;
-        rb_list_init(&wrrq->q);
-        wrrq->qlen = 0;
     }
 
-    sched_priv->cur_class = 0;
-
     return 0;
 }
 
@@ -348,17 +400,38 @@ sched_wrr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
 
     return sched_wrr_do_config(sched, req->max_queue_size, req->quantum,
                                req->weights.num_elements,
-                               req->weights.slots.dwords);
+                               req->weights.slots.dwords, GFP_KERNEL);
 }
 
 static int
-sched_wrr_init(struct rl_sched *sched)
+sched_wrr_init(struct rl_sched *sched, const struct rl_sched *tmpl, gfp_t gfp)
 {
     unsigned int weights[2] = {1, 4};
 
+    if (tmpl) {
+        struct rl_sched_wrr *tmpl_priv  = RL_SCHED_PRIV(tmpl);
+        struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
+        int ret;
+        int i;
+
+        /* Copy the normalized weights as they are. */
+        ret = sched_wrr_build(sched, tmpl_priv->max_queue_size,
+                              tmpl_priv->quantum, tmpl_priv->num_queues, gfp);
+        if (ret) {
+            return ret;
+        }
+        for (i = 0; i < tmpl_priv->num_queues; i++) {
+            struct rl_sched_wrr_queue *wrrq = sched_priv->queues + i;
+
+            wrrq->weight = wrrq->credit = tmpl_priv->queues[i].weight;
+        }
+
+        return 0;
+    }
+
     return sched_wrr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
                                /*quantum=*/2000, /*num_queues=*/2,
-                               /*weights=*/weights);
+                               /*weights=*/weights, gfp);
 }
 
 static void
@@ -456,225 +529,1528 @@ static struct rl_sched_ops rl_sched_wrr_ops = {
     .deq       = sched_wrr_deq,
 };
 
-/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
- * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
- * compiler may need to insert padding. */
-#define RL_PCI_LEN                                                             \
-    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
-     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+struct rl_sched_drr {
+    /* Array indexed by qos_id. */
+    struct rl_sched_drr_queue {
+        struct rb_list q;
+        int qlen;
+        /* Bytes added to the deficit on each round. */
+        unsigned int quantum;
+        /* Bytes that can be dequeued in the current round. */
+        unsigned int deficit;
+        /* In the list of active queues, if not empty. */
+        struct list_head node;
+    } * queues;
 
-#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+    /* Queues with at least one PDU, in round robin order. */
+    struct list_head active;
 
-/* Maximum and minimum values for the congestion control window. */
-#define RL_CGWIN_MIN 4
-#define RL_CGWIN_MAX (1U << 16)
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
 
-/* To be called under DTP lock */
-static void
-dtp_snd_reset(struct flow_entry *flow)
+    /* Number of queues (traffic classes). */
+    rl_qosid_t num_queues;
+};
+
+static int
+sched_drr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                    rl_qosid_t num_queues, const unsigned int quanta[],
+                    gfp_t gfp)
 {
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
 
-    dtp->flags |= DTP_F_DRF_SET;
-    /* InitialSeqNumPolicy */
-    dtp->next_seq_num_to_use = 0;
-    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
-    dtp->last_seq_num_sent      = -1;
-    dtp->last_ctrl_seq_num_rcvd = 0;
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
-        dtp->cgwin = RL_CGWIN_MIN;
+    if (num_queues == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
+    for (i = 0; i < num_queues; i++) {
+        if (quanta[i] == 0) {
+            return -1;
+        }
+    }
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_queues     = num_queues;
+    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+                                  gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->queues) {
+        return -ENOMEM;
+    }
+    INIT_LIST_HEAD(&sched_priv->active);
+
+    for (i = 0; i < num_queues; i++) {
+        struct rl_sched_drr_queue *drrq = sched_priv->queues + i;
+
+        rb_list_init(&drrq->q);
+        drrq->qlen    = 0;
+        drrq->quantum = quanta[i];
+        drrq->deficit = 0;
+        INIT_LIST_HEAD(&drrq->node);
     }
+
+    return 0;
 }
 
-/* To be called under DTP lock */
-static void
-dtp_rcv_reset(struct flow_entry *flow)
+static int
+sched_drr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
 {
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    struct rl_kmsg_ipcp_sched_drr *req = (struct rl_kmsg_ipcp_sched_drr *)bmsg;
 
-    dtp->flags |= DTP_F_DRF_EXPECTED;
-    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
-    dtp->max_seq_num_rcvd                               = -1;
-#if 0
-    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
-    dtp->next_snd_ctl_seq = 0;
-#endif
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
+    if (req->quanta.elem_size != sizeof(uint32_t) ||
+        req->quanta.num_elements > (rl_qosid_t)~0) {
+        /* Malformed array, or more queues than QoS ids. */
+        return -1;
     }
-    dtp->last_lwe_sent      = 0;
-    dtp->last_seq_num_acked = 0;
+
+    return sched_drr_do_config(sched, req->max_queue_size,
+                               req->quanta.num_elements,
+                               req->quanta.slots.dwords, GFP_KERNEL);
 }
 
-static void
-snd_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+static int
+sched_drr_init(struct rl_sched *sched, const struct rl_sched *tmpl, gfp_t gfp)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
+    unsigned int quanta[2] = {2000, 8000};
 
-    spin_lock_bh(&dtp->lock);
+    if (tmpl) {
+        struct rl_sched_drr *tmpl_priv = RL_SCHED_PRIV(tmpl);
+        unsigned int *tquanta;
+        int ret;
+        int i;
+
+        tquanta = rl_alloc(tmpl_priv->num_queues * sizeof(tquanta[0]), gfp,
+                           RL_MT_SHIM);
+        if (!tquanta) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < tmpl_priv->num_queues; i++) {
+            tquanta[i] = tmpl_priv->queues[i].quantum;
+        }
+        ret = sched_drr_do_config(sched, tmpl_priv->max_queue_size,
+                                  tmpl_priv->num_queues, tquanta, gfp);
+        rl_free(tquanta, RL_MT_SHIM);
 
-    del_timer(&dtp->rtx_tmr);
+        return ret;
+    }
 
-    dtp_dump(dtp);
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*num_queues=*/2, quanta, gfp);
+}
 
-    /* Re-initialize send-side state variables. */
-    dtp_snd_reset(flow);
+static void
+sched_drr_fini(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
 
-    /* Flush the retransmission queue. */
-    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        dtp->rtxq_len--;
+    if (!sched_priv->queues) {
+        return;
     }
 
-    /* Flush the closed window queue */
-    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->tx_err++;
-        dtp->cwq_len--;
+    for (i = 0; i < sched_priv->num_queues; i++) {
+        struct rl_sched_drr_queue *drrq = sched_priv->queues + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &drrq->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        drrq->qlen = 0;
     }
 
-    /* Send control ack PDU */
+    rl_free(sched_priv->queues, RL_MT_SHIM);
+}
 
-    /* Send transfer PDU with zero length. */
+static int
+sched_drr_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t qos_class =
+        min((rl_qosid_t)(sched_priv->num_queues - 1), RL_BUF_PCI(rb)->qos_id);
+    struct rl_sched_drr_queue *drrq = sched_priv->queues + qos_class;
 
-    /* Notify user flow that there has been no activity for a while */
+    if (drrq->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
 
-    spin_unlock_bh(&dtp->lock);
+    rb_list_enq(rb, &drrq->q);
+    drrq->qlen += rl_buf_truesize(rb);
+    if (list_empty(&drrq->node)) {
+        /* The queue becomes active, and joins the end of the round. */
+        drrq->deficit = 0;
+        list_add_tail(&drrq->node, &sched_priv->active);
+    }
 
-    /* Wake up processes sleeping on write(), since cwq and rtxq have been
-     * emptied. */
-    rl_write_restart_flow(flow);
+    return 0;
 }
 
-static void
-rcv_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+static struct rl_buf *
+sched_drr_deq(struct rl_sched *sched)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
-
-    spin_lock_bh(&dtp->lock);
-
-    /* Re-initialize receive-side state variables. */
-    dtp_rcv_reset(flow);
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+
+    while (!list_empty(&sched_priv->active)) {
+        struct rl_sched_drr_queue *drrq = list_first_entry(
+            &sched_priv->active, struct rl_sched_drr_queue, node);
+        struct rl_buf *rb = rb_list_front(&drrq->q);
+
+        if (rb->len > drrq->deficit) {
+            /* Not enough deficit for the head PDU: grant a quantum
+             * and move on to the next queue. */
+            drrq->deficit += drrq->quantum;
+            list_move_tail(&drrq->node, &sched_priv->active);
+            continue;
+        }
 
-    /* Flush sequencing queue. */
-    PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
         rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->rx_err++;
-        dtp->seqq_len--;
+        drrq->qlen -= rl_buf_truesize(rb);
+        BUG_ON(drrq->qlen < 0);
+        drrq->deficit -= rb->len;
+        if (rb_list_empty(&drrq->q)) {
+            /* Idle queues do not accumulate deficit. */
+            drrq->deficit = 0;
+            list_del_init(&drrq->node);
+        }
+
+        return rb;
     }
 
-    spin_unlock_bh(&dtp->lock);
+    return NULL;
 }
 
-static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+static struct rl_sched_ops rl_sched_drr_ops = {
+    .name      = "drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
 
-static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
-                                       struct flow_entry *flow,
-                                       bool ack_immediate);
+/* FQ-CoDel: PDUs are hashed on the destination address into a number
+ * of sub-queues, which are served with DRR, giving priority to the
+ * sub-queues that just became active ("new" ones). Each sub-queue
+ * runs the CoDel AQM, which drops at dequeue time when the sojourn
+ * time of the PDUs has been above 'target' for at least 'interval'. */
+/* Sub-queues are allocated for each N-1 flow, possibly in atomic
+ * context, so we keep the array reasonably small. */
+#define RL_FQ_CODEL_FLOWS_MAX 1024
+
+struct rl_sched_fq_codel {
+    struct rl_sched_fq_codel_flow {
+        struct rb_list q;
+        int qlen;
+        int deficit;
+        /* In the list of new or old sub-queues, if active. */
+        struct list_head node;
 
-static void
-a_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+        /* CoDel state. */
+        bool dropping;
+        u32 count;
+        u32 lastcount;
+        u64 first_above_ns;
+        u64 drop_next_ns;
+    } * flows;
+
+    struct list_head new_flows;
+    struct list_head old_flows;
+
+    /* Bytes queued in all the sub-queues. */
+    unsigned int backlog;
+
+    /* Maximum value of 'backlog'. */
+    unsigned int max_queue_size;
+
+    unsigned int num_flows;
+    unsigned int quantum;
+    u64 target_ns;
+    u64 interval_ns;
+};
+
+static int
+sched_fq_codel_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                         unsigned int num_flows, unsigned int target_us,
+                         unsigned int interval_us, unsigned int quantum,
+                         gfp_t gfp)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (max_queue_size == 0 || num_flows == 0 ||
+        num_flows > RL_FQ_CODEL_FLOWS_MAX || target_us == 0 ||
+        interval_us < target_us || quantum == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    /* Clean up the old sub-queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new sub-queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_flows      = num_flows;
+    sched_priv->quantum        = quantum;
+    sched_priv->target_ns      = (u64)target_us * NSEC_PER_USEC;
+    sched_priv->interval_ns    = (u64)interval_us * NSEC_PER_USEC;
+    sched_priv->backlog        = 0;
+    sched_priv->flows = rl_alloc(num_flows * sizeof(sched_priv->flows[0]),
+                                 gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->flows) {
+        return -ENOMEM;
+    }
+    INIT_LIST_HEAD(&sched_priv->new_flows);
+    INIT_LIST_HEAD(&sched_priv->old_flows);
+
+    for (i = 0; i < num_flows; i++) {
+        struct rl_sched_fq_codel_flow *flow = sched_priv->flows + i;
+
+        rb_list_init(&flow->q);
+        INIT_LIST_HEAD(&flow->node);
+    }
+
+    return 0;
+}
+
+static int
+sched_fq_codel_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_fq_codel *req =
+        (struct rl_kmsg_ipcp_sched_fq_codel *)bmsg;
+
+    return sched_fq_codel_do_config(sched, req->max_queue_size, req->flows,
+                                    req->target_us, req->interval_us,
+                                    req->quantum, GFP_KERNEL);
+}
+
+static int
+sched_fq_codel_init(struct rl_sched *sched, const struct rl_sched *tmpl,
+                    gfp_t gfp)
+{
+    if (tmpl) {
+        struct rl_sched_fq_codel *tmpl_priv = RL_SCHED_PRIV(tmpl);
+
+        return sched_fq_codel_do_config(
+            sched, tmpl_priv->max_queue_size, tmpl_priv->num_flows,
+            div_u64(tmpl_priv->target_ns, NSEC_PER_USEC),
+            div_u64(tmpl_priv->interval_ns, NSEC_PER_USEC), tmpl_priv->quantum,
+            gfp);
+    }
+
+    return sched_fq_codel_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                                    /*num_flows=*/64, /*target_us=*/5000,
+                                    /*interval_us=*/100000,
+                                    /*quantum=*/1500, gfp);
+}
+
+static void
+sched_fq_codel_fini(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (!sched_priv->flows) {
+        return;
+    }
+
+    for (i = 0; i < sched_priv->num_flows; i++) {
+        struct rl_sched_fq_codel_flow *flow = sched_priv->flows + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &flow->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        flow->qlen = 0;
+    }
+    sched_priv->backlog = 0;
+
+    rl_free(sched_priv->flows, RL_MT_SHIM);
+}
+
+static struct rl_buf *
+fq_codel_pop(struct rl_sched_fq_codel *sched_priv,
+             struct rl_sched_fq_codel_flow *flow)
+{
+    struct rl_buf *rb;
+
+    if (rb_list_empty(&flow->q)) {
+        return NULL;
+    }
+    rb = rb_list_front(&flow->q);
+    rb_list_del(rb);
+    flow->qlen -= rl_buf_truesize(rb);
+    sched_priv->backlog -= rl_buf_truesize(rb);
+
+    return rb;
+}
+
+static int
+sched_fq_codel_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    u64 dst_addr                         = (u64)RL_BUF_PCI(rb)->dst_addr;
+    struct rl_sched_fq_codel_flow *flow;
+    u32 hash;
+
+    hash = jhash_2words((u32)dst_addr, (u32)(dst_addr >> 32), 0);
+    flow = sched_priv->flows + (((u64)hash * sched_priv->num_flows) >> 32);
+
+    RL_BUF_RMT(rb).enq_ns = ktime_get_ns();
+    rb_list_enq(rb, &flow->q);
+    flow->qlen += rl_buf_truesize(rb);
+    sched_priv->backlog += rl_buf_truesize(rb);
+    if (list_empty(&flow->node)) {
+        flow->deficit = sched_priv->quantum;
+        list_add_tail(&flow->node, &sched_priv->new_flows);
+    }
+
+    while (sched_priv->backlog > sched_priv->max_queue_size) {
+        /* Over the limit: drop from the head of the fattest
+         * sub-queue, rather than refusing the new PDU, until the
+         * backlog is back under the limit. */
+        struct rl_sched_fq_codel_flow *fattest = flow;
+        unsigned int i;
+
+        for (i = 0; i < sched_priv->num_flows; i++) {
+            if (sched_priv->flows[i].qlen > fattest->qlen) {
+                fattest = sched_priv->flows + i;
+            }
+        }
+        rl_sched_drop(sched, fq_codel_pop(sched_priv, fattest));
+    }
+
+    return 0;
+}
+
+/* Decide whether the PDU that is about to leave 'flow' should be dropped,
+ * because the sojourn time has been above target for a whole interval. */
+static bool
+fq_codel_should_drop(struct rl_sched_fq_codel *sched_priv,
+                     struct rl_sched_fq_codel_flow *flow, struct rl_buf *rb,
+                     u64 now)
+{
+    if (!rb || now - RL_BUF_RMT(rb).enq_ns < sched_priv->target_ns ||
+        rb_list_empty(&flow->q)) {
+        /* Below target, or the queue only held this PDU. */
+        flow->first_above_ns = 0;
+        return false;
+    }
+
+    if (flow->first_above_ns == 0) {
+        flow->first_above_ns = now + sched_priv->interval_ns;
+        return false;
+    }
+
+    return now >= flow->first_above_ns;
+}
+
+/* The next drop happens interval/sqrt(count) after 't'. */
+static inline u64
+fq_codel_control_law(struct rl_sched_fq_codel *sched_priv, u64 t, u32 count)
+{
+    return t + div_u64(sched_priv->interval_ns, int_sqrt(count));
+}
+
+static struct rl_buf *
+fq_codel_dequeue(struct rl_sched *sched, struct rl_sched_fq_codel_flow *flow)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    u64 now                              = ktime_get_ns();
+    struct rl_buf *rb;
+    bool drop;
+
+    rb   = fq_codel_pop(sched_priv, flow);
+    drop = fq_codel_should_drop(sched_priv, flow, rb, now);
+
+    if (flow->dropping) {
+        if (!drop) {
+            /* Sojourn time went below target. */
+            flow->dropping = false;
+        } else {
+            while (flow->dropping && now >= flow->drop_next_ns) {
+                rl_sched_drop(sched, rb);
+                flow->count++;
+                rb = fq_codel_pop(sched_priv, flow);
+                if (!fq_codel_should_drop(sched_priv, flow, rb, now)) {
+                    flow->dropping = false;
+                } else {
+                    flow->drop_next_ns = fq_codel_control_law(
+                        sched_priv, flow->drop_next_ns, flow->count);
+                }
+            }
+        }
+    } else if (drop) {
+        u32 delta;
+
+        rl_sched_drop(sched, rb);
+        rb             = fq_codel_pop(sched_priv, flow);
+        flow->dropping = true;
+        /* If we were dropping recently, restart from a drop rate
+         * close to the last one. The time difference is signed, since
+         * 'drop_next_ns' may be in the future. */
+        delta       = flow->count - flow->lastcount;
+        flow->count = 1;
+        if (delta > 1 && (s64)(now - flow->drop_next_ns) <
+                             (s64)(16 * sched_priv->interval_ns)) {
+            flow->count = delta;
+        }
+        flow->lastcount    = flow->count;
+        flow->drop_next_ns = fq_codel_control_law(sched_priv, now, flow->count);
+    }
+
+    return rb;
+}
+
+static struct rl_buf *
+sched_fq_codel_deq(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+
+    for (;;) {
+        struct list_head *head = &sched_priv->new_flows;
+        struct rl_sched_fq_codel_flow *flow;
+        struct rl_buf *rb;
+
+        if (list_empty(head)) {
+            head = &sched_priv->old_flows;
+            if (list_empty(head)) {
+                return NULL;
+            }
+        }
+        flow = list_first_entry(head, struct rl_sched_fq_codel_flow, node);
+
+        if (flow->deficit <= 0) {
+            flow->deficit += sched_priv->quantum;
+            list_move_tail(&flow->node, &sched_priv->old_flows);
+            continue;
+        }
+
+        rb = fq_codel_dequeue(sched, flow);
+        if (!rb) {
+            /* A new sub-queue that empties goes through the old list
+             * once, so that it cannot starve the old ones by becoming
+             * new again right away. */
+            if (head == &sched_priv->new_flows &&
+                !list_empty(&sched_priv->old_flows)) {
+                list_move_tail(&flow->node, &sched_priv->old_flows);
+            } else {
+                list_del_init(&flow->node);
+            }
+            continue;
+        }
+
+        flow->deficit -= rb->len;
+
+        return rb;
+    }
+}
+
+static struct rl_sched_ops rl_sched_fq_codel_ops = {
+    .name      = "fq_codel",
+    .priv_size = sizeof(struct rl_sched_fq_codel),
+    .init      = sched_fq_codel_init,
+    .fini      = sched_fq_codel_fini,
+    .config    = sched_fq_codel_config,
+    .enq       = sched_fq_codel_enq,
+    .deq       = sched_fq_codel_deq,
+};
+
+/* HTB: a hierarchy of token-bucket classes shapes the traffic towards
+ * each N-1 flow. Every RMT output queue has its own instance, so the
+ * rates and ceils cap each N-1 flow separately, and not the aggregate
+ * of the IPCP. Leaf classes queue the PDUs of a QoS id. A class can
+ * always send within its 'rate', and above that it can borrow the
+ * unused rate of its ancestors, up to its 'ceil'. Among the leaves that
+ * can send, those that borrow from fewer levels up go first, and leaves
+ * at the same level are served in round robin. When no leaf can send,
+ * deq() tells the RMT when to try again. The buckets hold nanoseconds
+ * of transmission time. */
+#define RL_HTB_DEPTH_MAX 8
+
+/* Bound on the debt of a class, so that a class which lent a lot to
+ * its children recovers quickly once they go idle. */
+#define RL_HTB_DEBT_MAX_NS ((s64)NSEC_PER_SEC)
+
+struct rl_sched_htb {
+    struct rl_sched_htb_class {
+        /* Configuration, with the defaults filled in. */
+        struct rl_htb_class cfg;
+        struct rl_sched_htb_class *parent;
+        unsigned int depth;
+        bool leaf;
+
+        /* Token buckets for 'rate' and 'ceil', in nanoseconds. Both
+         * are refilled with the elapsed time. */
+        s64 tokens;
+        s64 ctokens;
+        s64 buffer;
+        s64 cbuffer;
+
+        /* The queue of a leaf class. */
+        struct rb_list q;
+        int qlen;
+        /* In the list of active leaves, if not empty. */
+        struct list_head node;
+    } * classes;
+
+    /* Leaf classes with at least one PDU, in round robin order. */
+    struct list_head active;
+
+    /* Last time the buckets were refilled. */
+    u64 t_c;
+
+    /* Leaf class for the PDUs with an unknown QoS id. */
+    struct rl_sched_htb_class *dflt;
+
+    /* Maximum size of each leaf queue, in bytes. */
+    unsigned int max_queue_size;
+
+    unsigned int num_classes;
+};
+
+/* Transmission time of 'bytes' at 'rate' bytes per second. */
+static inline s64
+htb_ns(u64 bytes, u32 rate)
+{
+    return div_u64(bytes * NSEC_PER_SEC, rate);
+}
+
+static int
+sched_htb_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                    unsigned int default_class,
+                    const struct rl_htb_class *cls, unsigned int n,
+                    gfp_t gfp)
+{
+    struct rl_sched_htb *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_htb_class *classes;
+    struct rl_sched_htb_class *dflt = NULL;
+    unsigned int i, j;
+
+    if (max_queue_size == 0 || n == 0 || n > RL_HTB_CLASSES_MAX) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    classes = rl_alloc(n * sizeof(classes[0]), gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!classes) {
+        return -ENOMEM;
+    }
+
+    /* Build the hierarchy. Parents come before their children, so
+     * that there cannot be cycles. */
+    for (i = 0; i < n; i++) {
+        struct rl_sched_htb_class *c = classes + i;
+
+        c->cfg = cls[i];
+        if (c->cfg.ceil == 0) {
+            c->cfg.ceil = c->cfg.rate;
+        }
+        if (c->cfg.burst == 0) {
+            /* 10 milliseconds worth of ceil. */
+            c->cfg.burst = max(c->cfg.ceil / 100, 2048U);
+        }
+        if (c->cfg.id == 0 || c->cfg.rate == 0 ||
+            c->cfg.ceil < c->cfg.rate) {
+            goto err;
+        }
+        for (j = 0; j < i; j++) {
+            if (classes[j].cfg.id == c->cfg.id) {
+                goto err;
+            }
+            if (classes[j].cfg.id == c->cfg.parent) {
+                c->parent = classes + j;
+            }
+        }
+        c->leaf = true;
+        if (c->cfg.parent) {
+            if (!c->parent) {
+                goto err;
+            }
+            c->parent->leaf = false;
+            c->depth        = c->parent->depth + 1;
+            if (c->depth >= RL_HTB_DEPTH_MAX) {
+                goto err;
+            }
+        }
+        c->buffer  = htb_ns(c->cfg.burst, c->cfg.rate);
+        c->cbuffer = htb_ns(c->cfg.burst, c->cfg.ceil);
+        c->tokens  = c->buffer;
+        c->ctokens = c->cbuffer;
+        rb_list_init(&c->q);
+        INIT_LIST_HEAD(&c->node);
+    }
+
+    /* Each leaf must serve a different QoS id. */
+    for (i = 0; i < n; i++) {
+        if (!classes[i].leaf) {
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (classes[j].leaf &&
+                classes[j].cfg.qos_id == classes[i].cfg.qos_id) {
+                goto err;
+            }
+        }
+        if (default_class ? classes[i].cfg.id == default_class : !dflt) {
+            dflt = classes + i;
+        }
+    }
+    if (!dflt) {
+        /* The default class is not a leaf. */
+        goto err;
+    }
+
+    /* Clean up the old classes (if any). */
+    sched->ops.fini(sched);
+
+    sched_priv->classes        = classes;
+    sched_priv->num_classes    = n;
+    sched_priv->dflt           = dflt;
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->t_c            = ktime_get_ns();
+    INIT_LIST_HEAD(&sched_priv->active);
+
+    return 0;
+err:
+    rl_free(classes, RL_MT_SHIM);
+    return -1;
+}
+
+static int
+sched_htb_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_htb *req = (struct rl_kmsg_ipcp_sched_htb *)bmsg;
+
+    if (req->classes.num_elements &&
+        req->classes.elem_size != sizeof(struct rl_htb_class)) {
+        return -1;
+    }
+
+    return sched_htb_do_config(sched, req->max_queue_size,
+                               req->default_class, req->classes.slots.raw,
+                               req->classes.num_elements, GFP_KERNEL);
+}
+
+static int
+sched_htb_init(struct rl_sched *sched, const struct rl_sched *tmpl, gfp_t gfp)
+{
+    /* A single class, which does not shape in practice. */
+    struct rl_htb_class root = {.id = 1, .rate = U32_MAX};
+
+    if (tmpl) {
+        struct rl_sched_htb *tmpl_priv = RL_SCHED_PRIV(tmpl);
+        struct rl_htb_class *cls;
+        int ret;
+        int i;
+
+        cls = rl_alloc(tmpl_priv->num_classes * sizeof(cls[0]), gfp,
+                       RL_MT_SHIM);
+        if (!cls) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < tmpl_priv->num_classes; i++) {
+            cls[i] = tmpl_priv->classes[i].cfg;
+        }
+        ret = sched_htb_do_config(sched, tmpl_priv->max_queue_size,
+                                  tmpl_priv->dflt->cfg.id, cls,
+                                  tmpl_priv->num_classes, gfp);
+        rl_free(cls, RL_MT_SHIM);
+
+        return ret;
+    }
+
+    return sched_htb_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*default_class=*/0, &root, 1, gfp);
+}
+
+static void
+sched_htb_fini(struct rl_sched *sched)
+{
+    struct rl_sched_htb *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (!sched_priv->classes) {
+        return;
+    }
+
+    for (i = 0; i < sched_priv->num_classes; i++) {
+        struct rl_sched_htb_class *c = sched_priv->classes + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &c->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        c->qlen = 0;
+    }
+
+    rl_free(sched_priv->classes, RL_MT_SHIM);
+    sched_priv->classes = NULL;
+}
+
+static int
+sched_htb_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_htb *sched_priv = RL_SCHED_PRIV(sched);
+    rlm_qosid_t qos_id              = RL_BUF_PCI(rb)->qos_id;
+    struct rl_sched_htb_class *leaf = sched_priv->dflt;
+    int i;
+
+    for (i = 0; i < sched_priv->num_classes; i++) {
+        struct rl_sched_htb_class *c = sched_priv->classes + i;
+
+        if (c->leaf && c->cfg.qos_id == qos_id) {
+            leaf = c;
+            break;
+        }
+    }
+
+    if (leaf->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
+
+    rb_list_enq(rb, &leaf->q);
+    leaf->qlen += rl_buf_truesize(rb);
+    if (list_empty(&leaf->node)) {
+        list_add_tail(&leaf->node, &sched_priv->active);
+    }
+
+    return 0;
+}
+
+/* Refill the buckets of all the classes up to 'now'. */
+static void
+htb_refill(struct rl_sched_htb *sched_priv, u64 now)
+{
+    s64 elapsed = (s64)(now - sched_priv->t_c);
+    int i;
+
+    sched_priv->t_c = now;
+    for (i = 0; i < sched_priv->num_classes; i++) {
+        struct rl_sched_htb_class *c = sched_priv->classes + i;
+
+        c->tokens  = min(c->tokens + elapsed, c->buffer);
+        c->ctokens = min(c->ctokens + elapsed, c->cbuffer);
+    }
+}
+
+/* Find the class that 'leaf' can send from: the leaf itself if it has
+ * rate tokens, otherwise the closest ancestor with rate tokens, as long
+ * as no class along the way is over its ceil. Returns the level of
+ * that class (0 for the leaf), or -1 if there is none. In the latter
+ * case '*wait' is set to the time until the leaf may be able to send. */
+static int
+htb_leaf_level(const struct rl_sched_htb_class *leaf, s64 *wait)
+{
+    const struct rl_sched_htb_class *c;
+    s64 cwait = 0;
+    int level = 0;
+
+    *wait = S64_MAX;
+    for (c = leaf; c; c = c->parent, level++) {
+        s64 w;
+
+        cwait = max(cwait, -c->ctokens);
+        w     = max(cwait, -c->tokens);
+        if (w <= 0) {
+            return level;
+        }
+        *wait = min(*wait, w);
+    }
+
+    return -1;
+}
+
+static struct rl_buf *
+sched_htb_deq(struct rl_sched *sched)
+{
+    struct rl_sched_htb *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_htb_class *best = NULL;
+    struct rl_sched_htb_class *leaf, *c;
+    int best_level = RL_HTB_DEPTH_MAX;
+    u64 now        = ktime_get_ns();
+    s64 wait       = S64_MAX;
+    struct rl_buf *rb;
+
+    sched->next_ns = 0;
+    if (list_empty(&sched_priv->active)) {
+        return NULL;
+    }
+
+    htb_refill(sched_priv, now);
+    list_for_each_entry (leaf, &sched_priv->active, node) {
+        s64 lwait;
+        int level = htb_leaf_level(leaf, &lwait);
+
+        if (level < 0) {
+            wait = min(wait, lwait);
+        } else if (level < best_level) {
+            best       = leaf;
+            best_level = level;
+            if (level == 0) {
+                break;
+            }
+        }
+    }
+
+    if (!best) {
+        /* All the active leaves are out of tokens. */
+        sched->next_ns = now + max_t(s64, wait, NSEC_PER_USEC);
+        return NULL;
+    }
+
+    rb = rb_list_front(&best->q);
+    rb_list_del(rb);
+    best->qlen -= rl_buf_truesize(rb);
+    BUG_ON(best->qlen < 0);
+
+    /* Charge the leaf and all its ancestors. */
+    for (c = best; c; c = c->parent) {
+        c->tokens  = max(c->tokens - htb_ns(rb->len, c->cfg.rate),
+                         -RL_HTB_DEBT_MAX_NS);
+        c->ctokens = max(c->ctokens - htb_ns(rb->len, c->cfg.ceil),
+                         -RL_HTB_DEBT_MAX_NS);
+    }
+
+    /* Round robin among the active leaves. */
+    if (rb_list_empty(&best->q)) {
+        list_del_init(&best->node);
+    } else {
+        list_move_tail(&best->node, &sched_priv->active);
+    }
+
+    return rb;
+}
+
+static struct rl_sched_ops rl_sched_htb_ops = {
+    .name      = "htb",
+    .priv_size = sizeof(struct rl_sched_htb),
+    .init      = sched_htb_init,
+    .fini      = sched_htb_fini,
+    .config    = sched_htb_config,
+    .enq       = sched_htb_enq,
+    .deq       = sched_htb_deq,
+};
+
+/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
+ * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
+ * compiler may need to insert padding. */
+#define RL_PCI_LEN                                                             \
+    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
+     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+
+#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+
+/* Maximum and minimum values for the congestion control window. */
+#define RL_CGWIN_MIN 4
+#define RL_CGWIN_MAX (1U << 16)
+
+/* To be called under DTP lock, after each congestion control callback. */
+static inline void
+dtp_cgwin_clamp(struct dtp *dtp)
+{
+    dtp->cgwin = clamp_t(unsigned, dtp->cgwin, RL_CGWIN_MIN, RL_CGWIN_MAX);
+}
+
+/* AIMD: the window is doubled on each ACK until the first retransmission
+ * in the IPCP, then it grows linearly. It is halved on loss. */
+static void
+cc_aimd_init(struct flow_entry *flow)
+{
+}
+
+static void
+cc_aimd_ack(struct flow_entry *flow, unsigned int acked, u32 rtt_us)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+
+    if (stats->rtx_pkt) {
+        dtp->cgwin++;
+    } else {
+        dtp->cgwin <<= 1;
+    }
+}
+
+static void
+cc_aimd_loss(struct flow_entry *flow)
+{
+    flow->dtp.cgwin >>= 1;
+}
+
+static struct rl_cc_ops rl_cc_aimd_ops = {
+    .name    = "aimd",
+    .init    = cc_aimd_init,
+    .ack     = cc_aimd_ack,
+    .loss    = cc_aimd_loss,
+    .timeout = cc_aimd_loss,
+};
+
+/* CUBIC (RFC 8312): after a loss the window follows a cubic function of
+ * the time elapsed, which is concave up to the window at which the loss
+ * happened and then convex, probing for more bandwidth. Unlike AIMD, the
+ * growth does not depend on the RTT, so that paths with a large
+ * bandwidth-delay product can be filled. Time is measured in units of
+ * 2^-RL_CUBIC_HZ seconds, and the constants are scaled by 2^10. */
+#define RL_CUBIC_HZ 10
+#define RL_CUBIC_C 410    /* 0.4 */
+#define RL_CUBIC_BETA 717 /* 0.7 */
+/* Bound on |t - K|, so that the cube does not overflow (256 seconds). */
+#define RL_CUBIC_OFFS_MAX (1ULL << (8 + RL_CUBIC_HZ))
+
+struct rl_cc_cubic {
+    u32 ssthresh;
+    u32 w_max;      /* window before the last reduction */
+    u32 origin;     /* origin point of the cubic function */
+    u32 k;          /* time needed to reach the origin point */
+    u32 ack_cnt;    /* PDUs acked since the last window increment */
+    u32 min_rtt_us; /* minimum RTT observed */
+    u64 epoch_ns;   /* start of the current epoch, or zero */
+};
+
+/* Integer cube root, bit by bit. */
+static u32
+cc_cubic_root(u64 x)
+{
+    u64 y = 0;
+    u64 b;
+    int s;
+
+    for (s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+
+    return (u32)y;
+}
+
+static void
+cc_cubic_init(struct flow_entry *flow)
+{
+    struct rl_cc_cubic *c = RL_CC_PRIV(&flow->dtp);
+
+    memset(c, 0, sizeof(*c));
+    c->ssthresh = RL_CGWIN_MAX;
+}
+
+static void
+cc_cubic_ack(struct flow_entry *flow, unsigned int acked, u32 rtt_us)
+{
+    struct dtp *dtp       = &flow->dtp;
+    struct rl_cc_cubic *c = RL_CC_PRIV(dtp);
+    u64 now               = ktime_get_ns();
+    u64 t, offs, delta, target;
+    u32 cnt;
+
+    if (!acked) {
+        return;
+    }
+
+    if (rtt_us && (!c->min_rtt_us || rtt_us < c->min_rtt_us)) {
+        c->min_rtt_us = rtt_us;
+    }
+
+    if (dtp->cgwin < c->ssthresh) {
+        /* Slow start. */
+        dtp->cgwin += acked;
+        return;
+    }
+
+    if (!c->epoch_ns) {
+        /* A new congestion avoidance epoch. */
+        c->epoch_ns = now;
+        c->ack_cnt  = 0;
+        if (dtp->cgwin < c->w_max) {
+            c->k = cc_cubic_root(((1ULL << (10 + 3 * RL_CUBIC_HZ)) /
+                                  RL_CUBIC_C) *
+                                 (c->w_max - dtp->cgwin));
+            c->origin = c->w_max;
+        } else {
+            c->k      = 0;
+            c->origin = dtp->cgwin;
+        }
+    }
+
+    /* Target window one RTT from now: W(t) = C * (t - K)^3 + W_max. */
+    t = div_u64((now - c->epoch_ns + (u64)c->min_rtt_us * NSEC_PER_USEC)
+                    << RL_CUBIC_HZ,
+                NSEC_PER_SEC);
+    offs  = min_t(u64, t < c->k ? c->k - t : t - c->k, RL_CUBIC_OFFS_MAX);
+    delta = (RL_CUBIC_C * offs * offs * offs) >> (10 + 3 * RL_CUBIC_HZ);
+    if (t >= c->k) {
+        target = c->origin + delta;
+    } else {
+        target = delta < c->origin ? c->origin - delta : 0;
+    }
+
+    /* Increment the window by one every 'cnt' acked PDUs, so that it
+     * reaches the target in one RTT. */
+    if (target > dtp->cgwin) {
+        cnt = dtp->cgwin /
+              (u32)min_t(u64, target - dtp->cgwin, dtp->cgwin);
+    } else {
+        cnt = 100 * dtp->cgwin;
+    }
+    if (!cnt) {
+        cnt = 1;
+    }
+
+    c->ack_cnt += acked;
+    if (c->ack_cnt >= cnt) {
+        dtp->cgwin += c->ack_cnt / cnt;
+        c->ack_cnt %= cnt;
+    }
+}
+
+static void
+cc_cubic_loss(struct flow_entry *flow)
+{
+    struct dtp *dtp       = &flow->dtp;
+    struct rl_cc_cubic *c = RL_CC_PRIV(dtp);
+
+    c->epoch_ns = 0;
+    /* Fast convergence: a flow that lost before reaching its previous
+     * maximum releases some bandwidth to the newcomers. */
+    if (dtp->cgwin < c->w_max) {
+        c->w_max = (dtp->cgwin * (1024 + RL_CUBIC_BETA)) >> 11;
+    } else {
+        c->w_max = dtp->cgwin;
+    }
+    dtp->cgwin  = (dtp->cgwin * RL_CUBIC_BETA) >> 10;
+    c->ssthresh = max_t(u32, dtp->cgwin, RL_CGWIN_MIN);
+}
+
+static void
+cc_cubic_timeout(struct flow_entry *flow)
+{
+    /* Restart from slow start, up to the reduced window. */
+    cc_cubic_loss(flow);
+    flow->dtp.cgwin = RL_CGWIN_MIN;
+}
+
+static struct rl_cc_ops rl_cc_cubic_ops = {
+    .name    = "cubic",
+    .init    = cc_cubic_init,
+    .ack     = cc_cubic_ack,
+    .loss    = cc_cubic_loss,
+    .timeout = cc_cubic_timeout,
+};
+
+/* Vegas: a delay-based algorithm. Once per round trip, the minimum RTT
+ * observed in the round is compared to the base RTT of the path, to
+ * estimate how many PDUs of the flow are sitting in the queues. The
+ * window grows linearly while less than RL_VEGAS_ALPHA PDUs are queued,
+ * and shrinks when more than RL_VEGAS_BETA are, so that queues (and
+ * latency) stay small. Losses are handled as in AIMD. */
+#define RL_VEGAS_ALPHA 2
+#define RL_VEGAS_BETA 4
+#define RL_VEGAS_GAMMA 1 /* slow start threshold */
+
+struct rl_cc_vegas {
+    u32 base_rtt_us;     /* minimum RTT ever observed */
+    u32 min_rtt_us;      /* minimum RTT in the current round */
+    rlm_seq_t round_end; /* the round ends when this is acked */
+    bool slow_start;
+};
+
+static void
+cc_vegas_init(struct flow_entry *flow)
+{
+    struct rl_cc_vegas *v = RL_CC_PRIV(&flow->dtp);
+
+    memset(v, 0, sizeof(*v));
+    v->slow_start = true;
+}
+
+static void
+cc_vegas_ack(struct flow_entry *flow, unsigned int acked, u32 rtt_us)
+{
+    struct dtp *dtp       = &flow->dtp;
+    struct rl_cc_vegas *v = RL_CC_PRIV(dtp);
+    u32 queued;
+
+    if (rtt_us) {
+        if (!v->base_rtt_us || rtt_us < v->base_rtt_us) {
+            v->base_rtt_us = rtt_us;
+        }
+        if (!v->min_rtt_us || rtt_us < v->min_rtt_us) {
+            v->min_rtt_us = rtt_us;
+        }
+    }
+
+    if (!acked || dtp->last_ack_rcvd < v->round_end) {
+        return;
+    }
+
+    /* A round trip has elapsed. */
+    v->round_end = dtp->next_seq_num_to_use;
+    if (!v->min_rtt_us) {
+        /* No RTT samples in this round. */
+        return;
+    }
+
+    /* (expected rate - actual rate) * base RTT */
+    queued = div_u64((u64)dtp->cgwin * (v->min_rtt_us - v->base_rtt_us),
+                     v->min_rtt_us);
+    v->min_rtt_us = 0;
+
+    if (v->slow_start) {
+        if (queued > RL_VEGAS_GAMMA) {
+            /* Leave slow start, with the window that matches the
+             * actual rate. */
+            v->slow_start = false;
+            dtp->cgwin -= queued - RL_VEGAS_GAMMA;
+        } else {
+            dtp->cgwin <<= 1;
+        }
+    } else if (queued < RL_VEGAS_ALPHA) {
+        dtp->cgwin++;
+    } else if (queued > RL_VEGAS_BETA) {
+        dtp->cgwin--;
+    }
+}
+
+static void
+cc_vegas_loss(struct flow_entry *flow)
+{
+    struct rl_cc_vegas *v = RL_CC_PRIV(&flow->dtp);
+
+    v->slow_start = false;
+    flow->dtp.cgwin >>= 1;
+}
+
+static struct rl_cc_ops rl_cc_vegas_ops = {
+    .name    = "vegas",
+    .init    = cc_vegas_init,
+    .ack     = cc_vegas_ack,
+    .loss    = cc_vegas_loss,
+    .timeout = cc_vegas_loss,
+};
+
+static const struct rl_cc_ops *
+rl_cc_lookup(const char *name)
+{
+    struct rl_cc_ops *cur;
+
+    if (!name[0]) {
+        return &rl_cc_aimd_ops;
+    }
+
+    list_for_each_entry (cur, &rl_cc_algorithms, node) {
+        if (!strncmp(name, cur->name, RL_CC_NAME_MAX)) {
+            return cur;
+        }
+    }
+
+    return NULL;
+}
+
+/* To be called under DTP lock */
+static void
+dtp_snd_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_SET;
+    /* InitialSeqNumPolicy */
+    dtp->next_seq_num_to_use = 0;
+    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
+    dtp->last_seq_num_sent      = -1;
+    dtp->last_ctrl_seq_num_rcvd = 0;
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
+        dtp->cgwin = RL_CGWIN_MIN;
+    }
+    dtp->cc->init(flow);
+    dtp->rtx_recover   = 0;
+    dtp->last_ack_rcvd = 0;
+    dtp->dup_acks      = 0;
+    dtp->rack_end      = 0;
+    dtp->flags &= ~DTP_F_TLP_OUT;
+}
+
+/* To be called under DTP lock */
+static void
+dtp_rcv_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_EXPECTED;
+    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
+    dtp->max_seq_num_rcvd                               = -1;
+#if 0
+    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
+    dtp->next_snd_ctl_seq = 0;
+#endif
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
+    }
+    dtp->last_lwe_sent      = 0;
+    dtp->last_seq_num_acked = 0;
+}
+
+static void
+snd_inact_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *rb, *tmp;
+
+    spin_lock_bh(&dtp->lock);
+
+    rl_hrtimer_cancel(&dtp->rtx_tmr);
+    rl_hrtimer_cancel(&dtp->tlp_tmr);
+
+    dtp_dump(dtp);
+
+    /* Re-initialize send-side state variables. */
+    dtp_snd_reset(flow);
+
+    /* Flush the retransmission queue. */
+    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        dtp->rtxq_len--;
+    }
+    INIT_LIST_HEAD(&dtp->rtxq_exp);
+
+    /* Flush the closed window queue */
+    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        stats->tx_err++;
+        dtp->cwq_len--;
+    }
+
+    /* Send control ack PDU */
+
+    /* Send transfer PDU with zero length. */
+
+    /* Notify user flow that there has been no activity for a while */
+
+    spin_unlock_bh(&dtp->lock);
+
+    /* Wake up processes sleeping on write(), since cwq and rtxq have been
+     * emptied. */
+    rl_write_restart_flow(flow);
+}
+
+static void
+rcv_inact_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *rb, *tmp;
+
+    spin_lock_bh(&dtp->lock);
+
+    /* Re-initialize receive-side state variables. */
+    dtp_rcv_reset(flow);
+
+    /* Flush sequencing queue. */
+    PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        stats->rx_err++;
+        dtp->seqq_len--;
+    }
+
+    spin_unlock_bh(&dtp->lock);
+}
+
+static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+
+static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
+                                       struct flow_entry *flow,
+                                       bool ack_immediate);
+
+static void
+a_tmr_cb(struct rl_hrtimer *tmr)
+{
+    struct flow_entry *flow = container_of(tmr, struct flow_entry, dtp.a_tmr);
+    struct ipcp_entry *ipcp = flow->txrx.ipcp;
+    struct dtp *dtp         = &flow->dtp;
+    struct rl_buf *crb;
+
+    RPV(1, "A tmr callback\n");
+
+    spin_lock_bh(&dtp->lock);
+    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
+    spin_unlock_bh(&dtp->lock);
+
+    if (crb) {
+        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    }
+}
+
+/*
+ * Compute the RTX timeout interval using the estimate of RTT mean
+ * and standard deviation. However, we have to make sure that the
+ * interval is bigger than the A timeout interval by a good margin, otherwise
+ * the sender will incur into unnecessary retransmits.
+ */
+static void
+dtp_rto_update(struct flow_entry *flow)
+{
+    struct dtp *dtp = &flow->dtp;
+    u32 x           = dtp->rtt_us + (dtp->rtt_stddev_us << 1);
+    u32 two_a       = flow->cfg.dtcp.initial_a * 2 * USEC_PER_MSEC;
+
+    dtp->rto_us = x > two_a ? x : two_a;
+}
+
+/* The RTX timeout interval in nanoseconds. */
+static inline u64
+rtt_to_rtx(struct flow_entry *flow)
+{
+    return (u64)flow->dtp.rto_us * NSEC_PER_USEC;
+}
+
+/* Insert an rtxq entry in the list sorted by expiration time. Expiration
+ * times are mostly increasing, so we scan from the tail, which is usually
+ * the right place. Called under DTP lock. */
+static void
+rtxq_exp_insert(struct dtp *dtp, struct rl_buf *rb)
+{
+    struct list_head *pos;
+
+    list_for_each_prev (pos, &dtp->rtxq_exp) {
+        if (RL_BUF_RTX(rb).rtx_ns >=
+            RL_BUF_RTX(RL_BUF_RTX_EXP_ENTRY(pos)).rtx_ns) {
+            break;
+        }
+    }
+    list_add(&RL_BUF_RTX(rb).exp_node, pos);
+}
+
+/* Point the rtx timer to the earliest expiration time, or stop it if
+ * the rtxq is empty. Called under DTP lock. */
+static void
+rtx_tmr_update(struct dtp *dtp)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.a_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
-    struct rl_buf *crb;
+    struct rl_buf *rb;
 
-    RPV(1, "A tmr callback\n");
+    if (list_empty(&dtp->rtxq_exp)) {
+        /* Everything has been acked, we can stop the rtx timer. */
+        rl_hrtimer_cancel(&dtp->rtx_tmr);
+        return;
+    }
+    rb = RL_BUF_RTX_EXP_ENTRY(dtp->rtxq_exp.next);
+    NPD("Forward rtx timer to %llu ns\n",
+        (long long unsigned)RL_BUF_RTX(rb).rtx_ns);
+    rl_hrtimer_start(&dtp->rtx_tmr, RL_BUF_RTX(rb).rtx_ns);
+}
 
-    spin_lock_bh(&dtp->lock);
-    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
-    spin_unlock_bh(&dtp->lock);
+/* Clone 'rb' from the rtxq into 'rrbq' for an immediate retransmission,
+ * restarting its timer. Returns true on success. Called under DTP lock. */
+static bool
+dtp_rtx_now(struct flow_entry *flow, struct rl_buf *rb, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    u64 now                     = ktime_get_ns();
+    struct rl_buf *crb;
 
-    if (crb) {
-        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    /* Invalidate RL_BUF_RTX(rb).sent_ns, so that RTT is not updated
+     * on retransmitted packets. */
+    RL_BUF_RTX(rb).rtx_ns  = now + rtt_to_rtx(flow);
+    RL_BUF_RTX(rb).xmit_ns = now;
+    RL_BUF_RTX(rb).sent_ns = 0;
+    RL_BUF_RTX(rb).flags |= RL_RTX_F_RTX;
+    list_del(&RL_BUF_RTX(rb).exp_node);
+    rtxq_exp_insert(&flow->dtp, rb);
+
+    crb = rl_buf_clone(rb, GFP_ATOMIC);
+    if (unlikely(!crb)) {
+        RPV(1, "Out of memory\n");
+        return false;
     }
+    rb_list_enq(crb, rrbq);
+    stats->rtx_pkt++;
+    stats->rtx_byte += rb->len;
+
+    return true;
 }
 
-/*
- * Compute the RTX timeout interval using the estimate of RTT mean
- * and standard deviation. However, we have to make sure that the
- * interval is bigger than the A timeout interval by a good margin, otherwise
- * the sender will incur into unnecessary retransmits.
- */
-static inline unsigned long
-rtt_to_rtx(struct flow_entry *flow)
+/* Start (or restart) the tail loss probe timer, unless the rtx timer is
+ * going to expire first. The probe timeout is two RTTs, plus the A timer
+ * if a single PDU is in flight, since the receiver may delay the ACK.
+ * Called under DTP lock. */
+static void
+dtp_tlp_arm(struct flow_entry *flow)
 {
-    struct dtp *dtp    = &flow->dtp;
-    unsigned long x    = dtp->rtt + (dtp->rtt_stddev << 1);
-    unsigned int two_a = flow->cfg.dtcp.initial_a << 1;
+    struct dtp *dtp = &flow->dtp;
+    u64 exp;
+
+    if (rb_list_empty(&dtp->rtxq) || (dtp->flags & DTP_F_TLP_OUT)) {
+        rl_hrtimer_cancel(&dtp->tlp_tmr);
+        return;
+    }
 
-    return x > (two_a) ? x : (two_a);
+    exp = ktime_get_ns() +
+          max_t(u64, (u64)dtp->rtt_us * 2 * NSEC_PER_USEC, NSEC_PER_USEC);
+    if (dtp->rtxq_len == 1) {
+        exp += (u64)flow->cfg.dtcp.initial_a * NSEC_PER_MSEC;
+    }
+    if (rl_hrtimer_pending(&dtp->rtx_tmr) &&
+        exp >= rl_hrtimer_expires_ns(&dtp->rtx_tmr)) {
+        rl_hrtimer_cancel(&dtp->tlp_tmr);
+        return;
+    }
+    rl_hrtimer_start(&dtp->tlp_tmr, exp);
 }
 
 static void
-rtx_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+rtx_tmr_cb(struct rl_hrtimer *tmr)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rtx_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = container_of(tmr, struct flow_entry, dtp.rtx_tmr);
     struct ipcp_entry *ipcp     = flow->txrx.ipcp;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct dtp *dtp             = &flow->dtp;
+    u64 now                     = ktime_get_ns();
     struct rl_buf *rb, *crb, *tmp;
-    long unsigned next_exp = ~0U;
-    bool next_exp_set      = false;
+    struct list_head *pos, *n;
+    struct list_head due;
     struct rb_list rrbq;
 
     rb_list_init(&rrbq);
+    INIT_LIST_HEAD(&due);
 
     spin_lock_bh(&dtp->lock);
 
@@ -683,16 +2059,30 @@ rtx_tmr_cb(
      * retransmissions. */
     del_timer(&dtp->snd_inact_tmr);
 
-    /* We scan all the elements in the retransmission list, since they are
-     * sorted by ascending sequence number, and not by ascending expiration
-     * time. */
-    rb_list_foreach (rb, &dtp->rtxq) {
-        if (!time_before(jiffies, RL_BUF_RTX(rb).rtx_jiffies)) {
+    /* Visit only the entries that expired, using the list sorted by
+     * ascending expiration time. They are moved to a temporary list and
+     * put back once their expiration time has been updated, so that each
+     * one is processed once. */
+    while (!list_empty(&dtp->rtxq_exp)) {
+        rb = RL_BUF_RTX_EXP_ENTRY(dtp->rtxq_exp.next);
+        if (now < RL_BUF_RTX(rb).rtx_ns) {
+            break;
+        }
+        list_move_tail(&RL_BUF_RTX(rb).exp_node, &due);
+
+        if (RL_BUF_RTX(rb).flags & RL_RTX_F_SACKED) {
+            /* The receiver already holds this rb, there is no need
+             * to send it again. */
+            RL_BUF_RTX(rb).rtx_ns += rtt_to_rtx(flow);
+            stats->rtx_avoided++;
+        } else {
             /* This rb should be retransmitted. We also invalidate
-             * RL_BUF_RTX(rb).jiffies, so that RTT is not updated on
+             * RL_BUF_RTX(rb).sent_ns, so that RTT is not updated on
              * retransmitted packets. */
-            RL_BUF_RTX(rb).rtx_jiffies += rtt_to_rtx(flow);
-            RL_BUF_RTX(rb).jiffies = 0;
+            RL_BUF_RTX(rb).rtx_ns += rtt_to_rtx(flow);
+            RL_BUF_RTX(rb).xmit_ns = now;
+            RL_BUF_RTX(rb).sent_ns = 0;
+            RL_BUF_RTX(rb).flags |= RL_RTX_F_RTX;
 
             crb = rl_buf_clone(rb, GFP_ATOMIC);
             if (unlikely(!crb)) {
@@ -703,25 +2093,24 @@ rtx_tmr_cb(
                 stats->rtx_byte += rb->len;
             }
         }
-        if (!next_exp_set ||
-            time_before(RL_BUF_RTX(rb).rtx_jiffies, next_exp)) {
-            next_exp     = RL_BUF_RTX(rb).rtx_jiffies;
-            next_exp_set = true;
-        }
+    }
+    list_for_each_safe (pos, n, &due) {
+        list_del(pos);
+        rtxq_exp_insert(dtp, RL_BUF_RTX_EXP_ENTRY(pos));
     }
 
     if (!rb_list_empty(&rrbq)) {
-        /* Halve the congestion window on retransmission. */
-        dtp->cgwin >>= 1;
-        if (unlikely(dtp->cgwin < RL_CGWIN_MIN)) {
-            dtp->cgwin = RL_CGWIN_MIN;
-        }
+        /* Reduce the congestion window on retransmission, and start a
+         * new loss episode, which fast recovery must not count twice. */
+        dtp->cc->timeout(flow);
+        dtp_cgwin_clamp(dtp);
+        dtp->rtx_recover = dtp->next_seq_num_to_use;
+        dtp->dup_acks    = 0;
+        dtp->flags &= ~DTP_F_TLP_OUT;
     }
 
-    if (next_exp_set) {
-        NPD("Forward rtx timer by %u\n", jiffies_to_msecs(next_exp - jiffies));
-        mod_timer(&dtp->rtx_tmr, next_exp);
-    }
+    rtx_tmr_update(dtp);
+    dtp_tlp_arm(flow);
 
     spin_unlock_bh(&dtp->lock);
 
@@ -739,6 +2128,42 @@ rtx_tmr_cb(
     spin_unlock_bh(&dtp->lock);
 }
 
+static void
+tlp_tmr_cb(struct rl_hrtimer *tmr)
+{
+    struct flow_entry *flow = container_of(tmr, struct flow_entry, dtp.tlp_tmr);
+    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *crb, *tmp;
+    struct rb_list rrbq;
+
+    rb_list_init(&rrbq);
+
+    spin_lock_bh(&dtp->lock);
+
+    if (!rb_list_empty(&dtp->rtxq) && !(dtp->flags & DTP_F_TLP_OUT)) {
+        /* No ACKs for a while: the tail of the window may have been lost,
+         * and there are no later PDUs to cause duplicate or selective
+         * ACKs. Retransmit the last PDU, so that the receiver reports
+         * the losses (if any) without waiting for the rtx timeout. Only
+         * a probe is allowed until new data gets acknowledged. */
+        dtp->flags |= DTP_F_TLP_OUT;
+        if (dtp_rtx_now(flow, rb_list_back(&dtp->rtxq), &rrbq)) {
+            stats->rtx_tlp_pkt++;
+        }
+    }
+
+    spin_unlock_bh(&dtp->lock);
+
+    rb_list_foreach_safe (crb, tmp, &rrbq) {
+        RPD(1, "sending [%lu] from rtxq as a tail loss probe\n",
+            (long unsigned)RL_BUF_PCI(crb)->seqnum);
+        rb_list_del(crb);
+        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    }
+}
+
 static int rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                                      bool maysleep);
 
@@ -752,6 +2177,13 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     unsigned long mpl      = 0;
     unsigned long r;
 
+    dtp->cc = rl_cc_lookup(dc->cc_name);
+    if (!dtp->cc) {
+        PE("Unknown congestion control algorithm '%.*s'\n", RL_CC_NAME_MAX,
+           dc->cc_name);
+        return -EINVAL;
+    }
+
     dtp_snd_reset(flow);
     dtp_rcv_reset(flow);
 
@@ -793,18 +2225,20 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 #ifdef RL_HAVE_TIMER_SETUP
     timer_setup(&dtp->snd_inact_tmr, snd_inact_tmr_cb, 0);
     timer_setup(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, 0);
-    timer_setup(&dtp->rtx_tmr, rtx_tmr_cb, 0);
-    timer_setup(&dtp->a_tmr, a_tmr_cb, 0);
 #else  /* !RL_HAVE_TIMER_SETUP */
     setup_timer(&dtp->snd_inact_tmr, snd_inact_tmr_cb, (unsigned long)flow);
     setup_timer(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->rtx_tmr, rtx_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->a_tmr, a_tmr_cb, (unsigned long)flow);
 #endif /* !RL_HAVE_TIMER_SETUP */
+    /* The timers that scale with the RTT need a better resolution than
+     * jiffies, which would inflate RTOs on sub-millisecond paths. */
+    rl_hrtimer_init(&dtp->rtx_tmr, rtx_tmr_cb);
+    rl_hrtimer_init(&dtp->a_tmr, a_tmr_cb);
+    rl_hrtimer_init(&dtp->tlp_tmr, tlp_tmr_cb);
     dtp->flags |= DTP_F_TIMERS_INITIALIZED;
 
-    dtp->rtt        = msecs_to_jiffies(flow->cfg.dtcp.rtx.initial_rtx_timeout);
-    dtp->rtt_stddev = 1;
+    dtp->rtt_us = flow->cfg.dtcp.rtx.initial_rtx_timeout * USEC_PER_MSEC;
+    dtp->rtt_stddev_us = 1;
+    dtp_rto_update(flow);
 
     if (dc->fc.fc_type == RLITE_FC_T_WIN) {
         dtp->max_cwq_len = dc->fc.cfg.w.max_cwq_len;
@@ -890,6 +2324,46 @@ inet_wrapsum(uint32_t sum)
     return sum; /* host endianness */
 }
 
+/* Checksum of the whole PDU, including the page fragments (if any). */
+static uint32_t
+rl_buf_inet_csum(struct rl_buf *rb)
+{
+    uint32_t sum = inet_csum(RL_BUF_DATA(rb), rl_buf_headlen(rb), 0);
+#ifndef RL_SKB
+    bool odd = rl_buf_headlen(rb) & 1;
+    unsigned int off, len;
+    unsigned int i;
+
+    if (likely(!rb->data_len)) {
+        return sum;
+    }
+
+    for (i = rl_buf_frag_first(rb, &off, &len);;) {
+        struct rl_buf_frag *frag = rb->raw->frags->f + i;
+        uint32_t fsum = inet_csum(rl_buf_frag_address(frag, off), len, 0);
+
+        if (odd) {
+            /* The fragment starts at an odd offset in the PDU, so
+             * its bytes are paired the other way around. */
+            fsum = ((fsum & 0xFF) << 8) | (fsum >> 8);
+        }
+        sum += fsum;
+        if (sum > 0xFFFF) {
+            sum -= 0xFFFF;
+        }
+        odd ^= len & 1;
+
+        if (++i >= rb->raw->frags->nr) {
+            break;
+        }
+        off = rb->raw->frags->f[i].off;
+        len = rb->raw->frags->f[i].len;
+    }
+#endif /* !RL_SKB */
+
+    return sum;
+}
+
 static int
 rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
                 struct rl_buf *rb, unsigned flags)
@@ -956,14 +2430,343 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
     return ret;
 }
 
+/* Maximum number of PDUs staged on each CPU before they are merged
+ * into the output queues. */
+#define RL_SCHED_INQ_MAX 64
+
+/* Length of the overflow list of an output queue beyond which the
+ * senders towards its N-1 flow are pushed back, or dropped if they
+ * cannot sleep. */
+#define RL_RMTQ_OVF_MAX 64
+
+static struct rl_sched *
+rl_sched_alloc(const struct rl_sched_ops *ops, const struct rl_sched *tmpl,
+               gfp_t gfp)
+{
+    struct rl_sched *sched;
+
+    sched =
+        rl_alloc(sizeof(*sched) + ops->priv_size, gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched) {
+        return NULL;
+    }
+
+    sched->ops = *ops;
+    INIT_LIST_HEAD(&sched->ops.node);
+    rb_list_init(&sched->drops);
+    if (sched->ops.init(sched, tmpl, gfp)) {
+        rl_free(sched, RL_MT_SHIM);
+        return NULL;
+    }
+
+    return sched;
+}
+
+static void
+rl_sched_free(struct rl_sched *sched)
+{
+    struct rl_buf *rb, *tmp;
+
+    if (sched->ops.fini) {
+        sched->ops.fini(sched);
+    }
+    rb_list_foreach_safe (rb, tmp, &sched->drops) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
+    rl_free(sched, RL_MT_SHIM);
+}
+
+/* Called under RCU read lock or under rmt->lock. */
+static struct rl_rmtq *
+rmtq_lookup(struct rl_rmt *rmt, const struct flow_entry *lower_flow)
+{
+    rl_port_t port_id = lower_flow->local_port;
+    struct rl_rmtq *q;
+
+    hash_for_each_possible_rcu (rmt->queues, q, node, port_id) {
+        if (q->lower_flow == lower_flow) {
+            return q;
+        }
+    }
+
+    return NULL;
+}
+
+static inline bool
+rmtq_pending(struct rl_rmtq *q)
+{
+    return q->backlog > 0 || !rb_list_empty(&q->held);
+}
+
+/* Make 'q' eligible for service, if it is not already. Called under
+ * rmt->lock. */
+static void
+rmtq_schedule(struct rl_rmtq *q)
+{
+    if (!q->blocked && !q->busy && !q->dead && !q->throttled &&
+        rmtq_pending(q) && list_empty(&q->ready)) {
+        list_add_tail(&q->ready, &q->rmt->ready);
+    }
+}
+
+/* Move the PDUs dropped by the scheduler of 'q' to 'drop', to be
+ * released by rmt_release_drops(). Called under rmt->lock. */
+static void
+rmtq_take_drops(struct rl_rmtq *q, struct rb_list *drop)
+{
+    struct rl_buf *rb, *tmp;
+
+    rb_list_foreach_safe (rb, tmp, &q->sched->drops) {
+        rb_list_del(rb);
+        rb_list_enq(rb, drop);
+        q->backlog--;
+    }
+}
+
+static void
+rmt_release_drops(struct rl_rmt *rmt, struct rb_list *drop)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(rmt->priv->ipcp->stats);
+    struct rl_buf *rb, *tmp;
+
+    rb_list_foreach_safe (rb, tmp, drop) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        stats->rmt.queue_drop++;
+    }
+}
+
+/* Called with the N-1 flow tx wait queue lock held, whenever the N-1
+ * flow may have become writable again. */
+static int
+rmtq_wake(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
+{
+    struct rl_rmtq *q  = container_of(wait, struct rl_rmtq, wait);
+    struct rl_rmt *rmt = q->rmt;
+    unsigned long flags;
+    bool kick = false;
+
+    spin_lock_irqsave(&rmt->lock, flags);
+    q->wakeups++;
+    if (q->blocked) {
+        q->blocked = false;
+        rmtq_schedule(q);
+        kick = !list_empty(&q->ready);
+    }
+    spin_unlock_irqrestore(&rmt->lock, flags);
+
+    if (kick) {
+        /* Let the worker of this CPU serve the queue. */
+        queue_work_on(smp_processor_id(), system_wq,
+                      &this_cpu_ptr(rmt->cpus)->work);
+    }
+
+    return 0;
+}
+
+/* Called when the shaping scheduler of 'q' may be able to release
+ * some PDUs again. */
+static enum hrtimer_restart
+rmtq_unthrottle(struct hrtimer *timer)
+{
+    struct rl_rmtq *q  = container_of(timer, struct rl_rmtq, throttle);
+    struct rl_rmt *rmt = q->rmt;
+    unsigned long flags;
+    bool kick;
+
+    spin_lock_irqsave(&rmt->lock, flags);
+    q->throttled = false;
+    rmtq_schedule(q);
+    kick = !list_empty(&q->ready);
+    spin_unlock_irqrestore(&rmt->lock, flags);
+
+    if (kick) {
+        queue_work_on(smp_processor_id(), system_wq,
+                      &this_cpu_ptr(rmt->cpus)->work);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+static void
+rmtq_free(struct rl_rmtq *q)
+{
+    struct rl_buf *rb, *tmp;
+
+    hrtimer_cancel(&q->throttle);
+    rb_list_foreach_safe (rb, tmp, &q->held) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
+    rb_list_foreach_safe (rb, tmp, &q->ovf) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
+    rl_sched_free(q->sched);
+    rl_free(q, RL_MT_SHIM);
+}
+
+/* Create the output queue for 'lower_flow', unless it already exists.
+ * The caller keeps 'lower_flow' alive, so that the queue cannot be
+ * created after rmt_flow_release(). Must be called without rmt->lock
+ * held, since the lock order is tx_wqh lock --> rmt->lock. */
+static int
+rmtq_create(struct rl_rmt *rmt, struct flow_entry *lower_flow, gfp_t gfp)
+{
+    unsigned long flags;
+    struct rl_rmtq *q;
+
+    q = rl_alloc(sizeof(*q), gfp | __GFP_ZERO, RL_MT_SHIM);
+    if (!q) {
+        return -ENOMEM;
+    }
+
+    q->sched = rl_sched_alloc(&rmt->tmpl->ops, rmt->tmpl, gfp);
+    if (!q->sched) {
+        rl_free(q, RL_MT_SHIM);
+        return -ENOMEM;
+    }
+    q->lower_flow = lower_flow;
+    q->rmt        = rmt;
+    rb_list_init(&q->held);
+    rb_list_init(&q->ovf);
+    INIT_LIST_HEAD(&q->ready);
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&q->throttle, rmtq_unthrottle, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&q->throttle, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    q->throttle.function = rmtq_unthrottle;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+    init_waitqueue_func_entry(&q->wait, rmtq_wake);
+    add_wait_queue(lower_flow->txrx.tx_wqh, &q->wait);
+
+    spin_lock_irqsave(&rmt->lock, flags);
+    if (rmtq_lookup(rmt, lower_flow)) {
+        /* Somebody else was faster. */
+        spin_unlock_irqrestore(&rmt->lock, flags);
+        remove_wait_queue(lower_flow->txrx.tx_wqh, &q->wait);
+        rmtq_free(q);
+        return 0;
+    }
+    hash_add_rcu(rmt->queues, &q->node, lower_flow->local_port);
+    spin_unlock_irqrestore(&rmt->lock, flags);
+
+    return 0;
+}
+
+/* Check if a PDU for 'lower_flow' can be staged, creating the output
+ * queue if needed. Returns -EAGAIN if the output queue is congested.
+ * Called under RCU read lock. */
+static int
+rmt_admit(struct rl_rmt *rmt, struct flow_entry *lower_flow)
+{
+    struct rl_rmtq *q;
+    int ret = 0;
+
+    rcu_read_lock();
+    q = rmtq_lookup(rmt, lower_flow);
+    if (q && READ_ONCE(q->ovf_len) >= RL_RMTQ_OVF_MAX) {
+        ret = -EAGAIN;
+    }
+    rcu_read_unlock();
+
+    if (!q) {
+        ret = rmtq_create(rmt, lower_flow, GFP_ATOMIC);
+    }
+
+    return ret;
+}
+
+/* Move PDUs from the overflow list to the scheduler, as long as the
+ * scheduler accepts them. Called under rmt->lock. */
+static void
+rmtq_refill(struct rl_rmtq *q)
+{
+    while (!rb_list_empty(&q->ovf)) {
+        struct rl_buf *rb = rb_list_front(&q->ovf);
+
+        rb_list_del(rb);
+        if (q->sched->ops.enq(q->sched, rb)) {
+            rb_list_enq_head(rb, &q->ovf);
+            break;
+        }
+        q->ovf_len--;
+        q->backlog++;
+    }
+}
+
+/* Merge the PDUs staged on 'sc' into their output queues, preserving
+ * their order. PDUs refused by the scheduler of an output queue go to
+ * its overflow list, so that a congested N-1 flow never holds back the
+ * PDUs staged for the other ones. Called under sc->lock. */
+static void
+rmt_merge(struct rl_rmt *rmt, struct rl_sched_cpu *sc)
+{
+    struct rl_buf *rb, *tmp;
+    unsigned long flags;
+    struct rb_list drop;
+
+    rb_list_init(&drop);
+
+    spin_lock_irqsave(&rmt->lock, flags);
+    rb_list_foreach_safe (rb, tmp, &sc->inq) {
+        struct rl_rmtq *q = rmtq_lookup(rmt, RL_BUF_RMT(rb).lower_flow);
+
+        rb_list_del(rb);
+        if (unlikely(!q)) {
+            /* The N-1 flow went away. */
+            rb_list_enq(rb, &drop);
+            continue;
+        }
+        if (!rb_list_empty(&q->ovf) || q->sched->ops.enq(q->sched, rb)) {
+            rb_list_enq(rb, &q->ovf);
+            q->ovf_len++;
+        } else {
+            q->backlog++;
+            rmtq_take_drops(q, &drop);
+            /* The new PDU may be allowed out before the shaping timer
+             * fires, let the workers find out. */
+            q->throttled = false;
+        }
+        rmtq_schedule(q);
+    }
+    sc->inq_len = 0;
+    spin_unlock_irqrestore(&rmt->lock, flags);
+
+    rmt_release_drops(rmt, &drop);
+}
+
+/* Stage a PDU on the local CPU, and kick the local worker. */
+static void
+rmt_stage(struct rl_rmt *rmt, struct rl_buf *rb)
+{
+    struct rl_sched_cpu *sc = get_cpu_ptr(rmt->cpus);
+
+    spin_lock_bh(&sc->lock);
+    if (sc->inq_len >= RL_SCHED_INQ_MAX) {
+        /* The staging queue is full, merge it by ourselves. */
+        rmt_merge(rmt, sc);
+    }
+    rb_list_enq(rb, &sc->inq);
+    sc->inq_len++;
+    spin_unlock_bh(&sc->lock);
+    queue_work_on(smp_processor_id(), system_wq, &sc->work);
+    put_cpu_ptr(rmt->cpus);
+}
+
 static int
 rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 {
     struct rina_pci *pci = RL_BUF_PCI(rb);
+    struct rl_ipcp_stats *stats;
     struct flow_entry *lower_flow;
     struct rl_pci_match match;
     struct rl_normal *priv = ipcp->priv;
-    struct rl_sched *sched;
+    DECLARE_WAITQUEUE(wait, current);
+    bool direct = false;
+    struct rl_rmt *rmt;
     int ret = 0;
 
     match.dst_addr  = (rlm_addr_t)pci->dst_addr;
@@ -974,11 +2777,17 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 
     /* For now we let rl_pduft_lookup() accept a rl_pci_match struct.
      * In the future we may let this function accept RL_BUF_PCI(rb),
-     * so that we get rid of the format conversion. */
+     * so that we get rid of the format conversion.
+     * The RMT can be replaced at any time, and it is only freed after
+     * an RCU grace period. While we are in the RCU read-side critical
+     * section, the PDUFT entry also keeps the N-1 flow alive, so that
+     * rmt_flow_release() cannot run. */
+    rcu_read_lock();
     lower_flow = rl_pduft_lookup(priv, &match);
+    rmt        = rcu_dereference(priv->rmt);
     if (unlikely(!lower_flow && match.dst_addr != ipcp->addr)) {
-        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-
+        rcu_read_unlock();
+        stats = raw_cpu_ptr(ipcp->stats);
         RPD(1, "No route to IPCP %lu, dropping packet\n",
             (long unsigned)match.dst_addr);
         rl_buf_free(rb);
@@ -990,6 +2799,7 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
     }
 
     if (!lower_flow) {
+        rcu_read_unlock();
         /* This SDU gets loopbacked to this IPCP, since this is a
          * self flow (match.dst_addr == ipcp->addr). */
         rb = ipcp->ops.sdu_rx(ipcp, rb, NULL /* unused */);
@@ -997,147 +2807,374 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
         return 0;
     }
 
-    /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
+    /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
+
+    if (!rmt) {
+        /* Direct path, bypassing the PDU scheduler. */
+        rcu_read_unlock();
+        return rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
+    }
+
+    /* PDU scheduler path. */
+    stats                     = raw_cpu_ptr(ipcp->stats);
+    RL_BUF_RMT(rb).lower_flow = lower_flow;
+
+    if (!(flags & RL_RMT_F_MAYSLEEP)) {
+        if (rmt_admit(rmt, lower_flow)) {
+            /* The output queue is congested (or could not be
+             * created), and we cannot backpressure. */
+            rl_buf_free(rb);
+            stats->rmt.queue_drop++;
+        } else {
+            rmt_stage(rmt, rb);
+            stats->rmt.queued_pkt++;
+        }
+        rcu_read_unlock();
+        return 0;
+    }
+
+    /* We may sleep waiting for space in the output queue, out of the
+     * RCU read-side critical section: hold a reference to the N-1 flow
+     * until the PDU is staged, and look up the RMT again on each
+     * attempt. */
+    flow_get_ref(lower_flow);
+    rcu_read_unlock();
 
-    sched = priv->sched;
-    if (!sched) {
-        /* Direct path, bypassing the PDU scheduler. */
-        return rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
+    add_wait_queue(&priv->rmt_wqh, &wait);
+    for (;;) {
+        int err = 0;
+
+        rcu_read_lock();
+        rmt = rcu_dereference(priv->rmt);
+        if (rmt) {
+            err = rmt_admit(rmt, lower_flow);
+            if (err == -EAGAIN) {
+                /* Check again after changing the task state, so that
+                 * we do not miss a wakeup. The output queue exists
+                 * now, so nothing is allocated. */
+                set_current_state(TASK_INTERRUPTIBLE);
+                err = rmt_admit(rmt, lower_flow);
+            }
+            if (err == 0) {
+                /* PDU handed over to the RMT. */
+                rmt_stage(rmt, rb);
+                stats->rmt.queued_pkt++;
+            }
+        }
+        rcu_read_unlock();
 
-    } else {
-        /* PDU scheduler path. */
-        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-        bool maysleep               = flags & RL_RMT_F_MAYSLEEP;
-        DECLARE_WAITQUEUE(wait, current);
+        if (err == 0) {
+            /* The PDU scheduler may have been removed in the
+             * meanwhile. */
+            direct = !rmt;
+            break;
+        }
+
+        if (err != -EAGAIN || signal_pending(current)) {
+            rl_buf_free(rb);
+            ret = err == -EAGAIN ? -EINTR /* -ERESTARTSYS */ : err;
+            break;
+        }
 
-        RL_BUF_RMT(rb).lower_flow = lower_flow;
+        /* Sleep waiting for more space in the output queue. */
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    remove_wait_queue(&priv->rmt_wqh, &wait);
+    if (direct) {
+        ret = rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
+    }
+    flow_put(lower_flow);
 
-        if (!maysleep) {
-            struct rl_buf *drb, *tmp;
-            struct rb_list drbs;
+    return ret;
+}
 
-            rb_list_init(&drbs);
+/* Dequeue engine. Each worker serves one ready output queue at a time,
+ * so that PDUs on the same N-1 flow are transmitted in order, while
+ * workers on different CPUs serve different N-1 flows in parallel.
+ * Output queues whose N-1 flow is not writable are left alone until
+ * the N-1 flow wakes them up. */
+static void
+sched_cpu_worker(struct work_struct *w)
+{
+    struct rl_sched_cpu *sc = container_of(w, struct rl_sched_cpu, work);
+    struct rl_rmt *rmt      = sc->rmt;
+    struct rb_list batch;
+    struct rb_list drop;
 
-            spin_lock_bh(&sched->qlock);
-            while (sched->ops.enq(sched, rb)) {
-                /* The queue backlog is becoming too large.
-                 * Since we cannot sleep, we help the dequeuer to do its
-                 * job, rather than dropping. */
-                struct rl_buf *drb = sched->ops.deq(sched);
+    rb_list_init(&batch);
+    rb_list_init(&drop);
 
-                BUG_ON(!drb);
-                rb_list_enq(drb, &drbs);
+    for (;;) {
+        struct rl_buf *rb, *tmp;
+        bool throttle = false;
+        unsigned int wakeups;
+        unsigned long flags;
+        struct rl_rmtq *q;
+        int n = 0;
+
+        /* Merge the PDUs staged on this CPU. */
+        spin_lock_bh(&sc->lock);
+        rmt_merge(rmt, sc);
+        spin_unlock_bh(&sc->lock);
+
+        /* Pick the next ready output queue and dequeue a batch of
+         * PDUs, starting from those previously refused. */
+        spin_lock_irqsave(&rmt->lock, flags);
+        if (list_empty(&rmt->ready)) {
+            /* Nothing to transmit, we can stop. */
+            spin_unlock_irqrestore(&rmt->lock, flags);
+            break;
+        }
+        q = list_first_entry(&rmt->ready, struct rl_rmtq, ready);
+        list_del_init(&q->ready);
+        q->busy = true;
+        wakeups = q->wakeups;
+        while (!rb_list_empty(&q->held) && n < 8) {
+            rb = rb_list_front(&q->held);
+            rb_list_del(rb);
+            rb_list_enq(rb, &batch);
+            n++;
+        }
+        for (; n < 8; n++) {
+            rb = q->sched->ops.deq(q->sched);
+            if (!rb) {
+                throttle = q->sched->next_ns != 0;
+                break;
             }
-            stats->rmt.queued_pkt++;
-            spin_unlock_bh(&sched->qlock);
-            rb = NULL;
+            q->backlog--;
+            rb_list_enq(rb, &batch);
+        }
+        rmtq_refill(q);
+        rmtq_take_drops(q, &drop);
+        if (throttle && q->backlog > 0) {
+            /* The scheduler is shaping: leave the queue alone until
+             * it can release more PDUs. */
+            q->throttled = true;
+            hrtimer_start(&q->throttle, ns_to_ktime(q->sched->next_ns),
+                          HRTIMER_MODE_ABS);
+        }
+        spin_unlock_irqrestore(&rmt->lock, flags);
+        rmt_release_drops(rmt, &drop);
 
-            /* We cannot backpressure here, so we need to force consumption. */
-            flags |= RL_RMT_F_CONSUME;
-            rb_list_foreach_safe (drb, tmp, &drbs) {
-                rb_list_del(drb);
-                lower_flow = RL_BUF_RMT(drb).lower_flow;
-                BUG_ON(!lower_flow);
-                rmt_tx_to_lower(ipcp, lower_flow, drb, flags);
+        /* Transmit the PDUs out of the RMT lock, without sleeping and
+         * without forcing consumption, so that the N-1 flow can
+         * refuse them. */
+        rb_list_foreach_safe (rb, tmp, &batch) {
+            rb_list_del(rb);
+            if (rmt_tx_to_lower(rmt->priv->ipcp, q->lower_flow, rb, 0) ==
+                -EAGAIN) {
+                rb_list_enq_head(rb, &batch);
+                break;
             }
-        } else {
-            add_wait_queue(&sched->wqh, &wait);
-            for (;;) {
-                int err;
+        }
 
-                set_current_state(TASK_INTERRUPTIBLE);
-                spin_lock_bh(&sched->qlock);
-                err = sched->ops.enq(sched, rb);
-                spin_unlock_bh(&sched->qlock);
-                if (err == 0) {
-                    /* PDU enqueued to the scheduler. */
-                    stats->rmt.queued_pkt++;
-                    break;
-                }
+        spin_lock_irqsave(&rmt->lock, flags);
+        q->busy = false;
+        if (!rb_list_empty(&batch)) {
+            /* Put back the refused PDUs, ahead of the held ones. */
+            while (!rb_list_empty(&q->held)) {
+                rb = rb_list_front(&q->held);
+                rb_list_del(rb);
+                rb_list_enq(rb, &batch);
+            }
+            rb_list_foreach_safe (rb, tmp, &batch) {
+                rb_list_del(rb);
+                rb_list_enq(rb, &q->held);
+            }
+            /* The N-1 flow is blocked, unless it woke us up in the
+             * meanwhile. */
+            q->blocked = (q->wakeups == wakeups);
+        }
+        rmtq_schedule(q);
+        spin_unlock_irqrestore(&rmt->lock, flags);
 
-                if (signal_pending(current)) {
-                    rl_buf_free(rb);
-                    ret = -EINTR; /* -ERESTARTSYS */
-                    break;
-                }
+        /* Wake up processes that may be blocked waiting for more space on
+         * the output queues. */
+        wake_up_interruptible_poll(&rmt->priv->rmt_wqh,
+                                   POLLOUT | POLLWRBAND | POLLWRNORM);
+    }
+}
 
-                /* Sleep waiting for more space in the queue. */
-                schedule();
+/* Release the output queue of 'flow', if any. Called in process context
+ * when 'flow' is going to be destroyed. */
+static void
+rmt_flow_release(struct rl_rmt *rmt, const struct flow_entry *flow)
+{
+    struct rl_buf *rb, *tmp;
+    unsigned long flags;
+    struct rb_list drop;
+    struct rl_rmtq *q;
+    int cpu;
+
+    rb_list_init(&drop);
+
+    /* Drop the PDUs for 'flow' staged on any CPU. */
+    for_each_possible_cpu (cpu) {
+        struct rl_sched_cpu *sc = per_cpu_ptr(rmt->cpus, cpu);
+
+        spin_lock_bh(&sc->lock);
+        rb_list_foreach_safe (rb, tmp, &sc->inq) {
+            if (RL_BUF_RMT(rb).lower_flow == flow) {
+                rb_list_del(rb);
+                rb_list_enq(rb, &drop);
+                sc->inq_len--;
             }
-            rb = NULL;
-            __set_current_state(TASK_RUNNING);
-            remove_wait_queue(&sched->wqh, &wait);
         }
+        spin_unlock_bh(&sc->lock);
+    }
 
-        /* Kick the dequeuer, since we (most likely) enqueued a new PDU. */
-        schedule_work(&priv->sched_deq_work);
+    spin_lock_irqsave(&rmt->lock, flags);
+    q = rmtq_lookup(rmt, flow);
+    if (q) {
+        hash_del_rcu(&q->node);
+        list_del_init(&q->ready);
+        q->dead = true;
+    }
+    spin_unlock_irqrestore(&rmt->lock, flags);
+
+    if (q) {
+        remove_wait_queue(flow->txrx.tx_wqh, &q->wait);
+        /* Wait for lockless lookups, and for any worker which may be
+         * transmitting from 'q'. */
+        synchronize_rcu();
+        for_each_possible_cpu (cpu) {
+            flush_work(&per_cpu_ptr(rmt->cpus, cpu)->work);
+        }
+        rmtq_free(q);
     }
 
-    return ret;
+    rb_list_foreach_safe (rb, tmp, &drop) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
 }
 
 static void
-sched_deq_worker(struct work_struct *w)
+rl_rmt_free(struct rl_rmt *rmt)
 {
-    struct rl_normal *priv = container_of(w, struct rl_normal, sched_deq_work);
-    struct rl_sched *sched = priv->sched;
-    struct rb_list ready;
-
-    if (unlikely(!sched)) {
-        return;
+    struct hlist_node *htmp;
+    unsigned long flags;
+    struct rl_rmtq *q;
+    int bucket;
+    int cpu;
+
+    spin_lock_irqsave(&rmt->lock, flags);
+    hash_for_each (rmt->queues, bucket, q, node) {
+        /* Neither shaping timers nor N-1 flow wakeups can schedule the
+         * queue anymore. */
+        q->dead = true;
+        list_del_init(&q->ready);
     }
+    spin_unlock_irqrestore(&rmt->lock, flags);
 
-    rb_list_init(&ready);
+    /* Stop the shaping timers before the workers and the per-CPU state
+     * they kick go away. */
+    hash_for_each (rmt->queues, bucket, q, node) {
+        hrtimer_cancel(&q->throttle);
+        remove_wait_queue(q->lower_flow->txrx.tx_wqh, &q->wait);
+    }
 
-    for (;;) {
-        struct rl_buf *rb, *tmp;
-        int i;
+    if (rmt->cpus) {
+        for_each_possible_cpu (cpu) {
+            struct rl_sched_cpu *sc = per_cpu_ptr(rmt->cpus, cpu);
+            struct rl_buf *rb, *tmp;
 
-        /* Dequeue a batch of PDUs. */
-        spin_lock_bh(&sched->qlock);
-        for (i = 0; i < 8; i++) {
-            rb = sched->ops.deq(sched);
-            if (!rb) {
-                break;
+            cancel_work_sync(&sc->work);
+            rb_list_foreach_safe (rb, tmp, &sc->inq) {
+                rb_list_del(rb);
+                rl_buf_free(rb);
             }
-            rb_list_enq(rb, &ready);
+            sc->inq_len = 0;
         }
-        spin_unlock_bh(&sched->qlock);
+        free_percpu(rmt->cpus);
+    }
 
-        if (rb_list_empty(&ready)) {
-            /* No more PDUs to dequeue, we can stop. */
-            break;
-        }
+    synchronize_rcu();
+    hash_for_each_safe (rmt->queues, bucket, htmp, q, node) {
+        hash_del_rcu(&q->node);
+        rmtq_free(q);
+    }
 
-        /* Transmit the PDUs out of the scheduler lock. */
-        rb_list_foreach_safe (rb, tmp, &ready) {
-            rb_list_del(rb);
-            BUG_ON(!RL_BUF_RMT(rb).lower_flow);
-            rmt_tx_to_lower(priv->ipcp, RL_BUF_RMT(rb).lower_flow, rb,
-                            RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME);
-        }
+    if (rmt->tmpl) {
+        rl_sched_free(rmt->tmpl);
+    }
+    rl_free(rmt, RL_MT_SHIM);
+}
 
-        if (true) {
-            /* Wake up processes that may be blocked waiting for more space on
-             * the scheduler queue. */
-            wake_up_interruptible_poll(&sched->wqh,
-                                       POLLOUT | POLLWRBAND | POLLWRNORM);
-        }
+static struct rl_rmt *
+rl_rmt_alloc(struct rl_normal *priv, const struct rl_sched_ops *ops)
+{
+    struct rl_rmt *rmt;
+    int cpu;
+
+    rmt = rl_alloc(sizeof(*rmt), GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!rmt) {
+        return NULL;
+    }
+
+    rmt->priv = priv;
+    spin_lock_init(&rmt->lock);
+    hash_init(rmt->queues);
+    INIT_LIST_HEAD(&rmt->ready);
+
+    rmt->tmpl = rl_sched_alloc(ops, /*tmpl=*/NULL, GFP_KERNEL);
+    if (!rmt->tmpl) {
+        rl_rmt_free(rmt);
+        return NULL;
+    }
+
+    rmt->cpus = alloc_percpu(struct rl_sched_cpu);
+    if (!rmt->cpus) {
+        rl_rmt_free(rmt);
+        return NULL;
+    }
+    for_each_possible_cpu (cpu) {
+        struct rl_sched_cpu *sc = per_cpu_ptr(rmt->cpus, cpu);
+
+        spin_lock_init(&sc->lock);
+        rb_list_init(&sc->inq);
+        sc->inq_len = 0;
+        INIT_WORK(&sc->work, sched_cpu_worker);
+        sc->rmt = rmt;
+    }
+
+    return rmt;
+}
+
+/* Dereference priv->rmt on the update side. */
+#define rl_rmt_deref(_priv)                                                    \
+    rcu_dereference_protected((_priv)->rmt,                                    \
+                              lockdep_is_held(&(_priv)->rmt_lock))
+
+/* Replace 'old' with 'rmt' (both may be NULL), and free 'old' once no
+ * sender can be using it anymore. Called under priv->rmt_lock. */
+static void
+rl_rmt_publish(struct rl_normal *priv, struct rl_rmt *old, struct rl_rmt *rmt)
+{
+    rcu_assign_pointer(priv->rmt, rmt);
+    if (old) {
+        synchronize_rcu();
+        rl_rmt_free(old);
     }
+    /* Let the blocked senders look up the new RMT. */
+    wake_up_interruptible_poll(&priv->rmt_wqh,
+                               POLLOUT | POLLWRBAND | POLLWRNORM);
 }
 
 /* Replace the current PDU scheduler with a new one ('ops'), which
- * can be NULL if we want to remove the scheduler.
+ * can be NULL if we want to remove the scheduler. Called under
+ * priv->rmt_lock.
  * TODO Eventually we would like to support run-time replacement,
  * probably using sleeping RCU. */
 static int
 rl_sched_replace(struct rl_normal *priv, const char *sched_name)
 {
     struct rl_sched_ops *ops = NULL;
-    struct rl_sched *sched   = NULL;
-    struct rl_sched *old     = priv->sched;
+    struct rl_rmt *rmt       = NULL;
+    struct rl_rmt *old       = rl_rmt_deref(priv);
 
-    if (old && sched_name && !strcmp(old->ops.name, sched_name)) {
+    if (old && sched_name && !strcmp(old->tmpl->ops.name, sched_name)) {
         /* Nothing to do. */
         return 0;
     }
@@ -1165,31 +3202,13 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
     }
 
     if (ops) {
-        sched = rl_alloc(sizeof(*sched) + ops->priv_size,
-                         GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
-        if (!sched) {
-            return -1;
-        }
-
-        sched->ops = *ops;
-        INIT_LIST_HEAD(&sched->ops.node);
-        if (sched->ops.init(sched)) {
-            rl_free(sched, RL_MT_SHIM);
+        rmt = rl_rmt_alloc(priv, ops);
+        if (!rmt) {
             return -1;
         }
-
-        spin_lock_init(&sched->qlock);
-        init_waitqueue_head(&sched->wqh);
     }
 
-    priv->sched = sched;
-
-    if (old) {
-        if (old->ops.fini) {
-            old->ops.fini(old);
-        }
-        rl_free(old, RL_MT_SHIM);
-    }
+    rl_rmt_publish(priv, old, rmt);
 
     return 0;
 }
@@ -1207,18 +3226,21 @@ rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
     }
 
     /* Record the rtx expiration time and current time. */
-    RL_BUF_RTX(crb).jiffies     = jiffies;
-    RL_BUF_RTX(crb).rtx_jiffies = RL_BUF_RTX(crb).jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).sent_ns = ktime_get_ns();
+    RL_BUF_RTX(crb).rtx_ns  = RL_BUF_RTX(crb).sent_ns + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).xmit_ns = RL_BUF_RTX(crb).sent_ns;
+    RL_BUF_RTX(crb).flags   = 0;
 
-    /* Add to the rtx queue and start the rtx timer if not already
-     * started. */
+    /* Add to the rtx queue and start the rtx timer if this is the
+     * first entry to expire. */
     rb_list_enq(crb, &dtp->rtxq);
     dtp->rtxq_len++;
-    if (!timer_pending(&dtp->rtx_tmr)) {
-        NPD("Forward rtx timer by %u\n",
-            jiffies_to_msecs(RL_BUF_RTX(crb).rtx_jiffies - jiffies));
-        mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_jiffies);
+    rtxq_exp_insert(dtp, crb);
+    if (dtp->rtxq_exp.next == &RL_BUF_RTX(crb).exp_node) {
+        rtx_tmr_update(dtp);
     }
+    /* Probe for tail losses after the last PDU sent. */
+    dtp_tlp_arm(flow);
     NPD("cloning [%lu] into rtxq\n", (long unsigned)RL_BUF_PCI(crb)->seqnum);
 
     return 0;
@@ -1330,7 +3352,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, len, 0));
+        pci->pdu_csum = inet_wrapsum(rl_buf_inet_csum(rb));
     }
 
     if (!dtcp_present) {
@@ -1496,7 +3518,9 @@ rl_normal_config(struct ipcp_entry *ipcp, const char *param_name,
         if (!strcmp(param_value, "none")) {
             param_value = NULL;
         }
+        mutex_lock(&priv->rmt_lock);
         ret = rl_sched_replace(priv, param_value);
+        mutex_unlock(&priv->rmt_lock);
     }
 
     return ret;
@@ -1517,8 +3541,12 @@ rl_normal_config_get(struct ipcp_entry *ipcp, const char *param_name, char *buf,
         const char *value = priv->csum ? "inet" : "none";
         snprintf(buf, buflen, "%s", value);
     } else if (strcmp(param_name, "sched") == 0) {
-        const char *value = priv->sched ? priv->sched->ops.name : "none";
-        snprintf(buf, buflen, "%s", value);
+        struct rl_rmt *rmt;
+
+        rcu_read_lock();
+        rmt = rcu_dereference(priv->rmt);
+        snprintf(buf, buflen, "%s", rmt ? rmt->tmpl->ops.name : "none");
+        rcu_read_unlock();
     } else {
         ret = -ENOSYS; /* don't know how to manage this parameter */
     }
@@ -1526,11 +3554,14 @@ rl_normal_config_get(struct ipcp_entry *ipcp, const char *param_name, char *buf,
     return ret;
 }
 
+/* Called under priv->rmt_lock. */
 static int
-rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
+__rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    int ret                = -ENOSYS;
+    struct rl_rmt *old     = rl_rmt_deref(priv);
+    struct rl_rmt *rmt;
+    int ret = -ENOSYS;
 
     if (rl_ipcp_has_flows(ipcp, /*report_all=*/false)) {
         /* Do not allow scheduler changes if this IPCP is being
@@ -1539,7 +3570,7 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
         return -EBUSY;
     }
 
-    if (!priv->sched) {
+    if (!old) {
         return -ENXIO;
     }
 
@@ -1547,12 +3578,27 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
      * scheduler. */
     switch (bmsg->hdr.msg_type) {
     case RLITE_KER_IPCP_SCHED_WRR:
-        if (strcmp(rl_sched_wrr_ops.name, priv->sched->ops.name)) {
+        if (strcmp(rl_sched_wrr_ops.name, old->tmpl->ops.name)) {
             return -ENXIO;
         }
         break;
     case RLITE_KER_IPCP_SCHED_PFIFO:
-        if (strcmp(rl_sched_pfifo_ops.name, priv->sched->ops.name)) {
+        if (strcmp(rl_sched_pfifo_ops.name, old->tmpl->ops.name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_DRR:
+        if (strcmp(rl_sched_drr_ops.name, old->tmpl->ops.name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_FQ_CODEL:
+        if (strcmp(rl_sched_fq_codel_ops.name, old->tmpl->ops.name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_HTB:
+        if (strcmp(rl_sched_htb_ops.name, old->tmpl->ops.name)) {
             return -ENXIO;
         }
         break;
@@ -1561,10 +3607,55 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
         break;
     }
 
-    /* Call the configuration callback, if available. */
-    if (priv->sched->ops.config) {
-        ret = priv->sched->ops.config(priv->sched, bmsg);
+    if (!old->tmpl->ops.config) {
+        return ret;
+    }
+
+    /* Configure a new RMT, so that all the output queues are built
+     * again from the new configuration. */
+    rmt = rl_rmt_alloc(priv, &old->tmpl->ops);
+    if (!rmt) {
+        return -ENOMEM;
+    }
+    ret = rmt->tmpl->ops.config(rmt->tmpl, bmsg);
+    if (ret) {
+        rl_rmt_free(rmt);
+        return ret;
+    }
+    rl_rmt_publish(priv, old, rmt);
+
+    return 0;
+}
+
+static int
+rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    int ret;
+
+    mutex_lock(&priv->rmt_lock);
+    ret = __rl_normal_sched_config(ipcp, bmsg);
+    mutex_unlock(&priv->rmt_lock);
+
+    return ret;
+}
+
+static int
+rl_normal_pduft_flush_by_flow(struct ipcp_entry *ipcp,
+                              const struct flow_entry *flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct rl_rmt *rmt;
+    int ret;
+
+    ret = rl_pduft_flush_by_flow(ipcp, flow);
+    mutex_lock(&priv->rmt_lock);
+    rmt = rl_rmt_deref(priv);
+    if (rmt) {
+        /* The N-1 flow is going away, together with its output queue. */
+        rmt_flow_release(rmt, flow);
     }
+    mutex_unlock(&priv->rmt_lock);
 
     return ret;
 }
@@ -1578,18 +3669,64 @@ rl_normal_qos_supported(struct ipcp_entry *ipcp, struct rina_flow_spec *spec)
     return 0;
 }
 
+/* Fill 'blocks' with the ranges of sequence numbers in the seqq, that
+ * is the PDUs received beyond the first gap. Returns the number of
+ * blocks. Called under DTP lock. */
+static unsigned int
+seqq_sack_blocks(struct dtp *dtp, struct rina_sack_block *blocks)
+{
+    unsigned int n = 0;
+    struct rl_buf *cur;
+
+    /* The seqq is sorted by sequence number. */
+    rb_list_foreach (cur, &dtp->seqq) {
+        rl_seq_t seqnum = RL_BUF_PCI(cur)->seqnum;
+
+        if (n && blocks[n - 1].end == seqnum) {
+            blocks[n - 1].end++;
+            continue;
+        }
+        if (n == RL_SACK_BLOCKS_MAX) {
+            break;
+        }
+        blocks[n].start = seqnum;
+        blocks[n].end   = seqnum + 1;
+        n++;
+    }
+
+    return n;
+}
+
+/* Type of the acknowledgement to send: selective if negotiated and if
+ * there are gaps to report. Called under DTP lock. */
+static inline uint8_t
+dtp_ack_type(struct flow_entry *flow)
+{
+    return (flow->cfg.dtcp.flags & DTCP_CFG_SACK) && flow->dtp.seqq_len
+               ? PDU_T_SACK
+               : PDU_T_ACK;
+}
+
 static struct rl_buf *
 ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
                uint8_t pdu_type)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct rl_buf *rb =
-        rl_buf_alloc(sizeof(struct rina_pci_ctrl), ipcp->txhdroom,
-                     ipcp->tailroom, GFP_ATOMIC);
+    struct rina_sack_block blocks[RL_SACK_BLOCKS_MAX];
+    unsigned int nblocks = 0;
     struct rina_pci_ctrl *pcic;
+    struct rl_buf *rb;
+    size_t len;
 
+    if ((pdu_type & PDU_T_ACK_BIT) &&
+        (pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK) {
+        nblocks = seqq_sack_blocks(&flow->dtp, blocks);
+    }
+    len = sizeof(struct rina_pci_ctrl) + nblocks * sizeof(blocks[0]);
+
+    rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_ATOMIC);
     if (likely(rb)) {
-        rl_buf_append(rb, sizeof(struct rina_pci_ctrl));
+        rl_buf_append(rb, len);
         pcic                         = (struct rina_pci_ctrl *)RL_BUF_DATA(rb);
         pcic->base.dst_addr          = flow->remote_addr;
         pcic->base.src_addr          = ipcp->addr;
@@ -1609,6 +3746,7 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
         pcic->my_rwe                            = flow->dtp.snd_rwe;
         pcic->my_lwe                            = flow->dtp.snd_lwe;
+        memcpy(pcic + 1, blocks, nblocks * sizeof(blocks[0]));
         if (priv->csum) {
             pcic->base.pdu_csum = inet_wrapsum(inet_csum(pcic, rb->len, 0));
         }
@@ -1659,7 +3797,7 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     if (ack && (dc->flags & DTCP_CFG_RTX_CTRL)) {
-        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK;
+        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT | dtp_ack_type(flow);
     }
 
     if (pdu_type) {
@@ -1671,14 +3809,15 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
             (long unsigned)flow->dtp.rcv_next_seq_num,
             (long unsigned)flow->dtp.last_lwe_sent + win_size);
         /* Stop the A timer, we are going to send a control PDU. */
-        del_timer(&flow->dtp.a_tmr);
+        rl_hrtimer_cancel(&flow->dtp.a_tmr);
         return ctrl_pdu_alloc(ipcp, flow, pdu_type);
     }
 
     /* We are not sending an immediate control PDU, so we need
      * to start the A timer (if it was not already started). */
-    if (a && !timer_pending(&flow->dtp.a_tmr)) {
-        mod_timer(&flow->dtp.a_tmr, jiffies + msecs_to_jiffies(a));
+    if (a && !rl_hrtimer_pending(&flow->dtp.a_tmr)) {
+        rl_hrtimer_start(&flow->dtp.a_tmr,
+                         ktime_get_ns() + (u64)a * NSEC_PER_MSEC);
         RPV(1, "start A timer\n");
     }
 
@@ -1749,6 +3888,164 @@ seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
     }
 }
 
+/* Record that 'rb' has been delivered to the receiver, and use it as the
+ * RACK reference if it is the most recently transmitted one. A
+ * retransmitted PDU acked less than half an RTT after the retransmission
+ * is ignored, as the ACK is likely for the original transmission.
+ * Called under DTP lock. */
+static void
+dtp_rack_update(struct dtp *dtp, struct rl_buf *rb)
+{
+    u64 xmit        = RL_BUF_RTX(rb).xmit_ns;
+    rl_seq_t seqnum = RL_BUF_PCI(rb)->seqnum;
+
+    if (!RL_BUF_RTX(rb).sent_ns &&
+        ktime_get_ns() < xmit + (u64)dtp->rtt_us * NSEC_PER_USEC / 2) {
+        return;
+    }
+
+    if (!dtp->rack_end || xmit > dtp->rack_xmit_ns ||
+        (xmit == dtp->rack_xmit_ns && seqnum > dtp->rack_seq)) {
+        dtp->rack_xmit_ns = xmit;
+        dtp->rack_seq     = seqnum;
+    }
+    if (seqnum >= dtp->rack_end) {
+        dtp->rack_end = seqnum + 1;
+    }
+}
+
+/* Time-based loss detection (RACK): a PDU still in the rtxq is lost if a
+ * PDU transmitted after it has been delivered, and more than an RTT plus
+ * a reordering window (a quarter of RTT) have elapsed since its own
+ * transmission. Unlike duplicate ACK counting, this also works for losses
+ * at the end of a burst and for lost retransmissions. Lost PDUs are
+ * cloned into 'rrbq'. Returns the number of such PDUs.
+ * Called under DTP lock. */
+static unsigned int
+dtp_rack_detect(struct flow_entry *flow, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    u64 rtt_ns                  = (u64)dtp->rtt_us * NSEC_PER_USEC;
+    u64 reo_wnd                 = max_t(u64, rtt_ns >> 2, NSEC_PER_USEC);
+    u64 now                     = ktime_get_ns();
+    unsigned int lost           = 0;
+    struct rl_buf *cur;
+
+    if (!dtp->rack_end) {
+        return 0;
+    }
+
+    /* PDUs beyond the highest delivered one cannot be declared lost. */
+    rb_list_foreach (cur, &dtp->rtxq) {
+        u64 xmit        = RL_BUF_RTX(cur).xmit_ns;
+        rl_seq_t seqnum = RL_BUF_PCI(cur)->seqnum;
+
+        if (seqnum >= dtp->rack_end) {
+            break;
+        }
+        if (RL_BUF_RTX(cur).flags & RL_RTX_F_SACKED) {
+            continue;
+        }
+        if (xmit > dtp->rack_xmit_ns ||
+            (xmit == dtp->rack_xmit_ns && seqnum >= dtp->rack_seq)) {
+            continue; /* sent after the reference */
+        }
+        if (now < xmit + rtt_ns + reo_wnd) {
+            continue; /* possibly just reordered */
+        }
+        if (dtp_rtx_now(flow, cur, rrbq)) {
+            stats->rtx_fast_pkt++;
+        }
+        lost++;
+    }
+
+    return lost;
+}
+
+/* Fast retransmission of the first unacknowledged PDU, if not already
+ * retransmitted (or selectively acked). Returns the number of PDUs
+ * cloned into 'rrbq'. Called under DTP lock. */
+static unsigned int
+dtp_fast_rtx(struct flow_entry *flow, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *rb;
+
+    if (rb_list_empty(&dtp->rtxq)) {
+        return 0;
+    }
+    rb = rb_list_front(&dtp->rtxq);
+    if (RL_BUF_RTX(rb).flags & (RL_RTX_F_SACKED | RL_RTX_F_RTX)) {
+        return 0;
+    }
+    if (dtp_rtx_now(flow, rb, rrbq)) {
+        stats->rtx_fast_pkt++;
+    }
+
+    return 1;
+}
+
+/* Process the blocks of a SACK control PDU. The PDUs in the rtxq that
+ * the receiver holds are marked, so that they are not retransmitted on
+ * timeout. The PDUs that look lost, because the receiver holds at least
+ * RL_SACK_REORDER later ones, are cloned into 'rrbq' to be retransmitted
+ * right away, once for each loss. Returns the number of such PDUs.
+ * Called under DTP lock. */
+static unsigned int
+dtp_sack_process(struct flow_entry *flow, const struct rina_sack_block *blocks,
+                 unsigned int nblocks, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    unsigned int sacked         = 0;
+    unsigned int lost           = 0;
+    struct rl_buf *cur;
+    unsigned int i;
+
+    rb_list_foreach (cur, &dtp->rtxq) {
+        rl_seq_t seqnum = RL_BUF_PCI(cur)->seqnum;
+
+        if (RL_BUF_RTX(cur).flags & RL_RTX_F_SACKED) {
+            sacked++;
+            continue;
+        }
+        for (i = 0; i < nblocks; i++) {
+            if (blocks[i].start <= seqnum && seqnum < blocks[i].end) {
+                RL_BUF_RTX(cur).flags |= RL_RTX_F_SACKED;
+                dtp_rack_update(dtp, cur);
+                sacked++;
+                break;
+            }
+        }
+    }
+
+    /* Here 'sacked' counts the selectively acked PDUs beyond 'cur'. */
+    rb_list_foreach (cur, &dtp->rtxq) {
+        if (sacked < RL_SACK_REORDER) {
+            break;
+        }
+        if (RL_BUF_RTX(cur).flags & RL_RTX_F_SACKED) {
+            sacked--;
+            continue;
+        }
+        if (RL_BUF_RTX(cur).flags & RL_RTX_F_RTX) {
+            /* Already retransmitted, leave it to RACK and to the
+             * timer. */
+            continue;
+        }
+
+        /* Retransmit the hole. */
+        if (dtp_rtx_now(flow, cur, rrbq)) {
+            stats->rtx_sack_pkt++;
+        }
+        lost++;
+    }
+
+    return lost;
+}
+
 static int
 sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 {
@@ -1756,7 +4053,9 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     struct rina_pci_ctrl *pcic  = RL_BUF_PCI_CTRL(rb);
     struct dtp *dtp             = &flow->dtp;
     struct rb_list qrbs;
+    struct rb_list rrbq;
     struct rl_buf *qrb, *tmp;
+    rlm_seq_t old_rwe;
 
     if (unlikely((pcic->base.pdu_type & PDU_T_CTRL) != PDU_T_CTRL)) {
         PE("Unknown PDU type %X\n", pcic->base.pdu_type);
@@ -1766,6 +4065,7 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     }
 
     rb_list_init(&qrbs);
+    rb_list_init(&rrbq);
 
     spin_lock_bh(&dtp->lock);
 
@@ -1789,6 +4089,7 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     }
 
     dtp->last_ctrl_seq_num_rcvd = pcic->base.seqnum;
+    old_rwe                     = dtp->snd_rwe;
 
     if (pcic->base.pdu_type & PDU_T_FC_BIT) {
         struct rl_buf *tmp;
@@ -1840,27 +4141,40 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 
     if (pcic->base.pdu_type & PDU_T_ACK_BIT) {
         struct rl_buf *cur, *tmp;
-        unsigned now = jiffies;
-        unsigned cur_rtt;
+        u64 now           = ktime_get_ns();
+        unsigned int lost  = 0;
+        unsigned int acked = 0;
+        u32 rtt_sample     = 0;
+        u32 cur_rtt;
         int cur_rttdev;
+        u64 srtt;
 
         switch (pcic->base.pdu_type & PDU_T_ACK_MASK) {
         case PDU_T_ACK:
+        case PDU_T_SACK:
+            /* The cumulative part of a selective ACK is processed as a
+             * conventional ACK. */
             rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
                 struct rina_pci *pci = RL_BUF_PCI(cur);
 
                 if (pci->seqnum < pcic->ack_nack_seq_num) {
                     NPD("Remove [%lu] from rtxq\n", (long unsigned)pci->seqnum);
                     rb_list_del(cur);
+                    list_del(&RL_BUF_RTX(cur).exp_node);
                     dtp->rtxq_len--;
-
-                    if (RL_BUF_RTX(cur).jiffies) {
-                        /* Update our RTT estimate. */
-                        cur_rtt = now - RL_BUF_RTX(cur).jiffies;
+                    acked++;
+
+                    if (RL_BUF_RTX(cur).sent_ns) {
+                        /* Update our RTT estimate, with microsecond
+                         * resolution. */
+                        cur_rtt =
+                            div_u64(now - RL_BUF_RTX(cur).sent_ns,
+                                    NSEC_PER_USEC);
                         if (!cur_rtt) {
                             cur_rtt = 1;
                         }
-                        cur_rttdev = (int)cur_rtt - dtp->rtt;
+                        rtt_sample = cur_rtt;
+                        cur_rttdev = (int)cur_rtt - (int)dtp->rtt_us;
                         if (cur_rttdev < 0) {
                             cur_rttdev = -cur_rttdev;
                         } else if (!cur_rttdev) {
@@ -1868,47 +4182,79 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                         }
 
                         /* RTT <== RTT * (112/128) + SAMPLE * (16/128)*/
-                        dtp->rtt = (dtp->rtt * 112 + (cur_rtt << 4)) >> 7;
-                        dtp->rtt_stddev =
-                            (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
-                        NPD(1, "RTT est %u msecs +/- %u msecs\n",
-                            jiffies_to_msecs(dtp->rtt),
-                            jiffies_to_msecs(dtp->rtt_stddev));
+                        srtt = (u64)dtp->rtt_us * 112 + ((u64)cur_rtt << 4);
+                        dtp->rtt_us = srtt >> 7;
+                        dtp->rtt_stddev_us =
+                            (dtp->rtt_stddev_us * 3 + cur_rttdev) >> 2;
+                        dtp_rto_update(flow);
+                        NPD(1, "RTT est %u usecs +/- %u usecs\n",
+                            dtp->rtt_us, dtp->rtt_stddev_us);
                     }
 
+                    dtp_rack_update(dtp, cur);
                     rl_buf_free(cur);
                 } else {
                     /* The rtxq is sorted by seqnum, so we can safely
-                     * stop here. Let's update the rtx timer
-                     * expiration time, if necessary. */
-                    NPD("Forward rtx timer by %u\n",
-                        jiffies_to_msecs(RL_BUF_RTX(cur).rtx_jiffies -
-                                         jiffies));
-                    mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
+                     * stop here. */
                     break;
                 }
             }
 
-            if (rb_list_empty(&dtp->rtxq)) {
-                /* Everything has been acked, we can stop the rtx timer. */
-                del_timer(&dtp->rtx_tmr);
+            /* Update the rtx timer expiration time, if necessary. */
+            rtx_tmr_update(dtp);
+
+            if ((pcic->base.pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK &&
+                (flow->cfg.dtcp.flags & DTCP_CFG_SACK) &&
+                rl_buf_headlen(rb) > sizeof(*pcic)) {
+                /* The blocks follow the control PCI. */
+                unsigned int nblocks = min_t(
+                    size_t,
+                    (rl_buf_headlen(rb) - sizeof(*pcic)) /
+                        sizeof(struct rina_sack_block),
+                    RL_SACK_BLOCKS_MAX);
+
+                lost += dtp_sack_process(
+                    flow, (struct rina_sack_block *)(pcic + 1), nblocks, &rrbq);
             }
 
-            /* Update the congestion control window size (up to a maximum).
-             * In case we never experienced retransmissions we double the
-             * size, otherwise we increment it linearly. */
-            if (dtp->cgwin < RL_CGWIN_MAX) {
-                if (stats->rtx_pkt) {
-                    dtp->cgwin++;
-                } else {
-                    dtp->cgwin <<= 1;
+            if (pcic->ack_nack_seq_num > dtp->last_ack_rcvd) {
+                /* New data acknowledged. During a loss episode this
+                 * is a partial ACK, meaning that the next PDU is
+                 * missing as well: retransmit it right away. */
+                dtp->last_ack_rcvd = pcic->ack_nack_seq_num;
+                dtp->dup_acks      = 0;
+                dtp->flags &= ~DTP_F_TLP_OUT;
+                if (pcic->ack_nack_seq_num < dtp->rtx_recover) {
+                    lost += dtp_fast_rtx(flow, &rrbq);
                 }
+                dtp_tlp_arm(flow);
+
+            } else if (pcic->ack_nack_seq_num == dtp->last_ack_rcvd &&
+                       !rb_list_empty(&dtp->rtxq) && dtp->snd_rwe == old_rwe) {
+                /* Duplicate ACK, caused by a PDU received out of order
+                 * (window updates don't count). */
+                if (++dtp->dup_acks == RL_DUPACK_THRESH) {
+                    lost += dtp_fast_rtx(flow, &rrbq);
+                }
+            }
+
+            lost += dtp_rack_detect(flow, &rrbq);
+
+            if (lost && pcic->ack_nack_seq_num >= dtp->rtx_recover) {
+                /* A new loss episode: reduce the congestion window. */
+                dtp->rtx_recover = dtp->next_seq_num_to_use;
+                dtp->cc->loss(flow);
+                dtp_cgwin_clamp(dtp);
+                break;
             }
 
+            /* Let the congestion control algorithm grow the window. */
+            dtp->cc->ack(flow, acked, rtt_sample);
+            dtp_cgwin_clamp(dtp);
+
             break;
 
         case PDU_T_NACK:
-        case PDU_T_SACK:
         case PDU_T_SNACK:
             PI("Missing support for PDU type [%X]\n", pcic->base.pdu_type);
             break;
@@ -1920,6 +4266,14 @@ out:
 
     rl_buf_free(rb);
 
+    /* Retransmit the PDUs detected as lost, if any. */
+    rb_list_foreach_safe (qrb, tmp, &rrbq) {
+        RPD(1, "fast retransmission of [%lu] from rtxq\n",
+            (long unsigned)RL_BUF_PCI(qrb)->seqnum);
+        rb_list_del(qrb);
+        rmt_tx(ipcp, qrb, RL_RMT_F_CONSUME);
+    }
+
     /* Send PDUs popped out from cwq, if any. Note that the qrbs list
      * is not emptied and must not be used after the scan.*/
     rb_list_foreach_safe (qrb, tmp, &qrbs) {
@@ -1958,6 +4312,15 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
 
     if (pci->pdu_len < rb->len) {
         /* Make up for tail padding introduced at lower layers. */
+        if (unlikely(rl_buf_headlen(rb) != rb->len)) {
+            rb = rl_buf_linearize(rb, GFP_ATOMIC);
+            if (unlikely(!rb)) {
+                RPV(1, "Out of memory\n");
+                stats->rmt.other_drop++;
+                return NULL; /* -ENOMEM */
+            }
+            pci = RL_BUF_PCI(rb);
+        }
         rb->len = pci->pdu_len;
     }
 
@@ -1969,7 +4332,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     }
 
     if (priv->csum) {
-        if (unlikely(inet_csum(pci, rb->len, 0) != 0xFFFF)) {
+        if (unlikely(rl_buf_inet_csum(rb) != 0xFFFF)) {
             RPD(1, "Dropping PDU on wrong checksum\n");
             rl_buf_free(rb);
             stats->rmt.csum_drop++;
@@ -2152,9 +4515,9 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         if ((flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) &&
             dtp->rcv_next_seq_num >= dtp->last_lwe_sent) {
             /* Send ACK control PDU. */
-            crb = ctrl_pdu_alloc(
-                ipcp, flow,
-                PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK | PDU_T_FC_BIT);
+            crb = ctrl_pdu_alloc(ipcp, flow,
+                                 PDU_T_CTRL | PDU_T_ACK_BIT |
+                                     dtp_ack_type(flow) | PDU_T_FC_BIT);
         }
 
         spin_unlock_bh(&dtp->lock);
@@ -2236,7 +4599,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         RL_BUF_RX(rb).cons_seqnum = seqnum;
         rl_buf_pci_pop(rb);
 
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        ret = rl_sdu_rx_flow_batch(ipcp, flow, rb, qlimit);
 
         /* Also deliver PDUs just extracted from the seqq. Note
          * that we must use the safe version of list scanning, since
@@ -2245,8 +4608,10 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
             rb_list_del(qrb);
             RL_BUF_RX(qrb).cons_seqnum = seqnum;
             rl_buf_pci_pop(qrb);
-            ret |= rl_sdu_rx_flow(ipcp, flow, qrb, qlimit);
+            ret |= rl_sdu_rx_flow_batch(ipcp, flow, qrb, qlimit);
         }
+        /* Wake up the reader once for the whole sequence. */
+        rl_sdu_rx_flush(flow);
 
         goto snd_crb;
     }
@@ -2261,9 +4626,14 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
 
     } else {
         /* What is not dropped nor delivered goes in the sequencing queue.
-         * Don't ack here, we have to wait for the gap to be filled. */
+         * With retransmission control we tell the sender about the gap
+         * right away, with a duplicate (or selective) ACK, so that it
+         * can recover without waiting for the rtx timeout. */
         seqq_push(flow, rb);
         rb = NULL;
+        if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+            crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
+        }
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -2282,16 +4652,23 @@ static int
 rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                           bool maysleep)
 {
-    struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
-    struct rl_buf *crb;
+    const struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct ipcp_entry *ipcp      = flow->txrx.ipcp;
+    struct dtp *dtp              = &flow->dtp;
+    struct rl_buf *crb           = NULL;
 
     spin_lock_bh(&dtp->lock);
 
     /* Update the advertised rcv_lwe and possibly send a an FC ACK
-     * control PDU. */
+     * control PDU. Without window flow control there is nothing to
+     * advertise, and an ACK would only repeat the last acknowledged
+     * sequence number, which the sender would take as a duplicate ACK
+     * caused by a PDU received out of order. */
     dtp->rcv_lwe = seqnum + 1;
-    crb          = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
+    if ((dc->flags & DTCP_CFG_FLOW_CTRL) &&
+        dc->fc.fc_type == RLITE_FC_T_WIN) {
+        crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
+    }
 
     spin_unlock_bh(&dtp->lock);
 
@@ -2326,15 +4703,14 @@ rl_normal_create(struct ipcp_entry *ipcp)
     ipcp->max_sdu_size = (1 << 16) - 1 - ipcp->txhdroom;
 
     priv->ipcp = ipcp;
-    hash_init(priv->pdu_ft);
-    hash_init(priv->pdu_ft_perflow);
-    priv->perflow_present = false;
-    priv->pduft_dflt      = NULL;
-    rwlock_init(&priv->pduft_lock);
+    if (rl_pduft_init(priv, ipcp->pcisizes.addr)) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
     priv->ttl  = RL_TTL_DFLT;
     priv->csum = false;
-
-    INIT_WORK(&priv->sched_deq_work, sched_deq_worker);
+    mutex_init(&priv->rmt_lock);
+    init_waitqueue_head(&priv->rmt_wqh);
 
     PD("New IPC created [%p]\n", priv);
 
@@ -2346,10 +4722,12 @@ rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    cancel_work_sync(&priv->sched_deq_work);
+    mutex_lock(&priv->rmt_lock);
     rl_sched_replace(priv, NULL);
+    mutex_unlock(&priv->rmt_lock);
 
     rl_pduft_flush(ipcp);
+    rl_pduft_fini(priv);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -2380,9 +4758,11 @@ static struct ipcp_factory normal_factory = {
     .ops.config_get          = rl_normal_config_get,
     .ops.pduft_set           = rl_pduft_set,
     .ops.pduft_flush         = rl_pduft_flush,
-    .ops.pduft_flush_by_flow = rl_pduft_flush_by_flow,
+    .ops.pduft_flush_by_flow = rl_normal_pduft_flush_by_flow,
     .ops.pduft_del           = rl_pduft_del,
     .ops.pduft_del_addr      = rl_pduft_del_addr,
+    .ops.pduft_stats         = rl_pduft_stats,
+    .ops.pduft_batch         = rl_pduft_batch,
     .ops.mgmt_sdu_build      = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx              = rl_normal_sdu_rx,
     .ops.flow_writeable      = rl_normal_flow_writeable,
@@ -2413,6 +4793,16 @@ rl_normal_init(void)
     /* Build the (static) list of PDU schedulers. */
     list_add_tail(&rl_sched_pfifo_ops.node, &rl_pdu_schedulers);
     list_add_tail(&rl_sched_wrr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_fq_codel_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_htb_ops.node, &rl_pdu_schedulers);
+
+    /* Build the (static) list of congestion control algorithms. */
+    BUILD_BUG_ON(sizeof(struct rl_cc_cubic) > RL_CC_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct rl_cc_vegas) > RL_CC_PRIV_SIZE);
+    list_add_tail(&rl_cc_aimd_ops.node, &rl_cc_algorithms);
+    list_add_tail(&rl_cc_cubic_ops.node, &rl_cc_algorithms);
+    list_add_tail(&rl_cc_vegas_ops.node, &rl_cc_algorithms);
 
     return rl_ipcp_factory_register(&normal_factory);
 }
@@ -38,10 +38,12 @@
 #include <linux/list.h>
 #include <asm/atomic.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/version.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/seqlock.h>
 
 #include "kerconfig.h"
 
@@ -56,6 +58,10 @@
 #include <linux/socket.h> /* memcpy_{to,from}iovecend */
 #endif
 
+#ifndef RL_HAVE_WAIT_QUEUE_ENTRY
+typedef wait_queue_t wait_queue_entry_t;
+#endif
+
 /* Enable if you wish to enable RMT queues. This is currently disabled because
  * it is not SMP scalable, and its advantages are still not clear.
  * We may reintroduce RMT queues once we add support for RMT scheduling; in
@@ -142,11 +148,13 @@ struct rina_pci;
  * If RL_SKB is defined, we use struct sk_buff for packet data and metadata,
  * rather than using a custom implementation.
  * The custom implementation is smaller and simpler, but it
- * requires copies and allocations at the shim-eth layer.
+ * requires copies and allocations at the shim-eth layer (only
+ * the linear part is copied, page fragments are attached to the skb).
  */
 
 #ifndef RL_SKB
 struct rl_buf;
+struct sk_buff;
 #else /* RL_SKB */
 #include <linux/skbuff.h>
 #define rl_buf sk_buff /* just map on sk_buff */
@@ -159,18 +167,55 @@ struct rl_buf *rl_buf_clone(struct rl_buf *rb, gfp_t gfp);
 
 void __rl_buf_free(struct rl_buf *rb);
 
+#ifndef RL_SKB
+/* Size classes of the per-CPU buffer cache (see bufs.c). */
+enum {
+    RL_BUFCACHE_SMALL = 0, /* control PDUs, ACKs, keepalives */
+    RL_BUFCACHE_MEDIUM,    /* Ethernet-sized PDUs */
+    RL_BUFCACHE_LARGE,     /* up to the largest hdroom + MSS + tailroom */
+    RL_BUFCACHE_NCLASSES,
+};
+
+struct rl_buf_cache_stats {
+    uint64_t hdr_hit;
+    uint64_t hdr_miss;
+    uint64_t block_hit[RL_BUFCACHE_NCLASSES];
+    uint64_t block_miss[RL_BUFCACHE_NCLASSES];
+};
+
+int rl_buf_cache_init(void);
+void rl_buf_cache_fini(void);
+void rl_buf_cache_hint(size_t real_size);
+void rl_buf_cache_stats_get(struct rl_buf_cache_stats *stats);
+#else /* RL_SKB */
+/* Native sk_buffs already come from dedicated slab caches. */
+#define rl_buf_cache_init() 0
+#define rl_buf_cache_fini()
+#define rl_buf_cache_hint(_sz)
+#endif /* RL_SKB */
+
 union rl_buf_ctx {
     struct {
         /* Used in the TX datapath when this rb ends up into
-         * a retransmission queue. */
-        unsigned long rtx_jiffies;
-        unsigned long jiffies;
+         * a retransmission queue. Times are in nanoseconds. */
+        u64 rtx_ns;  /* expiration time */
+        u64 sent_ns; /* first transmission, 0 if retransmitted */
+        /* Time of the last (re)transmission, for loss detection. */
+        u64 xmit_ns;
+#define RL_RTX_F_SACKED (1 << 0)   /* the receiver holds this PDU */
+#define RL_RTX_F_RTX (1 << 1)    /* retransmitted at least once */
+        unsigned int flags;
+        /* Linkage in the list of rtxq entries sorted by rtx_ns. */
+        struct list_head exp_node;
     } rtx;
 
     struct {
         /* Used in the TX datapath when this rb ends up into
          * an RMT queue. */
         struct flow_entry *lower_flow;
+        /* Enqueue time in nanoseconds, for schedulers that look at
+         * the sojourn time. */
+        u64 enq_ns;
     } rmt;
 
     struct {
@@ -182,43 +227,102 @@ union rl_buf_ctx {
 #ifndef RL_SKB
 /* Custom implementation of packet data and metadata.
  * The struct rl_rawbuf takes the role of struct skb_shared_info,
- * while struct rl_buf takes the role of struct sk_buff. */
+ * while struct rl_buf takes the role of struct sk_buff.
+ * A buffer returned by rl_buf_alloc() is a single cache-aligned
+ * allocation (block), where the struct rl_buf is immediately followed by
+ * the struct rl_rawbuf, so that header, reference counter and packet data
+ * are close to each other. A clone returned by rl_buf_clone() has its own
+ * struct rl_buf, and shares the raw buffer (and therefore the whole block)
+ * with the original buffer. The block is released when the raw buffer
+ * reference counter drops to zero. */
 struct rl_rawbuf {
     size_t size;
     atomic_t refcnt;
+    struct rl_buf_frags *frags; /* NULL if the buffer is linear */
     uint8_t buf[0];
 };
 
+/* Large SDUs written by applications can be stored in a chain of page
+ * fragments, rather than in the linear part of the raw buffer. The
+ * linear part only contains the headers (PCIs) pushed by the stack.
+ * Fragments are read-only, and they are shared by all the clones. */
+struct rl_buf_frag {
+    struct page *page;
+    unsigned int off;
+    unsigned int len;
+};
+
+struct rl_buf_frags {
+    unsigned int nr;
+    size_t len; /* sum of the fragment lengths */
+    struct rl_buf_frag f[0];
+};
+
+/* Minimum SDU size worth being stored in page fragments, and maximum
+ * number of fragments per buffer. */
+#define RL_BUF_FRAGS_THRESH 512
+#define RL_BUF_FRAGS_MAX 17
+
+/* Maximum number of kvec entries filled in by rl_buf_kvec(). */
+#define RL_BUF_KVEC_MAX (1 + RL_BUF_FRAGS_MAX)
+
 struct rl_buf {
     struct rl_rawbuf *raw;
     struct rina_pci *pci;
-    size_t len;
+    size_t len;      /* linear part + fragments */
+    size_t data_len; /* bytes still to be consumed in the fragments */
     union rl_buf_ctx u;
     struct list_head node;
 };
 
+/* Raw buffer contained in the same block as 'rb', and block owner of
+ * 'raw'. A buffer is a clone if rb->raw != RL_BUF_INLINE_RAW(rb). */
+#define RL_BUF_INLINE_RAW(rb) ((struct rl_rawbuf *)((rb) + 1))
+#define RL_RAWBUF_OWNER(raw) (((struct rl_buf *)(raw)) - 1)
+#define RL_BUF_BLOCK_OVERHEAD                                                  \
+    (sizeof(struct rl_buf) + sizeof(struct rl_rawbuf))
+
 #define RL_BUF_DATA(rb) ((uint8_t *)rb->pci)
 #define RL_BUF_PCI(rb) rb->pci
 #define RL_BUF_PCI_CTRL(rb) ((struct rina_pci_ctrl *)rb->pci)
 #define RL_BUF_RTX(rb) (rb)->u.rtx
 #define RL_BUF_RX(rb) (rb)->u.rx
 #define RL_BUF_RMT(rb) (rb)->u.rmt
+#define RL_BUF_RTX_EXP_ENTRY(n) container_of(n, struct rl_buf, u.rtx.exp_node)
 
 /* Amount of memory consumed by this packet. */
 static inline unsigned int
 rl_buf_truesize(struct rl_buf *rb)
 {
-    return sizeof(*rb) + rb->raw->size;
+    return sizeof(*rb) + rb->raw->size +
+           (rb->raw->frags ? rb->raw->frags->len : 0);
+}
+
+/* Length of the linear part. */
+static inline size_t
+rl_buf_headlen(struct rl_buf *rb)
+{
+    return rb->len - rb->data_len;
 }
 
 static inline int
 rl_buf_custom_pop(struct rl_buf *rb, size_t len)
 {
+    size_t headlen = rl_buf_headlen(rb);
+
     if (unlikely(rb->len < len)) {
         RPD(1, "No enough data to pop %zu bytes\n", len);
         return -1;
     }
 
+    if (unlikely(len > headlen)) {
+        /* Consume the whole linear part, and part of the fragments. */
+        rb->pci = (struct rina_pci *)(((uint8_t *)rb->pci) + headlen);
+        rb->data_len -= len - headlen;
+        rb->len -= len;
+        return 0;
+    }
+
     rb->pci = (struct rina_pci *)(((uint8_t *)rb->pci) + len);
     rb->len -= len;
 
@@ -242,21 +346,70 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
 static inline void
 rl_buf_append(struct rl_buf *rb, size_t len)
 {
+    BUG_ON(rb->data_len); /* cannot append after the fragments */
     rb->len += len;
     BUG_ON((uint8_t *)(rb->pci) + rb->len > rb->raw->buf + rb->raw->size);
 }
 
+/* Locate the first fragment that has not been consumed yet. Must be
+ * called with rb->data_len > 0. */
+static inline unsigned int
+rl_buf_frag_first(struct rl_buf *rb, unsigned int *off, unsigned int *len)
+{
+    struct rl_buf_frags *frags = rb->raw->frags;
+    size_t skip                = frags->len - rb->data_len;
+    unsigned int i;
+
+    for (i = 0; skip >= frags->f[i].len; i++) {
+        skip -= frags->f[i].len;
+    }
+    *off = frags->f[i].off + skip;
+    *len = frags->f[i].len - skip;
+
+    return i;
+}
+
+static inline void *
+rl_buf_frag_address(struct rl_buf_frag *frag, unsigned int off)
+{
+    /* Fragments are never allocated from high memory. */
+    return page_address(frag->page) + off;
+}
+
+struct rl_buf *rl_buf_linearize(struct rl_buf *rb, gfp_t gfp);
+void rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t len);
+int rl_buf_kvec(struct rl_buf *rb, struct kvec *vec);
+void rl_buf_copy_to_skb(struct rl_buf *rb, struct sk_buff *skb);
+
 #ifdef RL_HAVE_CHRDEV_RW_ITER
+int rl_buf_frags_from_user(struct rl_buf *rb, struct iov_iter *from,
+                           size_t len);
+int rl_buf_frags_copy_to_user(struct rl_buf *rb, struct iov_iter *to,
+                              size_t bytes);
+
 static inline int
 rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t bytes)
 {
+    if (unlikely(rb->data_len)) {
+        return rl_buf_frags_copy_to_user(rb, to, bytes);
+    }
+
     return copy_to_iter(RL_BUF_DATA(rb), bytes, to);
 }
 #else  /* AIO_RW */
+int rl_buf_frags_copy_to_user(struct rl_buf *rb, const struct iovec *to,
+                              size_t bytes);
+
 static inline int
 rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 {
-    int ret = memcpy_toiovecend(to, RL_BUF_DATA(rb), 0, bytes);
+    int ret;
+
+    if (unlikely(rb->data_len)) {
+        return rl_buf_frags_copy_to_user(rb, to, bytes);
+    }
+
+    ret = memcpy_toiovecend(to, RL_BUF_DATA(rb), 0, bytes);
 
     return ret ? ret : bytes;
 }
@@ -276,6 +429,8 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define rb_list_del(rb) list_del_init(&(rb)->node)
 #define rb_list_empty(l) list_empty(l)
 #define rb_list_front(l) list_first_entry(l, struct rl_buf, node)
+#define rb_list_back(l) list_entry((l)->prev, struct rl_buf, node)
+#define rb_list_enq_head(rb, q) list_add(&(rb)->node, q)
 #define rb_list_foreach(rb, l) list_for_each_entry (rb, l, node)
 #define rb_list_foreach_safe(rb, tmp, l)                                       \
     list_for_each_entry_safe (rb, tmp, l, node)
@@ -291,6 +446,10 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define RL_BUF_RTX(rb) ((union rl_buf_ctx *)((rb)->cb))->rtx
 #define RL_BUF_RX(rb) ((union rl_buf_ctx *)((rb)->cb))->rx
 #define RL_BUF_RMT(rb) ((union rl_buf_ctx *)((rb)->cb))->rmt
+#define RL_BUF_RTX_EXP_ENTRY(n)                                                \
+    ((struct rl_buf *)((uint8_t *)container_of(n, union rl_buf_ctx,            \
+                                               rtx.exp_node) -                 \
+                       offsetof(struct sk_buff, cb)))
 
 static inline unsigned int
 rl_buf_truesize(struct rl_buf *rb)
@@ -325,6 +484,31 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
 }
 
 #define rl_buf_append(_rb, _len) skb_put(_rb, _len)
+#define rl_buf_headlen(_rb) skb_headlen(_rb)
+#define rl_buf_copy_bits(_rb, _dst, _len) skb_copy_bits(_rb, 0, _dst, _len)
+
+static inline struct rl_buf *
+rl_buf_linearize(struct rl_buf *rb, gfp_t gfp)
+{
+    if (unlikely(skb_linearize(rb))) {
+        kfree_skb(rb);
+        return NULL;
+    }
+
+    return rb;
+}
+
+#define RL_BUF_KVEC_MAX 1
+
+static inline int
+rl_buf_kvec(struct rl_buf *rb, struct kvec *vec)
+{
+    /* Buffers are linearized before being passed to the shims. */
+    vec[0].iov_base = rb->data;
+    vec[0].iov_len  = skb_headlen(rb);
+
+    return 1;
+}
 
 #ifdef RL_HAVE_CHRDEV_RW_ITER
 static inline int
@@ -380,6 +564,16 @@ rb_list_enq(struct rl_buf *elem, struct rb_list *list)
     list->prev       = elem;
 }
 
+static inline void
+rb_list_enq_head(struct rl_buf *elem, struct rb_list *list)
+{
+    BUG_ON(elem->prev != NULL || elem->next != NULL);
+    list->next->prev = elem;
+    elem->prev       = (struct rl_buf *)list;
+    elem->next       = list->next;
+    list->next       = elem;
+}
+
 static inline void
 rb_list_del(struct rl_buf *elem)
 {
@@ -395,6 +589,12 @@ rb_list_front(struct rb_list *list)
     return list->next;
 }
 
+static inline struct rl_buf *
+rb_list_back(struct rb_list *list)
+{
+    return list->prev;
+}
+
 #define rb_list_foreach(_cur, _l)                                              \
     for (_cur = (_l)->next; _cur != ((struct rl_buf *)(_l)); _cur = _cur->next)
 
@@ -414,6 +614,7 @@ struct ipcp_entry;
 struct flow_entry;
 struct rl_ctrl;
 struct pduft_entry;
+struct rl_pduft_mod;
 
 struct ipcp_ops {
     bool (*flow_writeable)(struct flow_entry *flow);
@@ -452,13 +653,16 @@ struct ipcp_ops {
     int (*config_get)(struct ipcp_entry *ipcp, const char *param_name,
                       char *buf, int buflen);
     int (*pduft_set)(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
-                     struct flow_entry *flow);
+                     struct flow_entry *flow, unsigned int flags);
     int (*pduft_del)(struct ipcp_entry *ipcp, struct pduft_entry *entry);
     int (*pduft_del_addr)(struct ipcp_entry *ipcp,
                           const struct rl_pci_match *match);
     int (*pduft_flush)(struct ipcp_entry *ipcp);
     int (*pduft_flush_by_flow)(struct ipcp_entry *ipcp,
                                const struct flow_entry *flow);
+    int (*pduft_stats)(struct ipcp_entry *ipcp, struct rl_pduft_stats *stats);
+    int (*pduft_batch)(struct ipcp_entry *ipcp, const struct rl_pduft_mod *mods,
+                       struct flow_entry **flows, unsigned int n);
     int (*mgmt_sdu_build)(struct ipcp_entry *ipcp,
                           const struct rl_mgmt_hdr *hdr, struct rl_buf *rb,
                           struct ipcp_entry **lower_ipcp,
@@ -471,16 +675,24 @@ struct ipcp_ops {
 struct txrx {
     /* Read operation support. */
     struct rb_list rx_q;
-    unsigned int rx_qsize; /* in bytes */
+    unsigned int rx_qsize;  /* in bytes */
+    unsigned int rx_qlimit; /* in bytes, 0 to derive it from the flow spec */
+    unsigned int rx_qlen;   /* in SDUs */
+    unsigned int rx_lowat;  /* readers are woken up only with this many SDUs
+                             * queued, 0 means as soon as one is available */
     wait_queue_head_t rx_wqh;
     spinlock_t rx_lock;
 #define RL_TXRX_EOF (1 << 0)
+#define RL_TXRX_WAKE_PENDING (1 << 1)
     uint8_t flags;
 
     /* Write operation support. */
     struct ipcp_entry *ipcp;
     wait_queue_head_t __tx_wqh;
     wait_queue_head_t *tx_wqh;
+
+    /* Shared memory rings, if any (protected by rx_lock). */
+    struct rl_io_rings *rings;
 };
 
 struct dif {
@@ -522,6 +734,14 @@ struct ipcp_entry {
     struct rl_ctrl *uipcp;
     struct txrx *mgmt_txrx;
 
+    /* Memory budget for the userspace receive queues of the flows
+     * supported by this IPCP. When the budget is exceeded, flows
+     * queueing more than their fair share of the budget (with respect
+     * to the number of flows with a non-empty queue) start dropping. */
+    uint32_t rxq_budget;
+    atomic_t rxq_mem;
+    atomic_t rxq_active;
+
     wait_queue_head_t tx_wqh;
 
     /* Per-cpu lossy statistics, to allow accounting without cacheline
@@ -558,6 +778,53 @@ struct upper_ref {
     struct ipcp_entry *ipcp;
 };
 
+/* High resolution timer, used for the DTCP timers that scale with the
+ * RTT. As for a timer_list, the function runs in softirq context, either
+ * natively or through a tasklet if soft hrtimers are not supported. */
+struct rl_hrtimer {
+    struct hrtimer tmr;
+#ifndef RL_HAVE_HRTIMER_SOFT
+    struct tasklet_struct tasklet;
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+    void (*func)(struct rl_hrtimer *);
+};
+
+#ifdef RL_HAVE_HRTIMER_SOFT
+#define RL_HRTIMER_MODE_ABS HRTIMER_MODE_ABS_SOFT
+#else /* !RL_HAVE_HRTIMER_SOFT */
+#define RL_HRTIMER_MODE_ABS HRTIMER_MODE_ABS
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+
+void rl_hrtimer_init(struct rl_hrtimer *t, void (*func)(struct rl_hrtimer *));
+void rl_hrtimer_cancel_sync(struct rl_hrtimer *t);
+
+/* Start (or restart) the timer, to expire at 'expires_ns' (monotonic). */
+static inline void
+rl_hrtimer_start(struct rl_hrtimer *t, u64 expires_ns)
+{
+    hrtimer_start(&t->tmr, ns_to_ktime(expires_ns), RL_HRTIMER_MODE_ABS);
+}
+
+/* Stop the timer without waiting for a running function, like
+ * del_timer(). */
+static inline void
+rl_hrtimer_cancel(struct rl_hrtimer *t)
+{
+    hrtimer_try_to_cancel(&t->tmr);
+}
+
+static inline bool
+rl_hrtimer_pending(struct rl_hrtimer *t)
+{
+    return hrtimer_is_queued(&t->tmr);
+}
+
+static inline u64
+rl_hrtimer_expires_ns(struct rl_hrtimer *t)
+{
+    return ktime_to_ns(hrtimer_get_expires(&t->tmr));
+}
+
 /* Support for token bucket traffic shaping. */
 struct tkbk {
     ktime_t t_last_refill;
@@ -581,13 +848,31 @@ struct dtp {
     unsigned int max_cwq_len;
     struct timer_list snd_inact_tmr;
     struct rb_list rtxq;
+    struct list_head rtxq_exp; /* rtxq entries by expiration time */
     unsigned int rtxq_len;
     unsigned int max_rtxq_len;
-    struct timer_list rtx_tmr;
+    struct rl_hrtimer rtx_tmr;
     struct rl_buf *rtx_tmr_next; /* the packet is going to expire next */
-    unsigned rtt;                /* estimated round trip time, in jiffies. */
-    unsigned rtt_stddev;
+    u32 rtt_us;                  /* estimated round trip time */
+    u32 rtt_stddev_us;
+    u32 rto_us;     /* retransmission timeout */
     unsigned cgwin; /* number of PDUs in the congestion window */
+    /* Congestion control algorithm, and its per-flow state. */
+    const struct rl_cc_ops *cc;
+#define RL_CC_PRIV_SIZE 48
+#define RL_CC_PRIV(_dtp) ((void *)(_dtp)->cc_priv)
+    u64 cc_priv[RL_CC_PRIV_SIZE / sizeof(u64)];
+    /* The window is not reduced again for losses detected below this
+     * sequence number, which ends the current loss episode. */
+    rlm_seq_t rtx_recover;
+    rlm_seq_t last_ack_rcvd; /* last cumulative ack received */
+    unsigned int dup_acks;   /* consecutive duplicate acks */
+    /* Most recently transmitted PDU known to be delivered (RACK), and
+     * highest sequence number delivered. */
+    u64 rack_xmit_ns;
+    rlm_seq_t rack_seq;
+    rlm_seq_t rack_end;
+    struct rl_hrtimer tlp_tmr; /* tail loss probe timer */
     struct tkbk tkbk;
 
     /* Receiver state. */
@@ -601,11 +886,12 @@ struct dtp {
     struct timer_list rcv_inact_tmr;
     struct rb_list seqq;
     unsigned int seqq_len;
-    struct timer_list a_tmr;
+    struct rl_hrtimer a_tmr;
 
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
 #define DTP_F_TIMERS_INITIALIZED (1 << 2)
+#define DTP_F_TLP_OUT (1 << 3) /* a tail loss probe is outstanding */
     uint8_t flags;
 };
 
@@ -641,15 +927,44 @@ struct flow_entry {
 #define RL_FLOW_DEALLOCATED (1 << 3)   /* flow has been deallocated */
 #define RL_FLOW_DEL_POSTPONED (1 << 4) /* flow removal has been postponed */
 #define RL_FLOW_INITIATOR (1 << 5)     /* local node initiated this flow */
+#define RL_FLOW_DOWN (1 << 6)          /* the underlying link is down */
     uint8_t flags;
     struct hlist_node node;
     struct hlist_node node_cep;
 };
 
+/* Maximum number of equal-cost lower flows in a PDUFT entry. */
+#define RL_PDUFT_ECMP_MAX 8
+
 struct pduft_entry {
     struct rl_pci_match match;
-    struct flow_entry *flow;
+    unsigned int num_flows;
+    struct flow_entry *flows[RL_PDUFT_ECMP_MAX];
+    struct flow_entry *backup; /* used when the selected flow is down */
     struct hlist_node node; /* for the pdu_ft hash table */
+    struct rcu_head rcu;    /* for deferred free */
+};
+
+/* Node of the path-compressed binary trie used for prefix entries. */
+struct pduft_trie_node {
+    rlm_addr_t prefix; /* masked to the first 'plen' bits */
+    uint8_t plen;
+    struct pduft_entry __rcu *entry; /* entry for this prefix, if any */
+    struct pduft_trie_node __rcu *child[2];
+    struct rcu_head rcu;
+};
+
+/* Destination-based PDUFT: either a hash table or an array directly
+ * indexed by the destination address. */
+struct pduft_table {
+    uint8_t type;       /* RL_PDUFT_T_HASH or RL_PDUFT_T_ARRAY */
+    unsigned int bits;  /* log2 of the number of buckets or slots */
+    unsigned int count; /* number of entries */
+    struct rcu_head rcu;
+    union {
+        struct hlist_head buckets[0];
+        struct pduft_entry __rcu *slots[0];
+    };
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -701,6 +1016,11 @@ int rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port);
 int rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                    struct rl_buf *rb, bool qlimit);
 
+int rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rl_buf *rb, bool qlimit);
+
+void rl_sdu_rx_flush(struct flow_entry *flow);
+
 struct rl_buf *rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb);
 
 void rl_write_restart_flow(struct flow_entry *flow);
@@ -733,6 +1053,16 @@ void flow_make_mortal(struct flow_entry *flow);
 
 void rl_flow_shutdown(struct flow_entry *flow);
 
+void rl_flow_set_down(struct flow_entry *flow, bool down);
+
+/* Lockless check used by the datapath to avoid lower flows that
+ * cannot carry traffic anymore. */
+static inline bool
+rl_flow_unusable(const struct flow_entry *flow)
+{
+    return READ_ONCE(flow->flags) & (RL_FLOW_DEALLOCATED | RL_FLOW_DOWN);
+}
+
 void rl_iodevs_shutdown_by_ipcp(struct ipcp_entry *ipcp);
 
 void rl_iodevs_probe_ipcp_references(struct ipcp_entry *ipcp);
@@ -748,20 +1078,81 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
 {
     spin_lock_init(&txrx->rx_lock);
     rb_list_init(&txrx->rx_q);
-    txrx->rx_qsize = 0;
+    txrx->rx_qsize  = 0;
+    txrx->rx_qlimit = 0;
+    txrx->rx_qlen   = 0;
+    txrx->rx_lowat  = 0;
     init_waitqueue_head(&txrx->rx_wqh);
     txrx->ipcp = ipcp;
     init_waitqueue_head(&txrx->__tx_wqh);
     txrx->tx_wqh = &txrx->__tx_wqh; /* Use per-flow tx_wqh by default. */
     txrx->flags  = 0;
+    txrx->rings  = NULL;
+}
+
+/* Add 'rb' to the receive queue, updating the per-IPCP accounting.
+ * To be called under txrx->rx_lock. */
+static inline void
+txrx_rxq_enq(struct txrx *txrx, struct rl_buf *rb)
+{
+    unsigned int truesize = rl_buf_truesize(rb);
+
+    rb_list_enq(rb, &txrx->rx_q);
+    txrx->rx_qlen++;
+    if (txrx->rx_qsize == 0) {
+        atomic_inc(&txrx->ipcp->rxq_active);
+    }
+    txrx->rx_qsize += truesize;
+    atomic_add(truesize, &txrx->ipcp->rxq_mem);
+}
+
+/* Unlink 'rb' from the receive queue, updating the per-IPCP accounting.
+ * To be called under txrx->rx_lock. */
+static inline void
+txrx_rxq_del(struct txrx *txrx, struct rl_buf *rb)
+{
+    unsigned int truesize = rl_buf_truesize(rb);
+
+    rb_list_del(rb);
+    txrx->rx_qlen--;
+    txrx->rx_qsize -= truesize;
+    atomic_sub(truesize, &txrx->ipcp->rxq_mem);
+    if (txrx->rx_qsize == 0) {
+        atomic_dec(&txrx->ipcp->rxq_active);
+    }
+}
+
+/* Drop all the packets in the receive queue. */
+static inline void
+txrx_rxq_purge(struct txrx *txrx)
+{
+    struct rl_buf *rb, *tmp;
+
+    rb_list_foreach_safe (rb, tmp, &txrx->rx_q) {
+        txrx_rxq_del(txrx, rb);
+        rl_buf_free(rb);
+    }
+}
+
+/* Is there enough to read to wake up a reader? To be called under
+ * txrx->rx_lock. */
+static inline bool
+txrx_rx_readable(const struct txrx *txrx)
+{
+    return txrx->rx_qlen >= max(txrx->rx_lowat, 1U) ||
+           (txrx->flags & RL_TXRX_EOF);
 }
 
 struct rl_sched;
+struct rl_rmt;
+struct rl_normal;
 
 struct rl_sched_ops {
     const char *name;
     size_t priv_size;
-    int (*init)(struct rl_sched *);
+    /* If 'tmpl' is not NULL, the new instance takes the configuration
+     * of 'tmpl', otherwise the default one. */
+    int (*init)(struct rl_sched *, const struct rl_sched *tmpl, gfp_t gfp);
     void (*fini)(struct rl_sched *);
     int (*config)(struct rl_sched *, const struct rl_msg_base *bmsg);
     int (*enq)(struct rl_sched *, struct rl_buf *);
@@ -769,15 +1160,97 @@ struct rl_sched_ops {
     struct list_head node;
 };
 
+/* A congestion control algorithm for DTCP. The callbacks are invoked
+ * under the DTP lock and update dtp->cgwin, which the caller then keeps
+ * within its bounds. Per-flow state is stored in RL_CC_PRIV(dtp). */
+struct rl_cc_ops {
+    const char *name;
+    /* Reset the algorithm state, when the flow (re)starts. */
+    void (*init)(struct flow_entry *);
+    /* An ACK acknowledged 'acked' new PDUs (possibly none). 'rtt_us' is
+     * the most recent RTT sample carried by the ACK, or zero. */
+    void (*ack)(struct flow_entry *, unsigned int acked, u32 rtt_us);
+    /* A new loss episode was detected, through duplicate or selective
+     * ACKs or RACK. */
+    void (*loss)(struct flow_entry *);
+    /* The retransmission timer fired. */
+    void (*timeout)(struct flow_entry *);
+    struct list_head node;
+};
+
+/* An instance of a PDU scheduler. */
 struct rl_sched {
     struct rl_sched_ops ops;
-    wait_queue_head_t wqh;
-    spinlock_t qlock;
+    /* PDUs dropped by enq() or deq(), to be released by the caller
+     * outside its locks (see rl_sched_drop()). */
+    struct rb_list drops;
+    /* Set by shaping schedulers when deq() returns NULL although
+     * some PDUs are queued: the time (as in ktime_get_ns()) when
+     * deq() should be called again. */
+    u64 next_ns;
 #define RL_SCHED_PRIV(_sched) ((void *)(_sched)->priv)
     /* Private data allocated at the end of the struct. */
     char priv[0];
 };
 
+/* Called by the scheduler implementations to drop a PDU. */
+static inline void
+rl_sched_drop(struct rl_sched *sched, struct rl_buf *rb)
+{
+    rb_list_enq(rb, &sched->drops);
+}
+
+/* RMT output queue towards an N-1 flow, with its own scheduler instance
+ * and backpressure state. The queue is woken up through a custom entry
+ * in the transmit wait queue of the N-1 flow. */
+struct rl_rmtq {
+    struct flow_entry *lower_flow;
+    struct rl_rmt *rmt;
+    struct rl_sched *sched;
+    unsigned int backlog;    /* PDUs queued in 'sched' */
+    struct rb_list held;     /* dequeued, but refused by the N-1 flow */
+    struct rb_list ovf;      /* refused by 'sched' */
+    unsigned int ovf_len;    /* senders are pushed back when too long */
+    unsigned int wakeups;    /* incremented on each N-1 flow wakeup */
+    bool blocked;            /* the N-1 flow is not writable */
+    bool busy;               /* a worker is transmitting from the queue */
+    bool dead;               /* the N-1 flow is going away */
+    bool throttled;          /* 'sched' is shaping, wait for 'throttle' */
+    struct hrtimer throttle; /* fires at sched->next_ns */
+    wait_queue_entry_t wait; /* in lower_flow->txrx.tx_wqh */
+    struct hlist_node node;  /* in rmt->queues */
+    struct list_head ready;  /* in rmt->ready, if there is work to do */
+};
+
+/* Per-CPU front-end of the RMT. Senders stage their PDUs on the queue
+ * of the local CPU, without touching the RMT lock. The per-CPU worker
+ * merges the staged PDUs into the output queues in batches, and then
+ * serves the ready output queues in parallel with the workers of the
+ * other CPUs. */
+struct rl_sched_cpu {
+    spinlock_t lock;
+    struct rb_list inq;
+    unsigned int inq_len;
+    struct work_struct work;
+    struct rl_rmt *rmt;
+};
+
+/* PDU scheduling in the RMT of a normal IPCP. */
+struct rl_rmt {
+    struct rl_normal *priv;
+    /* Scheduler instance holding the configuration that the output
+     * queues are initialized from. It never holds PDUs. */
+    struct rl_sched *tmpl;
+    struct rl_sched_cpu __percpu *cpus;
+    /* Protects 'queues', 'ready' and the state of the output queues. */
+    spinlock_t lock;
+#define RL_RMTQ_HASH_BITS 5
+    DECLARE_HASHTABLE(queues, RL_RMTQ_HASH_BITS);
+    /* Output queues with PDUs to transmit, whose N-1 flow is writable,
+     * and which are not being served by any worker. */
+    struct list_head ready;
+};
+
 /* Implementation of the normal IPCP. */
 struct rl_normal {
     struct ipcp_entry *ipcp;
@@ -785,21 +1258,34 @@ struct rl_normal {
     bool csum;    /* compute/check internet checksum on each PDU */
 
     /* Implementation of the PDU Forwarding Table (PDUFT): a lock, a
-     * default entry, and two hash tables. One of the has tables maps
-     * (dst_addr) --> (lower_flow). The other maps
+     * default entry, a trie and two tables. One of the tables maps
+     * (dst_addr) --> (lower_flow), and grows with the number of
+     * destinations. The other is a hash table that maps
      * (dst_addr, src_addr, dst_cepid, src_cepid, qosid) --> (lower_flow)
+     * The trie maps destination prefixes to lower flows, and it is only
+     * looked up (longest prefix match) when the tables have no entry.
+     * Lookups are protected by RCU, the lock only serializes updates.
+     * Lookups retry when they overlap with the installation of a batch
+     * of modifications, which is delimited by the seqcount.
      */
-    rwlock_t pduft_lock;
-    struct flow_entry *pduft_dflt;
+    struct mutex pduft_lock;
+    seqcount_t pduft_seq;
+    struct pduft_entry __rcu *pduft_dflt;
+    struct pduft_table __rcu *pduft;
+    struct pduft_trie_node __rcu *pduft_trie;
+    unsigned int trie_count; /* number of prefix entries */
+    uint8_t addr_bits;       /* size of DIF addresses */
     bool perflow_present;
 #define PDUFT_HASHTABLE_BITS 3
-    DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
     DECLARE_HASHTABLE(pdu_ft_perflow, PDUFT_HASHTABLE_BITS);
 
     /* Support for PDU scheduling. May be NULL if no PDU scheduler is
-     * actually installed. */
-    struct rl_sched *sched;
-    struct work_struct sched_deq_work;
+     * actually installed. Readers use RCU, while replacements and
+     * rmt_flow_release() are serialized by 'rmt_lock'. */
+    struct rl_rmt __rcu *rmt;
+    struct mutex rmt_lock;
+    /* Senders waiting for a congested output queue. */
+    wait_queue_head_t rmt_wqh;
 };
 
 void dtp_init(struct dtp *dtp);
@@ -808,16 +1294,28 @@ void dtp_dump(struct dtp *dtp);
 int rl_pduft_del_addr(struct ipcp_entry *ipcp,
                       const struct rl_pci_match *match);
 int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry);
+int rl_pduft_batch(struct ipcp_entry *ipcp, const struct rl_pduft_mod *mods,
+                   struct flow_entry **flows, unsigned int n);
 int rl_pduft_flush(struct ipcp_entry *ipcp);
 int rl_pduft_flush_by_flow(struct ipcp_entry *ipcp,
                            const struct flow_entry *flow);
 int rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
-                 struct flow_entry *flow);
+                 struct flow_entry *flow, unsigned int flags);
 struct flow_entry *rl_pduft_lookup(struct rl_normal *priv,
                                    const struct rl_pci_match *pci);
+int rl_pduft_stats(struct ipcp_entry *ipcp, struct rl_pduft_stats *stats);
+int rl_pduft_init(struct rl_normal *priv, unsigned int addr_size);
+void rl_pduft_fini(struct rl_normal *priv);
 
 #define RL_UNBOUND_FLOW_TO (msecs_to_jiffies(15000))
 
+/* Default, minimum and maximum size of the userspace receive queue of a
+ * flow (in bytes), and default per-IPCP budget for all the queues. */
+#define RL_RXQ_SIZE_DFLT (1 << 20)
+#define RL_RXQ_SIZE_MIN (64 << 10)
+#define RL_RXQ_SIZE_MAX (64 << 20)
+#define RL_RXQ_BUDGET_DFLT (64 << 20)
+
 #define list_add_tail_safe(e, h)                                               \
     do {                                                                       \
         BUG_ON(!list_empty(e));                                                \
@@ -430,8 +430,9 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
         PD("Popping %u PDUs from rx_tmpq\n", entry->rx_tmpq_len);
         rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
             rb_list_del(rb);
-            rl_sdu_rx_flow(ipcp, flow, rb, true);
+            rl_sdu_rx_flow_batch(ipcp, flow, rb, true);
         }
+        rl_sdu_rx_flush(flow);
         entry->rx_tmpq_len = 0;
         arpt_flow_bind(entry, flow);
         ret = 0;
@@ -811,7 +812,8 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
 #ifndef RL_SKB
     hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
-    skb   = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
+    skb   = alloc_skb(hhlen + rl_buf_headlen(rb) + netdev->needed_tailroom,
+                    GFP_KERNEL);
     if (!skb) {
         rl_buf_free(rb);
         stats->tx_err++;
@@ -842,8 +844,9 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     skb_shinfo(skb)->destructor_arg = (void *)flow;
 
 #ifndef RL_SKB
-    /* Copy data into the skb. */
-    memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    /* Copy the headers into the skb, and attach the page fragments
+     * carrying the payload (if any). */
+    rl_buf_copy_to_skb(rb, skb);
 #endif /* !RL_SKB */
 
     /* Send the skb to the device for transmission. */
@@ -1049,6 +1052,15 @@ shim_eth_netdev_notify(struct notifier_block *nb, unsigned long event,
                     PD("flow %u goes down\n", flow->local_port);
                     break;
 
+                case NETDEV_CHANGE:
+                    /* Carrier change. */
+                    ntfy.flow_state = netif_carrier_ok(netdev)
+                                          ? RL_FLOW_STATE_UP
+                                          : RL_FLOW_STATE_DOWN;
+                    PD("flow %u carrier goes %s\n", flow->local_port,
+                       ntfy.flow_state == RL_FLOW_STATE_UP ? "up" : "down");
+                    break;
+
                 default:
                     filter = true;
                     break;
@@ -1058,6 +1070,10 @@ shim_eth_netdev_notify(struct notifier_block *nb, unsigned long event,
                     continue;
                 }
 
+                /* Let the upper IPCP reroute in the datapath, without
+                 * waiting for the routing recomputation in userspace. */
+                rl_flow_set_down(flow, ntfy.flow_state == RL_FLOW_STATE_DOWN);
+
                 ret =
                     rl_upqueue_append(flow->upper.ipcp->uipcp,
                                       (const struct rl_msg_base *)&ntfy, false);
@@ -67,6 +67,7 @@ rcv_work(struct work_struct *w)
     struct rl_shim_loopback *priv =
         container_of(w, struct rl_shim_loopback, rcv);
     struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->ipcp->stats);
+    struct flow_entry *last_flow = NULL;
 
     for (;;) {
         struct rl_buf *rb = NULL;
@@ -92,18 +93,33 @@ rcv_work(struct work_struct *w)
             break;
         }
 
-        ret = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
+        ret = rl_sdu_rx_flow_batch(priv->ipcp, rx_flow, rb, true);
         if (unlikely(ret)) {
             spin_lock_bh(&priv->lock);
             stats->tx_err++;
             stats->rx_err++;
             spin_unlock_bh(&priv->lock);
         }
-        flow_put(rx_flow);
+        if (rx_flow != last_flow) {
+            /* Wake up the reader of the previous run of SDUs, keeping
+             * the reference to the current flow until its run ends. */
+            if (last_flow) {
+                rl_sdu_rx_flush(last_flow);
+                flow_put(last_flow);
+            }
+            last_flow = rx_flow;
+        } else {
+            flow_put(rx_flow);
+        }
 
         rl_write_restart_flows(priv->ipcp);
         flow_put(tx_flow);
     }
+
+    if (last_flow) {
+        rl_sdu_rx_flush(last_flow);
+        flow_put(last_flow);
+    }
 }
 
 static void *
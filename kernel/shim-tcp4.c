@@ -190,7 +190,8 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
         } else if (!priv->cur_rx_hdr &&
                    priv->cur_rx_buflen == priv->cur_rx_rblen) {
             /* We have completely read the SDU. */
-            rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
+            rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, priv->cur_rx_rb,
+                                 true);
 
             stats->rx_pkt++;
             stats->rx_byte += priv->cur_rx_rblen;
@@ -203,6 +204,9 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
         }
     }
 
+    /* One reader wakeup for the whole burst. */
+    rl_sdu_rx_flush(flow);
+
     mutex_unlock(&priv->rxw_lock);
 }
 
@@ -335,20 +339,20 @@ tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf *rb)
     struct rl_ipcp_stats *stats =
         raw_cpu_ptr(flow_priv->flow->txrx.ipcp->stats);
     struct msghdr msghdr;
-    struct iovec iov[2];
+    struct kvec iov[1 + RL_BUF_KVEC_MAX];
     uint16_t lenhdr = htons(rb->len);
     int totlen      = rb->len + sizeof(lenhdr);
+    int niov;
     int ret;
 
     memset(&msghdr, 0, sizeof(msghdr));
     iov[0].iov_base = &lenhdr;
     iov[0].iov_len  = sizeof(lenhdr);
-    iov[1].iov_base = RL_BUF_DATA(rb);
-    iov[1].iov_len  = rb->len;
+    /* Linear part and page fragments (if any). */
+    niov = 1 + rl_buf_kvec(rb, iov + 1);
 
     msghdr.msg_flags = MSG_DONTWAIT;
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msghdr, (struct kvec *)iov, 2, totlen);
+    ret = kernel_sendmsg(flow_priv->sock, &msghdr, iov, niov, totlen);
 
     if (unlikely(ret != totlen)) {
         PD("wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
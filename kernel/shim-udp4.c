@@ -205,11 +205,14 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
 
         NPD("read %d bytes\n", ret);
         rb->len = ret;
-        rl_sdu_rx_flow(flow->txrx.ipcp, flow, rb, true);
+        rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, rb, true);
         stats->rx_pkt++;
         stats->rx_byte += ret;
     }
 
+    /* One reader wakeup for the whole burst. */
+    rl_sdu_rx_flush(flow);
+
     mutex_unlock(&priv->rxw_lock);
 }
 
@@ -343,11 +346,12 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     struct rl_ipcp_stats *stats      = raw_cpu_ptr(ipcp->stats);
     struct shim_udp4_flow *flow_priv = flow->priv;
     struct msghdr msg;
-    struct iovec iov;
+    struct kvec iov[RL_BUF_KVEC_MAX];
+    int niov;
     int ret;
 
-    iov.iov_base = RL_BUF_DATA(rb);
-    iov.iov_len  = rb->len;
+    /* Linear part and page fragments (if any). */
+    niov = rl_buf_kvec(rb, iov);
 
     msg.msg_name       = (struct sockaddr *)&flow_priv->remote_addr;
     msg.msg_namelen    = sizeof(flow_priv->remote_addr);
@@ -355,8 +359,7 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     msg.msg_controllen = 0;
     msg.msg_flags      = (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT;
 
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msg, (struct kvec *)&iov, 1, rb->len);
+    ret = kernel_sendmsg(flow_priv->sock, &msg, iov, niov, rb->len);
 
     if (unlikely(ret != rb->len)) {
         RPD(1, "wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
@@ -0,0 +1,113 @@
+#!/bin/bash -e
+
+# Forwarding microbenchmark. Three namespaces (red, blue and green) are
+# connected in a chain through two veth pairs and shim-eth IPCPs, with
+# a normal DIF on top, so that all the traffic between red and green is
+# forwarded by the normal IPCP in blue. For each number of cores from 1
+# to N, run that many parallel rinaperf perf flows pinned to distinct
+# cores and report the aggregate forwarding rate. Since veth delivers
+# packets on the sending CPU, the PDUFT lookups in blue run on the same
+# set of cores.
+
+source tests/libtest.sh
+
+function usage {
+    echo "$0 [-n MAX_CORES] [-D SECONDS] [-s SDU_SIZE]"
+}
+
+N=$(nproc)
+D=5
+S=64
+
+# Option parsing
+while [[ $# > 0 ]]
+do
+    key="$1"
+    case $key in
+        "-n")
+        if [ -n "$2" ]; then
+            N="$2"
+            shift
+        else
+            echo "-n requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-D")
+        if [ -n "$2" ]; then
+            D="$2"
+            shift
+        else
+            echo "-D requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-s")
+        if [ -n "$2" ]; then
+            S="$2"
+            shift
+        else
+            echo "-s requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-h")
+            usage
+            exit 0
+        ;;
+
+        *)
+        echo "Unknown option '$key'"
+        exit 255
+        ;;
+    esac
+    shift
+done
+
+create_veth_pair vrb red blue
+create_veth_pair vbg blue green
+create_namespace red
+create_namespace blue
+create_namespace green
+add_veth_to_namespace red vrb.red
+add_veth_to_namespace blue vrb.blue
+add_veth_to_namespace blue vbg.blue
+add_veth_to_namespace green vbg.green
+
+# The forwarding node.
+ip netns exec blue rlite-ctl ipcp-create blue.rb shim-eth rbdif
+ip netns exec blue rlite-ctl ipcp-config blue.rb netdev vrb.blue
+ip netns exec blue rlite-ctl ipcp-create blue.bg shim-eth bgdif
+ip netns exec blue rlite-ctl ipcp-config blue.bg netdev vbg.blue
+ip netns exec blue rlite-ctl ipcp-create blue.n normal fwdif
+ip netns exec blue rlite-ctl ipcp-enroller-enable blue.n
+ip netns exec blue rlite-ctl ipcp-register blue.n rbdif
+ip netns exec blue rlite-ctl ipcp-register blue.n bgdif
+
+# The two end nodes.
+ip netns exec red rlite-ctl ipcp-create red.rb shim-eth rbdif
+ip netns exec red rlite-ctl ipcp-config red.rb netdev vrb.red
+ip netns exec red rlite-ctl ipcp-create red.n normal fwdif
+ip netns exec red rlite-ctl ipcp-register red.n rbdif
+ip netns exec red rlite-ctl ipcp-enroll red.n fwdif rbdif blue.n
+
+ip netns exec green rlite-ctl ipcp-create green.bg shim-eth bgdif
+ip netns exec green rlite-ctl ipcp-config green.bg netdev vbg.green
+ip netns exec green rlite-ctl ipcp-create green.n normal fwdif
+ip netns exec green rlite-ctl ipcp-register green.n bgdif
+ip netns exec green rlite-ctl ipcp-enroll green.n fwdif bgdif blue.n
+start_daemon_namespace green rinaperf -lw -z fwbench
+
+# Wait for routing to converge.
+sleep 3
+
+printf "%6s %12s\n" "Cores" "Kpps"
+for n in $(seq 1 $N); do
+    kpps=$(ip netns exec red taskset -c 0-$((n - 1)) \
+           rinaperf -z fwbench -t perf -p $n -D $D -s $S |
+           awk '/^Receiver/ { sum += $3 } END { printf "%.3f", sum }')
+    printf "%6u %12s\n" $n $kpps
+done
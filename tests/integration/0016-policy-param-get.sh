@@ -62,6 +62,10 @@ rlite-ctl dif-policy-param-mod dd flowalloc max-cwq-len 2961
 rlite-ctl dif-policy-param-mod dd flowalloc max-rtxq-len 915
 rlite-ctl dif-policy-param-list dd flowalloc max-cwq-len | grep 2961
 rlite-ctl dif-policy-param-list dd flowalloc max-rtxq-len | grep 915
+rlite-ctl dif-policy-param-mod dd flowalloc selective-ack false
+rlite-ctl dif-policy-param-list dd flowalloc selective-ack | grep false
+rlite-ctl dif-policy-param-mod dd flowalloc congestion-control cubic
+rlite-ctl dif-policy-param-list dd flowalloc congestion-control | grep cubic
 
 rlite-ctl dif-policy-param-mod dd resalloc reliable-flows true
 rlite-ctl dif-policy-param-list dd resalloc reliable-flows | grep true
@@ -25,6 +25,8 @@ rlite-ctl ipcp-route-add x z y,p
 # For the following show commands IPCP 'x' is selected (and not 'y')
 rlite-ctl dif-routing-show dd | grep "\<y\>"
 rlite-ctl dif-routing-show dd | grep "\<p\>"
+# The kernel forwarding table is reported with the IPCP statistics
+rlite-ctl ipcp-stats x | grep "pduft.entries"
 # Negative tests
 rlite-ctl ipcp-route-add && exit 1
 rlite-ctl ipcp-route-add x && exit 1
@@ -18,6 +18,8 @@ rlite-ctl ipcp-config mio csum none
 rlite-ctl ipcp-config-get mio csum | grep "\<none\>"
 rlite-ctl ipcp-config mio flow-del-wait-ms 381
 rlite-ctl ipcp-config-get mio flow-del-wait-ms | grep "\<381\>"
+rlite-ctl ipcp-config mio rxq-budget 8388608
+rlite-ctl ipcp-config-get mio rxq-budget | grep "\<8388608\>"
 # Negative tests
 rlite-ctl ipcp-config-get mio fakeparam && exit 1
 rlite-ctl ipcp-config mio csum wrong && exit 1
@@ -15,6 +15,18 @@ link_set() {
     ip netns exec $right ip link set veth.${li}r $status
 }
 
+# First parameter: namespace name
+# Second parameter: signal to send to the uipcps daemon of that namespace
+uipcps_signal() {
+    local cont=$1
+    local sig=$2
+    for pid in $(pgrep -x rlite-uipcps); do
+        if [ "$(ip netns identify $pid)" == "$cont" ]; then
+            kill -$sig $pid
+        fi
+    done
+}
+
 # Create four namespaces, connected on the same LAN through a software
 # bridge and veth pairs.
 #
@@ -67,8 +79,27 @@ ip netns exec a rlite-ctl dif-routing-show normdif
 start_daemon_namespace d rinaperf -lw -z rpinstd
 # Check that A can connect to D
 ip netns exec a rinaperf -z rpinstd -i 0 -c 1
-# Now bring AD down
+# Keep a flow from A to D busy while AD goes down, with the uipcps of A and D
+# stopped, so that routes cannot be recomputed in userspace. The flow must
+# keep working on the backup lower flows selected by the kernel, and also
+# after the uipcps resume and release the lower flows over AD.
+PINGLOG=$(mktemp)
+cumulative_trap "rm -f ${PINGLOG}" "EXIT"
+ip netns exec a rinaperf -z rpinstd -i 100 -c 30 > ${PINGLOG} 2>&1 &
+PINGPID=$!
+sleep 0.5
+uipcps_signal a STOP
+uipcps_signal d STOP
+cumulative_trap "uipcps_signal a CONT; uipcps_signal d CONT" "EXIT"
 link_set ad down
+sleep 1
+uipcps_signal a CONT
+uipcps_signal d CONT
+wait ${PINGPID} || { cat ${PINGLOG}; false; }
+cat ${PINGLOG}
+grep -q "Stopping after" ${PINGLOG} && false
+# Tolerate the loss of a packet in flight on AD.
+test $(grep -c "bytes from server" ${PINGLOG}) -ge 29
 # Check that A can still connect to D (through B)
 ip netns exec a rinaperf -z rpinstd -i 0 -c 1
 # Now bring AB and BD down
@@ -20,6 +20,41 @@ rlite-ctl ipcp-sched-config pippo wrr qsize 65535 quantum 1600 weights 2,4,10
 rlite-ctl ipcp-sched-config pippo wrr qsize 65535 quantum 1600 weights 2,4,9,5
 rlite-ctl ipcp-config-get pippo sched | grep "\<wrr\>"
 
+# Check that we can set the DRR scheduler and configure it
+rlite-ctl ipcp-config pippo sched drr
+rlite-ctl ipcp-config-get pippo sched | grep "\<drr\>"
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quanta "" && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quanta 1500,0 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quanta 1500,3000,6000
+rlite-ctl ipcp-sched-config pippo wrr qsize 65535 quantum 1600 weights 1 && false
+
+# Check that we can set the FQ-CoDel scheduler and configure it
+rlite-ctl ipcp-config pippo sched fq_codel
+rlite-ctl ipcp-config-get pippo sched | grep "\<fq_codel\>"
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 64 && false
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 0 target 5000 interval 100000 quantum 1500 && false
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 64 target 5000 interval 1000 quantum 1500 && false
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 64 target 5000 interval 100000 quantum 1500
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 1 target 500 interval 10000 quantum 3000
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quanta 1500 && false
+
+# Check that we can set the HTB scheduler and configure it
+rlite-ctl ipcp-config pippo sched htb
+rlite-ctl ipcp-config-get pippo sched | grep "\<htb\>"
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 rate 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 rate 0 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 rate 2000 ceil 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 2 parent 1 rate 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 rate 1000 class 1 rate 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 rate 2000 class 2 parent 1 qos 3 rate 1000 class 3 parent 1 qos 3 rate 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 default 1 class 1 rate 2000 class 2 parent 1 rate 1000 && false
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 class 1 rate 1250000
+rlite-ctl ipcp-sched-config pippo htb qsize 65535 default 3 class 1 rate 1250000 class 2 parent 1 qos 0 rate 1000000 class 3 parent 1 qos 1 rate 250000 ceil 1250000 burst 3000
+rlite-ctl ipcp-sched-config pippo fq_codel qsize 1048576 flows 64 target 5000 interval 100000 quantum 1500 && false
+
 # Check that we can set the PFIFO scheduler, configure and remove it
 rlite-ctl ipcp-config pippo sched pfifo
 rlite-ctl ipcp-config pippo sched none
@@ -0,0 +1,49 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Two namespaces with static routing, where red reaches green through a
+# route towards an address prefix, rather than towards green itself.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+
+for cont in green red; do
+    ip netns exec ${cont} rlite-ctl ipcp-create ${cont}.eth shim-eth edif
+    ip netns exec ${cont} rlite-ctl ipcp-config ${cont}.eth netdev veth.${cont}
+    ip netns exec ${cont} rlite-ctl ipcp-config ${cont}.eth flow-del-wait-ms 100
+    ip netns exec ${cont} rlite-ctl ipcp-create ${cont}.n normal mydif
+    ip netns exec ${cont} rlite-ctl ipcp-config ${cont}.n flow-del-wait-ms 100
+    ip netns exec ${cont} rlite-ctl dif-policy-mod mydif addralloc static
+    ip netns exec ${cont} rlite-ctl dif-policy-mod mydif routing static
+    ip netns exec ${cont} rlite-ctl ipcp-register ${cont}.n edif
+done
+ip netns exec green rlite-ctl ipcp-config green.n address 77
+ip netns exec red rlite-ctl ipcp-config red.n address 20
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+start_daemon_namespace green rinaperf -lw -z rpinst1
+
+# Addresses are 32 bits wide, so 64/26 covers 64-127, including green.
+ip netns exec green rlite-ctl ipcp-route-add green.n red.n red.n
+ip netns exec red rlite-ctl ipcp-route-add red.n 64/26 green.n
+ip netns exec red rlite-ctl ipcp-stats red.n | grep "pduft.prefix *= 1$"
+ip netns exec red rlite-ctl ipcp-stats red.n | grep "pduft.entries *= 0$"
+
+# Check application connectivity through the aggregated route
+ip netns exec red rinaperf -z rpinst1 -p 1 -c 7 -i 20
+
+# Invalid prefixes are refused
+ip netns exec red rlite-ctl ipcp-route-add red.n 64/0 green.n && false
+ip netns exec red rlite-ctl ipcp-route-add red.n 64/32 green.n && false
+ip netns exec red rlite-ctl ipcp-route-add red.n 64/ green.n && false
+ip netns exec red rlite-ctl ipcp-route-add red.n a/26 green.n && false
+ip netns exec red rlite-ctl ipcp-route-del red.n 128/26 && false
+
+# Without the route, green is not reachable anymore
+ip netns exec red rlite-ctl ipcp-route-del red.n 64/26
+ip netns exec red rlite-ctl ipcp-stats red.n | grep "pduft.prefix *= 0$"
+ip netns exec red rinaperf -z rpinst1 -p 1 -c 1 -i 0 && false
+true
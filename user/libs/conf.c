@@ -259,7 +259,8 @@ out:
 /* Support for fetching flow information in kernel space. */
 
 int
-rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats)
+rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats,
+                       struct rl_pduft_stats *pduft)
 {
     struct rl_kmsg_ipcp_stats_req msg;
     struct rl_kmsg_ipcp_stats_resp *resp;
@@ -294,6 +295,9 @@ rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats)
     assert(resp->hdr.event_id == msg.hdr.event_id);
 
     *stats = resp->stats;
+    if (pduft) {
+        *pduft = resp->pduft;
+    }
 
     rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
     rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
@@ -37,6 +37,7 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
 #include "rlite/ctrl.h"
@@ -88,16 +89,21 @@ rl_read_next_msg(int rfd, int quiet)
 int
 rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
 {
-    char serbuf[4096];
+    char stackbuf[4096];
+    char *serbuf = stackbuf;
     unsigned int serlen;
     int ret;
 
-    /* Serialize the message. */
+    /* Serialize the message. Messages carrying arrays may not fit
+     * the stack buffer. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
-    if (serlen > sizeof(serbuf)) {
-        PE("Serialized message would be too long [%u]\n", serlen);
-        errno = EINVAL;
-        return -1;
+    if (serlen > sizeof(stackbuf)) {
+        serbuf = rl_alloc(serlen, RL_MT_MSG);
+        if (!serbuf) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
     }
     serlen =
         serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, msg);
@@ -120,6 +126,10 @@ rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
         ret = 0;
     }
 
+    if (serbuf != stackbuf) {
+        rl_free(serbuf, RL_MT_MSG);
+    }
+
     return ret;
 }
 
@@ -700,3 +710,264 @@ rina_flow_mss_get(int fd)
 
     return mss;
 }
+
+int
+rina_flow_rxq_limit_set(int fd, unsigned int bytes)
+{
+    uint32_t limit = bytes;
+
+    return ioctl(fd, RLITE_IOCTL_RXQ_LIMIT, &limit);
+}
+
+int
+rina_flow_rx_lowat_set(int fd, unsigned int sdus)
+{
+    uint32_t lowat = sdus;
+
+    return ioctl(fd, RLITE_IOCTL_RX_LOWAT, &lowat);
+}
+
+int
+rina_flow_group_create(void)
+{
+    return open_port_common(RL_PORT_ID_NONE, RLITE_IO_MODE_FLOW_GROUP, 0);
+}
+
+int
+rina_flow_group_add(int gfd, int fd)
+{
+    struct rl_ioctl_group req;
+
+    memset(&req, 0, sizeof(req));
+    req.fd = fd;
+    if (ioctl(gfd, RLITE_IOCTL_GROUP_ADD, &req)) {
+        return -1;
+    }
+
+    return req.port_id;
+}
+
+int
+rina_flow_group_del(int gfd, unsigned int port_id)
+{
+    struct rl_ioctl_group req;
+
+    memset(&req, 0, sizeof(req));
+    req.fd      = -1;
+    req.port_id = port_id;
+
+    return ioctl(gfd, RLITE_IOCTL_GROUP_DEL, &req);
+}
+
+int
+rina_flow_busy_poll_set(int fd, unsigned int usecs)
+{
+    uint32_t budget = usecs;
+
+    return ioctl(fd, RLITE_IOCTL_BUSY_POLL, &budget);
+}
+
+static int
+rina_flow_batch(int fd, struct rina_sdu *sdus, unsigned int num,
+                unsigned long cmd)
+{
+    struct rl_ioctl_sdu isdus[RLITE_IO_BATCH_MAX];
+    struct rl_ioctl_batch batch;
+    unsigned int i;
+    int ret;
+
+    if (num == 0) {
+        return 0;
+    }
+
+    if (num > RLITE_IO_BATCH_MAX) {
+        num = RLITE_IO_BATCH_MAX;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (sdus[i].len > UINT32_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        isdus[i].buf    = (uint64_t)(uintptr_t)sdus[i].buf;
+        isdus[i].len    = (uint32_t)sdus[i].len;
+        isdus[i].status = 0;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.sdus = (uint64_t)(uintptr_t)isdus;
+    batch.num  = num;
+
+    ret = ioctl(fd, cmd, &batch);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < num; i++) {
+        sdus[i].status = isdus[i].status;
+    }
+
+    return ret;
+}
+
+int
+rina_flow_read_batch(int fd, struct rina_sdu *sdus, unsigned int num)
+{
+    return rina_flow_batch(fd, sdus, num, RLITE_IOCTL_READ_BATCH);
+}
+
+int
+rina_flow_write_batch(int fd, struct rina_sdu *sdus, unsigned int num)
+{
+    return rina_flow_batch(fd, sdus, num, RLITE_IOCTL_WRITE_BATCH);
+}
+
+#if RINA_RING_F_TRUNC != RL_RING_SLOT_F_TRUNC ||                               \
+    RINA_RING_F_ERR != RL_RING_SLOT_F_ERR
+#error "Ring slot flags mismatch"
+#endif
+
+struct rina_flow_rings {
+    int fd;
+    void *mem;
+    size_t memsize;
+    struct rl_ring *rx;
+    struct rl_ring *tx;
+    /* TX slots already checked for errors, and errors found. */
+    uint32_t tx_reaped;
+    unsigned int tx_errors;
+};
+
+/* Collect the errors of the TX slots consumed by the kernel, before
+ * they are reused. */
+static void
+rina_flow_rings_tx_reap(struct rina_flow_rings *rings)
+{
+    struct rl_ring *tx = rings->tx;
+    uint32_t cons      = __atomic_load_n(&tx->cons, __ATOMIC_ACQUIRE);
+
+    for (; rings->tx_reaped != cons; rings->tx_reaped++) {
+        if (tx->slots[rings->tx_reaped & (tx->num_slots - 1)].flags &
+            RL_RING_SLOT_F_ERR) {
+            rings->tx_errors++;
+        }
+    }
+}
+
+struct rina_flow_rings *
+rina_flow_rings_open(int fd, unsigned int num_slots, unsigned int slot_size)
+{
+    struct rina_flow_rings *rings;
+    struct rl_rings_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.num_slots = num_slots;
+    req.slot_size = slot_size;
+    if (ioctl(fd, RLITE_IOCTL_RINGS_SETUP, &req)) {
+        return NULL;
+    }
+
+    rings = rl_alloc(sizeof(*rings), RL_MT_API);
+    if (!rings) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(rings, 0, sizeof(*rings));
+    rings->fd      = fd;
+    rings->memsize = 2 * (size_t)req.ring_size;
+    rings->mem     = mmap(NULL, rings->memsize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (rings->mem == MAP_FAILED) {
+        rl_free(rings, RL_MT_API);
+        return NULL;
+    }
+    rings->rx = (struct rl_ring *)rings->mem;
+    rings->tx = (struct rl_ring *)((uint8_t *)rings->mem + req.ring_size);
+
+    return rings;
+}
+
+void
+rina_flow_rings_close(struct rina_flow_rings *rings)
+{
+    munmap(rings->mem, rings->memsize);
+    rl_free(rings, RL_MT_API);
+}
+
+void *
+rina_flow_rings_tx_get(struct rina_flow_rings *rings, unsigned int *size)
+{
+    struct rl_ring *tx = rings->tx;
+
+    rina_flow_rings_tx_reap(rings);
+    if (tx->prod - rings->tx_reaped >= tx->num_slots) {
+        return NULL; /* TX ring is full */
+    }
+    if (size) {
+        *size = tx->slot_size;
+    }
+
+    return RL_RING_BUF(tx, tx->prod);
+}
+
+void
+rina_flow_rings_tx_put(struct rina_flow_rings *rings, unsigned int len)
+{
+    struct rl_ring *tx = rings->tx;
+
+    tx->slots[tx->prod & (tx->num_slots - 1)].len = len;
+    __atomic_store_n(&tx->prod, tx->prod + 1, __ATOMIC_RELEASE);
+}
+
+void *
+rina_flow_rings_rx_get(struct rina_flow_rings *rings, unsigned int *len)
+{
+    struct rl_ring *rx = rings->rx;
+    uint32_t prod      = __atomic_load_n(&rx->prod, __ATOMIC_ACQUIRE);
+
+    if (prod == rx->cons) {
+        return NULL; /* RX ring is empty */
+    }
+    if (len) {
+        *len = rx->slots[rx->cons & (rx->num_slots - 1)].len;
+    }
+
+    return RL_RING_BUF(rx, rx->cons);
+}
+
+void
+rina_flow_rings_rx_put(struct rina_flow_rings *rings)
+{
+    struct rl_ring *rx = rings->rx;
+
+    __atomic_store_n(&rx->cons, rx->cons + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int
+rina_flow_rings_rx_flags(struct rina_flow_rings *rings)
+{
+    struct rl_ring *rx = rings->rx;
+
+    return rx->slots[rx->cons & (rx->num_slots - 1)].flags;
+}
+
+unsigned int
+rina_flow_rings_tx_errors(struct rina_flow_rings *rings)
+{
+    unsigned int errors;
+
+    rina_flow_rings_tx_reap(rings);
+    errors           = rings->tx_errors;
+    rings->tx_errors = 0;
+
+    return errors;
+}
+
+int
+rina_flow_rings_sync(struct rina_flow_rings *rings)
+{
+    uint32_t flags = RL_RINGS_SYNC_TX | RL_RINGS_SYNC_RX;
+
+    return ioctl(rings->fd, RLITE_IOCTL_RINGS_SYNC, &flags);
+}
@@ -52,7 +52,8 @@
 
 using namespace std;
 
-FwdWorker::FwdWorker(int idx_, int verb) : idx(idx_), nfds(0), verbose(verb)
+FwdWorker::FwdWorker(int idx_, int verb, bool splice)
+    : idx(idx_), nfds(0), verbose(verb), use_splice(splice)
 {
     repoll_syncfd = eventfd(0, 0);
     if (repoll_syncfd < 0) {
@@ -118,6 +119,15 @@ FwdWorker::submit(FwdToken token, int cfd, int rfd)
      * between two consecutive entries. */
     fds[nfds++] = Fd(rfd, token);
     fds[nfds++] = Fd(cfd, token);
+    if (use_splice) {
+        for (int i = nfds - 2; i < nfds; i++) {
+            if (pipe2(fds[i].pipefd, O_NONBLOCK | O_CLOEXEC)) {
+                perror("pipe2()");
+                /* Fall back to copying through userspace. */
+                fds[i].pipefd[0] = fds[i].pipefd[1] = -1;
+            }
+        }
+    }
     eventfd_write(repoll_syncfd); /* trigger repoll */
 
     if (verbose >= 1) {
@@ -155,6 +165,9 @@ FwdWorker::terminate(unsigned int i, int ret, int errcode)
 
     close(fds[i].fd);
     close(fds[j].fd);
+    fds[i].len = fds[j].len = 0; /* pending data is discarded */
+    unsplice(i);
+    unsplice(j);
     fds[i].closed = fds[j].closed = true;
     if (fds[i].token > 0) {
         terminated.push_back(fds[i].token);
@@ -178,6 +191,85 @@ FwdWorker::terminate(unsigned int i, int ret, int errcode)
     /* fds entries are recovered at the beginning of the run() main loop */
 }
 
+/* Stop splicing for entry i, moving any data still in the pipe to the
+ * userspace output buffer. Called under worker lock. */
+void
+FwdWorker::unsplice(unsigned int i)
+{
+    if (!fds[i].spliced()) {
+        return;
+    }
+
+    if (fds[i].len > 0) {
+        int m = read(fds[i].pipefd[0], fds[i].data, fds[i].len);
+
+        fds[i].ofs = 0;
+        fds[i].len = m > 0 ? m : 0;
+    }
+    close(fds[i].pipefd[0]);
+    close(fds[i].pipefd[1]);
+    fds[i].pipefd[0] = fds[i].pipefd[1] = -1;
+}
+
+/* Load the output buffer of entry j with data read from the mapped entry i.
+ * Returns the number of bytes loaded, with the same semantic of read().
+ * Called under worker lock. */
+int
+FwdWorker::fill(unsigned int i, unsigned int j)
+{
+    int m;
+
+    if (fds[j].spliced()) {
+        m = splice(fds[i].fd, NULL, fds[j].pipefd[1], NULL, FDFWD_MAX_BUFSZ,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (m >= 0 || errno != EINVAL) {
+            if (m > 0) {
+                fds[j].len = m;
+            }
+            return m;
+        }
+        /* Splicing not supported by fds[i].fd. */
+        unsplice(j);
+    }
+
+    m = read(fds[i].fd, fds[j].data, FDFWD_MAX_BUFSZ);
+    if (m > 0) {
+        fds[j].len = m;
+        fds[j].ofs = 0;
+    }
+
+    return m;
+}
+
+/* Try to flush the output buffer of entry i. Returns the number of bytes
+ * flushed, with the same semantic of write(). Called under worker lock. */
+int
+FwdWorker::flush(unsigned int i)
+{
+    int m;
+
+    if (fds[i].spliced()) {
+        m = splice(fds[i].pipefd[0], NULL, fds[i].fd, NULL, fds[i].len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (m >= 0 || errno != EINVAL) {
+            if (m > 0) {
+                fds[i].len -= m;
+            }
+            return m;
+        }
+        /* Splicing not supported by fds[i].fd. */
+        unsplice(i);
+    }
+
+    m = write(fds[i].fd, fds[i].data + fds[i].ofs, fds[i].len);
+    if (m > 0) {
+        fds[i].ofs += m;
+        fds[i].len -= m;
+    }
+
+    return m;
+}
+
 void
 FwdWorker::run()
 {
@@ -299,12 +391,9 @@ FwdWorker::run()
                 /* The output buffer for entry j is empty and, there
                  * is data to read from the mapped entry i. Load the
                  * output buffer with this data. */
-                m = read(fds[i].fd, fds[j].data, FDFWD_MAX_BUFSZ);
+                m = fill(i, j);
                 if (m <= 0) {
                     terminate(i, m, errno);
-                } else {
-                    fds[j].len = m;
-                    fds[j].ofs = 0;
                 }
 
             } else if (pfds[i].revents & POLLOUT) {
@@ -313,12 +402,10 @@ FwdWorker::run()
                 assert(fds[i].len > 0);
                 /* There is data in the output buffer of entry i. Try to
                  * flush it. */
-                m = write(fds[i].fd, fds[i].data + fds[i].ofs, fds[i].len);
+                m = flush(i);
                 if (m <= 0) {
                     terminate(i, m, errno);
                 } else {
-                    fds[i].ofs += m;
-                    fds[i].len -= m;
                     if (verbose >= 2) {
                         printf("Forwarded %d bytes %d --> %d\n", m, fds[j].fd,
                                fds[i].fd);
@@ -45,12 +45,21 @@ struct Fd {
     int ofs;
     bool closed;
     FwdToken token;
+    /* When splicing is enabled, the output buffer is a pipe rather than
+     * 'data', and 'len' counts the bytes sitting in the pipe. */
+    int pipefd[2];
     char data[FDFWD_MAX_BUFSZ];
 
     Fd(int _fd, FwdToken t) : fd(_fd), len(0), ofs(0), closed(false), token(t)
     {
+        pipefd[0] = pipefd[1] = -1;
     }
-    Fd() : fd(0), len(0), ofs(0), closed(false), token(0) {}
+    Fd() : fd(0), len(0), ofs(0), closed(false), token(0)
+    {
+        pipefd[0] = pipefd[1] = -1;
+    }
+
+    bool spliced() const { return pipefd[0] >= 0; }
 };
 
 class FwdWorker {
@@ -71,12 +80,20 @@ class FwdWorker {
 
     int verbose;
 
+    /* Use splice() to move data through pipes, so that data is not
+     * copied through userspace. Only valid for byte-stream sessions,
+     * as a pipe does not preserve message boundaries. */
+    bool use_splice;
+
     void eventfd_write(int fd);
     void eventfd_drain(int fd);
     void terminate(unsigned int i, int ret, int errcode);
+    void unsplice(unsigned int i);
+    int fill(unsigned int i, unsigned int j);
+    int flush(unsigned int i);
 
 public:
-    FwdWorker(int idx_, int verb);
+    FwdWorker(int idx_, int verb, bool splice = false);
     ~FwdWorker();
 
     void submit(FwdToken token, int cfd, int rfd);
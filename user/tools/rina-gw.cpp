@@ -170,9 +170,10 @@ Gateway::Gateway()
 {
     appl_name = "rina-gw/1";
 
-    /* Start workers. */
+    /* Start workers. TCP connections and stream flows carry no message
+     * boundaries, so data can be spliced between them. */
     for (int i = 0; i < NUM_WORKERS; i++) {
-        workers.push_back(new FwdWorker(i, verbose));
+        workers.push_back(new FwdWorker(i, verbose, /*splice=*/true));
     }
 }
 
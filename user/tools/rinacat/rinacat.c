@@ -27,6 +27,7 @@
 // SUCH DAMAGE.
 //
 
+#define _GNU_SOURCE // for splice() and pipe2()
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
@@ -517,26 +518,101 @@ exec_command(int flowfd, int argc, const char **argv, int *ret_pid)
 
 static fd_set readbits, writebits;
 
+// Buffered data on its way from an input fd to an output fd.  When both fds
+// support splice(), the data sits in a pipe and never gets copied to
+// userspace; otherwise, or as soon as splice() fails with EINVAL, 'data' is
+// used.  In both cases 'count' is the number of buffered bytes.
+struct pumpbuf {
+    char *data;
+    int count;
+    int pipefd[2];
+};
+
+static void
+pumpbuf_init(struct pumpbuf *pb, char *data)
+{
+    pb->data  = data;
+    pb->count = 0;
+    if (pipe2(pb->pipefd, O_NONBLOCK | O_CLOEXEC)) {
+        pb->pipefd[0] = pb->pipefd[1] = -1;
+    }
+}
+
+// Stop splicing, moving any data still in the pipe to the userspace buffer.
+static void
+pumpbuf_unsplice(struct pumpbuf *pb)
+{
+    if (pb->pipefd[0] < 0)
+        return;
+    if (pb->count > 0 && read(pb->pipefd[0], pb->data, pb->count) != pb->count)
+        pb->count = 0;
+    close(pb->pipefd[0]);
+    close(pb->pipefd[1]);
+    pb->pipefd[0] = pb->pipefd[1] = -1;
+}
+
+// Fill an empty buffer with at most 'size' bytes read from 'infd', with the
+// same return value as read().
+static int
+pumpbuf_fill(int infd, struct pumpbuf *pb, int size)
+{
+    int result;
+
+    if (pb->pipefd[1] >= 0) {
+        result = (int)splice(infd, NULL, pb->pipefd[1], NULL, size,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (result >= 0 || errno != EINVAL) {
+            pb->count = result > 0 ? result : 0;
+            return (result);
+        }
+        VVERBOSE("splice() not supported from fd %d, copying\n", infd);
+        pumpbuf_unsplice(pb);
+    }
+    result    = (int)read(infd, pb->data, size);
+    pb->count = result > 0 ? result : 0;
+    return (result);
+}
+
+// Write out (some of) the buffered data, with the same return value as
+// write().
+static int
+pumpbuf_flush(int outfd, struct pumpbuf *pb)
+{
+    int result;
+
+    if (pb->pipefd[0] >= 0) {
+        result = (int)splice(pb->pipefd[0], NULL, outfd, NULL, pb->count,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (result >= 0 || errno != EINVAL) {
+            if (result > 0)
+                pb->count -= result;
+            return (result);
+        }
+        VVERBOSE("splice() not supported to fd %d, copying\n", outfd);
+        pumpbuf_unsplice(pb);
+    }
+    result = (int)write(outfd, pb->data, pb->count);
+    if (result > 0 && result < pb->count) // short write - probably needn't
+                                          // bother, but what the heck.
+        memmove(pb->data, &pb->data[result], pb->count - result);
+    if (result > 0)
+        pb->count -= result;
+    return (result);
+}
+
 // 0-length write is treated as EOF, produces a non-zero return, but with errno
 // set to 0 (not an error).
 static int
-condwrite(int outfd, int *count, char *buffer)
+condwrite(int outfd, struct pumpbuf *pb)
 {
-    if (*count > 0 && FD_ISSET(outfd, &writebits)) {
-        int result = (int)write(outfd, buffer, *count);
-        if (result >= 0 || (result < 0 && errno != EWOULDBLOCK)) {
-            if (result == 0) { // EOF
-                errno = 0;
-                return (-1);
-            }
-            if (result < 0) // error
-                return (-1);
-            // else short write
-            if (result < *count) // short write - probably needn't bother, but
-                                 // what the heck.
-                memmove(buffer, &buffer[result], *count - result);
-            *count -= result;
+    if (pb->count > 0 && FD_ISSET(outfd, &writebits)) {
+        int result = pumpbuf_flush(outfd, pb);
+        if (result == 0) { // EOF
+            errno = 0;
+            return (-1);
         }
+        if (result < 0 && errno != EWOULDBLOCK) // error
+            return (-1);
     }
     return (0);
 }
@@ -548,13 +624,14 @@ condwrite(int outfd, int *count, char *buffer)
 // there's still unbuffered data when we exit.
 
 void
-drain_buffer(int fd_to_drain, int *count, char *buffer)
+drain_buffer(int fd_to_drain, struct pumpbuf *pb)
 {
     struct timeval draintime;
 
-    VVERBOSE("Draining fd %d of %d bytes\n", fd_to_drain, *count);
+    pumpbuf_unsplice(pb);
+    VVERBOSE("Draining fd %d of %d bytes\n", fd_to_drain, pb->count);
 
-    if (*count <= 0)
+    if (pb->count <= 0)
         return;
     draintime.tv_usec = 0;
     draintime.tv_sec  = DRAIN_SECONDS;
@@ -563,68 +640,79 @@ drain_buffer(int fd_to_drain, int *count, char *buffer)
     FD_SET(fd_to_drain, &writebits);
     select(fd_to_drain + 1, NULL, &writebits, NULL, &draintime);
 
-    if (write(fd_to_drain, buffer, *count) != *count) {
+    if (write(fd_to_drain, pb->data, pb->count) != pb->count) {
         PRINTERRORMSG("WARNING: Failed to drain final output buffer!! "
                       "Incomplete final write to file %d\n",
                       fd_to_drain);
     }
+    pb->count = 0;
 }
 
 // Bi-directional data pump.  Read to stdin/write to flow, read from flow/write
 // to stdout. A zero return is "normal".  EOF on input or output is "normal";
-// errors aren't, errno is returned.
+// errors aren't, errno is returned.  Data is spliced through pipes where
+// possible, falling back to copies through userspace buffers.
 int
 pumpdata_bothdirections(int flowfd, int sdu_size)
 {
-    char stdinbuf[sdu_size];
-    int stdincount = 0;
-    char flowbuf[sdu_size];
-    int flowcount = 0;
+    char stdindata[sdu_size];
+    char flowdata[sdu_size];
+    struct pumpbuf stdinbuf, flowbuf;
+    int ret = 0;
+
+    pumpbuf_init(&stdinbuf, stdindata);
+    pumpbuf_init(&flowbuf, flowdata);
 
     V3VERBOSE("Pumping data in rinacat.\n");
     for (;;) {
         FD_ZERO(&readbits);
         FD_ZERO(&writebits);
 
-        if (stdincount > 0)
+        if (stdinbuf.count > 0)
             FD_SET(flowfd, &writebits);
         else
             FD_SET(0, &readbits);
-        if (flowcount > 0)
+        if (flowbuf.count > 0)
             FD_SET(1, &writebits);
         else
             FD_SET(flowfd, &readbits);
         select(flowfd + 1, &readbits, &writebits, NULL, NULL);
 
         // Try getting rid of buffered data
-        if (condwrite(flowfd, &stdincount, stdinbuf))
-            return (errno);
-        if (condwrite(1, &flowcount, flowbuf))
-            return (errno);
+        if (condwrite(flowfd, &stdinbuf) || condwrite(1, &flowbuf)) {
+            ret = errno;
+            break;
+        }
 
         // try reading
-        if (stdincount == 0 && FD_ISSET(0, &readbits)) {
-            stdincount = (int)read(0, stdinbuf, sdu_size);
-            if (stdincount < 0 && errno != EWOULDBLOCK)
-                return (errno);
-            if (stdincount == 0) {
-                drain_buffer(flowfd, &stdincount, stdinbuf);
-                drain_buffer(1, &flowcount, flowbuf);
+        if (stdinbuf.count == 0 && FD_ISSET(0, &readbits)) {
+            int n = pumpbuf_fill(0, &stdinbuf, sdu_size);
+            if (n < 0 && errno != EWOULDBLOCK) {
+                ret = errno;
+                break;
+            }
+            if (n == 0) {
+                drain_buffer(flowfd, &stdinbuf);
+                drain_buffer(1, &flowbuf);
                 break;
             }
         }
-        if (flowcount == 0 && FD_ISSET(flowfd, &readbits)) {
-            flowcount = (int)read(flowfd, flowbuf, sdu_size);
-            if (flowcount < 0 && errno != EWOULDBLOCK)
-                return (errno);
-            if (flowcount == 0) {
-                drain_buffer(1, &flowcount, flowbuf);
-                drain_buffer(flowfd, &stdincount, stdinbuf);
+        if (flowbuf.count == 0 && FD_ISSET(flowfd, &readbits)) {
+            int n = pumpbuf_fill(flowfd, &flowbuf, sdu_size);
+            if (n < 0 && errno != EWOULDBLOCK) {
+                ret = errno;
+                break;
+            }
+            if (n == 0) {
+                drain_buffer(1, &flowbuf);
+                drain_buffer(flowfd, &stdinbuf);
                 break;
             }
         }
     }
-    return (0);
+    pumpbuf_unsplice(&stdinbuf);
+    pumpbuf_unsplice(&flowbuf);
+    return (ret);
 }
 
 int
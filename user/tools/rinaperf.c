@@ -113,6 +113,8 @@
 #define RP_OPCODE_DATAFLOW 3
 #define RP_OPCODE_STOP 4 /* must be the last */
 
+#define RP_RINGS_SLOTS 256
+
 #define CLI_FA_TIMEOUT_MSECS 5000
 #define CLI_RESULT_TIMEOUT_MSECS 5000
 #define RP_DATA_WAIT_MSECS 10000
@@ -184,6 +186,8 @@ struct rinaperf {
     int cli_flow_allocated; /* client flows allocated ? */
     int background;         /* server runs as a daemon process */
     int cdf;                /* report CDF percentiles */
+    int rings;              /* perf client uses shared memory rings */
+    unsigned int busy_poll; /* busy-poll budget for the data flow (us) */
 
     /* Synchronization between client threads and main thread. */
     sem_t cli_barrier;
@@ -263,6 +267,18 @@ nanodiff(const struct timespec *t2, const struct timespec *t1)
 
 static int config_msg_read(int cfd, struct rp_config_msg *cfg);
 
+/* Enable busy-polling on the data flow, if requested by the user. */
+static int
+busy_poll_setup(struct worker *w)
+{
+    if (w->rp->busy_poll && rina_flow_busy_poll_set(w->dfd, w->rp->busy_poll)) {
+        perror("rina_flow_busy_poll_set()");
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Used for both ping and rr tests. */
 static int
 ping_client(struct worker *w)
@@ -285,6 +301,10 @@ ping_client(struct worker *w)
     pfd[1].fd     = w->rp->stop_pipe[0];
     pfd[0].events = pfd[1].events = POLLIN;
 
+    if (busy_poll_setup(w)) {
+        return -1;
+    }
+
     memset(buf, 'x', size);
 
     clock_gettime(CLOCK_MONOTONIC, &t_start);
@@ -391,6 +411,10 @@ ping_server(struct worker *w)
     pfd[1].fd     = w->cfd;
     pfd[0].events = pfd[1].events = POLLIN;
 
+    if (busy_poll_setup(w)) {
+        return -1;
+    }
+
     for (i = 0; !limit || i < limit; i++) {
         n = poll(pfd, 2, RP_DATA_WAIT_MSECS);
         if (n < 0) {
@@ -515,6 +539,12 @@ ping_report(struct worker *w, struct rp_result_msg *snd,
                (long unsigned)w->real_duration_ms);
         printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms\n", min, avg, max,
                stddev);
+        printf("rtt p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f us%s\n",
+               (double)w->rtt_win[num_samples * 500 / 1000] / 1000.0,
+               (double)w->rtt_win[num_samples * 900 / 1000] / 1000.0,
+               (double)w->rtt_win[num_samples * 990 / 1000] / 1000.0,
+               (double)w->rtt_win[num_samples * 999 / 1000] / 1000.0,
+               w->rp->busy_poll ? " (busy-poll)" : "");
     } else {
 #if RTT_WINSIZE < 100
 #error "RTT_WINSIZE must be >= 100"
@@ -533,6 +563,29 @@ ping_report(struct worker *w, struct rp_result_msg *snd,
     }
 }
 
+/* Write an SDU to the TX ring, ringing the doorbell when the ring is
+ * full. Behaves like a non-blocking write(). */
+static int
+rings_write(struct rina_flow_rings *rings, const char *buf, int size)
+{
+    void *slot = rina_flow_rings_tx_get(rings, NULL);
+
+    if (!slot) {
+        if (rina_flow_rings_sync(rings)) {
+            return -1;
+        }
+        slot = rina_flow_rings_tx_get(rings, NULL);
+        if (!slot) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    memcpy(slot, buf, size);
+    rina_flow_rings_tx_put(rings, size);
+
+    return size;
+}
+
 static int
 perf_client(struct worker *w)
 {
@@ -547,8 +600,9 @@ perf_client(struct worker *w)
     char buf[SDU_SIZE_MAX];
     long long ns;
     struct pollfd pfd[2];
-    unsigned int i = 0;
-    int timeout    = 0;
+    struct rina_flow_rings *rings = NULL;
+    unsigned int i                = 0;
+    int timeout                   = 0;
     int ret;
 
     if (rp->flowspec.avg_bandwidth == 0) {
@@ -562,6 +616,14 @@ perf_client(struct worker *w)
         }
     }
 
+    if (rp->rings) {
+        rings = rina_flow_rings_open(w->dfd, RP_RINGS_SLOTS, size);
+        if (!rings) {
+            perror("rina_flow_rings_open()");
+            return -1;
+        }
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->rp->stop_pipe[0];
     pfd[0].events = POLLOUT;
@@ -572,7 +634,7 @@ perf_client(struct worker *w)
     clock_gettime(CLOCK_MONOTONIC, &t_start);
 
     for (i = 0; !rp->cli_stop && (!limit || i < limit); i++) {
-        ret = write(w->dfd, buf, size);
+        ret = rings ? rings_write(rings, buf, size) : write(w->dfd, buf, size);
         if (ret < 0 && errno == EAGAIN) {
             ret = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (ret < 0) {
@@ -623,6 +685,11 @@ perf_client(struct worker *w)
         }
     }
 
+    if (rings) {
+        /* Flush the SDUs still in the TX ring. */
+        rina_flow_rings_sync(rings);
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &t_end);
     ns = nanodiff(&t_end, &t_start);
     if (timeout) {
@@ -645,6 +712,10 @@ perf_client(struct worker *w)
 
     w->test_config.cnt = i; /* write back packet count */
 
+    if (rings) {
+        rina_flow_rings_close(rings);
+    }
+
     return 0;
 }
 
@@ -1509,8 +1580,12 @@ usage(void)
         "   -T : print timestamp (unix time + microseconds as in gettimeofday) "
         "before each line in ping test\n"
         "   -C : client prints cumulative density function in ping mode\n"
+        "   -r : perf client writes to the data flow through shared memory "
+        "rings\n"
+        "   -P NUM : busy-poll the data flow for up to NUM microseconds "
+        "before sleeping (max %u)\n"
         "   -v : be verbose\n",
-        RINA_FLOW_SPEC_LOSS_MAX);
+        RINA_FLOW_SPEC_LOSS_MAX, RINA_FLOW_BUSY_POLL_MAX);
 }
 
 int
@@ -1555,7 +1630,7 @@ main(int argc, char **argv)
     /* Start with a default flow configuration (unreliable flow). */
     rina_flow_spec_unreliable(&rp->flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvC")) !=
+    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvCrP:")) !=
            -1) {
         switch (opt) {
         case 'h':
@@ -1674,6 +1749,18 @@ main(int argc, char **argv)
             rp->cdf = 1;
             break;
 
+        case 'r':
+            rp->rings = 1;
+            break;
+
+        case 'P':
+            rp->busy_poll = atoi(optarg);
+            if (rp->busy_poll > RINA_FLOW_BUSY_POLL_MAX) {
+                PRINTF("    Invalid busy-poll budget %u\n", rp->busy_poll);
+                return -1;
+            }
+            break;
+
         default:
             PRINTF("    Unrecognized option %c\n", opt);
             usage();
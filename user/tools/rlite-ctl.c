@@ -536,6 +536,49 @@ str_count_elems(const char *s)
     return n;
 }
 
+/* Parse a list of comma-separated positive integers smaller than 'max'
+ * into a newly allocated array. Returns the number of elements, or -1
+ * on error. */
+static int
+str_parse_dwords(const char *s, uint32_t **parr, uint32_t max,
+                 const char *what)
+{
+    char *copy = strdup_or_quit(s);
+    char *ctmp = copy;
+    uint32_t *arr;
+    char *saveptr;
+    int n;
+    int i;
+
+    /* Count elements. */
+    n = str_count_elems(s);
+    if (n <= 0) {
+        PE("No valid %ss\n", what);
+        free(copy);
+        return -1;
+    }
+
+    /* Allocate the array and parse the elements into it. */
+    arr = malloc_or_quit(n * sizeof(arr[0]));
+    for (i = 0; i < n; i++, ctmp = NULL) {
+        char *token = strtok_r(ctmp, ", ", &saveptr);
+        if (token == NULL) {
+            break;
+        }
+        arr[i] = atoi(token);
+        if (arr[i] <= 0 || arr[i] >= max) {
+            PE("Invalid %s '%s'\n", what, token);
+            free(arr);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    *parr = arr;
+
+    return n;
+}
+
 static int
 kernel_control_write(struct rl_msg_base *msg)
 {
@@ -544,6 +587,7 @@ kernel_control_write(struct rl_msg_base *msg)
 
     fd = rina_open();
     if (fd < 0) {
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
         return fd;
     }
 
@@ -593,7 +637,6 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
          * */
         struct rl_kmsg_ipcp_sched_wrr req;
         uint32_t *arr;
-        int ret;
         int n;
 
         if (argc < 4) {
@@ -618,37 +661,12 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
             return -1;
         }
 
-        /* Count weights. */
-        n = str_count_elems(argv[3]);
-        if (n <= 0) {
-            PE("No valid weights\n");
+        /* Parse weights into an array. */
+        n = str_parse_dwords(argv[3], &arr, 1000, "weight");
+        if (n < 0) {
             return -1;
         }
 
-        /* Allocate array for weights. */
-        arr = malloc_or_quit(n * sizeof(arr[0]));
-
-        /* Parse weights into the array. */
-        {
-            char *copy = strdup_or_quit(argv[3]);
-            char *ctmp = copy;
-            char *saveptr;
-            int i;
-
-            for (i = 0; i < n; i++, ctmp = NULL) {
-                char *token = strtok_r(ctmp, ", ", &saveptr);
-                if (token == NULL) {
-                    break;
-                }
-                arr[i] = atoi(token);
-                if (arr[i] <= 0 || arr[i] >= 1000) {
-                    PE("Invalid weight '%s'\n", token);
-                    return -1;
-                }
-            }
-            free(copy);
-        }
-
         /* Build the request. */
         req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_WRR;
         req.ipcp_hdr.hdr.event_id = 0;
@@ -658,10 +676,8 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
         req.weights.num_elements  = n;
         req.weights.slots.dwords  = arr;
 
-        ret = kernel_control_write(RLITE_MB(&req));
-        free(arr);
-
-        return ret;
+        /* The array is released together with the message. */
+        return kernel_control_write(RLITE_MB(&req));
 
     } else if (!strcmp(sched_name, "pfifo")) {
         /* Weighted Round Robin configuration. Example:
@@ -692,6 +708,213 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
         req.max_queue_size        = qsize;
 
         return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "drr")) {
+        /* Deficit Round Robin configuration. Example:
+         *   ipcp-sched-config x.IPCP drr qsize 65536 quanta 1500,3000
+         * */
+        struct rl_kmsg_ipcp_sched_drr req;
+        uint32_t *arr;
+        int n;
+
+        if (argc < 2) {
+            PE("Not enough arguments for drr. Example:\n"
+               "  ipcp-sched-config x.IPCP drr qsize 65536 quanta "
+               "1500,3000\n");
+            return -1;
+        }
+
+        if (strcmp(argv[0], "quanta")) {
+            PE("Missing 'quanta' argument\n");
+            return -1;
+        }
+
+        /* Parse quanta into an array. */
+        n = str_parse_dwords(argv[1], &arr, 1000000, "quantum");
+        if (n < 0) {
+            return -1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_DRR;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        req.quanta.elem_size      = sizeof(arr[0]);
+        req.quanta.num_elements   = n;
+        req.quanta.slots.dwords   = arr;
+
+        /* The array is released together with the message. */
+        return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "fq_codel")) {
+        /* FQ-CoDel configuration. Example:
+         *   ipcp-sched-config x.IPCP fq_codel qsize 1048576 flows 64
+         *          target 5000 interval 100000 quantum 1500
+         * */
+        struct rl_kmsg_ipcp_sched_fq_codel req;
+
+        if (argc < 8) {
+            PE("Not enough arguments for fq_codel. Example:\n"
+               "  ipcp-sched-config x.IPCP fq_codel qsize 1048576 flows 64 "
+               "target 5000 interval 100000 quantum 1500\n");
+            return -1;
+        }
+
+        if (strcmp(argv[0], "flows")) {
+            PE("Missing 'flows' argument\n");
+            return -1;
+        }
+        req.flows = atoi(argv[1]);
+        if (req.flows == 0 || req.flows > 1024) {
+            PE("Invalid number of flows '%s'\n", argv[1]);
+            return -1;
+        }
+
+        if (strcmp(argv[2], "target")) {
+            PE("Missing 'target' argument\n");
+            return -1;
+        }
+        req.target_us = atoi(argv[3]);
+        if (req.target_us == 0 || req.target_us > 10000000) {
+            PE("Invalid target '%s'\n", argv[3]);
+            return -1;
+        }
+
+        if (strcmp(argv[4], "interval")) {
+            PE("Missing 'interval' argument\n");
+            return -1;
+        }
+        req.interval_us = atoi(argv[5]);
+        if (req.interval_us < req.target_us || req.interval_us > 10000000) {
+            PE("Invalid interval '%s'\n", argv[5]);
+            return -1;
+        }
+
+        if (strcmp(argv[6], "quantum")) {
+            PE("Missing 'quantum' argument\n");
+            return -1;
+        }
+        req.quantum = atoi(argv[7]);
+        if (req.quantum == 0 || req.quantum > 1000000) {
+            PE("Invalid quantum '%s'\n", argv[7]);
+            return -1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_FQ_CODEL;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+
+        return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "htb")) {
+        /* Hierarchical Token Bucket configuration. Example:
+         *   ipcp-sched-config x.IPCP htb qsize 65536 default 3
+         *          class 1 rate 1250000
+         *          class 2 parent 1 qos 0 rate 1000000
+         *          class 3 parent 1 qos 1 rate 250000 ceil 1250000
+         * */
+        struct rl_kmsg_ipcp_sched_htb req;
+        struct rl_htb_class *arr;
+        int n = 0;
+
+        req.default_class = 0;
+        if (argc >= 2 && !strcmp(argv[0], "default")) {
+            req.default_class = atoi(argv[1]);
+            if (req.default_class == 0) {
+                PE("Invalid default class '%s'\n", argv[1]);
+                return -1;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+
+        if (argc < 4) {
+            PE("Not enough arguments for htb. Example:\n"
+               "  ipcp-sched-config x.IPCP htb qsize 65536 default 3 "
+               "class 1 rate 1250000 class 2 parent 1 qos 0 rate 1000000 "
+               "class 3 parent 1 qos 1 rate 250000 ceil 1250000\n");
+            return -1;
+        }
+
+        /* Parse the classes into an array, one 'class ID' followed by
+         * its 'KEY VALUE' attributes for each class. */
+        arr = malloc_or_quit(RL_HTB_CLASSES_MAX * sizeof(arr[0]));
+        memset(arr, 0, RL_HTB_CLASSES_MAX * sizeof(arr[0]));
+        while (argc >= 2) {
+            const char *key        = argv[0];
+            unsigned long long max = UINT32_MAX;
+            unsigned long long val;
+            char *end;
+
+            if (!strcmp(key, "class")) {
+                if (n == RL_HTB_CLASSES_MAX) {
+                    PE("Too many classes (max %d)\n", RL_HTB_CLASSES_MAX);
+                    free(arr);
+                    return -1;
+                }
+                n++;
+            } else if (n == 0) {
+                PE("Missing 'class' argument\n");
+                free(arr);
+                return -1;
+            }
+            /* Check each value against the range of the field that
+             * stores it. */
+            if (!strcmp(key, "class") || !strcmp(key, "parent")) {
+                max = UINT16_MAX;
+            } else if (!strcmp(key, "qos")) {
+                max = (rlm_qosid_t)-1;
+            }
+            errno = 0;
+            val   = strtoull(argv[1], &end, 10);
+            if (argv[1][0] == '-' || argv[1][0] == '\0' || *end != '\0' ||
+                errno || val > max) {
+                PE("Invalid %s '%s'\n", key, argv[1]);
+                free(arr);
+                return -1;
+            }
+
+            if (!strcmp(key, "class")) {
+                arr[n - 1].id = val;
+            } else if (!strcmp(key, "parent")) {
+                arr[n - 1].parent = val;
+            } else if (!strcmp(key, "qos")) {
+                arr[n - 1].qos_id = val;
+            } else if (!strcmp(key, "rate")) {
+                arr[n - 1].rate = val;
+            } else if (!strcmp(key, "ceil")) {
+                arr[n - 1].ceil = val;
+            } else if (!strcmp(key, "burst")) {
+                arr[n - 1].burst = val;
+            } else {
+                PE("Unknown class attribute '%s'\n", key);
+                free(arr);
+                return -1;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        if (argc > 0) {
+            PE("Missing value for '%s'\n", argv[0]);
+            free(arr);
+            return -1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_HTB;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        req.pad1                  = 0;
+        req.classes.elem_size     = sizeof(arr[0]);
+        req.classes.num_elements  = n;
+        req.classes.slots.raw     = arr;
+
+        /* The array is released together with the message. */
+        return kernel_control_write(RLITE_MB(&req));
     }
 
     PE("Unknown scheduler '%s'\n", sched_name);
@@ -840,6 +1063,7 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
 {
     struct ipcp_attrs *attrs = NULL;
     struct rl_ipcp_stats stats;
+    struct rl_pduft_stats pduft;
     unsigned long ipcp_id;
     char sbuf[4][32];
     int ret;
@@ -859,7 +1083,7 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
     }
     ipcp_id = attrs->id;
 
-    ret = rl_conf_ipcp_get_stats(ipcp_id, &stats);
+    ret = rl_conf_ipcp_get_stats(ipcp_id, &stats, &pduft);
     if (ret) {
         PE("Could not find ipcp with id %lu\n", ipcp_id);
         return ret;
@@ -878,6 +1102,10 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            "    rx_err             = %llu\n"
            "    rtx_pkt            = %llu\n"
            "    rtx_byte           = %s\n"
+           "    rtx_sack_pkt       = %llu\n"
+           "    rtx_avoided        = %llu\n"
+           "    rtx_fast_pkt       = %llu\n"
+           "    rtx_tlp_pkt        = %llu\n"
            "    rmt.fwd_pkt        = %llu\n"
            "    rmt.fwd_byte       = %s\n"
            "    rmt.queued_pkt     = %llu\n"
@@ -891,6 +1119,10 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            (unsigned long long)stats.tx_err, (unsigned long long)stats.rx_pkt,
            sbuf[1], (unsigned long long)stats.rx_err,
            (unsigned long long)stats.rtx_pkt, sbuf[2],
+           (unsigned long long)stats.rtx_sack_pkt,
+           (unsigned long long)stats.rtx_avoided,
+           (unsigned long long)stats.rtx_fast_pkt,
+           (unsigned long long)stats.rtx_tlp_pkt,
            (unsigned long long)stats.rmt.fwd_pkt, sbuf[3],
            (unsigned long long)stats.rmt.queued_pkt,
            (unsigned long long)stats.rmt.queue_drop,
@@ -900,6 +1132,20 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            (unsigned long long)stats.rmt.noflow_drop,
            (unsigned long long)stats.rmt.other_drop);
 
+    if (pduft.size) {
+        printf("    pduft.type         = %s\n"
+               "    pduft.size         = %u\n"
+               "    pduft.entries      = %u\n"
+               "    pduft.used         = %u\n"
+               "    pduft.max_chain    = %u\n"
+               "    pduft.perflow      = %u\n"
+               "    pduft.prefix       = %u\n"
+               "    pduft.default      = %s\n",
+               pduft.type == RL_PDUFT_T_ARRAY ? "array" : "hash", pduft.size,
+               pduft.count, pduft.used, pduft.max_chain, pduft.perflow_count,
+               pduft.prefix_count, pduft.dflt ? "yes" : "no");
+    }
+
     return 0;
 }
 
@@ -964,6 +1210,11 @@ flows_show(int argc, char **argv, struct cmd_descriptor *cd)
                  (long long unsigned)stats.rx_overrun_pkt,
                  (long long unsigned)stats.tx_pkt,
                  byteprint(bbuf[1], blen, stats.tx_byte));
+            if (stats.busy_poll_hit || stats.busy_poll_miss) {
+                PI_S("      busy-poll(hit:%llu, miss:%llu)\n",
+                     (long long unsigned)stats.busy_poll_hit,
+                     (long long unsigned)stats.busy_poll_miss);
+            }
         }
     }
     rl_conf_flows_purge(&flows);
@@ -1000,7 +1251,8 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         "    last_ctrl_seq_num_rcvd = %lu\n"
         "    cwq_len                = %lu [max=%lu]\n"
         "    rtxq_len               = %lu [max=%lu]\n"
-        "    rtt                    = %lums [stddev=%lums]\n"
+        "    rtt                    = %luus [stddev=%luus]\n"
+        "    rto                    = %luus\n"
         "    cgwin                  = %lu\n"
         "    rcv_lwe                = %lu\n"
         "    rcv_next_seq_num       = %lu\n"
@@ -1015,8 +1267,9 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         (unsigned long)dtp.last_seq_num_sent,
         (unsigned long)dtp.last_ctrl_seq_num_rcvd, (unsigned long)dtp.cwq_len,
         (unsigned long)dtp.max_cwq_len, (unsigned long)dtp.rtxq_len,
-        (unsigned long)dtp.max_rtxq_len, (unsigned long)dtp.rtt / 1000,
-        (unsigned long)dtp.rtt_stddev / 1000, (unsigned long)dtp.cgwin,
+        (unsigned long)dtp.max_rtxq_len, (unsigned long)dtp.rtt,
+        (unsigned long)dtp.rtt_stddev, (unsigned long)dtp.rto,
+        (unsigned long)dtp.cgwin,
 
         (unsigned long)dtp.rcv_lwe, (unsigned long)dtp.rcv_next_seq_num,
         (unsigned long)dtp.rcv_rwe, (unsigned long)dtp.max_seq_num_rcvd,
@@ -1620,13 +1873,13 @@ static struct cmd_descriptor cmd_descriptors[] = {
     },
     {
         .name     = "ipcp-route-add",
-        .usage    = "IPCP_NAME DEST_NAME NEXT_HOP[,NEXT_HOP][...]",
+        .usage    = "IPCP_NAME DEST_NAME|ADDR/PLEN NEXT_HOP[,NEXT_HOP][...]",
         .num_args = 3,
         .func     = ipcp_route_mod,
     },
     {
         .name     = "ipcp-route-del",
-        .usage    = "IPCP_NAME DEST_NAME",
+        .usage    = "IPCP_NAME DEST_NAME|ADDR/PLEN",
         .num_args = 2,
         .func     = ipcp_route_mod,
     },
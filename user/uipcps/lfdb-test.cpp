@@ -28,6 +28,7 @@
 #include <chrono>
 #include <unistd.h>
 #include <cmath>
+#include <algorithm>
 
 #include "uipcp-normal-lfdb.hpp"
 
@@ -284,5 +285,25 @@ main(int argc, char **argv)
         counter++;
     }
 
+    {
+        /* In a square network, node 0 reaches the opposite node 2 through
+         * two equal-cost next hops (1 and 3), while the neighbors are
+         * reached directly. */
+        TestLFDB lfdb({{0, 1}, {0, 3}, {1, 2}, {2, 3}}, /*lfa_enabled=*/false);
+        std::vector<rlite::NodeId> nhops;
+
+        std::cout << "Test ECMP" << std::endl;
+        lfdb.compute_next_hops("0");
+        nhops = lfdb.next_hops["2"];
+        std::sort(nhops.begin(), nhops.end());
+        if (lfdb.num_equal_cost("2") != 2 ||
+            nhops != std::vector<rlite::NodeId>({"1", "3"}) ||
+            lfdb.num_equal_cost("1") != 1 || lfdb.next_hops["1"].size() != 1) {
+            std::cout << "Test ECMP failed" << std::endl;
+            return -1;
+        }
+        std::cout << "Test ECMP completed" << std::endl;
+    }
+
     return 0;
 }
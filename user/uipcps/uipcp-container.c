@@ -98,7 +98,7 @@ uipcp_appl_register_resp(struct uipcp *uipcp, uint8_t response,
 
 static int
 uipcp_pduft_mod(struct uipcp *uipcp, rl_msg_t msg_type, rl_port_t local_port,
-                const struct rl_pci_match *match)
+                const struct rl_pci_match *match, uint16_t flags)
 {
     struct rl_kmsg_ipcp_pduft_mod req;
     int ret;
@@ -110,6 +110,7 @@ uipcp_pduft_mod(struct uipcp *uipcp, rl_msg_t msg_type, rl_port_t local_port,
     req.ipcp_id      = uipcp->id;
     req.match        = *match;
     req.local_port   = local_port;
+    req.flags        = flags;
 
     ret = rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1);
     if (ret) {
@@ -124,14 +125,53 @@ int
 uipcp_pduft_set(struct uipcp *uipcp, rl_port_t local_port,
                 const struct rl_pci_match *match)
 {
-    return uipcp_pduft_mod(uipcp, RLITE_KER_IPCP_PDUFT_SET, local_port, match);
+    return uipcp_pduft_mod(uipcp, RLITE_KER_IPCP_PDUFT_SET, local_port, match,
+                           0);
+}
+
+int
+uipcp_pduft_batch(struct uipcp *uipcp, struct rl_pduft_mod *mods,
+                  unsigned int n)
+{
+    struct rl_kmsg_ipcp_pduft_batch req;
+    unsigned int i;
+    int ret = 0;
+
+    /* Larger batches are split, each part being applied atomically. */
+    for (i = 0; i < n && ret == 0; i += RL_PDUFT_BATCH_MAX) {
+        unsigned int chunk = n - i;
+
+        if (chunk > RL_PDUFT_BATCH_MAX) {
+            chunk = RL_PDUFT_BATCH_MAX;
+        }
+
+        /* Create a request message. */
+        memset(&req, 0, sizeof(req));
+        req.hdr.msg_type      = RLITE_KER_IPCP_PDUFT_BATCH;
+        req.hdr.event_id      = 1;
+        req.ipcp_id           = uipcp->id;
+        req.mods.elem_size    = sizeof(mods[0]);
+        req.mods.num_elements = chunk;
+        req.mods.slots.raw    = mods + i;
+
+        ret = rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1);
+        if (ret) {
+            UPE(uipcp, "rl_write_msg() failed [%s]\n", strerror(errno));
+        }
+        /* The array belongs to the caller. */
+        req.mods.slots.raw = NULL;
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&req));
+    }
+
+    return ret;
 }
 
 int
 uipcp_pduft_del(struct uipcp *uipcp, rl_port_t local_port,
                 const struct rl_pci_match *match)
 {
-    return uipcp_pduft_mod(uipcp, RLITE_KER_IPCP_PDUFT_DEL, local_port, match);
+    return uipcp_pduft_mod(uipcp, RLITE_KER_IPCP_PDUFT_DEL, local_port, match,
+                           0);
 }
 
 int
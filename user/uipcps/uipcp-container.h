@@ -307,6 +307,10 @@ int uipcp_appl_register_resp(struct uipcp *uipcp, uint8_t response,
 int uipcp_pduft_set(struct uipcp *uipcp, rl_port_t local_port,
                     const struct rl_pci_match *match);
 
+/* Apply 'n' PDUFT modifications, see struct rl_kmsg_ipcp_pduft_batch. */
+int uipcp_pduft_batch(struct uipcp *uipcp, struct rl_pduft_mod *mods,
+                      unsigned int n);
+
 int uipcp_pduft_del(struct uipcp *uipcp, rl_port_t local_port,
                     const struct rl_pci_match *match);
 
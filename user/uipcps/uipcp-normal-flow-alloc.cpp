@@ -175,6 +175,7 @@ private:
                           struct rl_flow_config *cfg,
                           rlm_qosid_t *qos_id) const;
     void policies2flowcfg(struct rl_flow_config *cfg, const FlowRequest *freq);
+    void cc_name_set(struct rl_flow_config *cfg) const;
 };
 
 /* Translate a local flow configuration into the standard
@@ -204,6 +205,7 @@ flowcfg2policies(const struct rl_flow_config *cfg, FlowRequest *freq)
     policies->set_allocated_dtcp_cfg(dtcp_cfg);
     dtcp_cfg->set_flow_ctrl(cfg->dtcp.flags & DTCP_CFG_FLOW_CTRL);
     dtcp_cfg->set_rtx_ctrl(cfg->dtcp.flags & DTCP_CFG_RTX_CTRL);
+    dtcp_cfg->set_sack(cfg->dtcp.flags & DTCP_CFG_SACK);
 
     dtcp_cfg->set_allocated_flow_ctrl_cfg(flow_ctrl_cfg);
     flow_ctrl_cfg->set_window_based(cfg->dtcp.fc.fc_type == RLITE_FC_T_WIN);
@@ -230,6 +232,17 @@ flowcfg2policies(const struct rl_flow_config *cfg, FlowRequest *freq)
     rtx_ctrl_cfg->set_initial_rtx_timeout(cfg->dtcp.rtx.initial_rtx_timeout);
 }
 
+/* Select the congestion control algorithm for a window-based flow. */
+void
+LocalFlowAllocator::cc_name_set(struct rl_flow_config *cfg) const
+{
+    string cc =
+        rib->get_param_value<std::string>(FlowAllocator::Prefix,
+                                          "congestion-control");
+
+    strncpy(cfg->dtcp.cc_name, cc.c_str(), sizeof(cfg->dtcp.cc_name));
+}
+
 /* Translate a standard flow policies specification from FlowRequest
  * CDAP message into a local flow configuration. */
 void
@@ -251,6 +264,12 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
     }
     if (p.dtcp_cfg().rtx_ctrl()) {
         cfg->dtcp.flags |= DTCP_CFG_RTX_CTRL;
+        /* Selective ACKs are used only if both ends want them. */
+        if (p.dtcp_cfg().sack() &&
+            rib->get_param_value<bool>(FlowAllocator::Prefix,
+                                       "selective-ack")) {
+            cfg->dtcp.flags |= DTCP_CFG_SACK;
+        }
     }
 
     cfg->dtcp.fc.fc_type = RLITE_FC_T_NONE;
@@ -260,6 +279,8 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
             p.dtcp_cfg().flow_ctrl_cfg().window_based_config().max_cwq_len();
         cfg->dtcp.fc.cfg.w.initial_credit =
             p.dtcp_cfg().flow_ctrl_cfg().window_based_config().initial_credit();
+        /* Each end runs its own congestion control algorithm. */
+        cc_name_set(cfg);
 
     } else if (p.dtcp_cfg().flow_ctrl_cfg().rate_based()) {
         cfg->dtcp.fc.fc_type = RLITE_FC_T_RATE;
@@ -314,6 +335,10 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
         cfg->dtcp.initial_a = initial_a.count();
+        if (rib->get_param_value<bool>(FlowAllocator::Prefix,
+                                       "selective-ack")) {
+            cfg->dtcp.flags |= DTCP_CFG_SACK;
+        }
     }
 
     /* Delay, loss and jitter ignored for now. */
@@ -331,6 +356,7 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
             rib->get_param_value<int>(FlowAllocator::Prefix, "initial-credit");
         cfg->dtcp.fc.fc_type = RLITE_FC_T_WIN;
         cfg->dtcp.initial_a  = initial_a.count();
+        cc_name_set(cfg);
     }
 
     if (spec->avg_bandwidth) {
@@ -455,6 +481,10 @@ LocalFlowAllocator::flows_handler_create_r(const CDAPMessage *rm)
     freq->gpb.set_dst_port(remote_freq.gpb.dst_port());
     freq->gpb.mutable_connections(0)->set_dst_cep(
         remote_freq.gpb.connections(0).dst_cep());
+    if (!remote_freq.gpb.policies().dtcp_cfg().sack()) {
+        /* The slave (or an older peer) does not want selective ACKs. */
+        freq->flowcfg.dtcp.flags &= ~DTCP_CFG_SACK;
+    }
 
     rib->stats.fa_response_received++;
 
@@ -518,6 +548,9 @@ LocalFlowAllocator::flows_handler_create(const CDAPMessage *rm,
     local_appl  = apname2string(freq->gpb.dst_app());
     remote_appl = apname2string(freq->gpb.src_app());
     policies2flowcfg(&flowcfg, freq.get());
+    /* Tell the initiator whether we agreed on selective ACKs. */
+    freq->gpb.mutable_policies()->mutable_dtcp_cfg()->set_sack(
+        flowcfg.dtcp.flags & DTCP_CFG_SACK);
 
     freq->invoke_id = rm->invoke_id;
     freq->flags     = RL_FLOWREQ_SEND_DEL;
@@ -739,7 +772,9 @@ UipcpRib::fa_lib_init()
           PolicyParam(Msecs(int(LocalFlowAllocator::kATimerMsecsDflt)))},
          {"initial-rtx-timeout",
           PolicyParam(Msecs(int(LocalFlowAllocator::kRtxTimerMsecsDflt)))},
-         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)}});
+         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)},
+         {"selective-ack", PolicyParam(true)},
+         {"congestion-control", PolicyParam(string("aimd"))}});
 }
 
 } // namespace rlite
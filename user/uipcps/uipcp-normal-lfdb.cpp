@@ -25,6 +25,7 @@
 #include <sstream>
 #include <iostream>
 #include <queue>
+#include <algorithm>
 #include <limits>
 
 #include "BaseRIB.pb.h"
@@ -112,7 +113,10 @@ LFDB::compute_shortest_paths(
         }
 
         DijkstraInfo &info_min = info[closer.node];
-        info_min.dist          = closer.dist;
+        if (closer.dist > info_min.dist) {
+            continue; /* stale frontier entry */
+        }
+        info_min.dist = closer.dist;
 
         if (verbose) {
             std::cout << "Selecting node " << closer.node << std::endl;
@@ -128,12 +132,31 @@ LFDB::compute_shortest_paths(
         /* Apply relaxation rule and update the frontier. */
         for (const Edge &edge : edges) {
             DijkstraInfo &info_to = info[edge.to];
+            std::vector<NodeId> nhops;
+
+            if (info_to.dist < info_min.dist + edge.cost) {
+                continue;
+            }
+
+            if (closer.node == source_node) {
+                nhops.push_back(edge.to);
+            } else {
+                nhops = info_min.nhops;
+            }
 
             if (info_to.dist > info_min.dist + edge.cost) {
-                info_to.dist = info_min.dist + edge.cost;
-                info_to.nhop =
-                    (closer.node == source_node) ? edge.to : info_min.nhop;
+                info_to.dist  = info_min.dist + edge.cost;
+                info_to.nhops = std::move(nhops);
+                info_to.nhop  = info_to.nhops.front();
                 frontier.push({edge.to, info_to.dist});
+            } else {
+                /* Equal-cost path, merge the next hops. */
+                for (NodeId &nhop : nhops) {
+                    if (std::find(info_to.nhops.begin(), info_to.nhops.end(),
+                                  nhop) == info_to.nhops.end()) {
+                        info_to.nhops.push_back(std::move(nhop));
+                    }
+                }
             }
         }
     }
@@ -157,6 +180,7 @@ LFDB::compute_next_hops(const NodeId &local_node)
 
     /* Clean up state left from the previous run. */
     next_hops.clear();
+    ecmp_count.clear();
 
     /* Build the graph from the Lower Flow Database. */
     graph[local_node] = std::vector<Edge>();
@@ -201,7 +225,8 @@ LFDB::compute_next_hops(const NodeId &local_node)
             /* I don't need a next hop for myself. */
             continue;
         }
-        next_hops[kvi.first].push_back(kvi.second.nhop);
+        next_hops[kvi.first]  = kvi.second.nhops;
+        ecmp_count[kvi.first] = kvi.second.nhops.size();
     }
 
     if (lfa_enabled) {
@@ -71,6 +71,8 @@ struct LFDB {
     struct DijkstraInfo {
         unsigned int dist;
         NodeId nhop;
+        /* All the equal-cost next hops, nhop being the first one. */
+        std::vector<NodeId> nhops;
     };
 
     /* Is Loop Free Alternate algorithm enabled ? */
@@ -97,6 +99,17 @@ public:
     std::unordered_map<NodeId, std::vector<NodeId>> next_hops;
     NodeId dflt_nhop;
 
+    /* Number of equal-cost next hops at the front of each next_hops
+     * entry, the remaining ones being loop-free alternates. */
+    std::unordered_map<NodeId, size_t> ecmp_count;
+
+    size_t num_equal_cost(const NodeId &dst) const
+    {
+        const auto it = ecmp_count.find(dst);
+
+        return it == ecmp_count.end() ? 1 : it->second;
+    }
+
     const gpb::LowerFlow *find(const NodeId &local_node,
                                const NodeId &remote_node) const
     {
@@ -21,11 +21,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <cctype>
 #include <climits>
 #include <cerrno>
 #include <sstream>
 #include <iostream>
 #include <functional>
+#include <algorithm>
 
 #include "uipcp-normal.hpp"
 #include "uipcp-normal-lfdb.hpp"
@@ -77,10 +79,42 @@ public:
     /* Forwarding table computation and kernel update. */
     int compute_fwd_table();
 
+    /* A destination address prefix, and its length in bits. */
+    using Prefix = std::pair<rlm_addr_t, unsigned int>;
+
+    /* Routes towards address prefixes, in order of preference. The
+     * kernel resolves them with a longest prefix match, after the
+     * per-destination entries. */
+    std::map<Prefix, std::vector<NodeId>> prefix_hops;
+
 private:
+    /* An entry of the forwarding table. */
+    struct FwdEntry {
+        NodeId dst_node;
+        /* Ports towards all the equal-cost next hops. */
+        std::vector<rl_port_t> ports;
+        /* Port towards a loop-free alternate, if any. */
+        rl_port_t backup = RL_PORT_ID_NONE;
+
+        bool single_path() const
+        {
+            return ports.size() == 1 && backup == RL_PORT_ID_NONE;
+        }
+        bool operator==(const FwdEntry &o) const
+        {
+            return ports == o.ports && backup == o.backup;
+        }
+    };
+
     /* The forwarding table computed by compute_fwd_table().
-     * It maps a NodeId --> (dst_addr, local_port). */
-    std::unordered_map<rlm_addr_t, std::pair<NodeId, rl_port_t>> next_ports;
+     * It maps a dst_addr --> FwdEntry. */
+    std::unordered_map<rlm_addr_t, FwdEntry> next_ports;
+
+    /* Same as 'next_ports', for the routes in 'prefix_hops'. */
+    std::map<Prefix, FwdEntry> prefix_ports;
+
+    /* Port to be used to reach the neighbor 'nhop', or RL_PORT_ID_NONE. */
+    rl_port_t nhop_port(const NodeId &nhop);
 
     /* Set of ports that are currently down. */
     std::unordered_set<rl_port_t> ports_down;
@@ -124,151 +158,254 @@ RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
     compute_fwd_table();
 }
 
+rl_port_t
+RoutingEngine::nhop_port(const NodeId &nhop)
+{
+    struct uipcp *uipcp = rib->uipcp;
+    auto neigh          = rib->neighbors.find(nhop);
+    rl_port_t port_id;
+
+    if (neigh == rib->neighbors.end()) {
+        UPE(uipcp, "Could not find neighbor with name %s\n", nhop.c_str());
+        return RL_PORT_ID_NONE;
+    }
+
+    if (!neigh->second->has_flows()) {
+        /* This should not happen, because it would mean that we
+         * declared to have a local LFDB entry without a corresponding
+         * local flow. */
+        UPE(uipcp, "No flow for next hop %s\n",
+            neigh->second->ipcp_name.c_str());
+        return RL_PORT_ID_NONE;
+    }
+
+    /* Take one of the kernel-bound flows towards the neighbor. */
+    port_id = neigh->second->flows.begin()->second->port_id;
+    if (ports_down.count(port_id)) {
+        UPD(uipcp, "Skipping port_id %u as it is down\n", port_id);
+        return RL_PORT_ID_NONE;
+    }
+
+    return port_id;
+}
+
 int
 RoutingEngine::compute_fwd_table()
 {
-    unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_,
-        next_ports_new;
+    unordered_map<rlm_addr_t, FwdEntry> next_ports_new_, next_ports_new;
+    map<Prefix, FwdEntry> prefix_ports_new;
     struct uipcp *uipcp = rib->uipcp;
+    vector<struct rl_pduft_mod> mods;
     unordered_map<rl_port_t, int> port_hits;
     rl_port_t dflt_port;
     int dflt_hits = 0;
 
     /* Compute the forwarding table by translating the next-hop address
-     * into a port-id towards the next-hop. */
+     * into a port-id towards the next-hop. All the usable equal-cost next
+     * hops are used, falling back to the first usable alternate, if
+     * any. The next usable alternate is installed as a backup, so that
+     * the kernel can reroute as soon as a lower flow goes down. */
     for (const auto &kvr : next_hops) {
-        for (const NodeId &lfa : kvr.second) {
-            auto neigh = rib->neighbors.find(lfa);
-            rlm_addr_t dst_addr;
-            rl_port_t port_id;
-
-            if (neigh == rib->neighbors.end()) {
-                UPE(uipcp, "Could not find neighbor with name %s\n",
-                    lfa.c_str());
-                continue;
-            }
+        size_t num_ecmp = num_equal_cost(kvr.first);
+        vector<rl_port_t> alternates;
+        rlm_addr_t dst_addr;
+        NodeId first_nhop;
+        FwdEntry fe;
+
+        /* Make sure we know the address for this destination. */
+        dst_addr = rib->lookup_node_address(kvr.first);
+        if (dst_addr == RL_ADDR_NULL) {
+            /* We still miss the address of this destination. */
+            UPV(uipcp, "Can't find address for destination %s\n",
+                kvr.first.c_str());
+            continue;
+        }
 
-            if (!neigh->second->has_flows()) {
-                /* This should not happen, because it would mean that we
-                 * declared to have a local LFDB entry without a corresponding
-                 * local flow. */
-                UPE(uipcp, "No flow for next hop %s\n",
-                    neigh->second->ipcp_name.c_str());
-                continue;
-            }
+        for (size_t i = 0; i < kvr.second.size(); i++) {
+            vector<rl_port_t> &ports = i < num_ecmp ? fe.ports : alternates;
+            rl_port_t port_id        = nhop_port(kvr.second[i]);
 
-            /* Take one of the kernel-bound flows towards the neighbor. */
-            port_id = neigh->second->flows.begin()->second->port_id;
-            if (ports_down.count(port_id)) {
-                UPD(uipcp, "Skipping port_id %u as it is down\n", port_id);
+            if (port_id == RL_PORT_ID_NONE ||
+                std::find(fe.ports.begin(), fe.ports.end(), port_id) !=
+                    fe.ports.end() ||
+                std::find(alternates.begin(), alternates.end(), port_id) !=
+                    alternates.end()) {
                 continue;
             }
 
-            /* Also make sure we know the address for this destination. */
-            dst_addr = rib->lookup_node_address(kvr.first);
-            if (dst_addr == RL_ADDR_NULL) {
-                /* We still miss the address of this destination. */
-                UPV(uipcp, "Can't find address for destination %s\n",
-                    kvr.first.c_str());
-                continue;
+            if (fe.ports.empty() && alternates.empty()) {
+                first_nhop = kvr.second[i];
             }
+            ports.push_back(port_id);
+        }
 
-            /* We have found a suitable port for the destination, we can
-             * stop searching. */
-            next_ports_new_[dst_addr] = make_pair(kvr.first, port_id);
-            if (++port_hits[port_id] > dflt_hits) {
-                dflt_hits = port_hits[port_id];
-                dflt_port = port_id;
-                dflt_nhop = lfa;
-            }
-            break;
+        if (fe.ports.empty() && !alternates.empty()) {
+            fe.ports.push_back(alternates.front());
+            alternates.erase(alternates.begin());
+        }
+        if (fe.ports.empty()) {
+            continue;
         }
+        if (!alternates.empty()) {
+            fe.backup = alternates.front();
+        }
+        fe.dst_node = kvr.first;
+
+        if (fe.single_path() && ++port_hits[fe.ports[0]] > dflt_hits) {
+            dflt_hits = port_hits[fe.ports[0]];
+            dflt_port = fe.ports[0];
+            dflt_nhop = first_nhop;
+        }
+        next_ports_new_[dst_addr] = std::move(fe);
     }
 
 #if 1 /* Use default forwarding entry. */
     if (dflt_hits) {
+        FwdEntry dflt;
         string any = "";
 
-        /* Prune out those entries corresponding to the default port, and
-         * replace them with the default entry. */
+        /* Prune out those single-path entries corresponding to the default
+         * port, and replace them with the default entry. */
         for (const auto &kve : next_ports_new_) {
-            if (kve.second.second != dflt_port) {
+            if (!kve.second.single_path() ||
+                kve.second.ports[0] != dflt_port) {
                 next_ports_new[kve.first] = kve.second;
             }
         }
-        next_ports_new[RL_ADDR_NULL] = make_pair(any, dflt_port);
+        dflt.dst_node = any;
+        dflt.ports.push_back(dflt_port);
+        next_ports_new[RL_ADDR_NULL] = std::move(dflt);
         next_hops[any]               = std::vector<NodeId>(1, dflt_nhop);
     }
 #else /* Avoid using the default forwarding entry. */
     next_ports_new = next_ports_new_;
 #endif
 
-    /* Remove old PDUFT entries first. */
+    /* Routes towards address prefixes use the first usable next hop,
+     * and the following one as a backup. */
+    for (const auto &kvp : prefix_hops) {
+        FwdEntry fe;
+
+        for (const NodeId &nhop : kvp.second) {
+            rl_port_t port_id = nhop_port(nhop);
+
+            if (port_id == RL_PORT_ID_NONE ||
+                (!fe.ports.empty() && fe.ports[0] == port_id)) {
+                continue;
+            }
+            if (fe.ports.empty()) {
+                fe.ports.push_back(port_id);
+                fe.dst_node = nhop;
+            } else {
+                fe.backup = port_id;
+                break;
+            }
+        }
+        if (!fe.ports.empty()) {
+            prefix_ports_new[kvp.first] = std::move(fe);
+        }
+    }
+
+    /* Build a batch of PDUFT modifications, so that the kernel can apply
+     * all of them at once. First remove the old entries that do not
+     * exist anymore. The other ones are replaced below. */
     for (const auto &kve : next_ports) {
-        struct rl_pci_match match = {};
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
+        struct rl_pduft_mod mod = {};
 
-        auto nf = next_ports_new.find(kve.first);
-        if (nf != next_ports_new.end() &&
-            kve.second.second == nf->second.second) {
-            /* This old entry still exists, nothing to do. */
+        if (kve.second.ports.empty() || next_ports_new.count(kve.first)) {
+            /* This old entry was never inserted, or it still exists. */
             continue;
         }
 
-        /* Delete the old one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_del(uipcp, port_id, &match);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to delete PDUFT entry for %s(%lu) "
-                "(port_id=%u) [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id, strerror(errno));
-        } else {
-            UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id);
+        mod.op             = RLITE_KER_IPCP_PDUFT_DEL;
+        mod.local_port     = kve.second.ports.front();
+        mod.match.dst_addr = kve.first;
+        mods.push_back(mod);
+        UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port_id=%u)\n",
+            node_id_pretty(kve.second.dst_node).c_str(),
+            (long unsigned)kve.first, mod.local_port);
+    }
+    for (const auto &kvp : prefix_ports) {
+        struct rl_pduft_mod mod = {};
+
+        if (prefix_ports_new.count(kvp.first)) {
+            continue;
         }
+
+        mod.op             = RLITE_KER_IPCP_PDUFT_DEL;
+        mod.local_port     = kvp.second.ports.front();
+        mod.match.dst_addr = kvp.first.first;
+        mod.match.dst_plen = kvp.first.second;
+        mods.push_back(mod);
+        UPD(uipcp, "Delete PDUFT entry for %lu/%u (port_id=%u)\n",
+            (long unsigned)kvp.first.first, kvp.first.second,
+            mod.local_port);
     }
 
-    /* Generate new PDUFT entries. */
-    for (auto &kve : next_ports_new) {
-        struct rl_pci_match match = {};
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
+    /* Then generate the new entries, replacing the old ones (if any), and
+     * adding the other equal-cost ports and the backup port. */
+    for (const auto &kve : next_ports_new) {
+        const FwdEntry &fe      = kve.second;
+        struct rl_pduft_mod mod = {};
 
         auto of = next_ports.find(kve.first);
-        if (of != next_ports.end() && of->second.second == kve.second.second) {
+        if (of != next_ports.end() && of->second == fe) {
             /* This entry is already in place. */
             continue;
         }
 
-        /* Add the new one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_set(uipcp, port_id, &match);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to insert %s(%lu) --> %s (port_id=%u) PDUFT "
-                "entry [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id, strerror(errno));
-            /* Trigger re insertion next time. */
-            kve.second = make_pair(NodeId(), 0);
-        } else {
-            UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id);
+        mod.op             = RLITE_KER_IPCP_PDUFT_SET;
+        mod.match.dst_addr = kve.first;
+        for (size_t i = 0; i < fe.ports.size(); i++) {
+            mod.flags      = i ? RL_PDUFT_F_ADD : 0;
+            mod.local_port = fe.ports[i];
+            mods.push_back(mod);
+        }
+        if (fe.backup != RL_PORT_ID_NONE) {
+            mod.flags      = RL_PDUFT_F_BACKUP;
+            mod.local_port = fe.backup;
+            mods.push_back(mod);
         }
+        UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (%zu ports, backup %d)\n",
+            node_id_pretty(fe.dst_node).c_str(), (long unsigned)kve.first,
+            next_hops[fe.dst_node].front().c_str(), fe.ports.size(),
+            fe.backup == RL_PORT_ID_NONE ? -1 : (int)fe.backup);
     }
+    for (const auto &kvp : prefix_ports_new) {
+        const FwdEntry &fe      = kvp.second;
+        struct rl_pduft_mod mod = {};
 
-    next_ports = next_ports_new;
+        auto of = prefix_ports.find(kvp.first);
+        if (of != prefix_ports.end() && of->second == fe) {
+            continue;
+        }
+
+        mod.op             = RLITE_KER_IPCP_PDUFT_SET;
+        mod.match.dst_addr = kvp.first.first;
+        mod.match.dst_plen = kvp.first.second;
+        mod.local_port     = fe.ports.front();
+        mods.push_back(mod);
+        if (fe.backup != RL_PORT_ID_NONE) {
+            mod.flags      = RL_PDUFT_F_BACKUP;
+            mod.local_port = fe.backup;
+            mods.push_back(mod);
+        }
+        UPD(uipcp, "Set PDUFT entry %lu/%u --> %s (backup %d)\n",
+            (long unsigned)kvp.first.first, kvp.first.second,
+            fe.dst_node.c_str(),
+            fe.backup == RL_PORT_ID_NONE ? -1 : (int)fe.backup);
+    }
+
+    if (!mods.empty() && uipcp_pduft_batch(uipcp, mods.data(), mods.size())) {
+        UPE(uipcp, "Failed to update the PDUFT (%zu modifications) [%s]\n",
+            mods.size(), strerror(errno));
+        /* Keep the old table, so that the whole update is tried again
+         * next time. Modifications are idempotent. */
+        return -1;
+    }
+
+    next_ports   = next_ports_new;
+    prefix_ports = prefix_ports_new;
     rib->stats.fwd_table_compute++;
 
     return 0;
@@ -717,8 +854,61 @@ public:
         re.dump_routing(ss, rib->myname);
     }
     int route_mod(const struct rl_cmsg_ipcp_route_mod *req) override;
+
+private:
+    /* Add or remove a route towards an address prefix, specified
+     * as ADDRESS/LENGTH. */
+    int prefix_route_mod(const struct rl_cmsg_ipcp_route_mod *req);
 };
 
+int
+StaticRouting::prefix_route_mod(const struct rl_cmsg_ipcp_route_mod *req)
+{
+    unsigned int addr_bits = rib->uipcp->pcisizes.addr * 8;
+    unsigned long long addr;
+    unsigned long plen;
+    const char *slash;
+    char *end;
+
+    /* The prefix length must leave some host bits, otherwise this
+     * would be a route towards a single destination. */
+    errno = 0;
+    addr  = strtoull(req->dest_name, &end, 10);
+    slash = end;
+    plen  = 0;
+    if (end != req->dest_name && *slash == '/') {
+        plen = strtoul(slash + 1, &end, 10);
+    }
+    if (errno || !isdigit(req->dest_name[0]) || end == slash + 1 ||
+        *end != '\0' || plen == 0 || plen >= addr_bits ||
+        (addr_bits < 64 && (addr >> addr_bits))) {
+        UPE(rib->uipcp, "Invalid prefix '%s'\n", req->dest_name);
+        return -1;
+    }
+    /* Clear the host bits. */
+    addr &= ~((1ULL << (addr_bits - plen)) - 1);
+
+    RoutingEngine::Prefix prefix(static_cast<rlm_addr_t>(addr), plen);
+
+    if (req->hdr.msg_type == RLITE_U_IPCP_ROUTE_ADD) {
+        std::vector<NodeId> next_hops;
+
+        if (!req->next_hops || strlen(req->next_hops) == 0) {
+            UPE(rib->uipcp, "No next hop specified\n");
+            return -1;
+        }
+        next_hops = utils::strsplit<std::vector>(NodeId(req->next_hops), ',');
+        re.prefix_hops[prefix] = next_hops;
+    } else { /* RLITE_U_IPCP_ROUTE_DEL */
+        if (!re.prefix_hops.erase(prefix)) {
+            UPE(rib->uipcp, "No route to prefix '%s'\n", req->dest_name);
+            return -1;
+        }
+    }
+
+    return re.compute_fwd_table();
+}
+
 int
 StaticRouting::route_mod(const struct rl_cmsg_ipcp_route_mod *req)
 {
@@ -731,6 +921,9 @@ StaticRouting::route_mod(const struct rl_cmsg_ipcp_route_mod *req)
     }
 
     dest_ipcp = req->dest_name;
+    if (dest_ipcp.find('/') != std::string::npos) {
+        return prefix_route_mod(req);
+    }
 
     if (req->hdr.msg_type == RLITE_U_IPCP_ROUTE_ADD) {
         if (!req->next_hops || strlen(req->next_hops) == 0) {
@@ -189,6 +189,12 @@ update_qos_cube(struct rl_flow_config &flowcfg, const string &param,
         return 0;
     }
 
+    if (param == "dtcp.cc") {
+        strncpy(flowcfg.dtcp.cc_name, value.c_str(),
+                sizeof(flowcfg.dtcp.cc_name));
+        return 0;
+    }
+
     return -1;
 }
 
@@ -706,6 +706,10 @@ UipcpRib::dump(std::stringstream &ss) const
            << static_cast<unsigned int>(c.dtcp.rtx.data_rxms_max) << endl
            << "   dtcp.rtx.initial_rtx_timeout="
            << static_cast<unsigned int>(c.dtcp.rtx.initial_rtx_timeout) << endl;
+        ss << "   dtcp.cc="
+           << string(c.dtcp.cc_name,
+                     strnlen(c.dtcp.cc_name, sizeof(c.dtcp.cc_name)))
+           << endl;
         ss << "}" << endl;
     }
 #endif /* RL_USE_QOS_CUBES */